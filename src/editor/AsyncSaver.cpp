@@ -0,0 +1,123 @@
+#include "AsyncSaver.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "Document.h"
+#include "EditJournal.h"
+#include "FileManager.h"
+#include "MarkdownSerializer.h"
+#include "debug.h"
+#include "parser/IBufferProvider.h"
+namespace md::editor {
+namespace {
+// 拍快照时共享的缓冲区，工作线程序列化语法树时用，GUI线程可以接着改文档。
+// original不会再改；add只在末尾追加，快照只看拍快照时的长度以内。
+// 追加时要是快照还拿着缓冲区又得扩容，文档会换一块新内存，这里的指针一直有效
+class BufferSnapshot : public parser::IBufferProvider {
+ public:
+  BufferSnapshot(sptr<const String> original, sptr<const String> add)
+      : m_original(std::move(original)),
+        m_add(std::move(add)),
+        m_originalView(m_original->data(), m_original->size()),
+        m_addView(m_add->data(), m_add->size()) {}
+  std::string_view originalBuffer() const override { return m_originalView; }
+  std::string_view addBuffer() const override { return m_addView; }
+
+ private:
+  sptr<const String> m_original;
+  sptr<const String> m_add;
+  std::string_view m_originalView;
+  std::string_view m_addView;
+};
+struct Chunk {
+  uint64_t version;
+  // 没变的块直接有markdown，变了的块带着复制的语法树
+  sptr<const String> markdown;
+  std::unique_ptr<parser::Node> node;
+};
+}  // namespace
+AsyncSaver::AsyncSaver(std::function<void()> finishedCallback) : m_finishedCallback(std::move(finishedCallback)) {}
+AsyncSaver::~AsyncSaver() { wait(); }
+void AsyncSaver::save(const Document& doc, const String& path) {
+  wait();
+  std::vector<Chunk> chunks;
+  chunks.reserve(doc.blocks().size());
+  SizeType serialized = 0;
+  {
+    std::lock_guard lock(m_mutex);
+    for (SizeType i = 0; i < static_cast<SizeType>(doc.blocks().size()); ++i) {
+      auto version = doc.blocks()[i].version();
+      if (auto it = m_cache.find(version); it != m_cache.end()) {
+        chunks.push_back({version, it->second, nullptr});
+      } else {
+        chunks.push_back({version, nullptr, doc.root()->childAt(i)->clone()});
+        serialized++;
+      }
+    }
+    m_busy = true;
+    m_result.reset();
+  }
+  m_serializedBlocks = serialized;
+  // 都没变时不用缓冲区
+  sptr<BufferSnapshot> buffers;
+  if (serialized > 0) buffers = std::make_shared<BufferSnapshot>(doc.sharedOriginalBuffer(), doc.sharedAddBuffer());
+  m_thread = std::thread([this, chunks = std::move(chunks), buffers, path]() mutable {
+    auto notePath = FileManager::notePath(path);
+    auto tmpPath = notePath.toStdString() + ".tmp";
+    Result result{false, notePath, 0, EditJournal::kHashSeed};
+    std::unordered_map<uint64_t, sptr<const String>> cache;
+    std::FILE* file = std::fopen(tmpPath.c_str(), "wb");
+    bool ok = file != nullptr;
+    for (auto& chunk : chunks) {
+      if (!chunk.markdown) {
+        MarkdownSerializer serializer(*buffers);
+        chunk.node->accept(&serializer);
+        chunk.markdown = std::make_shared<const String>(serializer.markdown());
+        chunk.node.reset();
+      }
+      auto& markdown = *chunk.markdown;
+      if (ok) ok = std::fwrite(markdown.data(), 1, markdown.size(), file) == markdown.size();
+      result.bytes += markdown.size();
+      result.hash = EditJournal::hash(markdown.data(), markdown.size(), result.hash);
+      cache.emplace(chunk.version, std::move(chunk.markdown));
+    }
+    if (file) {
+      ok = ok && FileManager::flushToDisk(file);
+      std::fclose(file);
+    }
+    std::error_code ec;
+    if (ok) std::filesystem::rename(tmpPath, notePath.toStdString(), ec);
+    if (!ok || ec) {
+      DEBUG << "save fail:" << notePath;
+      std::filesystem::remove(tmpPath, ec);
+      ok = false;
+    }
+    result.ok = ok;
+    {
+      std::lock_guard lock(m_mutex);
+      // 只留这次保存的块，删掉的块不会再用到
+      m_cache = std::move(cache);
+      m_result = std::move(result);
+      m_busy = false;
+    }
+    if (m_finishedCallback) m_finishedCallback();
+  });
+}
+void AsyncSaver::wait() {
+  if (m_thread.joinable()) m_thread.join();
+}
+bool AsyncSaver::busy() const {
+  std::lock_guard lock(m_mutex);
+  return m_busy;
+}
+std::optional<AsyncSaver::Result> AsyncSaver::takeResult() {
+  std::lock_guard lock(m_mutex);
+  return std::exchange(m_result, std::nullopt);
+}
+}  // namespace md::editor
@@ -0,0 +1,54 @@
+#ifndef QTMARKDOWN_ASYNCSAVER_H
+#define QTMARKDOWN_ASYNCSAVER_H
+#include "QtMarkdown_global.h"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+
+#include "render/mddef.h"
+namespace md::editor {
+class Document;
+// 后台保存。save()在GUI线程给文档拍快照：版本号和上次保存时一样的块直接用缓存的markdown，
+// 变了的块复制一份语法树、共享缓冲区，交给工作线程序列化。工作线程边序列化边写临时文件，
+// fsync之后改名替换原文件，写到一半崩溃原文件还在。
+// 写完在工作线程调用finishedCallback，调用方切回GUI线程后调用takeResult
+class QTMARKDOWNEDITORCORE_EXPORT AsyncSaver {
+ public:
+  struct Result {
+    bool ok;
+    // 实际写入的路径
+    String path;
+    // 写进文件的字节数和哈希(EditJournal::hash)，日志用它接到新文件上
+    uint64_t bytes;
+    uint64_t hash;
+  };
+  explicit AsyncSaver(std::function<void()> finishedCallback = nullptr);
+  ~AsyncSaver();
+  AsyncSaver(const AsyncSaver&) = delete;
+  AsyncSaver& operator=(const AsyncSaver&) = delete;
+  // 在GUI线程调用。上一次保存还没写完时先等它
+  void save(const Document& doc, const String& path);
+  // 等当前的保存写完
+  void wait();
+  [[nodiscard]] bool busy() const;
+  // 写完了返回结果，只返回一次；还没写完或没在保存返回std::nullopt
+  std::optional<Result> takeResult();
+  // 最近一次保存里要重新序列化的块数
+  [[nodiscard]] SizeType countOfSerializedBlocks() const { return m_serializedBlocks; }
+
+ private:
+  std::function<void()> m_finishedCallback;
+  std::thread m_thread;
+  mutable std::mutex m_mutex;
+  // 上次保存的块，按块版本号查
+  std::unordered_map<uint64_t, sptr<const String>> m_cache;
+  std::optional<Result> m_result;
+  bool m_busy = false;
+  SizeType m_serializedBlocks = 0;
+};
+}  // namespace md::editor
+
+#endif  // QTMARKDOWN_ASYNCSAVER_H
@@ -4,10 +4,15 @@
 
 #include "Command.h"
 
+#include <algorithm>
+#include <cctype>
+
 #include "Cursor.h"
 #include "core/Utf8Util.h"
 #include "debug.h"
 #include "parser/Document.h"
+#include "parser/Parser.h"
+#include "parser/Text.h"
 #include "render/Render.h"
 #include "MarkdownSerializer.h"
 using namespace md::parser;
@@ -41,8 +46,101 @@ static void moveItemContentToParagraph(Paragraph* para, parser::Container* item)
   para->appendChildren(std::move(item->children()));
 }
 
+// ---- BlockDelta ----
+
+std::size_t BlockDelta::byteCount() const {
+  return sizeof(BlockDelta) + blockLengths.size() * sizeof(SizeType) + removed.size();
+}
+
+void Command::saveBlocks(SizeType first, SizeType last) {
+  std::vector<String> markdown;
+  for (SizeType i = first; i < last; ++i) {
+    markdown.push_back(m_doc->serializeBlock(i));
+  }
+  saveBlocks(first, std::move(markdown));
+}
+
+void Command::saveBlocks(SizeType first, std::vector<String> markdown) {
+  m_delta.blockNo = first;
+  m_delta.originalBlockCount = m_doc->countOfBlock();
+  m_delta.blockLengths.clear();
+  m_delta.removed = String();
+  for (const auto& md : markdown) {
+    m_delta.blockLengths.push_back(static_cast<SizeType>(md.size()));
+    m_delta.removed += md;
+  }
+  m_delta.offset = 0;
+  m_delta.insertedLength = 0;
+  m_delta.compacted = false;
+}
+
+// 编辑后这几块现在的markdown
+static String deltaMarkdown(const Document& doc, const BlockDelta& delta) {
+  SizeType count = SizeType(delta.blockLengths.size()) + doc.countOfBlock() - delta.originalBlockCount;
+  ASSERT(count >= 0 && delta.blockNo + count <= doc.countOfBlock());
+  String markdown;
+  for (SizeType i = 0; i < count; ++i) {
+    markdown += doc.serializeBlock(delta.blockNo + i);
+  }
+  return markdown;
+}
+
+void Command::compactDelta() {
+  if (m_delta.compacted) return;
+  m_delta.compacted = true;
+  auto after = deltaMarkdown(*m_doc, m_delta);
+  const auto& before = m_delta.removed;
+  const auto beforeSize = static_cast<SizeType>(before.size());
+  const auto afterSize = static_cast<SizeType>(after.size());
+  SizeType prefix = 0;
+  while (prefix < beforeSize && prefix < afterSize && before[prefix] == after[prefix]) {
+    prefix++;
+  }
+  SizeType suffix = 0;
+  while (suffix < beforeSize - prefix && suffix < afterSize - prefix &&
+         before[beforeSize - 1 - suffix] == after[afterSize - 1 - suffix]) {
+    suffix++;
+  }
+  m_delta.offset = prefix;
+  m_delta.removed = before.mid(prefix, beforeSize - prefix - suffix);
+  m_delta.insertedLength = afterSize - prefix - suffix;
+}
+
+void Command::restoreBlocks() {
+  compactDelta();
+  SizeType count = SizeType(m_delta.blockLengths.size()) + m_doc->countOfBlock() - m_delta.originalBlockCount;
+  auto after = deltaMarkdown(*m_doc, m_delta);
+  ASSERT(m_delta.offset + m_delta.insertedLength <= static_cast<SizeType>(after.size()));
+  auto before = after.left(m_delta.offset) + m_delta.removed + after.mid(m_delta.offset + m_delta.insertedLength);
+  // 先插回原来的块再删编辑后的，文档任何时候都不会是空的
+  SizeType blockNo = m_delta.blockNo;
+  SizeType pos = 0;
+  for (auto length : m_delta.blockLengths) {
+    auto md = before.mid(pos, length);
+    pos += length;
+    SizeType addOffset = m_doc->appendToAddBuffer(md);
+    auto root = Parser::parse(md, PieceTableItem::add, addOffset);
+    for (auto& node : root->children()) {
+      m_doc->insertBlock(blockNo++, std::move(node));
+    }
+  }
+  for (SizeType i = 0; i < count; ++i) {
+    m_doc->removeBlock(blockNo);
+  }
+}
+
 // ---- InsertTextCommand ----
 
+// 不是语法字符，会并进相邻的文本token
+static bool isPlainByte(Char ch) {
+  return static_cast<unsigned char>(ch) >= ' ' && Parser::tokenTypeOf(ch) == TokenType::none;
+}
+// 字母或多字节字符里的字节，块前缀("# "、"- "、"1. "、"- [ ] ")里不会有
+static bool isWordByte(Char ch) {
+  auto uc = static_cast<unsigned char>(ch);
+  return uc >= 128 || std::isalpha(uc);
+}
+
 InsertTextCommand::InsertTextCommand(Document* doc, CursorCoord coord, String text) : Command(doc), m_coord(coord) {
   if (text == "(") {
     m_text = "()";
@@ -55,10 +153,38 @@ InsertTextCommand::InsertTextCommand(Document* doc, CursorCoord coord, String te
   }
 }
 
+bool InsertTextCommand::insertPlainText(Cursor& cursor) {
+  if (m_coord.offset == 0) return false;
+  auto plain = std::all_of(m_text.begin(), m_text.end(), isPlainByte);
+  if (!plain) return false;
+  const auto& block = m_doc->blocks()[m_coord.blockNo];
+  const auto& line = block.logicalLineAt(m_coord.lineNo);
+  if (!line.hasTextAt(m_coord.offset)) return false;
+  auto [textNode, textOffset] = line.textAt(m_coord.offset);
+  if (!textNode || textOffset == 0) return false;
+  // 前一个字节是普通字符，插进去的字节只会让它所在的文本token变长，行内结构不变。
+  // 块前缀只看行首，前一个字节是字母时行首怎么也凑不出新前缀；否则只允许插字母
+  auto prev = textNode->at(textOffset - 1, m_doc->bufferProvider());
+  if (!isPlainByte(prev)) return false;
+  if (!isWordByte(prev) && !std::all_of(m_text.begin(), m_text.end(), isWordByte)) return false;
+
+  m_inPlace = true;
+  m_delta = {};
+  m_contentPos = computeContentPos(block, m_coord.lineNo, m_coord.offset);
+  SizeType addOffset = m_doc->appendToAddBuffer(m_text);
+  const auto length = static_cast<SizeType>(m_text.length());
+  textNode->insert(textOffset, PieceTableItem{PieceTableItem::add, addOffset, length});
+  // 结构没变，逻辑行还是那几行，只重排光标所在的行
+  m_doc->renderLine(m_coord.blockNo, m_coord.lineNo);
+  m_finishedCoord = CursorCoord{m_coord.blockNo, m_coord.lineNo, m_coord.offset + length};
+  m_doc->updateCursor(cursor, m_finishedCoord);
+  return true;
+}
+
 void InsertTextCommand::execute(Cursor& cursor) {
-  // Save snapshot
-  auto* blockNode = m_doc->root()->childAt(m_coord.blockNo);
-  m_snapshot = blockNode->clone();
+  if (insertPlainText(cursor)) return;
+  m_inPlace = false;
+  auto oldType = m_doc->root()->childAt(m_coord.blockNo)->type();
 
   // Compute content position
   const auto& block = m_doc->blocks()[m_coord.blockNo];
@@ -66,6 +192,7 @@ void InsertTextCommand::execute(Cursor& cursor) {
 
   // Serialize block and find markdown position
   auto [markdown, mdPos] = m_doc->cursorToMarkdownPosition(m_coord);
+  saveBlocks(m_coord.blockNo, {markdown});
 
   // Handle bracket skip: if we're inserting ")" and the next char is ")", just move cursor
   if (m_text == ")" || m_text == "]" || m_text == "}") {
@@ -90,7 +217,6 @@ void InsertTextCommand::execute(Cursor& cursor) {
 
   // Compute new cursor position
   auto* newBlockNode = m_doc->root()->childAt(m_coord.blockNo);
-  auto oldType = m_snapshot->type();
   auto newType = newBlockNode->type();
 
   // If block type changed (e.g., Paragraph→Header from "# ", UL→Checkbox from "[ ] "),
@@ -113,7 +239,14 @@ void InsertTextCommand::execute(Cursor& cursor) {
 }
 
 void InsertTextCommand::undo(Cursor& cursor) {
-  m_doc->replaceBlock(m_coord.blockNo, m_snapshot->clone());
+  if (!m_inPlace) {
+    restoreBlocks();
+  } else {
+    auto coord = m_doc->findCursorFromContentPosition(m_coord.blockNo, m_contentPos);
+    auto [textNode, textOffset] = m_doc->blocks()[m_coord.blockNo].logicalLineAt(coord.lineNo).textAt(coord.offset);
+    textNode->remove(textOffset, static_cast<SizeType>(m_text.length()));
+    m_doc->renderLine(m_coord.blockNo, coord.lineNo);
+  }
   m_doc->ensureTrailingParagraph();
   m_doc->updateCursor(cursor, m_coord);
 }
@@ -123,6 +256,24 @@ bool InsertTextCommand::merge(Command* command) {
   auto* other = static_cast<InsertTextCommand*>(command);
   if (m_finishedCoord != other->m_coord) return false;
   if (m_text.length() >= 20) return false;  // Avoid unbounded merge
+  // 快速路径没有撤销记录，撤销只能删自己插的字节，后面的命令改过结构就合并不了
+  if (m_inPlace && !other->m_inPlace) return false;
+  if (!m_inPlace) {
+    // 后面的编辑要落在这次插进去的那段里，合起来还是一处替换
+    if (other->m_coord.blockNo != m_delta.blockNo) return false;
+    auto insertedEnd = m_delta.offset + m_delta.insertedLength;
+    if (other->m_inPlace) {
+      auto pos = m_doc->cursorToMarkdownPosition(other->m_coord).pos;
+      if (pos < m_delta.offset || pos > insertedEnd) return false;
+      m_delta.insertedLength += static_cast<SizeType>(other->m_text.length());
+    } else if (const auto& delta = other->m_delta; !delta.removed.isEmpty() || delta.insertedLength > 0) {
+      // 跳过右括号之类什么都没改的不用管
+      if (delta.offset < m_delta.offset || delta.offset + static_cast<SizeType>(delta.removed.size()) > insertedEnd) {
+        return false;
+      }
+      m_delta.insertedLength += delta.insertedLength - static_cast<SizeType>(delta.removed.size());
+    }
+  }
   m_text += other->m_text;
   m_finishedCoord = other->m_finishedCoord;
   return true;
@@ -141,6 +292,7 @@ void RemoveTextCommand::execute(Cursor& cursor) {
       // Merge with previous block
       String prevMD = m_doc->serializeBlock(m_coord.blockNo - 1);
       String curMD = m_doc->serializeBlock(m_coord.blockNo);
+      saveBlocks(m_coord.blockNo - 1, {prevMD, curMD});
 
       // Strip trailing "\n\n" from previous block, then join
       if (prevMD.endsWith("\n\n")) prevMD = prevMD.left(prevMD.length() - 2);
@@ -153,10 +305,6 @@ void RemoveTextCommand::execute(Cursor& cursor) {
            curMD.startsWith(">") || curMD.startsWith("$$"));
       String joinedMD = prevMD + (needSep ? "\n" : "") + curMD;
 
-      // Save snapshots of both blocks for undo
-      m_originalBlockCount = m_doc->countOfBlock();
-      m_snapshots.push_back({m_coord.blockNo - 1, m_doc->root()->childAt(m_coord.blockNo - 1)->clone()});
-      m_snapshots.push_back({m_coord.blockNo, m_doc->root()->childAt(m_coord.blockNo)->clone()});
 
       // Compute cursor position: end of previous block's content
       SizeType prevContentLen = 0;
@@ -180,10 +328,9 @@ void RemoveTextCommand::execute(Cursor& cursor) {
     // At start of document — check for header/list degrade
     auto* blockNode = m_doc->root()->childAt(m_coord.blockNo);
     if (blockNode->type() == NodeType::header) {
-      m_originalBlockCount = m_doc->countOfBlock();
-      m_snapshots.push_back({m_coord.blockNo, blockNode->clone()});
       auto* headerNode = static_cast<Header*>(blockNode);
       String md = m_doc->serializeBlock(m_coord.blockNo);
+      saveBlocks(m_coord.blockNo, {md});
       SizeType prefixLen = headerNode->level() + 1;
       String editedMD = md.mid(prefixLen);
       SizeType addOffset = m_doc->appendToAddBuffer(editedMD);
@@ -196,8 +343,7 @@ void RemoveTextCommand::execute(Cursor& cursor) {
       return;
     }
     if (isListType(blockNode->type())) {
-      m_originalBlockCount = m_doc->countOfBlock();
-      m_snapshots.push_back({m_coord.blockNo, blockNode->clone()});
+      saveBlocks(m_coord.blockNo, m_coord.blockNo + 1);
       auto* container = static_cast<Container*>(blockNode);
       auto para = degradeListToParagraph(container);
       m_doc->replaceBlock(m_coord.blockNo, std::move(para));
@@ -213,10 +359,8 @@ void RemoveTextCommand::execute(Cursor& cursor) {
   }
 
   // Case 2: normal delete within block
-  m_originalBlockCount = m_doc->countOfBlock();
-  m_snapshots.push_back({m_coord.blockNo, m_doc->root()->childAt(m_coord.blockNo)->clone()});
-
   auto [markdown, mdPos] = m_doc->cursorToMarkdownPosition(m_coord);
+  saveBlocks(m_coord.blockNo, {markdown});
 
   if (mdPos == 0) return;  // Safety check
 
@@ -242,19 +386,7 @@ void RemoveTextCommand::execute(Cursor& cursor) {
 }
 
 void RemoveTextCommand::undo(Cursor& cursor) {
-  // Restore snapshots: replace existing blocks, insert removed ones
-  for (size_t i = 0; i < m_snapshots.size(); ++i) {
-    auto blockNo = m_snapshots[i].first;
-    if (blockNo < m_doc->countOfBlock()) {
-      m_doc->replaceBlock(blockNo, m_snapshots[i].second->clone());
-    } else {
-      m_doc->insertBlock(blockNo, m_snapshots[i].second->clone());
-    }
-  }
-  // Remove any extra blocks beyond original count
-  while (m_doc->countOfBlock() > m_originalBlockCount) {
-    m_doc->removeBlock(m_doc->countOfBlock() - 1);
-  }
+  restoreBlocks();
   m_doc->ensureTrailingParagraph();
   m_doc->updateCursor(cursor, m_coord);
 }
@@ -262,7 +394,6 @@ void RemoveTextCommand::undo(Cursor& cursor) {
 // ---- InsertReturnCommand ----
 
 void InsertReturnCommand::execute(Cursor& cursor) {
-  m_originalBlockCount = m_doc->countOfBlock();
   const auto& block = m_doc->blocks()[m_coord.blockNo];
   SizeType contentPos = block.countOfLogicalLine() > 0
       ? computeContentPos(block, m_coord.lineNo, m_coord.offset)
@@ -293,7 +424,8 @@ void InsertReturnCommand::execute(Cursor& cursor) {
     isEndOfContent = (contentPos >= totalContent);
   }
   if (block.countOfLogicalLine() == 0 || isEndOfContent) {
-    m_snapshots.push_back({m_coord.blockNo, blockNode->clone()});
+    // 当前块不变，撤销时只要删掉新插的块
+    saveBlocks(m_coord.blockNo + 1, m_coord.blockNo + 1);
     m_doc->insertBlock(m_coord.blockNo + 1, std::make_unique<Paragraph>());
     m_finishedCoord = CursorCoord{m_coord.blockNo + 1, 0, 0};
     m_doc->updateCursor(cursor, m_finishedCoord);
@@ -310,7 +442,7 @@ void InsertReturnCommand::handleListEnter(Cursor& cursor, Container* listNode, c
 
   if (block.countOfLogicalLine() == 0 || lineEmpty) {
     // Empty line: split the list at this item
-    m_snapshots.push_back({m_coord.blockNo, listNode->clone()});
+    saveBlocks(m_coord.blockNo, m_coord.blockNo + 1);
     SizeType splitLineNo = m_coord.lineNo;
     std::unique_ptr<Container> newList;
     if (listNode->type() == NodeType::ul) newList = std::make_unique<UnorderedList>();
@@ -329,7 +461,7 @@ void InsertReturnCommand::handleListEnter(Cursor& cursor, Container* listNode, c
     m_finishedCoord = CursorCoord{m_coord.blockNo + 1, 0, 0};
   } else {
     // Non-empty line: split the list item, creating a new item within the same list
-    m_snapshots.push_back({m_coord.blockNo, listNode->clone()});
+    saveBlocks(m_coord.blockNo, m_coord.blockNo + 1);
     SizeType itemIdx = m_coord.lineNo;
     auto* item = static_cast<Container*>(listNode->childAt(itemIdx));
     auto& line = block.logicalLineAt(m_coord.lineNo);
@@ -359,7 +491,7 @@ void InsertReturnCommand::handleListEnter(Cursor& cursor, Container* listNode, c
 }
 
 void InsertReturnCommand::handleCodeBlockEnter(Cursor& cursor, const Block& block, SizeType contentPos) {
-  m_snapshots.push_back({m_coord.blockNo, m_doc->root()->childAt(m_coord.blockNo)->clone()});
+  saveBlocks(m_coord.blockNo, m_coord.blockNo + 1);
   auto& line = block.logicalLineAt(m_coord.lineNo);
   auto [textNode, textOffset] = line.textAt(m_coord.offset);
   auto [leftText, rightText] = textNode->split(textOffset);
@@ -376,8 +508,8 @@ void InsertReturnCommand::handleCodeBlockEnter(Cursor& cursor, const Block& bloc
 }
 
 void InsertReturnCommand::handleContentSplit(Cursor& cursor, const Block& block, SizeType contentPos) {
-  m_snapshots.push_back({m_coord.blockNo, m_doc->root()->childAt(m_coord.blockNo)->clone()});
   auto [markdown, mdPos] = m_doc->cursorToMarkdownPosition(m_coord);
+  saveBlocks(m_coord.blockNo, {markdown});
   String editedMD = markdown.left(mdPos) + "\n" + markdown.mid(mdPos);
   SizeType addOffset = m_doc->appendToAddBuffer(editedMD);
   m_doc->replaceBlocksFromText(m_coord.blockNo, m_coord.blockNo + 1,
@@ -399,14 +531,7 @@ void InsertReturnCommand::handleContentSplit(Cursor& cursor, const Block& block,
 }
 
 void InsertReturnCommand::undo(Cursor& cursor) {
-  // Remove any blocks that were added by execute
-  while (m_doc->countOfBlock() > m_originalBlockCount) {
-    m_doc->removeBlock(m_doc->countOfBlock() - 1);
-  }
-  // Restore snapshot of original block
-  for (auto& [blockNo, snapshot] : m_snapshots) {
-    m_doc->replaceBlock(blockNo, snapshot->clone());
-  }
+  restoreBlocks();
   m_doc->ensureTrailingParagraph();
   m_doc->updateCursor(cursor, m_coord);
 }
@@ -417,10 +542,8 @@ UpgradeToHeaderCommand::UpgradeToHeaderCommand(Document* doc, CursorCoord coord,
     : Command(doc), m_coord(coord), m_level(level) {}
 
 void UpgradeToHeaderCommand::execute(Cursor& cursor) {
-  auto* blockNode = m_doc->root()->childAt(m_coord.blockNo);
-  m_snapshot = blockNode->clone();
-
   String md = m_doc->serializeBlock(m_coord.blockNo);
+  saveBlocks(m_coord.blockNo, {md});
   // Prepend "#" markers — remove trailing "\n\n", prepend, add back
   bool hadNewlines = md.endsWith("\n\n");
   if (hadNewlines) md = md.left(md.length() - 2);
@@ -440,7 +563,7 @@ void UpgradeToHeaderCommand::execute(Cursor& cursor) {
 }
 
 void UpgradeToHeaderCommand::undo(Cursor& cursor) {
-  m_doc->replaceBlock(m_coord.blockNo, m_snapshot->clone());
+  restoreBlocks();
   m_doc->ensureTrailingParagraph();
   m_doc->updateCursor(cursor, m_coord);
 }
@@ -457,9 +580,8 @@ void RemoveTextRangeCommand::execute(Cursor& cursor) {
 
   // Handle same-block selection removal
   if (m_begin.blockNo == m_end.blockNo) {
-    m_snapshots.push_back({m_begin.blockNo, m_doc->root()->childAt(m_begin.blockNo)->clone()});
-
     auto [md, mdBegin] = m_doc->cursorToMarkdownPosition(m_begin);
+    saveBlocks(m_begin.blockNo, {md});
     auto [md2, mdEnd] = m_doc->cursorToMarkdownPosition(m_end);
 
     if (mdBegin < mdEnd) {
@@ -481,8 +603,10 @@ void RemoveTextRangeCommand::execute(Cursor& cursor) {
   SizeType globalBegin = 0;  // Position in combinedMD where m_begin maps
   SizeType globalEnd = 0;    // Position in combinedMD where m_end maps
 
+  std::vector<String> saved;
   for (SizeType i = m_begin.blockNo; i <= m_end.blockNo; ++i) {
     String blockMD = m_doc->serializeBlock(i);
+    saved.push_back(blockMD);
     // For intermediate blocks, strip trailing "\n\n"
     if (i < m_end.blockNo && blockMD.endsWith("\n\n")) {
       blockMD = blockMD.left(blockMD.length() - 2);
@@ -499,11 +623,7 @@ void RemoveTextRangeCommand::execute(Cursor& cursor) {
     }
     combinedMD += blockMD;
   }
-
-  // Save snapshots
-  for (SizeType i = m_begin.blockNo; i <= m_end.blockNo; ++i) {
-    m_snapshots.push_back({i, m_doc->root()->childAt(i)->clone()});
-  }
+  saveBlocks(m_begin.blockNo, std::move(saved));
 
   if (globalBegin < globalEnd) {
     String editedMD = combinedMD.left(globalBegin) + combinedMD.mid(globalEnd);
@@ -519,44 +639,212 @@ void RemoveTextRangeCommand::execute(Cursor& cursor) {
 }
 
 void RemoveTextRangeCommand::undo(Cursor& cursor) {
-  // Restore snapshots in reverse order
-  for (auto it = m_snapshots.rbegin(); it != m_snapshots.rend(); ++it) {
-    m_doc->replaceBlock(it->first, it->second->clone());
-  }
+  restoreBlocks();
   m_doc->ensureTrailingParagraph();
   m_doc->updateCursor(cursor, m_begin);
 }
 
+// ---- TransactionCommand ----
+
+TransactionCommand::TransactionCommand(Document* doc, std::vector<Document::TextEdit> edits)
+    : Command(doc), m_edits(std::move(edits)) {
+  std::stable_sort(m_edits.begin(), m_edits.end(),
+                   [](const Document::TextEdit& a, const Document::TextEdit& b) { return a.begin < b.begin; });
+}
+
+void TransactionCommand::execute(Cursor& cursor) {
+  // 按块分段，跨块的编辑把两边的块并进同一段
+  struct Run {
+    SizeType first = 0;
+    SizeType last = 0;
+    std::vector<const Document::TextEdit*> edits{};
+    String markdown{};
+    std::vector<String> blocks{};
+    // 最后一处编辑结束在改后markdown里的位置
+    SizeType endPos = 0;
+  };
+  std::vector<Run> runs;
+  for (const auto& edit : m_edits) {
+    if (!runs.empty() && edit.begin.blockNo <= runs.back().last) {
+      runs.back().last = std::max(runs.back().last, edit.end.blockNo);
+    } else {
+      runs.push_back({edit.begin.blockNo, edit.end.blockNo});
+    }
+    runs.back().edits.push_back(&edit);
+  }
+  // 先在编辑前的文档上把每段的markdown改好，再从后往前换块，前面的块号不变
+  for (auto& run : runs) {
+    std::vector<SizeType> starts;
+    String markdown;
+    for (SizeType i = run.first; i <= run.last; ++i) {
+      starts.push_back(markdown.size());
+      run.blocks.push_back(m_doc->serializeBlock(i));
+      markdown += run.blocks.back();
+    }
+    auto markdownPos = [&](const CursorCoord& coord) {
+      return starts[coord.blockNo - run.first] + m_doc->cursorToMarkdownPosition(coord).pos;
+    };
+    SizeType pos = 0;
+    for (const auto* edit : run.edits) {
+      auto begin = markdownPos(edit->begin);
+      // 结尾取最后一个换掉的字节之后，不要把后面的标记(比如粗体结尾的**)也换掉
+      const auto& e = edit->end;
+      auto end = e != edit->begin && e.offset > 0 ? markdownPos({e.blockNo, e.lineNo, e.offset - 1}) + 1
+                                                  : markdownPos(e);
+      // replaceText排进来时已经检查过不重叠
+      ASSERT(begin >= pos);
+      run.markdown += markdown.mid(pos, begin - pos);
+      run.markdown += edit->text;
+      run.endPos = run.markdown.size();
+      pos = end;
+    }
+    run.markdown += markdown.mid(pos);
+  }
+  m_ranges.clear();
+  for (auto it = runs.rbegin(); it != runs.rend(); ++it) {
+    auto count = m_doc->replaceBlockRange(it->first, it->last + 1, it->markdown);
+    m_ranges.push_back({it->first, std::move(it->blocks), count});
+  }
+  std::reverse(m_ranges.begin(), m_ranges.end());
+  m_doc->ensureTrailingParagraph();
+
+  // 光标放到最后一处编辑之后
+  const auto& run = runs.back();
+  const auto& range = m_ranges.back();
+  SizeType blockNo = range.blockNo;
+  for (const auto& r : m_ranges) {
+    if (&r == &range) break;
+    blockNo += r.newBlockCount - SizeType(r.markdown.size());
+  }
+  // 整段都删掉了就放到后面那块的开头
+  auto endPos = range.newBlockCount > 0 ? run.endPos : 0;
+  SizeType last = blockNo + range.newBlockCount - 1;
+  for (; blockNo < last; ++blockNo) {
+    auto size = static_cast<SizeType>(m_doc->serializeBlock(blockNo).size());
+    if (endPos < size) break;
+    endPos -= size;
+  }
+  blockNo = std::min<SizeType>(blockNo, m_doc->countOfBlock() - 1);
+  m_doc->updateCursor(cursor, m_doc->findCursorFromMarkdownPosition(blockNo, endPos));
+}
+
+void TransactionCommand::undo(Cursor& cursor) {
+  // 从前往后换回去，换完的段块数和编辑前一样，后面的段块号不用调整
+  for (const auto& range : m_ranges) {
+    String markdown;
+    for (const auto& md : range.markdown) {
+      markdown += md;
+    }
+    m_doc->replaceBlockRange(range.blockNo, range.blockNo + range.newBlockCount, markdown);
+  }
+  m_doc->ensureTrailingParagraph();
+  m_doc->updateCursor(cursor, m_edits.front().begin);
+}
+
+std::size_t TransactionCommand::byteCount() const {
+  auto bytes = Command::byteCount();
+  for (const auto& edit : m_edits) {
+    bytes += sizeof(edit) + edit.text.size();
+  }
+  for (const auto& range : m_ranges) {
+    bytes += sizeof(range);
+    for (const auto& md : range.markdown) {
+      bytes += sizeof(String) + md.size();
+    }
+  }
+  return bytes;
+}
+
+// ---- ReplaceBlocksCommand ----
+
+void ReplaceBlocksCommand::execute(Cursor& cursor) {
+  saveBlocks(m_first, m_last);
+  m_doc->replaceBlockRange(m_first, m_last, m_markdown);
+  m_doc->ensureTrailingParagraph();
+  m_doc->updateCursor(cursor, {std::min<SizeType>(m_first, m_doc->countOfBlock() - 1), 0, 0});
+}
+
+void ReplaceBlocksCommand::undo(Cursor& cursor) {
+  restoreBlocks();
+  m_doc->ensureTrailingParagraph();
+  m_doc->updateCursor(cursor, {std::min<SizeType>(m_first, m_doc->countOfBlock() - 1), 0, 0});
+}
+
 // ---- CommandStack ----
 
 void CommandStack::push(std::unique_ptr<Command> command) {
-  while (m_commands.size() != m_top) {
-    m_commands.pop_back();
+  command->compactDelta();
+  // 新的编辑让还能重做的记录作废
+  while (m_size > m_top) {
+    popBack();
   }
-  if (m_commands.empty()) {
-    m_commands.push_back(std::move(command));
-  } else {
-    auto* topCommand = m_commands.back().get();
-    if (!topCommand->merge(command.get())) {
-      if (m_commands.size() >= kMaxCommands) {
-        m_commands.erase(m_commands.begin());
-        if (m_top > 0) --m_top;
-      }
-      m_commands.push_back(std::move(command));
+  if (m_size > 0) {
+    auto& top = at(m_size - 1);
+    auto before = top->byteCount();
+    if (top->merge(command.get())) {
+      m_bytes = m_bytes - before + top->byteCount();
+      evict();
+      return;
     }
   }
-  m_top = m_commands.size();
+  pushBack(std::move(command));
+  m_top = m_size;
+  evict();
 }
 void CommandStack::undo(Cursor& cursor) {
-  ASSERT(m_top <= m_commands.size());
+  ASSERT(m_top <= m_size);
   if (m_top == 0) return;
-  m_commands[m_top - 1]->undo(cursor);
+  at(m_top - 1)->undo(cursor);
   m_top--;
 }
 void CommandStack::redo(Cursor& cursor) {
-  ASSERT(m_top <= m_commands.size());
-  if (m_top == m_commands.size()) return;
-  m_commands[m_top]->execute(cursor);
+  ASSERT(m_top <= m_size);
+  if (m_top == m_size) return;
+  auto& command = at(m_top);
+  auto before = command->byteCount();
+  command->execute(cursor);
+  command->compactDelta();
+  m_bytes = m_bytes - before + command->byteCount();
   m_top++;
 }
+void CommandStack::setMaxBytes(std::size_t maxBytes) {
+  m_maxBytes = maxBytes;
+  evict();
+}
+void CommandStack::pushBack(std::unique_ptr<Command> command) {
+  if (m_size == m_ring.size()) {
+    // 满了就按顺序搬到两倍大的缓冲里
+    std::vector<std::unique_ptr<Command>> ring(std::max<std::size_t>(16, m_ring.size() * 2));
+    for (std::size_t i = 0; i < m_size; ++i) {
+      ring[i] = std::move(at(i));
+    }
+    m_ring = std::move(ring);
+    m_head = 0;
+  }
+  m_bytes += command->byteCount();
+  at(m_size) = std::move(command);
+  m_size++;
+}
+void CommandStack::popBack() {
+  ASSERT(m_size > 0);
+  auto& command = at(m_size - 1);
+  m_bytes -= command->byteCount();
+  command.reset();
+  m_size--;
+}
+void CommandStack::popFront() {
+  ASSERT(m_size > 0);
+  auto& command = at(0);
+  m_bytes -= command->byteCount();
+  command.reset();
+  m_head = (m_head + 1) % m_ring.size();
+  m_size--;
+  if (m_top > 0) m_top--;
+}
+void CommandStack::evict() {
+  // 只淘汰做过的，撤销掉的还要按顺序重做
+  while (m_bytes > m_maxBytes && m_size > 1 && m_top > 0) {
+    popFront();
+  }
+}
 }  // namespace md::editor
@@ -5,25 +5,62 @@
 #ifndef QTMARKDOWN_COMMAND_H
 #define QTMARKDOWN_COMMAND_H
 #include "QtMarkdown_global.h"
+#include <cstddef>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "CursorCoord.h"
 #include "Document.h"
 #include "render/mddef.h"
 namespace md::editor {
+// 撤销记录：把从blockNo开始的那几块改回编辑前要做的一处替换，不存整块的markdown。
+// 编辑前后的markdown去掉相同的开头和结尾，只留中间换掉的字节。
+// 撤销时文档正好回到编辑刚完成的样子，这几块现在占了多少块由前后的块数之差得出
+struct BlockDelta {
+  SizeType blockNo = 0;
+  SizeType originalBlockCount = 0;
+  // 编辑前每块markdown的长度，撤销时按它切开，每块单独解析
+  std::vector<SizeType> blockLengths;
+  // 相对blockNo那块开头的偏移。编辑前这里是removed，编辑后换成了insertedLength个字节
+  SizeType offset = 0;
+  String removed;
+  SizeType insertedLength = 0;
+  // 刚记下还没和编辑后的比较时，removed是编辑前的整段markdown
+  bool compacted = true;
+  [[nodiscard]] std::size_t byteCount() const;
+};
 class QTMARKDOWNEDITORCORE_EXPORT Command {
  public:
-  enum Type { insert_text, remove_text, insert_return, upgrade_to_header, remove_text_range };
+  enum Type {
+    insert_text,
+    remove_text,
+    insert_return,
+    upgrade_to_header,
+    remove_text_range,
+    transaction,
+    replace_blocks
+  };
   Command(Document* doc) : m_doc(doc) {}
   virtual ~Command() = default;
   [[nodiscard]] virtual Type type() const = 0;
   virtual bool merge(Command* command) = 0;
   virtual void execute(Cursor& cursor) = 0;
   virtual void undo(Cursor& cursor) = 0;
+  // 这条撤销记录占的内存(估算)
+  [[nodiscard]] virtual std::size_t byteCount() const { return sizeof(Command) + m_delta.byteCount(); }
+  // 执行完后把saveBlocks记下的整段markdown和编辑后的比较，只留变了的那段
+  void compactDelta();
 
  protected:
+  // 记下[first, last)编辑前的markdown，first == last表示编辑只插入新块
+  void saveBlocks(SizeType first, SizeType last);
+  // 已经序列化过的块直接传进来
+  void saveBlocks(SizeType first, std::vector<String> markdown);
+  // 把saveBlocks记下的那段换回来
+  void restoreBlocks();
   Document* m_doc;
+  BlockDelta m_delta;
 };
 class QTMARKDOWNEDITORCORE_EXPORT InsertTextCommand : public Command {
  public:
@@ -32,12 +69,16 @@ class QTMARKDOWNEDITORCORE_EXPORT InsertTextCommand : public Command {
   bool merge(Command* command) override;
   void execute(Cursor& cursor) override;
   void undo(Cursor& cursor) override;
+  [[nodiscard]] std::size_t byteCount() const override { return Command::byteCount() + m_text.size(); }
 
  private:
+  // 快速路径：插入的字节凑不出新语法时直接改光标所在的Text结点，不序列化也不重新解析
+  bool insertPlainText(Cursor& cursor);
   CursorCoord m_coord;
   CursorCoord m_finishedCoord;
   String m_text;
-  std::unique_ptr<parser::Node> m_snapshot;
+  // 走了快速路径，撤销时按m_contentPos删掉插入的字节，不用m_delta
+  bool m_inPlace = false;
   SizeType m_contentPos = 0;
 };
 class QTMARKDOWNEDITORCORE_EXPORT RemoveTextCommand : public Command {
@@ -53,8 +94,6 @@ class QTMARKDOWNEDITORCORE_EXPORT RemoveTextCommand : public Command {
   CursorCoord m_coord;
   CursorCoord m_finishedCoord;
   bool m_hasAction = false;
-  int m_originalBlockCount = 0;
-  std::vector<std::pair<SizeType, std::unique_ptr<parser::Node>>> m_snapshots;
   SizeType m_contentPos = 0;
 };
 class QTMARKDOWNEDITORCORE_EXPORT InsertReturnCommand : public Command {
@@ -71,8 +110,6 @@ class QTMARKDOWNEDITORCORE_EXPORT InsertReturnCommand : public Command {
   void handleContentSplit(Cursor& cursor, const render::Block& block, SizeType contentPos);
   CursorCoord m_coord;
   CursorCoord m_finishedCoord;
-  int m_originalBlockCount = 0;
-  std::vector<std::pair<SizeType, std::unique_ptr<parser::Node>>> m_snapshots;
 };
 class QTMARKDOWNEDITORCORE_EXPORT UpgradeToHeaderCommand : public Command {
  public:
@@ -87,7 +124,6 @@ class QTMARKDOWNEDITORCORE_EXPORT UpgradeToHeaderCommand : public Command {
   CursorCoord m_coord;
   CursorCoord m_finishedCoord;
   int m_level;
-  std::unique_ptr<parser::Node> m_snapshot;
 };
 class QTMARKDOWNEDITORCORE_EXPORT RemoveTextRangeCommand : public Command {
  public:
@@ -101,19 +137,74 @@ class QTMARKDOWNEDITORCORE_EXPORT RemoveTextRangeCommand : public Command {
   CursorCoord m_begin;
   CursorCoord m_end;
   bool m_hasAction = false;
-  std::vector<std::pair<SizeType, std::unique_ptr<parser::Node>>> m_snapshots;
   CursorCoord m_finishedCoord;
 };
+// Document::commit提交的一组编辑。重做时按原来的坐标再执行一遍
+class QTMARKDOWNEDITORCORE_EXPORT TransactionCommand : public Command {
+ public:
+  TransactionCommand(Document* doc, std::vector<Document::TextEdit> edits);
+  [[nodiscard]] Type type() const override { return transaction; }
+  void execute(Cursor& cursor) override;
+  void undo(Cursor& cursor) override;
+  bool merge(Command* command) override { return false; }
+  [[nodiscard]] std::size_t byteCount() const override;
+
+ private:
+  // 一段连着的脏块：编辑前的markdown(每块一段)和编辑后解析出的块数
+  struct Range {
+    SizeType blockNo;
+    std::vector<String> markdown;
+    SizeType newBlockCount;
+  };
+  std::vector<Document::TextEdit> m_edits;
+  std::vector<Range> m_ranges;
+};
+// 日志里的撤销、重做：把[first, last)换成markdown解析出的块
+class QTMARKDOWNEDITORCORE_EXPORT ReplaceBlocksCommand : public Command {
+ public:
+  ReplaceBlocksCommand(Document* doc, SizeType first, SizeType last, String markdown)
+      : Command(doc), m_first(first), m_last(last), m_markdown(std::move(markdown)) {}
+  [[nodiscard]] Type type() const override { return replace_blocks; }
+  void execute(Cursor& cursor) override;
+  void undo(Cursor& cursor) override;
+  bool merge(Command* command) override { return false; }
+  [[nodiscard]] std::size_t byteCount() const override { return Command::byteCount() + m_markdown.size(); }
+
+ private:
+  SizeType m_first;
+  SizeType m_last;
+  String m_markdown;
+};
+// 撤销栈按内存预算淘汰最早的记录，不按条数。命令放在环形缓冲里，淘汰队首不用挪动后面的
 class QTMARKDOWNEDITORCORE_EXPORT CommandStack {
  public:
-  static constexpr size_t kMaxCommands = 500;
+  static constexpr std::size_t kDefaultMaxBytes = 8 * 1024 * 1024;
+  explicit CommandStack(std::size_t maxBytes = kDefaultMaxBytes) : m_maxBytes(maxBytes) {}
   void push(std::unique_ptr<Command> command);
   void undo(Cursor& cursor);
   void redo(Cursor& cursor);
+  // 最近的一条总是留着，哪怕它自己就超出预算
+  void setMaxBytes(std::size_t maxBytes);
+  [[nodiscard]] std::size_t maxBytes() const { return m_maxBytes; }
+  // 所有记录(包括还能重做的)占的内存
+  [[nodiscard]] std::size_t byteCount() const { return m_bytes; }
+  [[nodiscard]] std::size_t size() const { return m_size; }
+  [[nodiscard]] bool canUndo() const { return m_top > 0; }
+  [[nodiscard]] bool canRedo() const { return m_top < m_size; }
 
  private:
-  std::vector<std::unique_ptr<Command>> m_commands;
-  size_t m_top = 0;
+  std::unique_ptr<Command>& at(std::size_t index) { return m_ring[(m_head + index) % m_ring.size()]; }
+  void pushBack(std::unique_ptr<Command> command);
+  void popBack();
+  void popFront();
+  void evict();
+
+  std::vector<std::unique_ptr<Command>> m_ring;
+  std::size_t m_head = 0;
+  std::size_t m_size = 0;
+  std::size_t m_top = 0;
+  std::size_t m_bytes = 0;
+  std::size_t m_maxBytes;
 };
 }  // namespace md::editor
 #endif  // QTMARKDOWN_COMMAND_H
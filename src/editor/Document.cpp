@@ -4,20 +4,41 @@
 
 #include "Document.h"
 
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "Cursor.h"
 #include "core/Utf8Util.h"
 #include "debug.h"
 #include "parser/Parser.h"
 #include "parser/Text.h"
+#include "render/IconAtlas.h"
+#include "render/ImageCache.h"
+#include "render/LatexCache.h"
 #include "render/Render.h"
+#include "render/StyleTable.h"
 #include "Command.h"
+#include "EditJournal.h"
 #include "MarkdownSerializer.h"
 using namespace md::parser;
 using namespace md::render;
 namespace md::editor {
-Document::Document(const String& str, sptr<RenderSetting> setting, core::IImageProvider* imageProvider)
+Document::Document(const String& str, sptr<RenderSetting> setting, core::IImageProvider* imageProvider,
+                   std::function<void()> latexTypesetCallback, std::function<void()> imageDecodeCallback,
+                   sptr<IconAtlas> iconAtlas)
     : m_parserDoc(std::make_unique<parser::Document>(str)), m_setting(setting), m_commandStack(std::make_shared<CommandStack>()),
-      m_imageProvider(imageProvider) {
+      m_imageProvider(imageProvider), m_styles(std::make_shared<StyleTable>()),
+      m_iconAtlas(iconAtlas ? std::move(iconAtlas) : std::make_shared<IconAtlas>(imageProvider)) {
+  // MicroTeX有全局状态，只开一个排版线程
+  int latexThreads = latexTypesetCallback ? 1 : 0;
+  sptr<LatexDiskCache> diskCache;
+  if (!m_setting->latexCacheDir.isEmpty()) {
+    diskCache = std::make_shared<LatexDiskCache>(m_setting->latexCacheDir.toStdString());
+  }
+  m_latexCache = std::make_shared<LatexCache>(1024, latexThreads, std::move(latexTypesetCallback), std::move(diskCache));
+  int imageThreads = imageDecodeCallback ? 2 : 0;
+  m_imageCache = std::make_shared<ImageCache>(m_setting->imageCacheMaxBytes, imageThreads, std::move(imageDecodeCallback));
   this->renderAllBlock();
 }
 void Document::assertBlocksInSync() {
@@ -42,18 +63,27 @@ void Document::ensureTrailingParagraph() {
     auto paragraph = std::make_unique<Paragraph>();
     parser::Node* raw = paragraph.get();
     m_parserDoc->root()->appendChild(std::move(paragraph));
-    m_blocks.push_back(Render::render(raw, m_setting, *m_parserDoc, nullptr, m_imageProvider));
+    m_blocks.push_back(Render::render(raw, m_setting, *m_parserDoc, nullptr, m_imageProvider, nullptr, m_styles, m_latexCache, m_imageCache, m_iconAtlas));
   }
   assertBlocksInSync();
 }
+void Document::record(const EditOp& op) {
+  ASSERT(!m_transaction && "use replaceText inside a transaction");
+  // 坐标要变了，先把组字文本清掉
+  clearPreedit();
+  m_revision++;
+  if (m_journal) m_journal->append(op);
+}
 void Document::insertText(Cursor& cursor, const String& text) {
   if (text.isEmpty()) return;
+  record({EditOp::insertText, cursor.coord(), {}, 0, text});
   auto command = std::make_unique<InsertTextCommand>(this, cursor.coord(), text);
   command->execute(cursor);
   m_commandStack->push(std::move(command));
   ensureTrailingParagraph();
 }
 void Document::removeText(Cursor& cursor) {
+  record({EditOp::removeText, cursor.coord()});
   auto command = std::make_unique<RemoveTextCommand>(this, cursor.coord());
   command->execute(cursor);
   if (command->hasUndoAction()) {
@@ -62,6 +92,7 @@ void Document::removeText(Cursor& cursor) {
   ensureTrailingParagraph();
 }
 void Document::insertReturn(Cursor& cursor) {
+  record({EditOp::insertReturn, cursor.coord()});
   auto command = std::make_unique<InsertReturnCommand>(this, cursor.coord());
   command->execute(cursor);
   m_commandStack->push(std::move(command));
@@ -69,9 +100,14 @@ void Document::insertReturn(Cursor& cursor) {
 }
 
 void Document::renderAllBlock() {
+  // 复用每个块的ShapeCache，宽度变化时只需要重新断行
+  auto oldBlocks = std::move(m_blocks);
   m_blocks.clear();
-  for (auto& node : m_parserDoc->root()->children()) {
-    Block block = Render::render(node.get(), m_setting, *m_parserDoc, nullptr, m_imageProvider);
+  m_blockTops.clear();
+  auto& children = m_parserDoc->root()->children();
+  for (SizeType i = 0; i < static_cast<SizeType>(children.size()); ++i) {
+    auto shapeCache = i < static_cast<SizeType>(oldBlocks.size()) ? oldBlocks[i].shapeCache() : nullptr;
+    Block block = Render::render(children[i].get(), m_setting, *m_parserDoc, nullptr, m_imageProvider, shapeCache, m_styles, m_latexCache, m_imageCache, m_iconAtlas, preeditOf(i));
     m_blocks.push_back(std::move(block));
   }
   ensureTrailingParagraph();
@@ -81,7 +117,8 @@ void Document::replaceBlock(SizeType blockNo, std::unique_ptr<parser::Node> node
   ASSERT(node != nullptr);
   auto* rawNode = node.get();
   m_parserDoc->root()->setChild(blockNo, std::move(node));
-  m_blocks[blockNo] = Render::render(rawNode, m_setting, *m_parserDoc, nullptr, m_imageProvider);
+  m_blocks[blockNo] = Render::render(rawNode, m_setting, *m_parserDoc, nullptr, m_imageProvider, m_blocks[blockNo].shapeCache(), m_styles, m_latexCache, m_imageCache, m_iconAtlas, preeditOf(blockNo));
+  invalidateBlockTops(blockNo);
   assertBlocksInSync();
 #ifdef QT_DEBUG
   assertBlockTextCellsValid(m_blocks[blockNo]);
@@ -92,7 +129,8 @@ void Document::insertBlock(SizeType blockNo, std::unique_ptr<parser::Node> node)
   ASSERT(node != nullptr);
   auto* rawNode = node.get();
   m_parserDoc->root()->insertChild(blockNo, std::move(node));
-  m_blocks.insert(m_blocks.begin() + blockNo, Render::render(rawNode, m_setting, *m_parserDoc, nullptr, m_imageProvider));
+  m_blocks.insert(m_blocks.begin() + blockNo, Render::render(rawNode, m_setting, *m_parserDoc, nullptr, m_imageProvider, nullptr, m_styles, m_latexCache, m_imageCache, m_iconAtlas));
+  invalidateBlockTops(blockNo);
   assertBlocksInSync();
 #ifdef QT_DEBUG
   assertBlockTextCellsValid(m_blocks[blockNo]);
@@ -100,12 +138,257 @@ void Document::insertBlock(SizeType blockNo, std::unique_ptr<parser::Node> node)
 }
 void Document::renderBlock(SizeType blockNo) {
   ASSERT(blockNo >= 0 && blockNo < m_parserDoc->root()->children().size());
-  m_blocks[blockNo] = Render::render(m_parserDoc->root()->children()[blockNo].get(), m_setting, *m_parserDoc, nullptr, m_imageProvider);
+  m_blocks[blockNo] = Render::render(m_parserDoc->root()->children()[blockNo].get(), m_setting, *m_parserDoc, nullptr,
+                                     m_imageProvider, m_blocks[blockNo].shapeCache(), m_styles, m_latexCache, m_imageCache, m_iconAtlas,
+                                     preeditOf(blockNo));
+  invalidateBlockTops(blockNo);
   assertBlocksInSync();
 #ifdef QT_DEBUG
   assertBlockTextCellsValid(m_blocks[blockNo]);
 #endif
 }
+void Document::renderLine(SizeType blockNo, SizeType lineNo) {
+  ASSERT(blockNo >= 0 && blockNo < static_cast<SizeType>(m_blocks.size()));
+  auto& block = m_blocks[blockNo];
+  auto height = block.height();
+  if (preeditOf(blockNo) || !Render::relayoutLine(block, lineNo, m_parserDoc->root()->childAt(blockNo), m_setting,
+                                                  *m_parserDoc, nullptr, m_imageProvider, m_latexCache, m_imageCache)) {
+    renderBlock(blockNo);
+    return;
+  }
+  if (block.height() != height) invalidateBlockTops(blockNo);
+  assertBlocksInSync();
+#ifdef QT_DEBUG
+  assertBlockTextCellsValid(block);
+#endif
+}
+void Document::setPreedit(Cursor& cursor, const String& text) {
+  auto coord = cursor.coord();
+  if (text.isEmpty()) {
+    if (!m_preedit) return;
+    clearPreedit();
+    updateCursor(cursor, coord);
+    return;
+  }
+  if (m_preedit && m_preedit->blockNo != coord.blockNo) clearPreedit();
+  m_preedit = PreeditState{coord.blockNo, {coord.lineNo, coord.offset, text}};
+  renderBlock(coord.blockNo);
+  updateCursor(cursor, coord);
+  const auto& rect = m_blocks[coord.blockNo].preeditRect();
+  if (rect.isEmpty()) return;
+  auto top = blockRect(coord.blockNo).y();
+  cursor.setPos(core::Point(rect.x() + rect.width(), top + rect.y() + cursor.ascent()));
+}
+const render::Preedit* Document::preeditOf(SizeType blockNo) const {
+  if (!m_preedit || m_preedit->blockNo != blockNo) return nullptr;
+  return &m_preedit->preedit;
+}
+void Document::clearPreedit() {
+  if (!m_preedit) return;
+  auto blockNo = m_preedit->blockNo;
+  m_preedit.reset();
+  renderBlock(blockNo);
+}
+bool Document::updateTypesetLatex() {
+  if (!m_latexCache->takeTypesetResults()) return false;
+  bool changed = false;
+  for (SizeType blockNo = 0; blockNo < static_cast<SizeType>(m_blocks.size()); ++blockNo) {
+    const auto& pending = m_blocks[blockNo].pendingLatex();
+    bool ready = std::any_of(pending.begin(), pending.end(),
+                             [this](const LatexKey& key) { return m_latexCache->ready(key); });
+    if (!ready) continue;
+    renderBlock(blockNo);
+    changed = true;
+  }
+  return changed;
+}
+bool Document::updateDecodedImages() {
+  if (!m_imageCache->takeDecodeResults()) return false;
+  bool changed = false;
+  for (SizeType blockNo = 0; blockNo < static_cast<SizeType>(m_blocks.size()); ++blockNo) {
+    if (m_blocks[blockNo].pendingImages().empty()) continue;
+    switch (m_blocks[blockNo].updateDecodedImages(*m_imageCache)) {
+      case Block::ImageUpdate::relayout:
+        renderBlock(blockNo);
+        changed = true;
+        break;
+      case Block::ImageUpdate::repaint:
+        changed = true;
+        break;
+      case Block::ImageUpdate::none:
+        break;
+    }
+  }
+  return changed;
+}
+void Document::prioritizeImages(int top, int bottom) {
+  int screen = bottom - top;
+  std::vector<std::pair<int, String>> images;
+  int y = m_setting->docMargin.top;
+  for (const auto& block : m_blocks) {
+    int h = block.height();
+    int distance = std::max({0, top - (y + h), y - bottom});
+    if (distance <= screen) {
+      for (const auto& pending : block.pendingImages()) {
+        images.emplace_back(distance, pending.key.path);
+      }
+    }
+    y += h + m_setting->blockSpacing;
+    if (y > bottom + screen) break;
+  }
+  // 最近的最后挪，排在队首
+  std::stable_sort(images.begin(), images.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (const auto& [distance, path] : images) {
+    m_imageCache->prioritize(path);
+  }
+}
+core::Rect Document::blockRect(SizeType blockNo) const {
+  ASSERT(blockNo >= 0 && blockNo < static_cast<SizeType>(m_blocks.size()));
+  return {0, blockTop(blockNo), m_setting->maxWidth, m_blocks[blockNo].height()};
+}
+int Document::blockTop(SizeType blockNo) const {
+  ASSERT(blockNo >= 0 && blockNo < static_cast<SizeType>(m_blocks.size()));
+  if (m_blockTops.empty()) m_blockTops.push_back(m_setting->docMargin.top);
+  while (static_cast<SizeType>(m_blockTops.size()) <= blockNo) {
+    auto i = m_blockTops.size() - 1;
+    m_blockTops.push_back(m_blockTops[i] + m_blocks[i].height() + m_setting->blockSpacing);
+  }
+  return m_blockTops[blockNo];
+}
+SizeType Document::blockAt(int y) const {
+  if (m_blocks.empty()) return 0;
+  // 索引补到第一个top超过y的块
+  SizeType last = m_blocks.size() - 1;
+  while (m_blockTops.size() < m_blocks.size() && (m_blockTops.empty() || m_blockTops.back() <= y)) {
+    blockTop(m_blockTops.size());
+  }
+  auto it = std::upper_bound(m_blockTops.begin(), m_blockTops.end(), y);
+  if (it == m_blockTops.begin()) return 0;
+  return std::min<SizeType>(std::distance(m_blockTops.begin(), it) - 1, last);
+}
+void Document::invalidateBlockTops(SizeType blockNo) {
+  if (static_cast<SizeType>(m_blockTops.size()) > blockNo + 1) m_blockTops.resize(blockNo + 1);
+}
+std::vector<core::Rect> Document::rangeRects(const CursorCoord& begin, const CursorCoord& end, int top,
+                                             int bottom) const {
+  std::vector<core::Rect> rects;
+  if (!(begin < end) || m_blocks.empty() || begin.blockNo >= static_cast<SizeType>(m_blocks.size())) return rects;
+  const auto& buffers = bufferProvider();
+  // 折行处的offset既是上一个视觉行的结尾，也是下一个的开头，按要画的视觉行取x
+  auto xAt = [&buffers](const LogicalLine& line, int visualLineNo, SizeType offset) {
+    const auto& visualLine = line.visualLineAt(visualLineNo);
+    auto [pos, h, ascent] = line.cursorAt(offset, buffers);
+    auto y = pos.y - ascent;
+    if (y < visualLine.pos().y) return visualLine.pos().x;
+    if (y >= visualLine.pos().y + visualLine.height()) return visualLine.pos().x + visualLine.width();
+    return pos.x;
+  };
+  SizeType lastBlockNo = std::min<SizeType>(end.blockNo, m_blocks.size() - 1);
+  for (auto blockNo = std::max(begin.blockNo, blockAt(top)); blockNo <= lastBlockNo; ++blockNo) {
+    auto y = blockTop(blockNo);
+    if (y >= bottom) break;
+    const auto& block = m_blocks[blockNo];
+    SizeType lastLineNo = block.countOfLogicalLine() - 1;
+    SizeType firstLineNo = blockNo == begin.blockNo ? std::min(begin.lineNo, lastLineNo) : 0;
+    if (blockNo == end.blockNo) lastLineNo = std::min(end.lineNo, lastLineNo);
+    for (auto lineNo = firstLineNo; lineNo <= lastLineNo; ++lineNo) {
+      const auto& line = block.logicalLineAt(lineNo);
+      if (line.countOfVisualLine() == 0) continue;
+      bool startsHere = blockNo == begin.blockNo && lineNo == begin.lineNo;
+      bool endsHere = blockNo == end.blockNo && lineNo == end.lineNo;
+      auto beginOffset = std::min(begin.offset, line.length());
+      auto endOffset = std::min(end.offset, line.length());
+      int firstVisualLineNo = startsHere ? line.visualLineAt(beginOffset, buffers) : 0;
+      int lastVisualLineNo = endsHere ? line.visualLineAt(endOffset, buffers) : line.countOfVisualLine() - 1;
+      for (auto i = firstVisualLineNo; i <= lastVisualLineNo; ++i) {
+        const auto& visualLine = line.visualLineAt(i);
+        auto lineTop = y + visualLine.pos().y;
+        if (lineTop >= bottom) return rects;
+        if (lineTop + visualLine.height() <= top) continue;
+        auto left = startsHere && i == firstVisualLineNo ? xAt(line, i, beginOffset) : visualLine.pos().x;
+        auto right = endsHere && i == lastVisualLineNo ? xAt(line, i, endOffset)
+                                                       : visualLine.pos().x + visualLine.width();
+        if (right > left) rects.emplace_back(left, lineTop, right - left, visualLine.height());
+      }
+    }
+  }
+  return rects;
+}
+core::Rect Document::takeDamage() {
+  core::Rect damage;
+  auto addDamage = [&damage, width = m_setting->maxWidth](int top, int height) {
+    damage = damage.united(core::Rect(0, top, width, height));
+  };
+  const auto paintedCount = static_cast<SizeType>(m_paintedBlocks.size());
+  std::unordered_map<uint64_t, SizeType> oldIndex;
+  for (SizeType i = 0; i < paintedCount; ++i) {
+    oldIndex.emplace(m_paintedBlocks[i].version, i);
+  }
+  std::unordered_set<uint64_t> versions;
+  for (const auto& block : m_blocks) {
+    versions.insert(block.version());
+  }
+  std::vector<bool> used(m_paintedBlocks.size(), false);
+  std::vector<PaintedBlock> painted;
+  painted.reserve(m_blocks.size());
+  int top = m_setting->docMargin.top;
+  for (SizeType i = 0; i < static_cast<SizeType>(m_blocks.size()); ++i) {
+    const auto& block = m_blocks[i];
+    int height = block.height();
+    if (auto it = oldIndex.find(block.version()); it != oldIndex.end()) {
+      // 没变过的块，只是被挤动了位置才重画
+      auto& old = m_paintedBlocks[it->second];
+      used[it->second] = true;
+      if (old.top != top) {
+        addDamage(old.top, old.height);
+        addDamage(top, height);
+        old.top = top;
+      }
+      painted.push_back(std::move(old));
+      top += height + m_setting->blockSpacing;
+      continue;
+    }
+    PaintedBlock now{block.version(), top, height, block.chromeHash(), block.lineSignatures()};
+    // 同一个下标上被换掉的旧块，位置和行外的装饰都没变时只重画变了的行
+    bool paired = i < paintedCount && !used[i] && !versions.contains(m_paintedBlocks[i].version) &&
+                  m_paintedBlocks[i].top == top && m_paintedBlocks[i].chromeHash == now.chromeHash;
+    if (paired) {
+      used[i] = true;
+      const auto& oldLines = m_paintedBlocks[i].lines;
+      const auto& newLines = now.lines;
+      const auto oldCount = static_cast<SizeType>(oldLines.size());
+      const auto newCount = static_cast<SizeType>(newLines.size());
+      SizeType a = 0;
+      SizeType b = 0;
+      while (a < oldCount || b < newCount) {
+        if (b == newCount || (a < oldCount && oldLines[a].top < newLines[b].top)) {
+          addDamage(top + oldLines[a].top, oldLines[a].height);
+          ++a;
+        } else if (a == oldCount || newLines[b].top < oldLines[a].top) {
+          addDamage(top + newLines[b].top, newLines[b].height);
+          ++b;
+        } else {
+          if (oldLines[a] != newLines[b]) {
+            addDamage(top + oldLines[a].top, oldLines[a].height);
+            addDamage(top + newLines[b].top, newLines[b].height);
+          }
+          ++a;
+          ++b;
+        }
+      }
+    } else {
+      addDamage(top, height);
+    }
+    painted.push_back(std::move(now));
+    top += height + m_setting->blockSpacing;
+  }
+  // 删掉的块原来的位置
+  for (SizeType i = 0; i < paintedCount; ++i) {
+    if (!used[i]) addDamage(m_paintedBlocks[i].top, m_paintedBlocks[i].height);
+  }
+  m_paintedBlocks = std::move(painted);
+  return damage;
+}
 void Document::mergeBlock(SizeType blockNo1, SizeType blockNo2) {
   ASSERT(blockNo1 >= 0 && blockNo1 < m_parserDoc->root()->children().size());
   ASSERT(blockNo2 >= 0 && blockNo2 < m_parserDoc->root()->children().size());
@@ -134,29 +417,157 @@ void Document::mergeBlock(SizeType blockNo1, SizeType blockNo2) {
   }
   m_parserDoc->root()->removeChildAt(blockNo2);
   m_blocks.erase(m_blocks.begin() + blockNo2);
+  invalidateBlockTops(blockNo2);
   renderBlock(blockNo1);
   assertBlocksInSync();
 }
 void Document::removeBlock(SizeType blockNo) {
   ASSERT(blockNo >= 0 && blockNo < m_blocks.size());
   m_blocks.erase(m_blocks.begin() + blockNo);
+  invalidateBlockTops(blockNo);
   m_parserDoc->root()->children().erase(m_parserDoc->root()->children().begin() + blockNo);
   assertBlocksInSync();
 }
-void Document::undo(Cursor& cursor) { m_commandStack->undo(cursor);
-  ensureTrailingParagraph(); }
+static std::vector<uint64_t> blockVersions(const render::BlockList& blocks) {
+  std::vector<uint64_t> versions;
+  versions.reserve(blocks.size());
+  for (const auto& block : blocks) versions.push_back(block.version());
+  return versions;
+}
+void Document::undo(Cursor& cursor) {
+  clearPreedit();
+  auto versions = blockVersions(m_blocks);
+  m_commandStack->undo(cursor);
+  ensureTrailingParagraph();
+  recordReplacedBlocks(versions);
+}
 void Document::redo(Cursor& cursor) {
+  clearPreedit();
+  auto versions = blockVersions(m_blocks);
   m_commandStack->redo(cursor);
   ensureTrailingParagraph();
+  recordReplacedBlocks(versions);
 }
+void Document::recordReplacedBlocks(const std::vector<uint64_t>& before) {
+  // 重新排版过的块版本号都变了，去掉前后没变的块，中间就是换掉的
+  const auto oldCount = static_cast<SizeType>(before.size());
+  const auto newCount = static_cast<SizeType>(m_blocks.size());
+  SizeType prefix = 0;
+  while (prefix < oldCount && prefix < newCount && before[prefix] == m_blocks[prefix].version()) {
+    prefix++;
+  }
+  SizeType suffix = 0;
+  while (suffix < oldCount - prefix && suffix < newCount - prefix &&
+         before[oldCount - 1 - suffix] == m_blocks[newCount - 1 - suffix].version()) {
+    suffix++;
+  }
+  if (prefix == oldCount && prefix == newCount) return;
+  String markdown;
+  if (m_journal) {
+    for (SizeType i = prefix; i < newCount - suffix; ++i) {
+      markdown += serializeBlock(i);
+    }
+  }
+  record({EditOp::replaceBlocks, {prefix, 0, 0}, {oldCount - suffix, 0, 0}, 0, markdown});
+}
+void Document::replaceBlocks(Cursor& cursor, SizeType first, SizeType last, const String& markdown) {
+  record({EditOp::replaceBlocks, {first, 0, 0}, {last, 0, 0}, 0, markdown});
+  auto command = std::make_unique<ReplaceBlocksCommand>(this, first, last, markdown);
+  command->execute(cursor);
+  m_commandStack->push(std::move(command));
+  ensureTrailingParagraph();
+}
+void Document::beginTransaction() {
+  ASSERT(!m_transaction && "transactions do not nest");
+  m_transaction.emplace();
+}
+void Document::replaceText(Cursor& cursor, const CursorCoord& begin, const CursorCoord& end, const String& text) {
+  ASSERT(begin <= end);
+  if (!m_transaction) {
+    beginTransaction();
+    m_transaction->push_back({begin, end, text});
+    commit(cursor);
+    return;
+  }
+  // 按位置排好放，不重叠的编辑结尾也是有序的，只用和前后两处比。按顺序排进来的(比如查找的结果)直接放到最后
+  auto& edits = *m_transaction;
+  auto it = std::upper_bound(edits.begin(), edits.end(), begin,
+                             [](const CursorCoord& coord, const TextEdit& edit) { return coord < edit.begin; });
+  ASSERT((it == edits.begin() || !(begin < std::prev(it)->end)) && "edits in a transaction must not overlap");
+  ASSERT((it == edits.end() || !(it->begin < end)) && "edits in a transaction must not overlap");
+  edits.insert(it, {begin, end, text});
+}
+void Document::commit(Cursor& cursor) {
+  ASSERT(m_transaction);
+  auto edits = std::move(*m_transaction);
+  m_transaction.reset();
+  if (edits.empty()) return;
+  // 日志里按原样记一组，重放时还是一个事务
+  record({EditOp::beginTransaction});
+  for (const auto& edit : edits) {
+    record({EditOp::replaceText, edit.begin, edit.end, 0, edit.text});
+  }
+  record({EditOp::commitTransaction});
+  auto command = std::make_unique<TransactionCommand>(this, std::move(edits));
+  command->execute(cursor);
+  m_commandStack->push(std::move(command));
+  ensureTrailingParagraph();
+}
+SizeType Document::replaceBlockRange(SizeType first, SizeType last, const String& markdown) {
+  ASSERT(first >= 0 && first <= last && last <= static_cast<SizeType>(m_blocks.size()));
+  SizeType addOffset = appendToAddBuffer(markdown);
+  auto newRoot = Parser::parse(markdown, PieceTableItem::add, addOffset);
+  auto& children = m_parserDoc->root()->children();
+  children.erase(children.begin() + first, children.begin() + last);
+  m_blocks.erase(m_blocks.begin() + first, m_blocks.begin() + last);
+  invalidateBlockTops(first);
+  auto& newChildren = newRoot->children();
+  SizeType count = newChildren.size();
+  for (SizeType i = 0; i < count; ++i) {
+    auto* raw = newChildren[i].get();
+    m_parserDoc->root()->insertChild(first + i, std::move(newChildren[i]));
+    m_blocks.insert(m_blocks.begin() + first + i,
+                    Render::render(raw, m_setting, *m_parserDoc, nullptr, m_imageProvider, nullptr, m_styles, m_latexCache, m_imageCache, m_iconAtlas));
+  }
+  assertBlocksInSync();
+  return count;
+}
+std::size_t Document::undoHistoryBytes() const { return m_commandStack->byteCount(); }
+void Document::setUndoHistoryMaxBytes(std::size_t maxBytes) { m_commandStack->setMaxBytes(maxBytes); }
 void Document::upgradeToHeader(Cursor& cursor, int level) {
   ASSERT(level >= 1 && level <= 6);
+  record({EditOp::upgradeToHeader, cursor.coord(), {}, level});
   auto command = std::make_unique<UpgradeToHeaderCommand>(this, cursor.coord(), level);
   command->execute(cursor);
   m_commandStack->push(std::move(command));
   ensureTrailingParagraph();
 }
+// 块里的复选框，按先序
+static void collectCheckboxItems(Node* node, std::vector<CheckboxItem*>& items) {
+  if (node->type() == NodeType::checkbox_item) items.push_back(static_cast<CheckboxItem*>(node));
+  auto container = dynamic_cast<Container*>(node);
+  if (!container) return;
+  for (auto& child : container->children()) {
+    collectCheckboxItems(child.get(), items);
+  }
+}
+void Document::toggleCheckbox(SizeType blockNo, SizeType itemNo) {
+  std::vector<CheckboxItem*> items;
+  collectCheckboxItems(m_parserDoc->root()->childAt(blockNo), items);
+  if (itemNo < 0 || itemNo >= static_cast<SizeType>(items.size())) return;
+  record({EditOp::toggleCheckbox, {blockNo, 0, 0}, {}, static_cast<int32_t>(itemNo)});
+  items[itemNo]->setChecked(!items[itemNo]->isChecked());
+  renderBlock(blockNo);
+}
+void Document::toggleCheckbox(SizeType blockNo, CheckboxItem* item) {
+  std::vector<CheckboxItem*> items;
+  collectCheckboxItems(m_parserDoc->root()->childAt(blockNo), items);
+  auto it = std::find(items.begin(), items.end(), item);
+  if (it == items.end()) return;
+  toggleCheckbox(blockNo, it - items.begin());
+}
 void Document::removeTextRange(const CursorCoord& begin, const CursorCoord& end) {
+  record({EditOp::removeTextRange, begin, end});
   auto command = std::make_unique<RemoveTextRangeCommand>(this, begin, end);
   Cursor cursor;
   command->execute(cursor);
@@ -165,13 +576,24 @@ void Document::removeTextRange(const CursorCoord& begin, const CursorCoord& end)
   }
   ensureTrailingParagraph();
 }
-String Document::serializeBlock(SizeType blockNo) const {
-  ASSERT(blockNo >= 0 && blockNo < m_parserDoc->root()->children().size());
-  auto* node = m_parserDoc->root()->childAt(blockNo);
-  MarkdownSerializer serializer(*m_parserDoc);
-  node->accept(&serializer);
-  return serializer.markdown();
+const MarkdownSerializer& Document::serialized(SizeType blockNo) const {
+  ASSERT(blockNo >= 0 && blockNo < static_cast<SizeType>(m_blocks.size()));
+  auto version = m_blocks[blockNo].version();
+  if (auto it = m_serializedBlocks.find(version); it != m_serializedBlocks.end()) return *it->second;
+  m_serializeCacheMisses++;
+  // 重新排版过的块版本号都换了，旧的积多了就清掉
+  if (m_serializedBlocks.size() > 2 * m_blocks.size() + 16) {
+    std::unordered_set<uint64_t> versions;
+    for (const auto& block : m_blocks) {
+      versions.insert(block.version());
+    }
+    std::erase_if(m_serializedBlocks, [&versions](const auto& entry) { return !versions.contains(entry.first); });
+  }
+  auto serializer = std::make_shared<MarkdownSerializer>(*m_parserDoc);
+  m_parserDoc->root()->childAt(blockNo)->accept(serializer.get());
+  return *m_serializedBlocks.emplace(version, std::move(serializer)).first->second;
 }
+String Document::serializeBlock(SizeType blockNo) const { return serialized(blockNo).markdown(); }
 
 Document::MarkdownPosition Document::cursorToMarkdownPosition(const CursorCoord& coord) const {
   MarkdownPosition result;
@@ -186,17 +608,12 @@ Document::MarkdownPosition Document::cursorToMarkdownPosition(const CursorCoord&
   contentPos += coord.offset;
 
   auto* blockNode = m_parserDoc->root()->childAt(coord.blockNo);
-  MarkdownSerializer serializer(*m_parserDoc);
-  blockNode->accept(&serializer);
+  const auto& serializer = serialized(coord.blockNo);
   result.text = serializer.markdown();
-  const auto& posMap = serializer.contentToMarkdown();
 
   SizeType contentLen = blockNode->contentLength(*m_parserDoc);
-  if (contentPos < contentLen && contentPos < posMap.size()) {
-    result.pos = posMap[contentPos];
-  } else {
-    result.pos = serializer.contentEndMarkdownPos();
-  }
+  auto pos = contentPos < contentLen ? serializer.contentToMarkdown(contentPos) : std::nullopt;
+  result.pos = pos ? *pos : serializer.contentEndMarkdownPos();
   return result;
 }
 
@@ -214,6 +631,10 @@ CursorCoord Document::findCursorFromContentPosition(SizeType blockNo, SizeType c
   return {blockNo, lastLine, block.logicalLineAt(lastLine).length()};
 }
 
+CursorCoord Document::findCursorFromMarkdownPosition(SizeType blockNo, SizeType markdownPos) const {
+  return findCursorFromContentPosition(blockNo, serialized(blockNo).markdownToContent(markdownPos));
+}
+
 void Document::replaceBlocksFromText(SizeType startBlockNo, SizeType endBlockNo,
                                      const String& editedMD, SizeType addOffset, SizeType addLength) {
   auto newRoot = Parser::parse(editedMD, PieceTableItem::add, addOffset);
@@ -234,12 +655,13 @@ void Document::replaceBlocksFromText(SizeType startBlockNo, SizeType endBlockNo,
     oldChildren.erase(oldChildren.begin() + startBlockNo);
     m_blocks.erase(m_blocks.begin() + startBlockNo);
   }
+  invalidateBlockTops(startBlockNo);
 
   for (SizeType i = 0; i < newBlockCount; ++i) {
     auto* raw = newChildren[i].get();
     m_parserDoc->root()->insertChild(startBlockNo + i, std::move(newChildren[i]));
     m_blocks.insert(m_blocks.begin() + startBlockNo + i,
-                    Render::render(raw, m_setting, *m_parserDoc, nullptr, m_imageProvider));
+                    Render::render(raw, m_setting, *m_parserDoc, nullptr, m_imageProvider, nullptr, m_styles, m_latexCache, m_imageCache, m_iconAtlas));
   }
   assertBlocksInSync();
 }
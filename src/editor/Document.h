@@ -5,13 +5,19 @@
 #ifndef QTMARKDOWN_DOCUMENT_H
 #define QTMARKDOWN_DOCUMENT_H
 #include "QtMarkdown_global.h"
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
 #include "render/mddef.h"
 #include "parser/Document.h"
 #include "parser/IBufferProvider.h"
-#include "render/Instruction.h"
+#include "render/DisplayList.h"
 #include "render/Render.h"
 #include "core/Types.h"
 #include "core/IImageProvider.h"
+#include "CursorCoord.h"
 #include "CursorNavigator.h"
 
 namespace md::editor {
@@ -19,19 +25,26 @@ class Command;
 class CommandStack;
 class Cursor;
 struct CursorCoord;
+class EditJournal;
+struct EditOp;
+class MarkdownSerializer;
 class QTMARKDOWNEDITORCORE_EXPORT Document {
  public:
+  // latexTypesetCallback不为空时公式在后台线程排版，有结果时在工作线程回调，
+  // 调用方切回GUI线程后调用updateTypesetLatex。imageDecodeCallback同理，对应updateDecodedImages
+  // iconAtlas为空时自己从imageProvider加载界面图标，多个文档可以共用一份
   explicit Document(const String& str, sptr<render::RenderSetting> setting,
-                    core::IImageProvider* imageProvider = nullptr);
+                    core::IImageProvider* imageProvider = nullptr,
+                    std::function<void()> latexTypesetCallback = nullptr,
+                    std::function<void()> imageDecodeCallback = nullptr,
+                    sptr<render::IconAtlas> iconAtlas = nullptr);
   parser::Container* root() const { return m_parserDoc->root(); }
-  const String& addBuffer() const { return m_parserDoc->addBuffer(); }
+  std::string_view addBuffer() const { return m_parserDoc->addBuffer(); }
   const parser::IBufferProvider& bufferProvider() const { return *m_parserDoc; }
+  sptr<const String> sharedOriginalBuffer() const { return m_parserDoc->sharedOriginalBuffer(); }
+  sptr<const String> sharedAddBuffer() const { return m_parserDoc->sharedAddBuffer(); }
   void accept(parser::NodeVisitor* visitor) const { m_parserDoc->accept(visitor); }
-  SizeType appendToAddBuffer(const String& text) {
-    SizeType offset = m_parserDoc->addBuffer().size();
-    m_parserDoc->addBuffer().append(text);
-    return offset;
-  }
+  SizeType appendToAddBuffer(const String& text) { return m_parserDoc->appendToAddBuffer(text); }
   CursorCoord moveCursorToRight(CursorCoord coord) { return m_navigator.moveCursorToRight(coord); }
   CursorCoord moveCursorToLeft(CursorCoord coord) { return m_navigator.moveCursorToLeft(coord); }
   CursorCoord moveCursorToBol(CursorCoord coord) { return m_navigator.moveCursorToBol(coord); }
@@ -50,14 +63,66 @@ class QTMARKDOWNEDITORCORE_EXPORT Document {
   void replaceBlock(SizeType blockNo, std::unique_ptr<parser::Node> node);
   void insertBlock(SizeType blockNo, std::unique_ptr<parser::Node> node);
   void renderBlock(SizeType blockNo);
+  // 块的结构没变时只重排第lineNo个逻辑行，块的类型不支持时整块重排
+  void renderLine(SizeType blockNo, SizeType lineNo);
+  // 重新排版公式已经排好的块，返回是否有块变化
+  bool updateTypesetLatex();
+  // 大小已知的图片只填进显示列表，大小未知的重新排版所在的块。返回是否需要重画
+  bool updateDecodedImages();
+  // 视口[top, bottom)里和附近一屏以内的块的图片先解码，越近越先
+  void prioritizeImages(int top, int bottom);
+  // 和上次调用时的块比较：版本号没变的块只看位置，换过的块逐行比较摘要。
+  // 返回要重画的区域(文档坐标，占满文档宽度)，第一次调用返回整个文档
+  core::Rect takeDamage();
+  // 块在文档中占的区域，占满文档宽度
+  core::Rect blockRect(SizeType blockNo) const;
+  // 块的top，查过的存在位置索引里，块变了只作废它后面的
+  int blockTop(SizeType blockNo) const;
+  // 文档坐标y所在的块，落在块间距里时是上面那块
+  SizeType blockAt(int y) const;
+  // [begin, end)在文档坐标[top, bottom)里的高亮框，每个视觉行一个，只看这个范围里的块和视觉行
+  std::vector<core::Rect> rangeRects(const CursorCoord& begin, const CursorCoord& end, int top, int bottom) const;
   void removeBlock(SizeType blockNo);
   void mergeBlock(SizeType blockNo1, SizeType blockNo2);
   void removeTextRange(const CursorCoord& begin, const CursorCoord& end);
 
   void undo(Cursor& cursor);
   void redo(Cursor& cursor);
+  // 撤销历史占的内存，超出预算时淘汰最早的记录
+  [[nodiscard]] std::size_t undoHistoryBytes() const;
+  void setUndoHistoryMaxBytes(std::size_t maxBytes);
+
+  // 批量编辑：beginTransaction之后replaceText只记下来，commit时一起改。
+  // 连着的脏块各序列化一次，改好之后一起重新解析、排版一次，整个事务是一条撤销记录
+  struct TextEdit {
+    CursorCoord begin;
+    CursorCoord end;
+    String text;
+  };
+  void beginTransaction();
+  // 把[begin, end)换成text。坐标都按beginTransaction时的文档算，各处编辑不能重叠，重叠直接断言失败。
+  // 不在事务里时自己算一个事务，马上提交，光标放到编辑之后；在事务里时光标等commit再动
+  void replaceText(Cursor& cursor, const CursorCoord& begin, const CursorCoord& end, const String& text);
+  // 光标放到最后一处编辑之后。没有编辑时什么都不做
+  void commit(Cursor& cursor);
+  [[nodiscard]] bool inTransaction() const { return m_transaction.has_value(); }
+  // 用markdown解析出的块换掉[first, last)，返回新块数
+  SizeType replaceBlockRange(SizeType first, SizeType last, const String& markdown);
+  // 同上，作为一次编辑进撤销历史和日志，光标放到first那块的开头。日志重放撤销、重做用
+  void replaceBlocks(Cursor& cursor, SizeType first, SizeType last, const String& markdown);
 
   void upgradeToHeader(Cursor& cursor, int level);
+  // 切换块里第itemNo个复选框(按先序数)，不进撤销历史
+  void toggleCheckbox(SizeType blockNo, SizeType itemNo);
+  void toggleCheckbox(SizeType blockNo, parser::CheckboxItem* item);
+  // 之后的每次编辑操作都追加到journal里，为空时不记
+  void setJournal(EditJournal* journal) { m_journal = journal; }
+  // 每次编辑操作加一，界面用它判断内容有没有变
+  [[nodiscard]] uint64_t revision() const { return m_revision; }
+  // 输入法组字中的文本只在排版光标所在的逻辑行时画出来，不进语法树、撤销历史和日志，
+  // 只重新排版光标所在的块。text为空时清掉。光标移到组字文本后面
+  void setPreedit(Cursor& cursor, const String& text);
+  [[nodiscard]] bool hasPreedit() const { return m_preedit.has_value(); }
 
   void updateCursor(Cursor& cursor, const CursorCoord& coord, bool updatePos = true) { m_navigator.updateCursor(cursor, coord, updatePos); }
   std::tuple<core::Point, int, int> mapToScreen(const CursorCoord& coord) { return m_navigator.mapToScreen(coord); }
@@ -65,7 +130,10 @@ class QTMARKDOWNEDITORCORE_EXPORT Document {
   void ensureTrailingParagraph();
 
   const render::RenderSetting& setting() const { return *m_setting; }
+  const render::LatexCache& latexCache() const { return *m_latexCache; }
+  const render::ImageCache& imageCache() const { return *m_imageCache; }
 
+  // 块的markdown和内容位置映射按块的版本号缓存，块重新排版之前反复调用只序列化一次
   String serializeBlock(SizeType blockNo) const;
   struct MarkdownPosition {
     String text;
@@ -73,17 +141,58 @@ class QTMARKDOWNEDITORCORE_EXPORT Document {
   };
   MarkdownPosition cursorToMarkdownPosition(const CursorCoord& coord) const;
   CursorCoord findCursorFromContentPosition(SizeType blockNo, SizeType contentPos) const;
+  CursorCoord findCursorFromMarkdownPosition(SizeType blockNo, SizeType markdownPos) const;
   void replaceBlocksFromText(SizeType startBlockNo, SizeType endBlockNo,
                               const String& editedMD, SizeType addOffset, SizeType addLength);
   int countOfBlock() const { return m_blocks.size(); }
+  // 序列化缓存没命中的次数
+  [[nodiscard]] SizeType serializeCacheMisses() const { return m_serializeCacheMisses; }
 
  private:
   void assertBlocksInSync();
+  // 第blockNo块换了、插入或删掉了，它自己的top不变，后面的要重算
+  void invalidateBlockTops(SizeType blockNo);
+  void record(const EditOp& op);
+  // 撤销、重做之后和before(之前每块的版本号)比较，换掉的块记成一条replaceBlocks
+  void recordReplacedBlocks(const std::vector<uint64_t>& before);
+  const render::Preedit* preeditOf(SizeType blockNo) const;
+  void clearPreedit();
+  const MarkdownSerializer& serialized(SizeType blockNo) const;
   std::unique_ptr<parser::Document> m_parserDoc;
   render::BlockList m_blocks;
   sptr<render::RenderSetting> m_setting;
   sptr<CommandStack> m_commandStack;
   core::IImageProvider* m_imageProvider = nullptr;
+  // 所有块共享的样式表
+  sptr<render::StyleTable> m_styles;
+  // 所有块共享的LaTeX排版缓存
+  sptr<render::LatexCache> m_latexCache;
+  // 所有块共享的解码图片缓存
+  sptr<render::ImageCache> m_imageCache;
+  // 界面图标
+  sptr<render::IconAtlas> m_iconAtlas;
+  // 上次takeDamage时画出来的块
+  struct PaintedBlock {
+    uint64_t version;
+    int top;
+    int height;
+    uint64_t chromeHash;
+    std::vector<render::LineSignature> lines;
+  };
+  std::vector<PaintedBlock> m_paintedBlocks;
+  // 位置索引：前m_blockTops.size()块的top，后面的用到时再接着算
+  mutable std::vector<int> m_blockTops;
+  EditJournal* m_journal = nullptr;
+  // 块版本号 -> 序列化结果
+  mutable std::unordered_map<uint64_t, sptr<const MarkdownSerializer>> m_serializedBlocks;
+  mutable SizeType m_serializeCacheMisses = 0;
+  uint64_t m_revision = 0;
+  struct PreeditState {
+    SizeType blockNo;
+    render::Preedit preedit;
+  };
+  std::optional<PreeditState> m_preedit;
+  std::optional<std::vector<TextEdit>> m_transaction;
   CursorNavigator m_navigator{m_blocks, *m_parserDoc, *m_parserDoc->root(), *m_setting};
 };
 }  // namespace md::editor
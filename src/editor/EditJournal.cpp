@@ -0,0 +1,282 @@
+#include "EditJournal.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <utility>
+
+#include "Cursor.h"
+#include "Document.h"
+#include "FileManager.h"
+#include "debug.h"
+namespace md::editor {
+namespace {
+constexpr char kMagic[4] = {'Q', 'M', 'D', 'J'};
+// 2: 撤销、重做记成replaceBlocks
+constexpr uint32_t kVersion = 2;
+// 魔数、版本、原文件大小、原文件哈希
+constexpr std::size_t kHeaderBytes = 4 + 4 + 8 + 8;
+// 类型、两个坐标、参数，后面跟文本
+constexpr std::size_t kFixedPayloadBytes = 1 + 6 * 8 + 4;
+
+uint32_t checksum(const char* data, std::size_t size) {
+  auto h = EditJournal::hash(data, size);
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+template <typename T>
+void put(std::string& out, T value) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  out.append(bytes, sizeof(T));
+}
+template <typename T>
+T get(const char* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+void putCoord(std::string& out, const CursorCoord& coord) {
+  put<int64_t>(out, coord.blockNo);
+  put<int64_t>(out, coord.lineNo);
+  put<int64_t>(out, coord.offset);
+}
+CursorCoord getCoord(const char* data) {
+  return {get<int64_t>(data), get<int64_t>(data + 8), get<int64_t>(data + 16)};
+}
+}  // namespace
+EditJournal::EditJournal(String path) : m_path(std::move(path)) {}
+EditJournal::~EditJournal() {
+  sync();
+  close();
+}
+uint64_t EditJournal::hash(const char* data, std::size_t size, uint64_t seed) {
+  uint64_t h = seed;
+  for (std::size_t i = 0; i < size; ++i) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+std::string EditJournal::header(uint64_t baseBytes, uint64_t baseHash) {
+  std::string out(kMagic, sizeof(kMagic));
+  put<uint32_t>(out, kVersion);
+  put<uint64_t>(out, baseBytes);
+  put<uint64_t>(out, baseHash);
+  return out;
+}
+void EditJournal::encode(std::string& out, const EditOp& op) {
+  std::string payload;
+  payload.reserve(kFixedPayloadBytes + op.text.size());
+  put<uint8_t>(payload, op.type);
+  putCoord(payload, op.begin);
+  putCoord(payload, op.end);
+  put<int32_t>(payload, op.arg);
+  payload.append(op.text.data(), op.text.size());
+  put<uint32_t>(out, payload.size());
+  out += payload;
+  put<uint32_t>(out, checksum(payload.data(), payload.size()));
+}
+std::optional<std::vector<EditOp>> EditJournal::read(std::size_t* validBytes) {
+  std::ifstream file(m_path.toStdString(), std::ios::binary);
+  if (!file.is_open()) return std::nullopt;
+  std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (content.size() < kHeaderBytes || content.compare(0, kHeaderBytes, m_header) != 0) {
+    DEBUG << "journal does not match the file:" << m_path;
+    return std::nullopt;
+  }
+  std::vector<EditOp> ops;
+  std::size_t pos = kHeaderBytes;
+  while (content.size() - pos >= 4) {
+    auto size = get<uint32_t>(content.data() + pos);
+    // 写了一半就崩溃了，后面的都不要
+    if (size < kFixedPayloadBytes || content.size() - pos - 4 < std::size_t(size) + 4) break;
+    const char* payload = content.data() + pos + 4;
+    if (get<uint32_t>(payload + size) != checksum(payload, size)) break;
+    auto type = get<uint8_t>(payload);
+    if (type < EditOp::snapshot || type > EditOp::commitTransaction) break;
+    EditOp op;
+    op.type = static_cast<EditOp::Type>(type);
+    op.begin = getCoord(payload + 1);
+    op.end = getCoord(payload + 25);
+    op.arg = get<int32_t>(payload + 49);
+    op.text = String(std::string(payload + kFixedPayloadBytes, size - kFixedPayloadBytes));
+    pos += 4 + size + 4;
+    if (op.type == EditOp::snapshot) {
+      m_snapshotEnd = pos;
+      m_snapshotBytes = op.text.size();
+    }
+    ops.push_back(std::move(op));
+  }
+  *validBytes = pos;
+  return ops;
+}
+bool EditJournal::open(const String& base, std::vector<EditOp>* recovered) {
+  close();
+  m_header = header(base.size(), hash(base.data(), base.size()));
+  m_snapshotEnd = kHeaderBytes;
+  m_snapshotBytes = base.size();
+  std::size_t validBytes = 0;
+  auto ops = read(&validBytes);
+  if (!ops) return create(base);
+  std::error_code ec;
+  std::filesystem::resize_file(m_path.toStdString(), validBytes, ec);
+  if (ec) return create(base);
+  m_file = std::fopen(m_path.toStdString().c_str(), "ab");
+  if (!m_file) return false;
+  m_fileBytes = validBytes;
+  m_pending.clear();
+  if (recovered) *recovered = std::move(*ops);
+  return true;
+}
+bool EditJournal::create(const String& base) {
+  close();
+  m_header = header(base.size(), hash(base.data(), base.size()));
+  m_file = std::fopen(m_path.toStdString().c_str(), "wb");
+  if (!m_file) {
+    DEBUG << "journal open fail:" << m_path;
+    return false;
+  }
+  m_pending.clear();
+  m_fileBytes = 0;
+  m_snapshotEnd = kHeaderBytes;
+  m_snapshotBytes = base.size();
+  if (std::fwrite(m_header.data(), 1, m_header.size(), m_file) != m_header.size() || !FileManager::flushToDisk(m_file)) {
+    close();
+    return false;
+  }
+  m_fileBytes = m_header.size();
+  return true;
+}
+void EditJournal::append(const EditOp& op) {
+  encode(m_pending, op);
+  if (m_pending.size() >= kSyncBytes) sync();
+}
+bool EditJournal::sync() {
+  if (!m_file) return false;
+  if (m_pending.empty()) return true;
+  auto size = m_pending.size();
+  auto written = std::fwrite(m_pending.data(), 1, size, m_file);
+  m_fileBytes += written;
+  m_pending.clear();
+  return written == size && FileManager::flushToDisk(m_file);
+}
+bool EditJournal::needsCompaction() const {
+  auto records = byteCount() - m_snapshotEnd;
+  return records > kCompactBytes && records > m_snapshotBytes;
+}
+bool EditJournal::compact(const String& markdown) {
+  if (!m_file) return false;
+  std::string content = m_header;
+  EditOp op;
+  op.text = markdown;
+  encode(content, op);
+  if (!replace(content)) return sync();
+  // 快照里已经包含了还没写入的记录
+  m_pending.clear();
+  m_snapshotEnd = content.size();
+  m_snapshotBytes = markdown.size();
+  return true;
+}
+bool EditJournal::rebase(uint64_t baseBytes, uint64_t baseHash, std::size_t from) {
+  if (!m_file || !sync()) return false;
+  std::string content = header(baseBytes, baseHash);
+  {
+    std::ifstream file(m_path.toStdString(), std::ios::binary);
+    if (!file.is_open()) return false;
+    file.seekg(static_cast<std::streamoff>(from));
+    content.append(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+  auto oldHeader = std::exchange(m_header, content.substr(0, kHeaderBytes));
+  if (!replace(content)) {
+    m_header = std::move(oldHeader);
+    return false;
+  }
+  m_snapshotEnd = kHeaderBytes;
+  m_snapshotBytes = baseBytes;
+  return true;
+}
+bool EditJournal::replace(const std::string& content) {
+  auto tmpPath = m_path.toStdString() + ".tmp";
+  std::FILE* file = std::fopen(tmpPath.c_str(), "wb");
+  if (!file) return false;
+  bool ok = std::fwrite(content.data(), 1, content.size(), file) == content.size() && FileManager::flushToDisk(file);
+  std::fclose(file);
+  std::error_code ec;
+  if (ok) std::filesystem::rename(tmpPath, m_path.toStdString(), ec);
+  if (!ok || ec) {
+    std::filesystem::remove(tmpPath, ec);
+    return false;
+  }
+  close();
+  m_file = std::fopen(m_path.toStdString().c_str(), "ab");
+  m_fileBytes = content.size();
+  return m_file != nullptr;
+}
+void EditJournal::remove() {
+  close();
+  m_pending.clear();
+  m_fileBytes = 0;
+  std::error_code ec;
+  std::filesystem::remove(m_path.toStdString(), ec);
+}
+void EditJournal::close() {
+  if (!m_file) return;
+  std::fclose(m_file);
+  m_file = nullptr;
+}
+void EditJournal::replay(Document& doc, Cursor& cursor, const std::vector<EditOp>& ops) {
+  for (const auto& op : ops) {
+    // 原文件校验过，正常不会越界，以防万一。replaceBlocks可以只在最后插入块
+    bool outOfRange = op.type == EditOp::replaceBlocks
+                          ? op.begin.blockNo < 0 || op.begin.blockNo > op.end.blockNo ||
+                                op.end.blockNo > doc.countOfBlock()
+                          : op.begin.blockNo < 0 || op.begin.blockNo >= doc.countOfBlock();
+    if (outOfRange) {
+      DEBUG << "journal replay stopped at" << op.begin;
+      return;
+    }
+    switch (op.type) {
+      case EditOp::snapshot:
+        ASSERT(false && "snapshot must be handled by the caller");
+        break;
+      case EditOp::insertText:
+        doc.updateCursor(cursor, op.begin);
+        doc.insertText(cursor, op.text);
+        break;
+      case EditOp::removeText:
+        doc.updateCursor(cursor, op.begin);
+        doc.removeText(cursor);
+        break;
+      case EditOp::insertReturn:
+        doc.updateCursor(cursor, op.begin);
+        doc.insertReturn(cursor);
+        break;
+      case EditOp::upgradeToHeader:
+        doc.updateCursor(cursor, op.begin);
+        doc.upgradeToHeader(cursor, op.arg);
+        break;
+      case EditOp::removeTextRange:
+        doc.removeTextRange(op.begin, op.end);
+        doc.updateCursor(cursor, op.begin);
+        break;
+      case EditOp::toggleCheckbox:
+        doc.toggleCheckbox(op.begin.blockNo, op.arg);
+        break;
+      case EditOp::replaceBlocks:
+        doc.replaceBlocks(cursor, op.begin.blockNo, op.end.blockNo, op.text);
+        break;
+      case EditOp::beginTransaction:
+        doc.beginTransaction();
+        break;
+      case EditOp::replaceText:
+        doc.replaceText(cursor, op.begin, op.end, op.text);
+        break;
+      case EditOp::commitTransaction:
+        doc.commit(cursor);
+        break;
+    }
+  }
+}
+}  // namespace md::editor
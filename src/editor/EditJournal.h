@@ -0,0 +1,101 @@
+#ifndef QTMARKDOWN_EDITJOURNAL_H
+#define QTMARKDOWN_EDITJOURNAL_H
+#include "QtMarkdown_global.h"
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "render/mddef.h"
+#include "CursorCoord.h"
+namespace md::editor {
+class Cursor;
+class Document;
+// 一次编辑操作。坐标是编辑前的(块, 逻辑行, 偏移)，和排版宽度无关，对同一个原文件重放的结果是确定的
+struct EditOp {
+  enum Type : uint8_t {
+    // 全文快照，之前的记录都不用了
+    snapshot = 1,
+    insertText,
+    removeText,
+    insertReturn,
+    upgradeToHeader,
+    removeTextRange,
+    toggleCheckbox,
+    // [begin.blockNo, end.blockNo)的块换成text解析出的块。撤销、重做记成这个，
+    // 重放时不依赖撤销历史，快照或者保存截掉前面的记录之后也能重放
+    replaceBlocks,
+    // 一个事务：beginTransaction、若干replaceText、commitTransaction
+    beginTransaction,
+    replaceText,
+    commitTransaction,
+  };
+  Type type = snapshot;
+  CursorCoord begin{};
+  // 只有removeTextRange和replaceBlocks用
+  CursorCoord end{};
+  // 标题级别，或者复选框是块里的第几个
+  int32_t arg = 0;
+  // 插入的文本，换上的块的markdown，或者快照的全文
+  String text{};
+};
+// 崩溃恢复用的只追加编辑日志。文件头记下原文件的大小和哈希，后面每条记录是一次编辑操作。
+// 记录先攒在内存里，sync()时一次写入再fsync，平时的开销只和打字量有关。
+// 快照之后的记录比文档本身还大时，compact()把当前全文写成一条快照记录换掉整个日志。
+// 数值按本机字节序写，日志只给本机恢复用
+class QTMARKDOWNEDITORCORE_EXPORT EditJournal {
+ public:
+  // 攒够这么多字节不等定时器，直接写入
+  static constexpr std::size_t kSyncBytes = 64 * 1024;
+  // 快照之后的记录至少这么大才压缩
+  static constexpr std::size_t kCompactBytes = 1024 * 1024;
+  explicit EditJournal(String path);
+  ~EditJournal();
+  EditJournal(const EditJournal&) = delete;
+  EditJournal& operator=(const EditJournal&) = delete;
+  // 打开日志，base是原文件内容。已有日志且文件头和base对得上时，有效的记录放进recovered，
+  // 结尾写了一半或者校验不过的记录截掉，之后接着往后写；否则新建
+  bool open(const String& base, std::vector<EditOp>* recovered = nullptr);
+  // 丢掉已有内容，从base重新开始，比如保存到原文件之后
+  bool create(const String& base);
+  void append(const EditOp& op);
+  // 攒着的记录写入文件并fsync
+  bool sync();
+  [[nodiscard]] bool needsCompaction() const;
+  // 用全文快照换掉日志：先写临时文件再改名，中途崩溃旧日志还在
+  bool compact(const String& markdown);
+  // 原文件换成了日志写到from字节时的文档内容(后台保存完成)，from之后的记录接到新原文件上
+  bool rebase(uint64_t baseBytes, uint64_t baseHash, std::size_t from);
+  // 关闭并删掉日志文件
+  void remove();
+  // 把记录重放到doc上，快照记录由调用方用它的全文新建文档
+  static void replay(Document& doc, Cursor& cursor, const std::vector<EditOp>& ops);
+  // FNV-1a，可以分段接着算
+  static constexpr uint64_t kHashSeed = 14695981039346656037ULL;
+  static uint64_t hash(const char* data, std::size_t size, uint64_t seed = kHashSeed);
+  [[nodiscard]] const String& path() const { return m_path; }
+  // 文件里的加上还没写入的
+  [[nodiscard]] std::size_t byteCount() const { return m_fileBytes + m_pending.size(); }
+
+ private:
+  static std::string header(uint64_t baseBytes, uint64_t baseHash);
+  static void encode(std::string& out, const EditOp& op);
+  // 读出和m_header对得上的记录，文件不存在或者文件头不对返回std::nullopt
+  std::optional<std::vector<EditOp>> read(std::size_t* validBytes);
+  // 写临时文件再改名，换掉整个日志
+  bool replace(const std::string& content);
+  void close();
+
+  String m_path;
+  std::FILE* m_file = nullptr;
+  std::string m_header;
+  std::string m_pending;
+  std::size_t m_fileBytes = 0;
+  // 最后一个快照(没有时是文件头)结束的位置，和快照全文(没有时是原文件)的大小
+  std::size_t m_snapshotEnd = 0;
+  std::size_t m_snapshotBytes = 0;
+};
+}  // namespace md::editor
+
+#endif  // QTMARKDOWN_EDITJOURNAL_H
@@ -3,18 +3,22 @@
 //
 
 #include "Editor.h"
+#include "AsyncSaver.h"
 #include "EditorRenderer.h"
 #include "EditorInputHandler.h"
+#include "EditJournal.h"
 #include "FileManager.h"
+#include "MarkdownSerializer.h"
 #include "platform/qt/QtImageProvider.h"
 
+#include <algorithm>
 #include <format>
 #include <memory>
 #include <vector>
 
 #include "Cursor.h"
 #include "debug.h"
-#include "render/Instruction.h"
+#include "render/IconAtlas.h"
 #include "render/Render.h"
 using namespace md::parser;
 namespace md::editor {
@@ -26,6 +30,8 @@ Editor::Editor(core::IImageProvider* imageProvider) {
     m_ownedImageProvider = std::make_unique<QtImageProvider>();
     m_imageProvider = m_ownedImageProvider.get();
   }
+  // 图标只加载一次，重新打开文档时接着用
+  m_iconAtlas = std::make_shared<render::IconAtlas>(m_imageProvider);
   m_renderSetting = std::make_shared<render::RenderSetting>();
 #ifdef __ANDROID__
   m_renderSetting->docMargin.left = 0;
@@ -34,10 +40,28 @@ Editor::Editor(core::IImageProvider* imageProvider) {
   m_imageClickedCallback = [](String s) { DEBUG << "click image" << s; };
   m_copyCodeBtnClickedCallback = [](String s) { DEBUG << "click copy code btn" << s; };
   m_checkBoxClickedCallback = []() { DEBUG << "click check box"; };
+  m_saver = std::make_unique<AsyncSaver>([this]() {
+    if (m_saveFinishedCallback) m_saveFinishedCallback();
+  });
+}
+Editor::~Editor() {
+  // 文档的后台解码线程还在用m_imageProvider，先于它析构
+  m_inputHandler.reset();
+  m_renderer.reset();
+  m_search.reset();
+  m_doc.reset();
 }
-Editor::~Editor() = default;
 void Editor::loadText(const String &text) {
-  m_doc = std::make_unique<Document>(text, m_renderSetting, m_imageProvider);
+  // 攒着的字符先插进上一个文档，记进它的日志
+  flushInput();
+  // 上一个文档的保存写完再换，日志先接到保存好的文件上
+  m_saver->wait();
+  finishSave();
+  closeJournal();
+  m_search.reset();
+  m_doc = std::make_unique<Document>(text, m_renderSetting, m_imageProvider, m_latexTypesetCallback,
+                                     m_imageDecodeCallback, m_iconAtlas);
+  m_search = std::make_unique<SearchEngine>(*m_doc);
   m_cursor = std::make_unique<Cursor>();
   m_renderer = std::make_unique<EditorRenderer>(*m_doc, *m_renderSetting);
   m_inputHandler = std::make_unique<EditorInputHandler>(*this, *m_doc, *m_cursor, *m_renderSetting);
@@ -52,20 +76,94 @@ std::pair<bool, String> Editor::loadFile(const String &path) {
 }
 
 bool Editor::saveToFile(const String &path) {
+  if (!saveToFileAsync(path)) return false;
+  m_saver->wait();
+  return finishSave().value_or(false);
+}
+bool Editor::saveToFileAsync(const String &path) {
   if (!m_doc) return false;
-  FileManager fm(*m_doc);
-  return fm.saveToFile(path);
+  flushInput();
+  if (m_journal && m_journal->sync()) {
+    m_saveJournalMark = m_journal->byteCount();
+  } else {
+    m_saveJournalMark.reset();
+  }
+  m_saver->save(*m_doc, path);
+  return true;
+}
+std::optional<bool> Editor::finishSave() {
+  auto result = m_saver->takeResult();
+  if (!result) return std::nullopt;
+  if (result->ok && m_journal && m_saveJournalMark) {
+    m_journal->rebase(result->bytes, result->hash, *m_saveJournalMark);
+  }
+  m_saveJournalMark.reset();
+  return result->ok;
+}
+bool Editor::openJournal(const String &path) {
+  if (!m_doc) return false;
+  closeJournal();
+  // 刚加载完，原始缓冲区就是原文件
+  auto journal = std::make_unique<EditJournal>(path);
+  std::vector<EditOp> ops;
+  if (!journal->open(*m_doc->sharedOriginalBuffer(), &ops)) return false;
+  // 从最后一个快照开始重放。loadText会关掉日志，所以重放完再接上
+  auto snapshot = std::find_if(ops.rbegin(), ops.rend(), [](const EditOp &op) { return op.type == EditOp::snapshot; });
+  if (snapshot != ops.rend()) loadText(snapshot->text);
+  std::vector<EditOp> rest(snapshot.base(), ops.end());
+  EditJournal::replay(*m_doc, *m_cursor, rest);
+  m_doc->updateCursor(*m_cursor, m_cursor->coord());
+  m_journal = std::move(journal);
+  m_doc->setJournal(m_journal.get());
+  return !ops.empty();
+}
+void Editor::syncJournal() {
+  if (!m_journal) return;
+  // 后台保存还要按位置截日志
+  if (m_saveJournalMark || !m_journal->needsCompaction()) {
+    m_journal->sync();
+    return;
+  }
+  MarkdownSerializer serializer(m_doc->bufferProvider());
+  m_doc->accept(&serializer);
+  m_journal->compact(serializer.markdown());
+}
+void Editor::closeJournal(bool remove) {
+  if (!m_journal) return;
+  if (m_doc) m_doc->setJournal(nullptr);
+  if (remove) m_journal->remove();
+  m_journal.reset();
 }
 void Editor::drawSelection(core::AbstractPainter& painter,
                            const core::Point& offset) {
   if (!m_renderer || !m_hasSelection) return;
-  m_renderer->drawSelection(painter, offset,
-                            m_selectionInstructions, *m_doc);
+  m_renderer->drawSelection(painter, offset, selectionRects());
+}
+std::vector<core::Rect> Editor::selectionRects() const {
+  if (!m_doc || !m_hasSelection) return {};
+  auto [begin, end] = m_selectionRange->range();
+  auto [top, bottom] = viewport();
+  return m_doc->rangeRects(begin.coord(), end.coord(), top, bottom);
+}
+void Editor::drawSearchHighlights(core::AbstractPainter& painter, const core::Point& offset) {
+  core::Color bg(255, 230, 150);
+  for (const auto& rect : searchHighlightRects()) {
+    painter.fillRect(core::Rect(rect.pos + offset, rect.size), bg);
+  }
+}
+std::vector<core::Rect> Editor::searchHighlightRects() const {
+  if (!m_search) return {};
+  auto [top, bottom] = viewport();
+  return m_search->highlightRects(top, bottom);
+}
+std::pair<int, int> Editor::viewport() const {
+  if (m_viewportHeight <= 0) return {0, height()};
+  return {m_viewportTop, m_viewportTop + m_viewportHeight};
 }
 void Editor::drawDoc(core::AbstractPainter& painter,
-                     const core::Point& offset) {
+                     const core::Point& offset, const core::Rect& clip) {
   if (!m_renderer) return;
-  m_renderer->drawDoc(painter, offset);
+  m_renderer->drawDoc(painter, offset, clip);
 #ifndef Q_OS_ANDROID
   auto coord = m_cursor->coord();
   if (coord.blockNo < 0 || coord.blockNo >= static_cast<SizeType>(m_doc->blocks().size())) return;
@@ -110,8 +208,25 @@ void Editor::drawCursor(core::AbstractPainter& painter, const core::Point& offse
 }
 void Editor::keyPressEvent(const core::KeyEvent& event) {
   if (!m_inputHandler) return;
+  // 有选区时第一个字符要先删选区，不攒
+  if (m_inputCoalescing && !m_hasSelection && !m_inputHandler->isPreediting() &&
+      EditorInputHandler::isPlainTextInput(event)) {
+    m_pendingText += String(event.text());
+    return;
+  }
+  flushInput();
   m_inputHandler->keyPressEvent(event);
 }
+void Editor::setInputCoalescing(bool enabled) {
+  if (!enabled) flushInput();
+  m_inputCoalescing = enabled;
+}
+bool Editor::flushInput() {
+  if (m_pendingText.isEmpty() || !m_doc) return false;
+  auto text = std::exchange(m_pendingText, String());
+  m_doc->insertText(*m_cursor, text);
+  return true;
+}
 core::Point Editor::cursorPos() const {
   if (!m_inputHandler) return {};
   return m_inputHandler->isPreediting() ? m_inputHandler->preeditPos() : m_cursor->pos();
@@ -121,11 +236,78 @@ core::Rect Editor::cursorRect() const {
   auto h = m_cursor->height();
   return core::Rect(pos, core::Size(5, h));
 }
+core::Rect Editor::highlightRect() const {
+#ifdef Q_OS_ANDROID
+  return {};
+#else
+  auto blockNo = m_cursor->coord().blockNo;
+  if (blockNo < 0 || blockNo >= static_cast<SizeType>(m_doc->blocks().size())) return {};
+  auto rect = m_doc->blockRect(blockNo);
+  // 类型标记的基线在块顶上，往上留出字高
+  constexpr int labelAscent = 20;
+  int w = m_renderSetting->docMargin.left + m_doc->blocks()[blockNo].width() + 1;
+  return {0, rect.y() - labelAscent, w, rect.height() + labelAscent + 1};
+#endif
+}
+std::vector<core::Rect> Editor::takeDamage() {
+  std::vector<core::Rect> damage;
+  if (!m_doc || !m_renderer) return damage;
+  auto add = [&damage](const core::Rect& rect) {
+    if (!rect.isEmpty()) damage.push_back(rect);
+  };
+  add(m_doc->takeDamage());
+  auto repaint = [&add](core::Rect& painted, const core::Rect& now) {
+    if (painted == now) return;
+    add(painted);
+    add(now);
+    painted = now;
+  };
+  repaint(m_paintedCursor, m_renderer->cursorRect(*m_cursor, m_hasSelection));
+  repaint(m_paintedHighlight, highlightRect());
+  std::optional<std::pair<CursorCoord, CursorCoord>> selection;
+  if (m_hasSelection) {
+    auto [begin, end] = m_selectionRange->range();
+    selection.emplace(begin.coord(), end.coord());
+  }
+  if (selection != m_paintedSelection) {
+    auto [top, bottom] = viewport();
+    auto repaintRange = [&](CursorCoord begin, CursorCoord end) {
+      if (end < begin) std::swap(begin, end);
+      core::Rect rect;
+      for (const auto& r : m_doc->rangeRects(begin, end, top, bottom)) {
+        rect = rect.united(r);
+      }
+      add(rect);
+    };
+    const auto& old = m_paintedSelection;
+    if (selection && old && !(selection->second < old->first) && !(old->second < selection->first)) {
+      // 拖动或者shift+方向键只动了一头，中间不用重画
+      repaintRange(old->first, selection->first);
+      repaintRange(old->second, selection->second);
+    } else {
+      if (old) repaintRange(old->first, old->second);
+      if (selection) repaintRange(selection->first, selection->second);
+    }
+    m_paintedSelection = selection;
+  }
+  core::Rect search;
+  for (const auto& rect : searchHighlightRects()) {
+    search = search.united(rect);
+  }
+  repaint(m_paintedSearch, search);
+  return damage;
+}
+core::Rect Editor::cursorDamageRect() const {
+  if (!m_renderer) return {};
+  return m_renderer->cursorRect(*m_cursor, m_hasSelection);
+}
 void Editor::mousePressEvent(const core::Point& offset, const core::MouseEvent& event) {
   if (!m_inputHandler) return;
+  flushInput();
   m_inputHandler->mousePressEvent(offset, event);
 }
 void Editor::insertText(String str) {
+  flushInput();
   if (str.isEmpty()) return;
   auto strs = str.split('\n');
   for (int i = 0; i < static_cast<int>(strs.size()) - 1; ++i) {
@@ -135,11 +317,33 @@ void Editor::insertText(String str) {
   m_doc->insertText(*m_cursor, strs.back());
 }
 void Editor::reset() {
+  flushInput();
+  m_saver->wait();
+  finishSave();
+  closeJournal();
   m_cursor = std::make_unique<Cursor>();
-  m_doc = std::make_unique<Document>("", m_renderSetting, m_imageProvider);
+  m_search.reset();
+  m_doc = std::make_unique<Document>("", m_renderSetting, m_imageProvider, nullptr, nullptr, m_iconAtlas);
+  m_search = std::make_unique<SearchEngine>(*m_doc);
   m_renderer = std::make_unique<EditorRenderer>(*m_doc, *m_renderSetting);
   m_inputHandler = std::make_unique<EditorInputHandler>(*this, *m_doc, *m_cursor, *m_renderSetting);
 }
+SizeType Editor::find(const String& pattern, bool regex) {
+  if (!m_search) return 0;
+  flushInput();
+  return m_search->search(pattern, regex).size();
+}
+SizeType Editor::replaceAll(const String& text) {
+  if (!m_search) return 0;
+  flushInput();
+  m_hasSelection = false;
+  return m_search->replaceAll(*m_cursor, text);
+}
+const std::vector<SearchMatch>& Editor::searchMatches() const {
+  static const std::vector<SearchMatch> empty;
+  if (!m_search) return empty;
+  return m_search->matches();
+}
 String Editor::cursorCoord() const {
   String s;
   auto pos = m_cursor->pos();
@@ -183,12 +387,31 @@ String Editor::cursorCoord() const {
 
 void Editor::setWidth(int w) { m_renderSetting->maxWidth = w; }
 void Editor::setResPathList(StringList pathList) { m_renderSetting->resPathList = pathList; }
+void Editor::setLatexCacheDir(const String& dir) { m_renderSetting->latexCacheDir = dir; }
+void Editor::setTileCacheMaxBytes(std::size_t maxBytes) { m_renderSetting->tileCacheMaxBytes = maxBytes; }
 
 void Editor::renderDocument() {
   if (m_doc) {
     m_doc->renderAllBlock();
   }
 }
+bool Editor::updateTypesetLatex() {
+  if (!m_doc || !m_doc->updateTypesetLatex()) return false;
+  // 块高度变了，光标位置要重新算
+  m_doc->updateCursor(*m_cursor, m_cursor->coord());
+  return true;
+}
+bool Editor::updateDecodedImages() {
+  if (!m_doc || !m_doc->updateDecodedImages()) return false;
+  m_doc->updateCursor(*m_cursor, m_cursor->coord());
+  return true;
+}
+void Editor::updateViewport(int top, int height) {
+  if (!m_doc) return;
+  m_viewportTop = top;
+  m_viewportHeight = height;
+  m_doc->prioritizeImages(top, top + height);
+}
 CursorShape Editor::cursorShape(const core::Point& offset, const core::Point& pos) {
   if (!m_inputHandler) return IBeamCursor;
   return m_inputHandler->cursorShape(offset, pos);
@@ -199,10 +422,12 @@ void Editor::keyReleaseEvent(const core::KeyEvent& event) {
 }
 void Editor::setPreedit(const String& str) {
   if (!m_inputHandler) return;
+  flushInput();
   m_inputHandler->setPreedit(str);
 }
 void Editor::commitString(const String& str) {
   if (!m_inputHandler) return;
+  flushInput();
   m_inputHandler->commitString(str);
 }
 String Editor::title() {
@@ -212,10 +437,12 @@ String Editor::title() {
 }
 void Editor::mouseMoveEvent(const core::Point& offset, const core::MouseEvent& event) {
   if (!m_inputHandler) return;
+  flushInput();
   m_inputHandler->mouseMoveEvent(offset, event);
 }
 void Editor::mouseReleaseEvent(const core::Point& offset, const core::MouseEvent& event) {
   if (!m_inputHandler) return;
+  flushInput();
   m_inputHandler->mouseReleaseEvent(offset, event);
 }
 void Editor::setHoldCtrl(bool v) { m_holdCtrl = v; }
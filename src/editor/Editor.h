@@ -5,11 +5,14 @@
 #ifndef QTMARKDOWN_EDITOR_H
 #define QTMARKDOWN_EDITOR_H
 #include <functional>
+#include <optional>
 #include <utility>
+#include <vector>
 
 #include "QtMarkdown_global.h"
 #include "Document.h"
 #include "CursorCoord.h"
+#include "SearchEngine.h"
 #include "core/AbstractPainter.h"
 #include "core/Types.h"
 #include "core/Event.h"
@@ -20,6 +23,8 @@ class SelectionRange;
 class EditorRenderer;
 class EditorInputHandler;
 class FileManager;
+class EditJournal;
+class AsyncSaver;
 enum CursorShape {
   IBeamCursor = 4,
   PointingHandCursor = 13,
@@ -32,11 +37,38 @@ class QTMARKDOWNEDITORCORE_EXPORT Editor {
   void loadText(const String& text);
   std::pair<bool, String> loadFile(const String& path);
   String title();
+  // 同步保存，等后台保存写完才返回
   bool saveToFile(const String& path);
-  void drawDoc(core::AbstractPainter& painter, const core::Point& offset);
+  // 后台保存，写完在工作线程调用saveFinishedCallback，调用方切回GUI线程后调用finishSave
+  bool saveToFileAsync(const String& path);
+  void setSaveFinishedCallback(std::function<void()> cb) { m_saveFinishedCallback = std::move(cb); }
+  // 后台保存的结果，没有写完的保存时返回std::nullopt。
+  // 日志开着时，保存开始之后的编辑改接到新保存的文件上
+  std::optional<bool> finishSave();
+  // 崩溃恢复日志，在loadFile之后调用。path上有和刚加载的原文件对得上的日志时，
+  // 把里面的编辑重放到当前文档，之后的编辑都追加进日志。返回是否恢复了编辑
+  bool openJournal(const String& path);
+  // 把攒着的日志记录写入并fsync，日志太长时压缩成全文快照。界面定时调用
+  void syncJournal();
+  // 加载别的文档时自动关闭，日志文件留着；remove为true时删掉
+  void closeJournal(bool remove = false);
+  // clip是要重画的区域(绘制坐标)，为空时全画
+  void drawDoc(core::AbstractPainter& painter, const core::Point& offset, const core::Rect& clip = {});
   void drawCursor(core::AbstractPainter& painter, const core::Point& offset);
+  // 选区只存两头的坐标，画的时候才算视口里的视觉行的高亮框
   void drawSelection(core::AbstractPainter& painter, const core::Point& offset);
+  [[nodiscard]] std::vector<core::Rect> selectionRects() const;
+  // 只画视口(updateViewport)里的查找结果，没设置过视口时全画
+  void drawSearchHighlights(core::AbstractPainter& painter, const core::Point& offset);
   void keyPressEvent(const core::KeyEvent& event);
+  // 打开时(默认)普通字符先攒起来，界面每帧调用一次flushInput，一帧里的按键只插入一次：
+  // 一次重新解析、一次排版、一次重画。测试里关掉，每个按键立即执行
+  void setInputCoalescing(bool enabled);
+  // 插入攒着的字符，返回是否有。其他按键、鼠标、输入法、粘贴和保存之前会自动调用
+  bool flushInput();
+  [[nodiscard]] bool hasPendingInput() const { return !m_pendingText.isEmpty(); }
+  // 攒字符最多等一帧
+  static constexpr int kInputFrameMs = 16;
   void keyReleaseEvent(const core::KeyEvent& event);
   void mousePressEvent(const core::Point& offset, const core::MouseEvent& event);
   void mouseMoveEvent(const core::Point& offset, const core::MouseEvent& event);
@@ -46,18 +78,40 @@ class QTMARKDOWNEDITORCORE_EXPORT Editor {
   [[nodiscard]] int height() const;
   [[nodiscard]] core::Point cursorPos() const;
   [[nodiscard]] core::Rect cursorRect() const;
+  // 自上次调用以来要重画的区域(文档坐标)：变了的行、光标和当前块高亮框的新旧位置、选区。
+  // 界面每处理完一个事件调用一次，只重画这些区域
+  std::vector<core::Rect> takeDamage();
+  // 光标闪烁时只重画光标
+  [[nodiscard]] core::Rect cursorDamageRect() const;
   void insertText(String str);
   void setPreedit(const String& str);
   void commitString(const String& str);
   void reset();
+  // 查找，返回匹配数。边打边搜时每次把整个输入框的内容传进来
+  SizeType find(const String& pattern, bool regex = false);
+  // 把上次找到的都换成text，一次撤销就能还原。返回换了几处
+  SizeType replaceAll(const String& text);
+  [[nodiscard]] const std::vector<SearchMatch>& searchMatches() const;
   [[nodiscard]] String cursorCoord() const;
   [[nodiscard]] Document* document() const { return m_doc.get(); }
   void setLinkClickedCallback(std::function<void(String)> cb) { m_linkClickedCallback = std::move(cb); }
   void setImageClickedCallback(std::function<void(String)> cb) { m_imageClickedCallback = std::move(cb); }
   void setCopyCodeBtnClickedCallback(std::function<void(String)> cb) { m_copyCodeBtnClickedCallback = std::move(cb); }
   void setCheckBoxClickedCallback(std::function<void()> cb) { m_checkBoxClickedCallback = std::move(cb); }
+  // 设置后公式在后台排版，回调在工作线程调用，需要切回GUI线程再调用updateTypesetLatex
+  // 对之后加载的文档生效
+  void setLatexTypesetCallback(std::function<void()> cb) { m_latexTypesetCallback = std::move(cb); }
+  bool updateTypesetLatex();
+  // 设置后图片在后台解码，用法同setLatexTypesetCallback，切回GUI线程后调用updateDecodedImages
+  void setImageDecodeCallback(std::function<void()> cb) { m_imageDecodeCallback = std::move(cb); }
+  bool updateDecodedImages();
+  // 视口在文档中的位置，视口附近的图片先解码
+  void updateViewport(int top, int height);
   void setWidth(int w);
   void setResPathList(StringList pathList);
+  void setLatexCacheDir(const String& dir);
+  // 大于0时打开保留模式：块光栅化成图块缓存，滚动时只贴图。maxBytes是图块的内存上限
+  void setTileCacheMaxBytes(std::size_t maxBytes);
   void renderDocument();
 
   // -- Public accessors for tests --
@@ -75,23 +129,50 @@ class QTMARKDOWNEDITORCORE_EXPORT Editor {
   void triggerCheckBoxClicked();
 
  private:
+  // drawDoc画的当前块高亮框和类型标记占的区域
+  [[nodiscard]] core::Rect highlightRect() const;
+  // 视口里的查找结果的高亮框
+  [[nodiscard]] std::vector<core::Rect> searchHighlightRects() const;
+  // 视口[top, bottom)，没设置过时是整个文档
+  [[nodiscard]] std::pair<int, int> viewport() const;
   std::unique_ptr<Document> m_doc;
+  // 引用着m_doc，换文档时一起换
+  std::unique_ptr<SearchEngine> m_search;
+  std::unique_ptr<EditJournal> m_journal;
+  // 后台保存开始时日志写到的位置，保存完成前不压缩日志
+  std::optional<std::size_t> m_saveJournalMark;
   std::unique_ptr<Cursor> m_cursor;
   std::unique_ptr<core::IImageProvider> m_ownedImageProvider;
   core::IImageProvider* m_imageProvider = nullptr;
   sptr<render::RenderSetting> m_renderSetting;
+  sptr<render::IconAtlas> m_iconAtlas;
   std::unique_ptr<EditorRenderer> m_renderer;
   std::unique_ptr<EditorInputHandler> m_inputHandler;
-  std::vector<InstructionPtr> m_selectionInstructions;
   bool m_holdCtrl = false;
   bool m_holdShift = false;
   bool m_mousePressing = false;
   bool m_hasSelection = false;
+  bool m_inputCoalescing = true;
+  // 还没插入的普通字符
+  String m_pendingText;
   std::unique_ptr<SelectionRange> m_selectionRange;
   std::function<void(String)> m_linkClickedCallback;
   std::function<void(String)> m_imageClickedCallback;
   std::function<void(String)> m_copyCodeBtnClickedCallback;
   std::function<void()> m_checkBoxClickedCallback;
+  std::function<void()> m_latexTypesetCallback;
+  std::function<void()> m_imageDecodeCallback;
+  std::function<void()> m_saveFinishedCallback;
+  // 回调要用m_saveFinishedCallback，放在它后面先析构
+  std::unique_ptr<AsyncSaver> m_saver;
+  // updateViewport设置的视口，高度为0时没设置过
+  int m_viewportTop = 0;
+  int m_viewportHeight = 0;
+  // 上次takeDamage时画出来的光标、当前块高亮框、选区和查找结果。选区记坐标，只重画变了的那一头
+  core::Rect m_paintedCursor;
+  core::Rect m_paintedHighlight;
+  std::optional<std::pair<CursorCoord, CursorCoord>> m_paintedSelection;
+  core::Rect m_paintedSearch;
   friend class EditorInputHandler;
 };
 }  // namespace md::editor
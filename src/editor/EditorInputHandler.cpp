@@ -7,8 +7,9 @@
 #include "Document.h"
 #include "debug.h"
 #include "parser/Text.h"
-#include "render/Instruction.h"
 
+#include <algorithm>
+#include <cctype>
 #include <filesystem>
 
 using namespace md::parser;
@@ -30,8 +31,7 @@ class MousePressVisitor : public NodeVisitor {
     }
   }
   void visit(CheckboxItem *node) override {
-    node->setChecked(!node->isChecked());
-    m_doc.renderBlock(m_blockNo);
+    m_doc.toggleCheckbox(m_blockNo, node);
     m_editor.triggerCheckBoxClicked();
     m_handled = true;
   }
@@ -83,36 +83,20 @@ EditorInputHandler::EditorInputHandler(Editor& editor, Document& doc, Cursor& cu
     : m_editor(editor), m_doc(doc), m_cursor(cursor), m_setting(setting) {}
 
 void EditorInputHandler::setPreedit(const String& str) {
-    if (m_preediting) {
-        for (int i = 0; i < m_preeditLength; ++i) {
-            m_doc.removeText(m_cursor);
-        }
-    } else {
+    // 组字文本只画出来，提交之前不改文档
+    if (!m_doc.hasPreedit()) {
         m_preeditPos = m_cursor.pos();
     }
-    if (str.isEmpty()) {
-        m_preediting = false;
-        m_preeditLength = 0;
-    } else {
-        m_preediting = true;
-        m_preeditLength = str.length();
-        m_doc.insertText(m_cursor, str);
-    }
+    m_doc.setPreedit(m_cursor, str);
 }
 
 void EditorInputHandler::commitString(const String& str) {
-    if (m_preediting) {
-        for (int i = 0; i < m_preeditLength; ++i) {
-            m_doc.removeText(m_cursor);
-        }
-    }
+    m_doc.setPreedit(m_cursor, String());
     m_doc.insertText(m_cursor, str);
-    m_preediting = false;
-    m_preeditLength = 0;
 }
 
 bool EditorInputHandler::isPreediting() const {
-    return m_preediting;
+    return m_doc.hasPreedit();
 }
 
 core::Point EditorInputHandler::preeditPos() const {
@@ -138,6 +122,32 @@ void EditorInputHandler::keyPressEvent(const core::KeyEvent &event) {
   handleTextInput(event);
 }
 
+bool EditorInputHandler::isPlainTextInput(const core::KeyEvent &event) {
+  auto commandModifiers = core::Modifier::Ctrl | core::Modifier::Alt | core::Modifier::Meta;
+  if ((event.modifiers() & commandModifiers) != core::Modifier::None) return false;
+  switch (event.key()) {
+    case core::Key::Tab:
+    case core::Key::Escape:
+    case core::Key::Return:
+    case core::Key::Backspace:
+    case core::Key::Left:
+    case core::Key::Right:
+    case core::Key::Up:
+    case core::Key::Down:
+    case core::Key::Key_Control:
+    case core::Key::Key_Shift:
+      return false;
+    default:
+      break;
+  }
+  auto text = event.text();
+  if (text.empty()) return false;
+  return std::all_of(text.begin(), text.end(), [](char ch) {
+    auto c = static_cast<unsigned char>(ch);
+    return c >= 0x80 || std::isalnum(c);
+  });
+}
+
 bool EditorInputHandler::handleShortcutKeys(const core::KeyEvent &event) {
   int key = static_cast<int>(event.key());
   if (key == static_cast<int>(core::Key::A) && m_editor.isHoldCtrl()) {
@@ -327,7 +337,6 @@ void EditorInputHandler::mousePressEvent(const core::Point& offset, const core::
     }
   } else {
     m_editor.m_hasSelection = false;
-    m_editor.m_selectionInstructions.clear();
   }
   auto off = offset;
   off.y += m_setting.docMargin.top;
@@ -351,7 +360,6 @@ void EditorInputHandler::mousePressEvent(const core::Point& offset, const core::
   m_doc.updateCursor(m_cursor, coord);
   if (m_editor.m_hasSelection) {
     m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-    generateSelectionInstruction();
   }
 }
 
@@ -364,7 +372,6 @@ void EditorInputHandler::mouseMoveEvent(const core::Point& offset, const core::M
   }
   auto coord = m_doc.moveCursorToPos(event.pos() + offset);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::mouseReleaseEvent(const core::Point& offset, const core::MouseEvent &event) {
@@ -385,7 +392,6 @@ void EditorInputHandler::selectLeft() {
   }
   coord = m_doc.moveCursorToLeft(coord);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectRight() {
@@ -400,7 +406,6 @@ void EditorInputHandler::selectRight() {
   }
   coord = m_doc.moveCursorToRight(coord);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectUp() {
@@ -418,7 +423,6 @@ void EditorInputHandler::selectUp() {
   }
   coord = m_doc.moveCursorToUp(coord, pos);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectDown() {
@@ -443,7 +447,6 @@ void EditorInputHandler::selectDown() {
     coord = m_doc.moveCursorToDown(coord, pos);
     m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
   }
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectBol() {
@@ -458,7 +461,6 @@ void EditorInputHandler::selectBol() {
   }
   coord = m_doc.moveCursorToBol(coord);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectEol() {
@@ -474,7 +476,6 @@ void EditorInputHandler::selectEol() {
   auto [_coord, x] = m_doc.moveCursorToEol(coord);
   m_editor.m_selectionRange->caret.setX(x);
   m_doc.updateCursor(m_editor.m_selectionRange->caret, _coord, false);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::selectAll() {
@@ -485,7 +486,6 @@ void EditorInputHandler::selectAll() {
   m_doc.updateCursor(m_editor.m_selectionRange->anchor, coord);
   coord = m_doc.moveCursorToEndOfDocument();
   m_doc.updateCursor(m_editor.m_selectionRange->caret, coord);
-  generateSelectionInstruction();
 }
 
 void EditorInputHandler::removeSelection() {
@@ -496,95 +496,4 @@ void EditorInputHandler::removeSelection() {
   m_doc.updateCursor(m_cursor, begin.coord());
 }
 
-void EditorInputHandler::generateSelectionInstruction() {
-  m_editor.m_selectionInstructions.clear();
-  auto fillRect = [this, &selIns = m_editor.m_selectionInstructions](core::Point pos, int w, int h) {
-    core::Color bg(187, 214, 251);
-    auto instruction = std::make_unique<render::FillRectInstruction>(pos, core::Size(w, h), bg);
-    selIns.push_back(std::move(instruction));
-  };
-  auto isBefore = [this](const CursorCoord &coord, SizeType blockNo, SizeType lineNo, SizeType visualLineNo) {
-    if (blockNo < coord.blockNo) return true;
-    if (blockNo > coord.blockNo) return false;
-    if (lineNo < coord.lineNo) return true;
-    if (lineNo > coord.lineNo) return false;
-    const auto &line = m_doc.blocks()[blockNo].logicalLineAt(lineNo);
-    auto coordVisualLineNo = line.visualLineAt(coord.offset, m_doc.bufferProvider());
-    if (coordVisualLineNo > visualLineNo) return true;
-    return false;
-  };
-  auto isSameVisualLine = [this](const CursorCoord &coord, SizeType blockNo, SizeType lineNo, SizeType visualLineNo) {
-    if (blockNo < coord.blockNo) return false;
-    if (blockNo > coord.blockNo) return false;
-    if (lineNo < coord.lineNo) return false;
-    if (lineNo > coord.lineNo) return false;
-    const auto &line = m_doc.blocks()[blockNo].logicalLineAt(lineNo);
-    auto coordVisualLineNo = line.visualLineAt(coord.offset, m_doc.bufferProvider());
-    if (coordVisualLineNo < visualLineNo) return false;
-    if (coordVisualLineNo > visualLineNo) return false;
-    return true;
-  };
-  auto selectionRange = m_editor.m_selectionRange->range();
-  auto [begin, end] = selectionRange;
-  auto totalH = m_setting.docMargin.top;
-  for (int i = 0; i < begin.coord().blockNo; ++i) {
-    const auto &block = m_doc.blocks()[i];
-    totalH += block.height() + m_setting.blockSpacing;
-  }
-  bool drawDone = false;
-  for (auto blockNo = begin.coord().blockNo; blockNo <= end.coord().blockNo; ++blockNo) {
-    const auto &block = m_doc.blocks()[blockNo];
-    auto blockOffset = core::Point(0, totalH);
-    for (int lineNo = 0; lineNo < block.countOfLogicalLine(); ++lineNo) {
-      const auto &line = block.logicalLineAt(lineNo);
-      for (int visualLineNo = 0; visualLineNo < line.countOfVisualLine(); ++visualLineNo) {
-        const auto &visualLine = line.visualLineAt(visualLineNo);
-        if (isBefore(begin.coord(), blockNo, lineNo, visualLineNo)) {
-          continue;
-        }
-        auto fixW = [&visualLine, &selectionRange](int &w) {
-          if (w == 0) {
-            if (selectionRange.first.coord() == selectionRange.second.coord()) {
-              // 不用管的确是0
-            } else {
-              // 整行都要画，因为end被调到另外一行到开头
-              w = visualLine.width();
-            }
-          }
-        };
-        auto h = visualLine.height();
-        if (isSameVisualLine(begin.coord(), blockNo, lineNo, visualLineNo)) {
-          auto pos = core::Point(begin.x(), 0) + core::Point(0, visualLine.pos().y) + blockOffset;
-          if (isSameVisualLine(end.coord(), blockNo, lineNo, visualLineNo)) {
-            // 同一个视觉行，从begin画到end
-            auto w = end.pos().x - begin.pos().x;
-            fixW(w);
-            fillRect(pos, w, h);
-            drawDone = true;
-            break;
-          } else {
-            // 从begin画到视觉行结束
-            auto w = visualLine.width() + visualLine.pos().x - begin.pos().x;
-            fixW(w);
-            fillRect(pos, w, h);
-            continue;
-          }
-        }
-        if (isSameVisualLine(end.coord(), blockNo, lineNo, visualLineNo)) {
-          auto pos = visualLine.pos() + blockOffset;
-          auto w = end.pos().x - visualLine.pos().x;
-          fixW(w);
-          fillRect(pos, w, h);
-          drawDone = true;
-          break;
-        }
-        fillRect(visualLine.pos() + blockOffset, visualLine.width(), h);
-      }
-      if (drawDone) break;
-    }
-    totalH += block.height() + m_setting.blockSpacing;
-    if (drawDone) break;
-  }
-}
-
 } // namespace md::editor
@@ -34,6 +34,10 @@ public:
     void mouseMoveEvent(const core::Point& offset, const core::MouseEvent& event);
     void mouseReleaseEvent(const core::Point& offset, const core::MouseEvent& event);
     CursorShape cursorShape(const core::Point& offset, const core::Point& pos);
+    // 不带Ctrl/Alt/Meta的字母、数字和多字节字符，连着的几个可以合成一次插入。
+    // 括号(自动补全、跳过右括号)、空格和符号(可能凑出块前缀，块类型变了光标回到行首)单独插入时
+    // 处理不一样，合起来插结果就和打字快慢有关，所以不算
+    static bool isPlainTextInput(const core::KeyEvent& event);
 
     // IME support
     void setPreedit(const String& str);
@@ -51,16 +55,13 @@ private:
     void selectEol();
     void selectAll();
     void removeSelection();
-    void generateSelectionInstruction();
 
     // Key event helpers (extracted from keyPressEvent)
     bool handleShortcutKeys(const core::KeyEvent& event);
     bool handleArrowKeys(const core::KeyEvent& event);
     void handleTextInput(const core::KeyEvent& event);
 
-    // IME state
-    bool m_preediting = false;
-    int m_preeditLength = 0;
+    // IME state，组字文本在Document里
     core::Point m_preeditPos;
 
     // Shared state references
@@ -3,26 +3,96 @@
 //
 
 #include "EditorRenderer.h"
+
+#include <algorithm>
+#include <optional>
+
 #include "Cursor.h"
 #include "Document.h"
-#include "render/Instruction.h"
+#include "render/DisplayList.h"
+#include "render/Render.h"
 
 namespace md::editor {
+// 光标上下两端短横线的半宽
+static constexpr int kCursorSerif = 2;
 
 EditorRenderer::EditorRenderer(Document& doc, const render::RenderSetting& setting)
     : m_doc(doc), m_setting(setting) {}
 
 void EditorRenderer::drawDoc(core::AbstractPainter& painter,
-                              const core::Point& offset) {
+                              const core::Point& offset, const core::Rect& clip) {
+    auto maxBytes = m_setting.tileCacheMaxBytes;
+    bool retained = maxBytes > 0;
+    m_frame++;
     auto qOffset = offset;
     qOffset.y += m_setting.docMargin.top;
     for (const auto& block : m_doc.blocks()) {
         int h = block.height();
-        for (const auto& instruction : block) {
-            instruction->run(painter, qOffset, m_doc.bufferProvider());
+        if (clip.isEmpty() || (qOffset.y < clip.y() + clip.height() && clip.y() < qOffset.y + h)) {
+            if (!retained || !drawBlockTiles(painter, block, qOffset, clip)) {
+                block.displayList().run(painter, qOffset, m_doc.bufferProvider());
+            }
         }
         qOffset.y += h + m_setting.blockSpacing;
     }
+    evictTiles(maxBytes);
+}
+
+std::size_t EditorRenderer::TileKeyHash::operator()(const TileKey& key) const {
+    std::size_t h = std::hash<uint64_t>()(key.version);
+    auto mix = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+    mix(key.tileTop);
+    mix(key.width);
+    mix(std::hash<double>()(key.devicePixelRatio));
+    return h;
+}
+
+bool EditorRenderer::drawBlockTiles(core::AbstractPainter& painter, const render::Block& block,
+                                    const core::Point& origin, const core::Rect& clip) {
+    int h = block.height();
+    int width = m_setting.maxWidth;
+    double dpr = painter.devicePixelRatio();
+    // 装饰可能画到块外面(比如代码块背景四周多出的3像素)，直接画时看得见。
+    // 图块按显示列表的范围往外扩：左右每块都扩，上下只扩第一块和最后一块
+    std::optional<core::Rect> bounds;
+    for (int tileTop = 0; tileTop < h; tileTop += kTileHeight) {
+        core::Rect rect(origin.x, origin.y + tileTop, width, std::min(kTileHeight, h - tileTop));
+        if (!clip.isEmpty() && !rect.intersects(clip)) continue;
+        TileKey key{block.version(), tileTop, width, dpr};
+        auto it = m_tileIndex.find(key);
+        if (it == m_tileIndex.end()) {
+            if (!bounds) bounds = block.displayList().bounds().united(core::Rect(0, 0, width, h));
+            int top = tileTop == 0 ? bounds->y() : tileTop;
+            int bottom = tileTop + kTileHeight >= h ? bounds->y() + bounds->height() : tileTop + kTileHeight;
+            core::Point pos(bounds->x(), top);
+            auto layer = painter.createLayer(core::Size(bounds->width(), bottom - top));
+            if (!layer) return false;
+            // 整个块的显示列表往左上挪，图层外面的自然被裁掉
+            block.displayList().run(layer->painter(), core::Point(-pos.x, -pos.y), m_doc.bufferProvider());
+            layer->finish();
+            m_tileBytes += layer->byteCount();
+            m_tiles.push_front({key, pos, std::move(layer), m_frame});
+            it = m_tileIndex.emplace(key, m_tiles.begin()).first;
+        } else {
+            it->second->frame = m_frame;
+            m_tiles.splice(m_tiles.begin(), m_tiles, it->second);
+        }
+        const auto& tile = *it->second;
+        painter.drawLayer(core::Point(origin.x + tile.pos.x, origin.y + tile.pos.y), *tile.layer);
+    }
+    return true;
+}
+
+void EditorRenderer::evictTiles(std::size_t maxBytes) {
+    // 从最久没用的开始，这一帧画到的留着
+    auto it = m_tiles.end();
+    while (m_tileBytes > maxBytes && it != m_tiles.begin()) {
+        --it;
+        if (it->frame == m_frame) break;
+        m_tileBytes -= it->layer->byteCount();
+        m_tileIndex.erase(it->key);
+        it = m_tiles.erase(it);
+    }
 }
 
 void EditorRenderer::drawCursor(core::AbstractPainter& painter, const core::Point& offset,
@@ -34,21 +104,28 @@ void EditorRenderer::drawCursor(core::AbstractPainter& painter, const core::Poin
     int x = pos.x;
     int y = pos.y - cursor.ascent();
     int h = cursor.height();
-    int delta = 2;
+    int delta = kCursorSerif;
     painter.drawLine(core::Point(x - delta, y), core::Point(x + delta, y));
     painter.drawLine(core::Point(x, y), core::Point(x, y + h));
     painter.drawLine(core::Point(x - delta, y + h), core::Point(x + delta, y + h));
     painter.restore();
 }
 
+core::Rect EditorRenderer::cursorRect(const Cursor& cursor, bool hasSelection) const {
+    if (hasSelection) return {};
+    core::Point pos = cursor.pos();
+    // 线宽和抗锯齿各留一个像素
+    int x = pos.x - kCursorSerif - 1;
+    int y = pos.y - cursor.ascent() - 1;
+    return {x, y, kCursorSerif * 2 + 3, cursor.height() + 3};
+}
+
 void EditorRenderer::drawSelection(core::AbstractPainter& painter,
                                     const core::Point& offset,
-                                    const std::vector<InstructionPtr>& selectionInstructions,
-                                    const Document& doc) {
-    if (selectionInstructions.empty()) return;
-    auto qOffset = offset;
-    for (const auto& instruction : selectionInstructions) {
-        instruction->run(painter, qOffset, doc.bufferProvider());
+                                    const std::vector<core::Rect>& rects) {
+    core::Color bg(187, 214, 251);
+    for (const auto& rect : rects) {
+        painter.fillRect(core::Rect(rect.pos + offset, rect.size), bg);
     }
 }
 
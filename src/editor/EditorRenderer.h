@@ -1,7 +1,10 @@
 #ifndef QTMARKDOWN_EDITORRENDERER_H
 #define QTMARKDOWN_EDITORRENDERER_H
 
+#include <cstdint>
+#include <list>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "core/AbstractPainter.h"
@@ -22,21 +25,60 @@ public:
     EditorRenderer(Document& doc, const render::RenderSetting& setting);
 
     // -- Main paint entry points --
+    // clip是要重画的区域(绘制坐标)，不和它相交的块不画；为空时全画
     void drawDoc(core::AbstractPainter& painter,
-                 const core::Point& offset);
+                 const core::Point& offset, const core::Rect& clip = {});
     void drawCursor(core::AbstractPainter& painter, const core::Point& offset,
                     const Cursor& cursor, bool hasSelection);
+    // drawCursor画到的区域(文档坐标)，有选区时不画光标，返回空矩形
+    core::Rect cursorRect(const Cursor& cursor, bool hasSelection) const;
+    // rects是文档坐标
     void drawSelection(core::AbstractPainter& painter,
                        const core::Point& offset,
-                       const std::vector<InstructionPtr>& selectionInstructions,
-                       const Document& doc);
+                       const std::vector<core::Rect>& rects);
 
     int documentHeight() const;
     int documentWidth() const;
 
+    // 保留模式下缓存的图块
+    [[nodiscard]] std::size_t tileBytes() const { return m_tileBytes; }
+    [[nodiscard]] SizeType countOfTile() const { return m_tiles.size(); }
+
+    // 图块的高度，块按这个高度切开光栅化
+    static constexpr int kTileHeight = 256;
+
 private:
+    // 块从tileTop开始的一段，按块的版本号失效
+    struct TileKey {
+        uint64_t version;
+        int tileTop;
+        int width;
+        double devicePixelRatio;
+        bool operator==(const TileKey& other) const = default;
+    };
+    struct TileKeyHash {
+        std::size_t operator()(const TileKey& key) const;
+    };
+    struct Tile {
+        TileKey key;
+        // 图层左上角相对块左上角的位置，装饰画到块外时是负的
+        core::Point pos;
+        std::unique_ptr<core::AbstractLayer> layer;
+        // 最后一次画到的帧，当前帧用到的不淘汰
+        uint64_t frame;
+    };
+    // 返回false表示painter不支持离屏图层
+    bool drawBlockTiles(core::AbstractPainter& painter, const render::Block& block,
+                        const core::Point& origin, const core::Rect& clip);
+    void evictTiles(std::size_t maxBytes);
+
     Document& m_doc;
     const render::RenderSetting& m_setting;
+    // 最近用过的在前面
+    std::list<Tile> m_tiles;
+    std::unordered_map<TileKey, std::list<Tile>::iterator, TileKeyHash> m_tileIndex;
+    std::size_t m_tileBytes = 0;
+    uint64_t m_frame = 0;
 };
 
 } // namespace md::editor
@@ -10,6 +10,11 @@
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 using namespace md::parser;
 
@@ -40,11 +45,25 @@ std::pair<bool, String> FileManager::loadFile(const String& path) {
     return {true, String(std::move(content))};
 }
 
-bool FileManager::saveToFile(const String& path) const {
+String FileManager::notePath(const String& path) {
     String notePath = path;
     if (!notePath.endsWith(".md")) {
         notePath += ".md";
     }
+    return notePath;
+}
+
+bool FileManager::flushToDisk(std::FILE* file) {
+    if (std::fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool FileManager::saveToFile(const String& path) const {
+    auto notePath = FileManager::notePath(path);
     DEBUG << "note path" << notePath;
     std::ofstream file(notePath.toStdString(), std::ios::binary);
     if (!file.is_open()) {
@@ -8,6 +8,8 @@
 #include "QtMarkdown_global.h"
 #include "render/mddef.h"
 
+#include <cstdio>
+
 namespace md::editor {
 class Document;
 
@@ -17,6 +19,10 @@ public:
 
     // Static: pure file I/O, no Document needed. Returns {ok, fileContents}.
     static std::pair<bool, String> loadFile(const String& path);
+    // 保存时真正写入的路径，没有后缀时补上.md
+    static String notePath(const String& path);
+    // fflush之后让系统把数据真正写到磁盘上
+    static bool flushToDisk(std::FILE* file);
 
     // Instance methods: need Document for serialization/metadata.
     bool saveToFile(const String& path) const;
@@ -3,6 +3,7 @@
 //
 
 #include "MarkdownSerializer.h"
+#include <algorithm>
 #include <string>
 #include "debug.h"
 #include "parser/Document.h"
@@ -30,13 +31,34 @@ void MarkdownSerializer::visit(Header* node) {
 }
 
 void MarkdownSerializer::recordTextPositions(const String& text) {
-    if (!m_recordPositions) return;
+    if (!m_recordPositions || text.isEmpty()) return;
     SizeType mdStart = m_md.length();
     SizeType textLen = text.length();
-    m_contentToMarkdown.reserve(m_contentToMarkdown.size() + textLen);
-    for (SizeType i = 0; i < textLen; ++i) {
-        m_contentToMarkdown.push_back(mdStart + i);
+    // 紧挨着上一段(中间没有标记符号)就接上
+    if (!m_segments.empty() && m_segments.back().markdownStart + m_segments.back().length == mdStart) {
+        m_segments.back().length += textLen;
+    } else {
+        m_segments.push_back({m_contentLength, mdStart, textLen});
     }
+    m_contentLength += textLen;
+}
+
+std::optional<SizeType> MarkdownSerializer::contentToMarkdown(SizeType contentPos) const {
+    if (contentPos < 0 || contentPos >= m_contentLength) return std::nullopt;
+    auto it = std::upper_bound(m_segments.begin(), m_segments.end(), contentPos,
+                               [](SizeType pos, const Segment& segment) { return pos < segment.contentStart; });
+    ASSERT(it != m_segments.begin());
+    --it;
+    return it->markdownStart + (contentPos - it->contentStart);
+}
+
+SizeType MarkdownSerializer::markdownToContent(SizeType markdownPos) const {
+    // 各段在markdown里也是按顺序排的
+    auto it = std::upper_bound(m_segments.begin(), m_segments.end(), markdownPos,
+                               [](SizeType pos, const Segment& segment) { return pos < segment.markdownStart; });
+    if (it == m_segments.begin()) return 0;
+    --it;
+    return it->contentStart + std::min(markdownPos - it->markdownStart, it->length);
 }
 
 void MarkdownSerializer::visit(Text* node) {
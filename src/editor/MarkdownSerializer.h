@@ -6,6 +6,9 @@
 #define QTMARKDOWN_MARKDOWNSERIALIZER_H
 
 #include "QtMarkdown_global.h"
+#include <optional>
+#include <vector>
+
 #include "render/mddef.h"
 #include "parser/IBufferProvider.h"
 #include "parser/Visitor.h"
@@ -16,7 +19,13 @@ class QTMARKDOWNEDITORCORE_EXPORT MarkdownSerializer : public parser::NodeVisito
 public:
     explicit MarkdownSerializer(const parser::IBufferProvider& doc);
     String markdown() const;
-    const std::vector<SizeType>& contentToMarkdown() const { return m_contentToMarkdown; }
+    // 第contentPos个内容字节在markdown里的位置，超出记录的内容时返回std::nullopt
+    std::optional<SizeType> contentToMarkdown(SizeType contentPos) const;
+    // 反过来，markdown位置落在语法字符上时取前面最近的内容位置
+    SizeType markdownToContent(SizeType markdownPos) const;
+    // 记录了位置的内容字节数
+    SizeType contentLength() const { return m_contentLength; }
+    SizeType countOfSegments() const { return m_segments.size(); }
     SizeType contentEndMarkdownPos() const { return m_contentEndMdPos; }
     void markContentEnd() { m_contentEndMdPos = m_md.length(); }
 
@@ -47,9 +56,17 @@ public:
 
 private:
     void recordTextPositions(const String& text);
+    // 内容和markdown里都连续的一段
+    struct Segment {
+        SizeType contentStart;
+        SizeType markdownStart;
+        SizeType length;
+    };
     String m_md;
     const parser::IBufferProvider& m_doc;
-    std::vector<SizeType> m_contentToMarkdown;
+    // 按contentStart排好序，首尾相接覆盖[0, m_contentLength)
+    std::vector<Segment> m_segments;
+    SizeType m_contentLength = 0;
     SizeType m_contentEndMdPos = 0;
     bool m_recordPositions = true;
 };
@@ -0,0 +1,297 @@
+#include "SearchEngine.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <regex>
+#include <string>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MD_SEARCH_SSE2
+#endif
+
+#include "Cursor.h"
+#include "Document.h"
+#include "debug.h"
+#include "render/Cell.h"
+namespace md::editor {
+namespace {
+// 逻辑行的内容在缓冲区里的一段。不是文字的cell(比如行内公式)data为空，匹配不能跨过它
+struct Span {
+  const char* data;
+  SizeType length;
+  // 在逻辑行里的偏移
+  SizeType offset;
+  // 属于哪个Text结点，不是文字时为空
+  const parser::Text* node;
+};
+std::vector<Span> lineSpans(const render::LogicalLine& line, const parser::IBufferProvider& buffers) {
+  std::vector<Span> spans;
+  SizeType offset = 0;
+  auto add = [&spans, &offset](const char* data, SizeType length, const parser::Text* node) {
+    // 同一个片段折行后分到几个cell里，在缓冲区里是连着的，合成一段
+    if (data && !spans.empty() && spans.back().node == node && spans.back().data + spans.back().length == data) {
+      spans.back().length += length;
+    } else {
+      spans.push_back({data, length, offset, node});
+    }
+    offset += length;
+  };
+  for (auto cell : line.cells()) {
+    auto length = cell->length();
+    auto text = cell->textNode();
+    if (!text) {
+      add(nullptr, length, nullptr);
+      continue;
+    }
+    // 跳过cell之前的部分，取cell里的length个字节
+    auto skip = cell->textOffset();
+    for (const auto& item : text->items()) {
+      if (length == 0) break;
+      if (skip >= item.length) {
+        skip -= item.length;
+        continue;
+      }
+      auto buffer =
+          item.bufferType == parser::PieceTableItem::original ? buffers.originalBuffer() : buffers.addBuffer();
+      auto take = std::min(length, item.length - skip);
+      add(buffer.data() + item.offset + skip, take, text);
+      length -= take;
+      skip = 0;
+    }
+  }
+  return spans;
+}
+// 逻辑行里偏移offset处的字节所在的段
+std::size_t spanAt(const std::vector<Span>& spans, SizeType offset) {
+  auto it = std::upper_bound(spans.begin(), spans.end(), offset,
+                             [](SizeType offset, const Span& span) { return offset < span.offset; });
+  ASSERT(it != spans.begin());
+  return std::distance(spans.begin(), it) - 1;
+}
+// data里第一次出现pattern的位置。先比首尾两个字节筛候选位置，再比较中间
+const char* findLiteral(const char* data, SizeType size, const char* pattern, SizeType n) {
+  if (size < n) return nullptr;
+  if (n == 1) return static_cast<const char*>(std::memchr(data, pattern[0], size));
+  const char first = pattern[0];
+  const char last = pattern[n - 1];
+  // 候选位置是[0, end)
+  const SizeType end = size - n + 1;
+  SizeType i = 0;
+#ifdef MD_SEARCH_SSE2
+  const __m128i firstBytes = _mm_set1_epi8(first);
+  const __m128i lastBytes = _mm_set1_epi8(last);
+  for (; i + 16 <= end; i += 16) {
+    auto head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    auto tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1));
+    auto eq = _mm_and_si128(_mm_cmpeq_epi8(head, firstBytes), _mm_cmpeq_epi8(tail, lastBytes));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8(eq));
+    while (mask != 0) {
+      auto bit = std::countr_zero(mask);
+      if (std::memcmp(data + i + bit + 1, pattern + 1, n - 2) == 0) return data + i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < end; ++i) {
+    if (data[i] == first && data[i + n - 1] == last && std::memcmp(data + i + 1, pattern + 1, n - 2) == 0) {
+      return data + i;
+    }
+  }
+  return nullptr;
+}
+// 从第i段的pos处开始和pattern比较，可以接着比后面的段
+bool matchesAt(const std::vector<Span>& spans, std::size_t i, SizeType pos, const char* pattern, SizeType n) {
+  while (n > 0) {
+    if (i >= spans.size() || !spans[i].data) return false;
+    auto take = std::min(n, spans[i].length - pos);
+    if (std::memcmp(spans[i].data + pos, pattern, take) != 0) return false;
+    pattern += take;
+    n -= take;
+    ++i;
+    pos = 0;
+  }
+  return true;
+}
+// 逻辑行里pattern的所有出现，可以重叠，按偏移从小到大
+template <typename Visitor>
+void findInLine(const std::vector<Span>& spans, const String& pattern, Visitor visit) {
+  const char* p = pattern.data();
+  const SizeType n = pattern.size();
+  for (std::size_t i = 0; i < spans.size(); ++i) {
+    const auto& span = spans[i];
+    if (!span.data) continue;
+    SizeType pos = 0;
+    while (auto hit = findLiteral(span.data + pos, span.length - pos, p, n)) {
+      pos = hit - span.data;
+      visit(span.offset + pos);
+      ++pos;
+    }
+    // 跨到下一段的，只在片段的边界上才有
+    if (i + 1 == spans.size() || !spans[i + 1].data) continue;
+    for (pos = std::max<SizeType>(0, span.length - n + 1); pos < span.length; ++pos) {
+      if (span.data[pos] == p[0] && matchesAt(spans, i, pos, p, n)) visit(span.offset + pos);
+    }
+  }
+}
+}  // namespace
+const std::vector<SearchMatch>& SearchEngine::search(const String& pattern, bool regex) {
+  auto revision = m_doc.revision();
+  bool sameDoc = m_valid && m_revision == revision && m_regex == regex;
+  m_incremental = false;
+  if (sameDoc && pattern == m_pattern) {
+    m_incremental = true;
+    return m_matches;
+  }
+  if (pattern.isEmpty()) {
+    clear();
+    return m_matches;
+  }
+  if (regex) {
+    searchRegex(pattern);
+  } else if (sameDoc && !m_pattern.isEmpty() && pattern.startsWith(m_pattern)) {
+    // 新模式的每次出现，一定也是旧模式的一次出现
+    refineLiteral(pattern);
+    m_incremental = true;
+  } else {
+    searchLiteral(pattern);
+  }
+  m_pattern = pattern;
+  m_regex = regex;
+  m_revision = revision;
+  m_valid = true;
+  return m_matches;
+}
+void SearchEngine::searchLiteral(const String& pattern) {
+  m_occurrences.clear();
+  const auto& buffers = m_doc.bufferProvider();
+  const auto& blocks = m_doc.blocks();
+  for (SizeType blockNo = 0; blockNo < static_cast<SizeType>(blocks.size()); ++blockNo) {
+    const auto& block = blocks[blockNo];
+    for (SizeType lineNo = 0; lineNo < static_cast<SizeType>(block.countOfLogicalLine()); ++lineNo) {
+      auto spans = lineSpans(block.logicalLineAt(lineNo), buffers);
+      findInLine(spans, pattern, [this, blockNo, lineNo](SizeType offset) {
+        m_occurrences.push_back({blockNo, lineNo, offset});
+      });
+    }
+  }
+  collectMatches(pattern.size());
+}
+void SearchEngine::refineLiteral(const String& pattern) {
+  const auto& buffers = m_doc.bufferProvider();
+  const auto& blocks = m_doc.blocks();
+  std::vector<Occurrence> occurrences;
+  std::vector<Span> spans;
+  SizeType blockNo = -1;
+  SizeType lineNo = -1;
+  for (const auto& occurrence : m_occurrences) {
+    if (occurrence.blockNo != blockNo || occurrence.lineNo != lineNo) {
+      blockNo = occurrence.blockNo;
+      lineNo = occurrence.lineNo;
+      spans = lineSpans(blocks[blockNo].logicalLineAt(lineNo), buffers);
+    }
+    auto i = spanAt(spans, occurrence.offset);
+    if (matchesAt(spans, i, occurrence.offset - spans[i].offset, pattern.data(), pattern.size())) {
+      occurrences.push_back(occurrence);
+    }
+  }
+  m_occurrences = std::move(occurrences);
+  collectMatches(pattern.size());
+}
+void SearchEngine::searchRegex(const String& pattern) {
+  m_occurrences.clear();
+  m_matches.clear();
+  std::regex re;
+  try {
+    re = std::regex(pattern.toStdString(), std::regex::ECMAScript);
+  } catch (const std::regex_error& e) {
+    DEBUG << "invalid regex:" << pattern << e.what();
+    return;
+  }
+  const auto& buffers = m_doc.bufferProvider();
+  const auto& blocks = m_doc.blocks();
+  std::string text;
+  for (SizeType blockNo = 0; blockNo < static_cast<SizeType>(blocks.size()); ++blockNo) {
+    const auto& block = blocks[blockNo];
+    for (SizeType lineNo = 0; lineNo < static_cast<SizeType>(block.countOfLogicalLine()); ++lineNo) {
+      text.clear();
+      for (const auto& span : lineSpans(block.logicalLineAt(lineNo), buffers)) {
+        // 不是文字的cell用\0占位，偏移和逻辑行对得上
+        if (span.data) {
+          text.append(span.data, span.length);
+        } else {
+          text.append(span.length, '\0');
+        }
+      }
+      for (auto it = std::cregex_iterator(text.data(), text.data() + text.size(), re); it != std::cregex_iterator();
+           ++it) {
+        if (it->length() == 0) continue;
+        SizeType offset = it->position();
+        m_matches.push_back({{blockNo, lineNo, offset}, {blockNo, lineNo, offset + it->length()}});
+      }
+    }
+  }
+}
+void SearchEngine::collectMatches(SizeType length) {
+  m_matches.clear();
+  const Occurrence* last = nullptr;
+  for (const auto& occurrence : m_occurrences) {
+    if (last && last->blockNo == occurrence.blockNo && last->lineNo == occurrence.lineNo &&
+        occurrence.offset < last->offset + length) {
+      continue;
+    }
+    m_matches.push_back({{occurrence.blockNo, occurrence.lineNo, occurrence.offset},
+                         {occurrence.blockNo, occurrence.lineNo, occurrence.offset + length}});
+    last = &occurrence;
+  }
+}
+std::vector<core::Rect> SearchEngine::highlightRects(int top, int bottom) const {
+  std::vector<core::Rect> rects;
+  if (m_matches.empty()) return rects;
+  auto first = m_doc.blockAt(top);
+  auto match = std::lower_bound(m_matches.begin(), m_matches.end(), first,
+                                [](const SearchMatch& m, SizeType blockNo) { return m.begin.blockNo < blockNo; });
+  for (; match != m_matches.end() && m_doc.blockTop(match->begin.blockNo) < bottom; ++match) {
+    auto matchRects = m_doc.rangeRects(match->begin, match->end, top, bottom);
+    rects.insert(rects.end(), matchRects.begin(), matchRects.end());
+  }
+  return rects;
+}
+SizeType SearchEngine::replaceAll(Cursor& cursor, const String& text) {
+  if (!m_valid || m_revision != m_doc.revision()) search(m_pattern, m_regex);
+  if (m_matches.empty()) return 0;
+  const auto& buffers = m_doc.bufferProvider();
+  const auto& blocks = m_doc.blocks();
+  std::vector<Span> spans;
+  SizeType blockNo = -1;
+  SizeType lineNo = -1;
+  SizeType count = 0;
+  m_doc.beginTransaction();
+  for (const auto& match : m_matches) {
+    if (match.begin.blockNo != blockNo || match.begin.lineNo != lineNo) {
+      blockNo = match.begin.blockNo;
+      lineNo = match.begin.lineNo;
+      spans = lineSpans(blocks[blockNo].logicalLineAt(lineNo), buffers);
+    }
+    // 跨了行内样式的边界(比如**foo**bar里的foobar)，换掉会把标记切成两半，不换
+    auto node = spans[spanAt(spans, match.begin.offset)].node;
+    if (!node || spans[spanAt(spans, match.end.offset - 1)].node != node) continue;
+    m_doc.replaceText(cursor, match.begin, match.end, text);
+    count++;
+  }
+  m_doc.commit(cursor);
+  // 文档变了，下次查找重新扫
+  m_valid = false;
+  m_occurrences.clear();
+  m_matches.clear();
+  return count;
+}
+void SearchEngine::clear() {
+  m_pattern = String();
+  m_regex = false;
+  m_incremental = false;
+  m_valid = false;
+  m_occurrences.clear();
+  m_matches.clear();
+}
+}  // namespace md::editor
@@ -0,0 +1,62 @@
+#ifndef QTMARKDOWN_SEARCHENGINE_H
+#define QTMARKDOWN_SEARCHENGINE_H
+#include "QtMarkdown_global.h"
+#include <cstdint>
+#include <vector>
+
+#include "render/mddef.h"
+#include "core/Types.h"
+#include "CursorCoord.h"
+namespace md::editor {
+class Cursor;
+class Document;
+// 一处匹配，[begin, end)在同一个逻辑行里
+struct SearchMatch {
+  CursorCoord begin;
+  CursorCoord end;
+};
+// 查找替换。字面量不拼字符串，直接在piece table的缓冲区上逐行扫：
+// 先用模式的首尾字节过滤候选位置(有SSE2时一次16个)，再比较中间的字节。
+// 正则(ECMAScript语法)要把逻辑行拼出来再匹配，慢一些。
+// 边打边搜：文档没改、新模式是上次的延长时，只在上次出现过的位置上接着比较
+class QTMARKDOWNEDITORCORE_EXPORT SearchEngine {
+ public:
+  explicit SearchEngine(Document& doc) : m_doc(doc) {}
+  // 结果按位置排好，互不重叠。正则写错了没有结果
+  const std::vector<SearchMatch>& search(const String& pattern, bool regex = false);
+  [[nodiscard]] const std::vector<SearchMatch>& matches() const { return m_matches; }
+  // 上一次search是否复用了之前的结果
+  [[nodiscard]] bool lastSearchWasIncremental() const { return m_incremental; }
+  // 文档坐标[top, bottom)内的匹配的高亮框，折行的匹配每个视觉行一个框。视口外的块不看
+  [[nodiscard]] std::vector<core::Rect> highlightRects(int top, int bottom) const;
+  // 所有匹配换成text：一个事务，只重新解析一次，一条撤销记录。返回换了几处。
+  // 跨了行内样式边界的匹配(开头和结尾不在同一个Text结点里)不换，不然会把标记切开
+  SizeType replaceAll(Cursor& cursor, const String& text);
+  void clear();
+
+ private:
+  // 字面量的一次出现，可以和别的重叠
+  struct Occurrence {
+    SizeType blockNo;
+    SizeType lineNo;
+    SizeType offset;
+  };
+  void searchLiteral(const String& pattern);
+  void refineLiteral(const String& pattern);
+  void searchRegex(const String& pattern);
+  // 从m_occurrences里按顺序挑出互不重叠的
+  void collectMatches(SizeType length);
+
+  Document& m_doc;
+  String m_pattern;
+  bool m_regex = false;
+  bool m_incremental = false;
+  // 有没有结果，结果对应的文档版本
+  bool m_valid = false;
+  uint64_t m_revision = 0;
+  std::vector<Occurrence> m_occurrences;
+  std::vector<SearchMatch> m_matches;
+};
+}  // namespace md::editor
+
+#endif  // QTMARKDOWN_SEARCHENGINE_H
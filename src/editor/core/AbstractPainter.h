@@ -4,8 +4,24 @@
 #include "Types.h"
 #include "parser/MdString.h"
 
+namespace microtex {
+class Render;
+}
 namespace md::editor::core {
 
+class AbstractPainter;
+// 离屏图层，画一次之后整张贴回去
+class AbstractLayer {
+public:
+    virtual ~AbstractLayer() = default;
+    // 往图层里画用的painter，原点是图层左上角
+    virtual AbstractPainter& painter() = 0;
+    // 画完之后调用，之后painter()不能再用
+    virtual void finish() = 0;
+    // 像素占的字节数
+    virtual std::size_t byteCount() const = 0;
+};
+
 class AbstractPainter {
 public:
     virtual ~AbstractPainter() = default;
@@ -24,7 +40,15 @@ public:
     virtual void drawImage(const Rect& rect, const ImageData& image) = 0;
     virtual void drawText(const Rect& rect, int flags, const String& text) = 0;
 
-    virtual void drawLatex(const Rect& rect, const String& latex, float fontSize) = 0;
+    // render由排版阶段解析好，绘制时只画
+    virtual void drawLatex(const Rect& rect, microtex::Render& render) = 0;
+
+    // 设备像素比，离屏图层按这个比例分配像素
+    virtual double devicePixelRatio() const { return 1.0; }
+    // 创建透明的离屏图层，大小是逻辑像素。不支持时返回nullptr
+    virtual std::unique_ptr<AbstractLayer> createLayer(const Size& /*size*/) { return nullptr; }
+    // 把同一个painter创建的图层贴到pos
+    virtual void drawLayer(const Point& /*pos*/, const AbstractLayer& /*layer*/) {}
 
     // Returns a pointer to the native platform painter context.
     // For Qt: returns QPainter*. Returns nullptr in the base class.
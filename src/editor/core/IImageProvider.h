@@ -10,6 +10,11 @@ public:
     virtual ~IImageProvider() = default;
     virtual ImageData load(const String& path) = 0;
     virtual bool exists(const String& path) = 0;
+    // 文件修改时间，图片缓存用来判断文件有没有变；0表示不知道，当作不会变
+    virtual int64_t lastModified(const String& /*path*/) { return 0; }
+    // 只读文件头拿到图片大小，不解码；读不到返回空的Size
+    virtual Size imageSize(const String& /*path*/) { return {}; }
+    // load会在后台解码线程调用，实现要保证线程安全
 };
 
 } // namespace md::editor::core
@@ -1,7 +1,10 @@
 #ifndef QTMARKDOWN_CORE_TYPES_H
 #define QTMARKDOWN_CORE_TYPES_H
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -46,6 +49,23 @@ struct Rect {
             && p.y >= pos.y && p.y <= pos.y + size.height;
     }
     constexpr bool isEmpty() const { return size.width <= 0 || size.height <= 0; }
+    constexpr bool operator==(const Rect& other) const { return pos == other.pos && size == other.size; }
+    constexpr bool operator!=(const Rect& other) const { return !(*this == other); }
+    // 包含两个矩形的最小矩形，空矩形不参与
+    constexpr Rect united(const Rect& other) const {
+        if (other.isEmpty()) return *this;
+        if (isEmpty()) return other;
+        int left = std::min(pos.x, other.pos.x);
+        int top = std::min(pos.y, other.pos.y);
+        int right = std::max(pos.x + size.width, other.pos.x + other.size.width);
+        int bottom = std::max(pos.y + size.height, other.pos.y + other.size.height);
+        return {left, top, right - left, bottom - top};
+    }
+    constexpr bool intersects(const Rect& other) const {
+        if (isEmpty() || other.isEmpty()) return false;
+        return pos.x < other.pos.x + other.size.width && other.pos.x < pos.x + size.width &&
+               pos.y < other.pos.y + other.size.height && other.pos.y < pos.y + size.height;
+    }
 };
 
 struct Color {
@@ -81,13 +101,25 @@ struct FontDescription {
     bool italic = false;
     bool underline = false;
     bool strikeOut = false;
+    bool operator==(const FontDescription& other) const = default;
 };
 
 struct ImageData {
     int width = 0;
     int height = 0;
     std::vector<unsigned char> pixels;  // RGBA, row-major
-    bool isNull() const { return pixels.empty(); }
+    // 像素也可以放在平台的图片对象里(Qt下是QImage)，由storage持有，storageBits指向像素，
+    // 这样解码后不用再拷贝一次
+    std::shared_ptr<const void> storage;
+    const unsigned char* storageBits = nullptr;
+    // 图片的身份，非0时绘制端可以按它缓存转换好的平台图片(QPixmap)。像素不会再变才能设置
+    uint64_t cacheKey = 0;
+    bool isNull() const { return bits() == nullptr; }
+    const unsigned char* bits() const {
+        if (storage) return storageBits;
+        return pixels.empty() ? nullptr : pixels.data();
+    }
+    std::size_t byteCount() const { return isNull() ? 0 : static_cast<std::size_t>(width) * height * 4; }
 };
 
 } // namespace md::editor::core
@@ -18,7 +18,23 @@ std::ostream& operator<<(std::ostream& os, const NodeType& type) {
 }
 Header::Header(int level) : m_level(level) { m_type = NodeType::header; }
 
-Document::Document(const String &str) : m_originalBuffer(str), m_root(Parser::parse(str)) {}
+Document::Document(const String &str)
+    : m_originalBuffer(std::make_shared<const String>(str)),
+      m_addBuffer(std::make_shared<String>()),
+      m_root(Parser::parse(str)) {}
+
+SizeType Document::appendToAddBuffer(const String &text) {
+  auto offset = static_cast<SizeType>(m_addBuffer->size());
+  // 保存的快照还在读这块内存时不能让它搬家：容量不够就换一块新的接着写，旧的留给快照
+  if (m_addBuffer.use_count() > 1 && m_addBuffer->size() + text.size() > m_addBuffer->capacity()) {
+    auto buffer = std::make_shared<String>();
+    buffer->reserve(std::max(m_addBuffer->capacity() * 2, m_addBuffer->size() + text.size()));
+    *buffer += *m_addBuffer;
+    m_addBuffer = std::move(buffer);
+  }
+  *m_addBuffer += text;
+  return offset;
+}
 
 String Document::toHtml() {
   // HTML export not yet implemented
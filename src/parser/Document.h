@@ -41,13 +41,17 @@ class QTMARKDOWNPARSER_EXPORT Document : public IBufferProvider {
   String toHtml();
   void accept(NodeVisitor* visitor);
   Container* root() const { return m_root.get(); }
-  String& addBuffer() { return m_addBuffer; }
-  const String& addBuffer() const override { return m_addBuffer; }
-  const String& originalBuffer() const override { return m_originalBuffer; }
+  std::string_view addBuffer() const override { return {m_addBuffer->data(), m_addBuffer->size()}; }
+  std::string_view originalBuffer() const override { return {m_originalBuffer->data(), m_originalBuffer->size()}; }
+  // 追加到add缓冲区末尾，返回追加的位置
+  SizeType appendToAddBuffer(const String& text);
+  // 后台保存时共享缓冲区，不复制。快照只读它拿到时的长度以内的字节
+  [[nodiscard]] sptr<const String> sharedOriginalBuffer() const { return m_originalBuffer; }
+  [[nodiscard]] sptr<const String> sharedAddBuffer() const { return m_addBuffer; }
 
  protected:
-  String m_originalBuffer;
-  String m_addBuffer;
+  sptr<const String> m_originalBuffer;
+  sptr<String> m_addBuffer;
   std::unique_ptr<Container> m_root;
   friend class Parser;
   friend class Text;
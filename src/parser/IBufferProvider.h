@@ -1,16 +1,19 @@
 #ifndef QTMARKDOWN_IBUFFERPROVIDER_H
 #define QTMARKDOWN_IBUFFERPROVIDER_H
 
+#include <string_view>
+
 #include "QtMarkdown_global.h"
 #include "mddef.h"
 
 namespace md::parser {
 
+// piece table的两个缓冲区。original建好后不再改，add只在末尾追加，已有的字节不会变
 class QTMARKDOWNPARSER_EXPORT IBufferProvider {
 public:
     virtual ~IBufferProvider() = default;
-    virtual const String& originalBuffer() const = 0;
-    virtual const String& addBuffer() const = 0;
+    virtual std::string_view originalBuffer() const = 0;
+    virtual std::string_view addBuffer() const = 0;
 };
 
 } // namespace md::parser
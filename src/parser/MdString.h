@@ -138,6 +138,7 @@ public:
 
     // Capacity
     void reserve(size_type n) { m_str.reserve(n); }
+    [[nodiscard]] size_type capacity() const noexcept { return m_str.capacity(); }
 
     // Append
     void append(const String& s) { m_str.append(s.m_str); }
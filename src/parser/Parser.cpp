@@ -218,6 +218,10 @@ class ParserPrivate {
   PieceTableItem::BufferType m_bufferType;
   SizeType m_baseOffset;
 };
+TokenType Parser::tokenTypeOf(Char ch) {
+  auto uc = static_cast<unsigned char>(ch);
+  return uc < 128 ? ch2type[uc] : TokenType::none;
+}
 std::unique_ptr<Container> Parser::parse(const String& text) {
   ParserPrivate parser(text);
   return parser.parse();
@@ -6,6 +6,7 @@
 #define MD_PARSER_H
 #include "PieceTable.h"
 #include "QtMarkdown_global.h"
+#include "Token.h"
 #include "mddef.h"
 namespace md::parser {
 class Container;
@@ -13,6 +14,8 @@ class QTMARKDOWNPARSER_EXPORT Parser {
  public:
   static std::unique_ptr<Container> parse(const String& text);
   static std::unique_ptr<Container> parse(const String& text, PieceTableItem::BufferType bufferType, SizeType baseOffset = 0);
+  // 单个字节切分出的token类型，不是语法字符(会并进文本token)时返回TokenType::none
+  static TokenType tokenTypeOf(Char ch);
 };
 }  // namespace md::parser
 
@@ -9,7 +9,9 @@
 #include "debug.h"
 namespace md::parser {
 String PieceTableItem::toString(const IBufferProvider& doc) const {
-  auto s = bufferType == original ? doc.originalBuffer().mid(offset, length) : doc.addBuffer().mid(offset, length);
+  auto buffer = bufferType == original ? doc.originalBuffer() : doc.addBuffer();
+  String s;
+  if (offset <= static_cast<SizeType>(buffer.size())) s = std::string(buffer.substr(offset, length));
   if (s.endsWith("\n")) {
     DEBUG << "换行";
   }
@@ -13,6 +13,17 @@ String Text::toString(const IBufferProvider& doc) const {
   }
   return s;
 }
+Char Text::at(SizeType totalOffset, const IBufferProvider& doc) const {
+  for (const auto& item : m_items) {
+    if (totalOffset < item.length) {
+      auto buffer = item.bufferType == PieceTableItem::original ? doc.originalBuffer() : doc.addBuffer();
+      return buffer[item.offset + totalOffset];
+    }
+    totalOffset -= item.length;
+  }
+  ASSERT(false && "offset out of text");
+  return 0;
+}
 void Text::insert(SizeType totalOffset, PieceTableItem item) {
   int i = 0;
   SizeType curOffset = 0;
@@ -24,11 +24,15 @@ class QTMARKDOWNPARSER_EXPORT Text : public Node {
   }
   bool empty() const;
   [[nodiscard]] String toString(const IBufferProvider& doc) const;
+  // 第totalOffset个字节，不拼整个字符串
+  [[nodiscard]] Char at(SizeType totalOffset, const IBufferProvider& doc) const;
   void insert(SizeType totalOffset, PieceTableItem item);
   void remove(SizeType totalOffset, SizeType length);
   std::pair<std::unique_ptr<Text>, std::unique_ptr<Text>> split(SizeType totalOffset);
   auto begin() { return m_items.begin(); }
   auto end() { return m_items.end(); }
+  // 按顺序拼起来就是这段文字，查找时直接在缓冲区上扫
+  [[nodiscard]] const PieceTableItemList& items() const { return m_items; }
   void merge(Text& text);
   void accept(NodeVisitor* v) override { v->visit(this); }
   std::unique_ptr<Node> clone() const override;
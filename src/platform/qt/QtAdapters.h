@@ -9,10 +9,13 @@
 #include <QMouseEvent>
 #include <QPainter>
 #include <QPixmap>
+#include <QPixmapCache>
 #include <QPoint>
 #include <QRect>
 #include <QSize>
 #include <QTimer>
+#include <QtMath>
+#include <memory>
 
 #include "editor/core/Event.h"
 #include "editor/core/Types.h"
@@ -55,24 +58,48 @@ inline QFont toQFont(const core::FontDescription& fd) {
     return font;
 }
 
+// 不拷贝像素，返回的QImage只在img存活期间有效
 inline QImage toQImage(const core::ImageData& img) {
     if (img.isNull()) return {};
-    if (img.pixels.empty()) return {};
-    QImage qimg(img.pixels.data(), img.width, img.height, img.width * 4, QImage::Format_RGBA8888);
-    return qimg.copy(); // deep copy since we don't own the data
+    return QImage(img.bits(), img.width, img.height, img.width * 4, QImage::Format_RGBA8888);
 }
 
+// 转换后的QImage直接当作像素存储，不再拷贝
 inline core::ImageData fromQImage(const QImage& img) {
     if (img.isNull()) return {};
-    QImage converted = img.convertToFormat(QImage::Format_RGBA8888);
+    auto converted = std::make_shared<const QImage>(img.convertToFormat(QImage::Format_RGBA8888));
     core::ImageData data;
-    data.width = converted.width();
-    data.height = converted.height();
-    data.pixels.resize(static_cast<size_t>(converted.width() * converted.height() * 4));
-    std::memcpy(data.pixels.data(), converted.constBits(), data.pixels.size());
+    data.width = converted->width();
+    data.height = converted->height();
+    data.storageBits = converted->constBits();
+    data.storage = std::move(converted);
     return data;
 }
 
+// 有cacheKey的图片转换成QPixmap后放进QPixmapCache，按(图片, 目标大小, 设备像素比)查找，
+// 之后每次绘制都不用再转换和缩放
+inline QPixmap toQPixmap(const core::ImageData& img, const QSize& size, qreal dpr) {
+    if (img.isNull()) return {};
+    QSize deviceSize = size * dpr;
+    auto convert = [&]() {
+        QPixmap pixmap = QPixmap::fromImage(toQImage(img));
+        if (deviceSize.isValid() && pixmap.size() != deviceSize) {
+            pixmap = pixmap.scaled(deviceSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        pixmap.setDevicePixelRatio(dpr);
+        return pixmap;
+    };
+    if (img.cacheKey == 0) return convert();
+    QString key = QStringLiteral("md:image:%1:%2x%3@%4")
+                      .arg(img.cacheKey).arg(size.width()).arg(size.height()).arg(dpr);
+    QPixmap pixmap;
+    if (!QPixmapCache::find(key, &pixmap)) {
+        pixmap = convert();
+        QPixmapCache::insert(key, pixmap);
+    }
+    return pixmap;
+}
+
 // -- QtKeyEvent adapter --
 class QtKeyEvent : public core::KeyEvent {
 public:
@@ -184,23 +211,21 @@ public:
         m_painter->drawEllipse(toQRect(rect));
     }
     void drawImage(const core::Rect& rect, const core::ImageData& image) override {
-        m_painter->drawPixmap(toQRect(rect), QPixmap::fromImage(toQImage(image)));
+        qreal dpr = m_painter->device() ? m_painter->device()->devicePixelRatioF() : 1.0;
+        m_painter->drawPixmap(toQRect(rect), toQPixmap(image, toQSize(rect.size), dpr));
     }
     void drawText(const core::Rect& rect, int flags, const String& text) override {
         m_painter->drawText(toQRect(rect), flags, toQString(text));
     }
-    void drawLatex(const core::Rect& rect, const String& latex, float fontSize) override {
-        try {
-            auto render = microtex::MicroTeX::parse(latex.toStdString(), rect.width(), fontSize,
-                                                    fontSize / 3.f, 0xff424242);
-            microtex::Graphics2D_qt g2(m_painter);
-            render->draw(g2, rect.x(), rect.y());
-            delete render;
-        } catch (const std::exception&) {
-            // Fallback: draw placeholder text
-            m_painter->drawText(toQPoint(rect.pos), toQString(latex));
-        }
+    void drawLatex(const core::Rect& rect, microtex::Render& render) override {
+        microtex::Graphics2D_qt g2(m_painter);
+        render.draw(g2, rect.x(), rect.y());
     }
+    double devicePixelRatio() const override {
+        return m_painter->device() ? m_painter->device()->devicePixelRatioF() : 1.0;
+    }
+    std::unique_ptr<core::AbstractLayer> createLayer(const core::Size& size) override;
+    void drawLayer(const core::Point& pos, const core::AbstractLayer& layer) override;
     // Access the underlying QPainter for instruction dispatch
     void* nativePainter() const override { return m_painter; }
     QPainter* underlyingPainter() const { return m_painter; }
@@ -208,6 +233,36 @@ private:
     QPainter* m_painter;
 };
 
+// 按设备像素比分配的透明QImage，贴回去时不再缩放
+class QtLayer : public core::AbstractLayer {
+public:
+    QtLayer(const QSize& size, qreal dpr)
+        : m_image(qCeil(size.width() * dpr), qCeil(size.height() * dpr), QImage::Format_ARGB32_Premultiplied) {
+        m_image.setDevicePixelRatio(dpr);
+        m_image.fill(Qt::transparent);
+        m_painter = std::make_unique<QPainter>(&m_image);
+        m_adapter = std::make_unique<QtPainterAdapter>(m_painter.get());
+    }
+    core::AbstractPainter& painter() override { return *m_adapter; }
+    void finish() override {
+        m_adapter.reset();
+        m_painter.reset();
+    }
+    std::size_t byteCount() const override { return static_cast<std::size_t>(m_image.sizeInBytes()); }
+    const QImage& image() const { return m_image; }
+private:
+    QImage m_image;
+    std::unique_ptr<QPainter> m_painter;
+    std::unique_ptr<QtPainterAdapter> m_adapter;
+};
+
+inline std::unique_ptr<core::AbstractLayer> QtPainterAdapter::createLayer(const core::Size& size) {
+    return std::make_unique<QtLayer>(toQSize(size), devicePixelRatio());
+}
+inline void QtPainterAdapter::drawLayer(const core::Point& pos, const core::AbstractLayer& layer) {
+    m_painter->drawImage(toQPoint(pos), static_cast<const QtLayer&>(layer).image());
+}
+
 // -- Qt Timer adapter --
 class QtTimerAdapter : public core::ITimer {
 public:
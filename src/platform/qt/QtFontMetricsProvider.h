@@ -4,6 +4,7 @@
 #include "render/FontMetricsProvider.h"
 #include <QFont>
 #include <QFontMetrics>
+#include <QFontMetricsF>
 
 namespace md::render {
 
@@ -20,6 +21,10 @@ public:
         QFontMetrics fm(toQFont(font));
         return fm.horizontalAdvance(toQString(text));
     }
+    double horizontalAdvanceF(const Font& font, const String& text) const override {
+        QFontMetricsF fm(toQFont(font));
+        return fm.horizontalAdvance(toQString(text));
+    }
     int height(const Font& font) const override {
         QFontMetrics fm(toQFont(font));
         return fm.height();
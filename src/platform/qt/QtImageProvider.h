@@ -1,8 +1,11 @@
 #ifndef QTMARKDOWN_PLATFORM_QTIMAGEPROVIDER_H
 #define QTMARKDOWN_PLATFORM_QTIMAGEPROVIDER_H
 
+#include <QDateTime>
 #include <QFile>
+#include <QFileInfo>
 #include <QImage>
+#include <QImageReader>
 #include <QString>
 
 #include "editor/core/IImageProvider.h"
@@ -21,6 +24,18 @@ public:
     bool exists(const String& path) override {
         return QFile::exists(toQString(path));
     }
+
+    int64_t lastModified(const String& path) override {
+        // 资源文件没有修改时间
+        QDateTime time = QFileInfo(toQString(path)).lastModified();
+        return time.isValid() ? time.toMSecsSinceEpoch() : 0;
+    }
+
+    core::Size imageSize(const String& path) override {
+        QSize size = QImageReader(toQString(path)).size();
+        if (!size.isValid()) return {};
+        return {size.width(), size.height()};
+    }
 };
 
 } // namespace md::editor
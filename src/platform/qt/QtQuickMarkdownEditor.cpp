@@ -8,7 +8,7 @@
 #include <QGuiApplication>
 #include <QDesktopServices>
 #include <QClipboard>
-#include <QFile>
+#include <QStandardPaths>
 
 #include "platform/qt/QtAdapters.h"
 #include "platform/qt/QtLatexPlatform.h"
@@ -30,16 +30,53 @@ QtQuickMarkdownEditor::QtQuickMarkdownEditor(QQuickItem *parent) : QQuickPainted
     emit codeCopied(toQString(code));
   });
   m_editor->setCheckBoxClickedCallback([this]() { markContentChanged(); });
+  m_editor->setLatexCacheDir(
+      String(QStandardPaths::writableLocation(QStandardPaths::CacheLocation).toStdString() + "/latex"));
+  m_editor->setLatexTypesetCallback([this]() {
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+          if (m_editor->updateTypesetLatex()) updateDamage();
+        },
+        Qt::QueuedConnection);
+  });
+  m_editor->setImageDecodeCallback([this]() {
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+          if (m_editor->updateDecodedImages()) updateDamage();
+        },
+        Qt::QueuedConnection);
+  });
+  m_editor->setSaveFinishedCallback([this]() {
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+          auto ok = m_editor->finishSave();
+          if (!ok) return;
+          if (*ok) {
+            DEBUG << "save success";
+            emit docSave(m_isNewDoc);
+          } else {
+            DEBUG << "save fail";
+          }
+        },
+        Qt::QueuedConnection);
+  });
   setAcceptHoverEvents(true);
   setAcceptedMouseButtons(Qt::AllButtons);
   setFlag(ItemAcceptsInputMethod, true);
   m_cursorTimer.start(500);
   connect(&m_cursorTimer, &QTimer::timeout, [this]() {
     m_showCursor = !m_showCursor;
-    this->update();
+    this->update(toQRect(m_editor->cursorDamageRect()));
   });
-  m_tmpSaveTimer.start(30 * 1000);
-  connect(&m_tmpSaveTimer, &QTimer::timeout, this, &QtQuickMarkdownEditor::tmpSave);
+  // 编辑随时记进日志，定时一起fsync
+  m_journalTimer.start(1000);
+  connect(&m_journalTimer, &QTimer::timeout, this, [this]() { m_editor->syncJournal(); });
+  m_inputTimer.setSingleShot(true);
+  m_inputTimer.setInterval(Editor::kInputFrameMs);
+  connect(&m_inputTimer, &QTimer::timeout, this, &QtQuickMarkdownEditor::flushInput);
   connect(this, &QtQuickMarkdownEditor::widthChanged, this, [this]() {
     int w = this->width();
     if (w > 0) {
@@ -53,12 +90,16 @@ void QtQuickMarkdownEditor::paint(QPainter *painter) {
   Q_ASSERT(painter != nullptr);
   QtPainterAdapter adapter(painter);
   core::Point offset(0, 0);
+  // update(rect)时painter裁剪到要重画的区域
+  core::Rect clip;
+  if (painter->hasClipping()) clip = fromQRect(painter->clipBoundingRect().toAlignedRect());
 #ifdef __ANDROID__
-  m_editor->drawDoc(adapter, offset);
+  m_editor->drawDoc(adapter, offset, clip);
   setImplicitHeight(m_editor->height());
 #else
+  m_editor->drawSearchHighlights(adapter, offset);
   m_editor->drawSelection(adapter, offset);
-  m_editor->drawDoc(adapter, offset);
+  m_editor->drawDoc(adapter, offset, clip);
   setImplicitHeight(m_editor->height());
   if (hasActiveFocus()) {
     m_editor->drawCursor(adapter, offset);
@@ -73,8 +114,6 @@ void QtQuickMarkdownEditor::setSource(const QString &source) {
   emit sourceChanged(m_source);
   m_source = source;
   m_isNewDoc = false;
-  auto tmpPath = this->tmpPath();
-  DEBUG << tmpPath.toStdString();
   int w = this->width();
   if (w > 0) {
     m_editor->setWidth(this->width());
@@ -86,12 +125,16 @@ void QtQuickMarkdownEditor::setSource(const QString &source) {
     }
     m_editor->setResPathList(pathList);
   }
-  if (QFile(tmpPath).exists()) {
-    m_editor->loadFile(String(tmpPath.toStdString()));
+  m_editor->loadFile(String(url2path(source).toStdString()));
+  // qrc的文件直接忽略
+  auto journalPath = this->journalPath();
+  if (!journalPath.startsWith(":") && m_editor->openJournal(String(journalPath.toStdString()))) {
+    DEBUG << "restore edits from" << journalPath.toStdString();
     markContentChanged();
-  } else {
-    m_editor->loadFile(String(url2path(source).toStdString()));
   }
+  m_revision = m_editor->document()->revision();
+  // 整个重画，之前的变化区域不用了
+  m_editor->takeDamage();
   setImplicitWidth(m_editor->width());
   setImplicitHeight(m_editor->height());
   setHeight(m_editor->height());
@@ -120,13 +163,24 @@ void QtQuickMarkdownEditor::keyPressEvent(QKeyEvent *event) {
       QtKeyEvent adapter(event);
       m_editor->keyPressEvent(adapter);
     }
-    markContentChanged();
   } else {
     QtKeyEvent adapter(event);
     m_editor->keyPressEvent(adapter);
-    markContentChanged();
   }
-  this->update();
+  // 普通字符攒到这一帧结束再插入
+  if (m_editor->hasPendingInput()) {
+    if (!m_inputTimer.isActive()) m_inputTimer.start();
+    return;
+  }
+  afterEdit();
+}
+void QtQuickMarkdownEditor::flushInput() {
+  if (m_editor->flushInput()) afterEdit();
+}
+void QtQuickMarkdownEditor::afterEdit() {
+  // 移动光标之类的按键不算修改
+  if (m_editor->document()->revision() != m_revision) markContentChanged();
+  updateDamage();
   setImplicitWidth(m_editor->width());
   setImplicitHeight(m_editor->height());
   setHeight(m_editor->height());
@@ -144,13 +198,13 @@ void QtQuickMarkdownEditor::mousePressEvent(QMouseEvent *event) {
   forceActiveFocus();
   QtMouseEvent adapter(event);
   m_editor->mousePressEvent(core::Point(0, 0), adapter);
-  this->update();
+  updateDamage();
   emit showInputMethod();
 }
 void QtQuickMarkdownEditor::keyReleaseEvent(QKeyEvent *event) {
   QtKeyEvent adapter(event);
   m_editor->keyReleaseEvent(adapter);
-  this->update();
+  updateDamage();
 }
 QVariant QtQuickMarkdownEditor::inputMethodQuery(Qt::InputMethodQuery query) const {
   switch (query) {
@@ -173,7 +227,8 @@ void QtQuickMarkdownEditor::inputMethodEvent(QInputMethodEvent *event) {
   } else {
     m_editor->commitString(str);
   }
-  this->update();
+  if (m_editor->document()->revision() != m_revision) markContentChanged();
+  updateDamage();
 }
 void QtQuickMarkdownEditor::newDoc() {
   m_editor->reset();
@@ -182,59 +237,43 @@ void QtQuickMarkdownEditor::newDoc() {
 void QtQuickMarkdownEditor::saveToFile(const QString &path) {
   m_source = path;
   m_isNewDoc = false;
-  bool ok = m_editor->saveToFile(String(url2path(m_source).toStdString()));
-  if (ok) {
-    DEBUG << "save success";
-    auto tmpPath = this->tmpPath();
-    QFile file(tmpPath);
-    if (file.exists()) {
-      ok = file.remove();
-      if (ok) {
-        DEBUG << "remove tmp file success";
-      } else {
-        DEBUG << "remove tmp file fail";
-      }
-    }
-    emit docSave(m_isNewDoc);
-  } else {
-    DEBUG << "save fail";
-  }
+  // 后台写，写完再通知
+  m_editor->saveToFileAsync(String(url2path(m_source).toStdString()));
+}
+int QtQuickMarkdownEditor::find(const QString &pattern, bool regex) {
+  auto count = m_editor->find(String(pattern.toStdString()), regex);
+  updateDamage();
+  return static_cast<int>(count);
+}
+int QtQuickMarkdownEditor::replaceAll(const QString &text) {
+  auto count = m_editor->replaceAll(String(text.toStdString()));
+  afterEdit();
+  return static_cast<int>(count);
 }
 QString QtQuickMarkdownEditor::title() { return toQString(m_editor->title()); }
 void QtQuickMarkdownEditor::mouseMoveEvent(QMouseEvent *event) {
   QtMouseEvent adapter(event);
   m_editor->mouseMoveEvent(core::Point(0, 0), adapter);
-  this->update();
+  updateDamage();
 }
-void QtQuickMarkdownEditor::tmpSave() {
-  // 新文档暂时不考虑
-  if (m_isNewDoc) return;
-  if (!m_contentChanged) return;
-  auto path = tmpPath();
-  // qrc的文件直接忽略
-  if (path.startsWith(":")) {
-    return;
-  }
-  auto ok = m_editor->saveToFile(String(path.toStdString()));
-  if (ok) {
-    DEBUG << "tmp save success";
-  } else {
-    DEBUG << "tmp save fail";
+void QtQuickMarkdownEditor::updateDamage() {
+  for (const auto &rect : m_editor->takeDamage()) {
+    this->update(toQRect(rect));
   }
 }
 void QtQuickMarkdownEditor::markContentChanged() {
+  m_revision = m_editor->document()->revision();
   emit contentChanged();
-  m_contentChanged = true;
 }
-QString QtQuickMarkdownEditor::tmpPath() {
+QString QtQuickMarkdownEditor::journalPath() {
   auto index = m_source.lastIndexOf("/");
   auto name = m_source.mid(index + 1);
-  auto tmpPath = m_source.left(index) + "/~" + name;
+  auto journalPath = m_source.left(index) + "/~" + name + ".journal";
   QString prefix = "file://";
-  if (tmpPath.startsWith(prefix)) {
-    return url2path(tmpPath);
+  if (journalPath.startsWith(prefix)) {
+    return url2path(journalPath);
   }
-  return tmpPath;
+  return journalPath;
 }
 void QtQuickMarkdownEditor::save() { this->saveToFile(url2path(m_source)); }
 QString QtQuickMarkdownEditor::url2path(QString url) {
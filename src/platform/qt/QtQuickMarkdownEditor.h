@@ -27,6 +27,9 @@ class QTQUICKMARKDOWNEDITOR_EXPORT QtQuickMarkdownEditor : public QQuickPaintedI
   QString title();
   Q_INVOKABLE void newDoc();
   Q_INVOKABLE void saveToFile(const QString &path);
+  // 查找框每次变化时调用，返回匹配数
+  Q_INVOKABLE int find(const QString &pattern, bool regex = false);
+  Q_INVOKABLE int replaceAll(const QString &text);
 
  protected:
   void hoverMoveEvent(QHoverEvent *event) override;
@@ -41,11 +44,16 @@ class QTQUICKMARKDOWNEDITOR_EXPORT QtQuickMarkdownEditor : public QQuickPaintedI
 
  private:
   void markContentChanged();
-  QString tmpPath();
+  // 插入攒着的字符后统一更新一次
+  void flushInput();
+  // 按键处理完之后的通知、重画和高度
+  void afterEdit();
+  // 只重画编辑器报告的变化区域
+  void updateDamage();
+  // 崩溃恢复日志，和原文件放在一起
+  QString journalPath();
   void save();
   QString url2path(QString url);
- private slots:
-  void tmpSave();
  signals:
   void docSave(bool isNew);
   void contentChanged();
@@ -61,8 +69,11 @@ class QTQUICKMARKDOWNEDITOR_EXPORT QtQuickMarkdownEditor : public QQuickPaintedI
   QStringList m_resPathList;
   std::shared_ptr<md::editor::Editor> m_editor;
   QTimer m_cursorTimer;
-  QTimer m_tmpSaveTimer;
-  bool m_contentChanged;
+  QTimer m_journalTimer;
+  // 快速打字时一帧里的按键合成一次插入
+  QTimer m_inputTimer;
+  // 上次通知contentChanged时文档的修改次数
+  uint64_t m_revision = 0;
   bool m_isNewDoc;
   bool m_showCursor;
 };
@@ -17,6 +17,7 @@
 #include <QPainter>
 #include <QRect>
 #include <QScrollBar>
+#include <QStandardPaths>
 #include <QVariant>
 
 #include "platform/qt/QtAdapters.h"
@@ -55,9 +56,39 @@ QtWidgetMarkdownEditor::QtWidgetMarkdownEditor(QWidget *parent) : QAbstractScrol
     dialog.setLayout(hbox);
     dialog.exec();
   });
+  m_editor->setLatexCacheDir(
+      String(QStandardPaths::writableLocation(QStandardPaths::CacheLocation).toStdString() + "/latex"));
+  // 滚动时贴缓存好的图块，不再每帧重画文字
+  m_editor->setTileCacheMaxBytes(64 * 1024 * 1024);
+  m_editor->setLatexTypesetCallback([this]() {
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+          if (!m_editor->updateTypesetLatex()) return;
+          verticalScrollBar()->setRange(0, m_editor->height() - viewport()->height());
+          updateDamage();
+        },
+        Qt::QueuedConnection);
+  });
+  m_editor->setImageDecodeCallback([this]() {
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+          if (!m_editor->updateDecodedImages()) return;
+          verticalScrollBar()->setRange(0, m_editor->height() - viewport()->height());
+          updateDamage();
+        },
+        Qt::QueuedConnection);
+  });
   DEBUG << "viewport size:" << viewport()->sizeHint().width() << viewport()->sizeHint().height();
   m_cursorTimer.start(500);
-  connect(&m_cursorTimer, &QTimer::timeout, [this]() { this->viewport()->update(); });
+  connect(&m_cursorTimer, &QTimer::timeout,
+          [this]() { viewport()->update(toQRect(m_editor->cursorDamageRect()).translated(m_offset)); });
+  m_inputTimer.setSingleShot(true);
+  m_inputTimer.setInterval(Editor::kInputFrameMs);
+  connect(&m_inputTimer, &QTimer::timeout, this, [this]() {
+    if (m_editor->flushInput()) updateDamage();
+  });
 }
 void QtWidgetMarkdownEditor::loadFile(QString path) {
   if (path.startsWith(":/")) {
@@ -69,6 +100,8 @@ void QtWidgetMarkdownEditor::loadFile(QString path) {
   } else {
     m_editor->loadFile(String(path.toStdString()));
   }
+  // 整个重画，之前的变化区域不用了
+  m_editor->takeDamage();
   viewport()->update();
   QSize areaSize = viewport()->size();
   QSize widgetSize = this->size();
@@ -82,8 +115,10 @@ void QtWidgetMarkdownEditor::paintEvent(QPaintEvent *event) {
   QPainter qpainter(viewport());
   QtPainterAdapter adapter(&qpainter);
   auto offset = fromQPoint(m_offset);
+  m_editor->updateViewport(-m_offset.y(), viewport()->height());
+  m_editor->drawSearchHighlights(adapter, offset);
   m_editor->drawSelection(adapter, offset);
-  m_editor->drawDoc(adapter, offset);
+  m_editor->drawDoc(adapter, offset, fromQRect(event->rect()));
   if (hasFocus()) {
     m_editor->drawCursor(adapter, offset);
   }
@@ -98,7 +133,12 @@ QSize QtWidgetMarkdownEditor::viewportSizeHint() const { return {m_editor->width
 void QtWidgetMarkdownEditor::keyPressEvent(QKeyEvent *event) {
   QtKeyEvent adapter(event);
   m_editor->keyPressEvent(adapter);
-  viewport()->update();
+  // 普通字符攒到这一帧结束再插入
+  if (m_editor->hasPendingInput()) {
+    if (!m_inputTimer.isActive()) m_inputTimer.start();
+    return;
+  }
+  updateDamage();
 }
 QVariant QtWidgetMarkdownEditor::inputMethodQuery(Qt::InputMethodQuery query) const {
   switch (query) {
@@ -122,12 +162,12 @@ void QtWidgetMarkdownEditor::inputMethodEvent(QInputMethodEvent *event) {
   if (!preeditStr.isEmpty()) {
     m_editor->setPreedit(String(preeditStr.toStdString()));
   }
-  viewport()->update();
+  updateDamage();
 }
 void QtWidgetMarkdownEditor::mousePressEvent(QMouseEvent *event) {
   QtMouseEvent adapter(event);
   m_editor->mousePressEvent(fromQPoint(m_offset), adapter);
-  viewport()->update();
+  updateDamage();
 }
 void QtWidgetMarkdownEditor::mouseMoveEvent(QMouseEvent *event) {
   QtMouseEvent adapter(event);
@@ -139,9 +179,14 @@ void QtWidgetMarkdownEditor::mouseMoveEvent(QMouseEvent *event) {
   CursorShape shape = m_editor->cursorShape(fromQPoint(m_offset), fromQPoint(pos));
   setCursor(QCursor(static_cast<Qt::CursorShape>(shape)));
   m_editor->mouseMoveEvent(fromQPoint(m_offset), adapter);
-  viewport()->update();
+  updateDamage();
 }
 void QtWidgetMarkdownEditor::reload() {}
+void QtWidgetMarkdownEditor::updateDamage() {
+  for (const auto &rect : m_editor->takeDamage()) {
+    viewport()->update(toQRect(rect).translated(m_offset));
+  }
+}
 void QtWidgetMarkdownEditor::mouseReleaseEvent(QMouseEvent *event) {
   QtMouseEvent adapter(event);
   m_editor->mouseReleaseEvent(fromQPoint(m_offset), adapter);
@@ -30,9 +30,13 @@ class QTWIDGETMARKDOWNEDITOR_EXPORT QtWidgetMarkdownEditor : public QAbstractScr
   void mouseReleaseEvent(QMouseEvent* event) override;
 
  private:
+  // 只重画编辑器报告的变化区域
+  void updateDamage();
   std::shared_ptr<md::editor::Editor> m_editor;
   QPoint m_offset;
   QTimer m_cursorTimer;
+  // 快速打字时一帧里的按键合成一次插入
+  QTimer m_inputTimer;
 };
 }  // namespace md::editor
 #endif  // QTMARKDOWN_QTWIDGETMARKDOWNEDITOR_H
@@ -4,19 +4,37 @@
 
 #include "Cell.h"
 
-#include "FontMetricsProvider.h"
+#include <algorithm>
+
 #include "debug.h"
 namespace md::render {
 SizeType TextCell::length() { return m_length; }
-int TextCell::ascent() const { return m_fm->ascent(m_font); }
-int TextCell::width(SizeType length, const parser::IBufferProvider& doc) const {
+int TextCell::ascent() const { return m_ascent; }
+int TextCell::width(SizeType length, const parser::IBufferProvider& /*doc*/) const {
   ASSERT(length >= 0 && length <= m_length);
-  auto s = m_text->toString(doc).mid(m_offset, m_length);
-  auto w = m_fm->horizontalAdvance(m_font, s.left(length));
-  return w;
+  return m_advances.width(m_offset, m_offset + length);
+}
+SizeType TextCell::offsetAtX(int dx, const parser::IBufferProvider& /*doc*/) const {
+  if (dx <= 0) return 0;
+  // run的累计宽度里属于这个cell的一段
+  const auto& prefix = *m_advances.prefix;
+  auto first = prefix.begin() + (m_offset - m_advances.offset);
+  auto last = first + m_length + 1;
+  // 多字节字符的后续字节和首字节宽度相同，lower_bound总是落在字符边界上
+  auto it = std::lower_bound(first, last, *first + dx);
+  if (it == last) return m_length;
+  SizeType end = it - first;
+  if (end == 0) return 0;
+  SizeType begin = std::lower_bound(first, it, first[end - 1]) - first;
+  // 按中间划分
+  auto mid = first[begin] + (first[end] - first[begin]) / 2;
+  return *first + dx <= mid ? begin : end;
 }
 int InlineLatexCell::width(SizeType length, const parser::IBufferProvider& /*doc*/) const {
   if (length == 0) return 0;
   return m_size.width;
 }
+SizeType InlineLatexCell::offsetAtX(int dx, const parser::IBufferProvider& /*doc*/) const {
+  return dx <= m_size.width / 2 ? 0 : 1;
+}
 }  // namespace md::render
@@ -6,11 +6,14 @@
 #define QTMARKDOWN_CELL_H
 #include "QtMarkdown_global.h"
 #include <utility>
+#include <vector>
 
 #include "debug.h"
 #include "mddef.h"
 #include "parser/IBufferProvider.h"
 #include "parser/Text.h"
+#include "ShapeCache.h"
+#include "StyleTable.h"
 namespace md::render {
 class IFontMetricsProvider;
 
@@ -26,6 +29,8 @@ class QTMARKDOWNRENDER_EXPORT Cell {
   [[nodiscard]] int height() const { return m_size.height; };
   // 如果长度为length的子串，占用像素宽度
   [[nodiscard]] virtual int width(SizeType length, const parser::IBufferProvider& doc) const = 0;
+  // 距cell左边dx像素处对应的offset，按字符中间划分
+  [[nodiscard]] virtual SizeType offsetAtX(int dx, const parser::IBufferProvider& doc) const = 0;
   // 返回关联的Text节点和在此cell内的偏移（非TextCell返回nullptr/0）
   [[nodiscard]] virtual parser::Text* textNode() const { return nullptr; }
   [[nodiscard]] virtual SizeType textOffset() const { return 0; }
@@ -37,41 +42,54 @@ class QTMARKDOWNRENDER_EXPORT Cell {
   friend class LayoutPass;
   friend class LogicalLine;
   friend class VisualLine;
+  friend class DisplayList;
 };
-class TextInstruction;
 class QTMARKDOWNRENDER_EXPORT TextCell : public Cell {
  public:
-  TextCell(parser::Text* text, SizeType offset, SizeType length, Point pos, Size size, const Color& fg,
-           const Font& font, IFontMetricsProvider* fm)
-      : Cell(pos, size), m_fg(fg), m_font(font), m_text(text), m_offset(offset), m_length(length), m_fm(fm) {
-    ASSERT(fm != nullptr);
+  // advances是cell所在run的累计宽度，排版时由ShapeCache算好，同一个run切出的cell共用
+  TextCell(parser::Text* text, SizeType offset, SizeType length, Point pos, StyleId style, const StyleTable* styles,
+           RunAdvances advances, int height, int ascent)
+      : Cell(pos, Size(advances.width(offset, offset + length), height)),
+        m_style(style),
+        m_text(text),
+        m_offset(offset),
+        m_length(length),
+        m_styles(styles),
+        m_advances(std::move(advances)),
+        m_ascent(ascent) {
+    ASSERT(styles != nullptr);
+    ASSERT(offset >= m_advances.offset &&
+           offset + length - m_advances.offset < static_cast<SizeType>(m_advances.prefix->size()));
   }
   SizeType length() override;
   int width(SizeType length, const parser::IBufferProvider& doc) const override;
+  SizeType offsetAtX(int dx, const parser::IBufferProvider& doc) const override;
   parser::Text* textNode() const override { return m_text; }
   SizeType textOffset() const override { return m_offset; }
+  SizeType textLength() const { return m_length; }
   int ascent() const override;
   parser::Text* text() const { return m_text; }
+  StyleId style() const { return m_style; }
+  const Font& font() const { return m_styles->font(m_style); }
+  const Color& pen() const { return m_styles->pen(m_style); }
 
  private:
-  Color m_fg;
-  Font m_font;
+  StyleId m_style;
   parser::Text* m_text;
   SizeType m_offset;
   SizeType m_length;
-  IFontMetricsProvider* m_fm;
-  friend class TextInstruction;
+  const StyleTable* m_styles;
+  RunAdvances m_advances;
+  int m_ascent;
+  friend class DisplayList;
   friend class LogicalLine;
 };
-class LatexInstruction;
 class QTMARKDOWNRENDER_EXPORT InlineLatexCell : public Cell {
  public:
   InlineLatexCell(Point pos, Size size) : Cell(pos, size) {}
   SizeType length() override { return 1; }
   int width(SizeType length, const parser::IBufferProvider& doc) const override;
-
- private:
-  friend class LatexInstruction;
+  SizeType offsetAtX(int dx, const parser::IBufferProvider& doc) const override;
 };
 }  // namespace md::render
 #endif  // QTMARKDOWN_CELL_H
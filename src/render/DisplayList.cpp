@@ -0,0 +1,188 @@
+#include "DisplayList.h"
+
+#include <algorithm>
+
+#include "IconAtlas.h"
+#include "LatexCache.h"
+#include "debug.h"
+#include "parser/Text.h"
+namespace md::render {
+void DisplayList::addText(const TextCell* cell) {
+  ASSERT(cell != nullptr);
+  DisplayCommand command{DisplayCommandType::text};
+  command.style = cell->m_style;
+  command.cell = cell;
+  m_commands.push_back(command);
+}
+void DisplayList::addStaticText(String text, Rect rect, StyleId style) {
+  ASSERT(m_styles != nullptr);
+  DisplayCommand command{DisplayCommandType::staticText};
+  command.style = style;
+  command.rect = rect;
+  command.resource = m_strings.size();
+  m_strings.push_back(std::move(text));
+  m_commands.push_back(command);
+}
+void DisplayList::addFillRect(Rect rect, Color color) {
+  DisplayCommand command{DisplayCommandType::fillRect};
+  command.rect = rect;
+  command.color = color;
+  m_commands.push_back(command);
+}
+void DisplayList::addEllipse(Rect rect, Color color) {
+  DisplayCommand command{DisplayCommandType::ellipse};
+  command.rect = rect;
+  command.color = color;
+  m_commands.push_back(command);
+}
+void DisplayList::addImage(Rect rect, sptr<const editor::core::ImageData> image) {
+  DisplayCommand command{DisplayCommandType::image};
+  command.rect = rect;
+  command.color = Color::transparent();
+  command.resource = m_images.size();
+  m_images.push_back(std::move(image));
+  m_commands.push_back(command);
+}
+uint32_t DisplayList::addImagePlaceholder(Rect rect, Color color) {
+  DisplayCommand command{DisplayCommandType::image};
+  command.rect = rect;
+  command.color = color;
+  command.resource = m_images.size();
+  m_images.push_back(nullptr);
+  m_commands.push_back(command);
+  return command.resource;
+}
+void DisplayList::setImage(uint32_t index, sptr<const editor::core::ImageData> image) {
+  ASSERT(index < m_images.size());
+  m_images[index] = std::move(image);
+}
+void DisplayList::addIcon(Rect rect, uint32_t slot) {
+  ASSERT(m_icons != nullptr);
+  DisplayCommand command{DisplayCommandType::icon};
+  command.rect = rect;
+  command.resource = slot;
+  m_commands.push_back(command);
+}
+void DisplayList::addLatex(const InlineLatexCell* cell, sptr<LatexBox> box) {
+  ASSERT(cell != nullptr);
+  ASSERT(box != nullptr);
+  DisplayCommand command{DisplayCommandType::latex};
+  command.cell = cell;
+  command.resource = m_latex.size();
+  m_latex.push_back(std::move(box));
+  m_commands.push_back(command);
+}
+Rect DisplayList::bounds() const {
+  Rect rect;
+  for (const auto& command : m_commands) {
+    rect = rect.united(command.cell ? Rect(command.cell->m_pos, command.cell->m_size) : command.rect);
+  }
+  return rect;
+}
+void DisplayList::clear() {
+  m_commands.clear();
+  m_strings.clear();
+  m_images.clear();
+  m_latex.clear();
+}
+void DisplayList::splice(SizeType first, SizeType last, SizeType from) {
+  ASSERT(0 <= first && first <= last && last <= from && from <= size());
+  auto begin = m_commands.begin();
+  std::rotate(begin + last, begin + from, m_commands.end());
+  m_commands.erase(begin + first, begin + last);
+}
+void DisplayList::translate(SizeType first, SizeType last, int dy) {
+  ASSERT(0 <= first && first <= last && last <= size());
+  for (auto i = first; i < last; ++i) {
+    auto& command = m_commands[i];
+    if (!command.cell) command.rect.pos.y += dy;
+  }
+}
+void DisplayList::run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const {
+  if (m_commands.empty()) return;
+  painter.save();
+  // 记录当前已经设置到painter上的状态
+  constexpr StyleId kNoStyle = static_cast<StyleId>(-1);
+  StyleId curStyle = kNoStyle;
+  const Font* curFont = nullptr;
+  Color curPen;
+  bool hasPen = false;
+  auto applyStyle = [&](StyleId id, const Style& style) {
+    if (id == curStyle) return;
+    if (!curFont || !(*curFont == style.font)) {
+      painter.setFont(style.font);
+      curFont = &style.font;
+    }
+    if (!hasPen || curPen != style.pen) {
+      painter.setPen(style.pen);
+      curPen = style.pen;
+      hasPen = true;
+    }
+    curStyle = id;
+  };
+  for (const auto& command : m_commands) {
+    switch (command.type) {
+      case DisplayCommandType::text: {
+        auto* cell = static_cast<const TextCell*>(command.cell);
+        applyStyle(command.style, cell->m_styles->style(command.style));
+        auto s = cell->m_text->toString(doc).mid(cell->m_offset, cell->m_length);
+        auto pt = cell->m_pos + offset;
+        pt.y += cell->ascent();
+        painter.drawText(pt, s);
+        break;
+      }
+      case DisplayCommandType::staticText: {
+        applyStyle(command.style, m_styles->style(command.style));
+        painter.drawText(Rect(command.rect.pos + offset, command.rect.size), 0, m_strings[command.resource]);
+        break;
+      }
+      case DisplayCommandType::fillRect: {
+        painter.fillRect(Rect(command.rect.pos + offset, command.rect.size), command.color);
+        break;
+      }
+      case DisplayCommandType::ellipse: {
+        if (!hasPen || curPen != command.color) {
+          painter.setPen(command.color);
+          curPen = command.color;
+          hasPen = true;
+          curStyle = kNoStyle;
+        }
+        painter.drawEllipse(Rect(command.rect.pos + offset, command.rect.size), command.color);
+        break;
+      }
+      case DisplayCommandType::image: {
+        const auto& image = m_images[command.resource];
+        Rect rect(command.rect.pos + offset, command.rect.size);
+        if (image) {
+          painter.drawImage(rect, *image);
+        } else if (command.color.a > 0) {
+          painter.fillRect(rect, command.color);
+        }
+        break;
+      }
+      case DisplayCommandType::icon: {
+        if (auto* image = m_icons->imageAt(command.resource)) {
+          painter.drawImage(Rect(command.rect.pos + offset, command.rect.size), *image);
+        }
+        break;
+      }
+      case DisplayCommandType::latex: {
+        Rect rect(command.cell->m_pos + offset, command.cell->m_size);
+        auto* render = m_latex[command.resource]->render();
+        if (!render) {
+          // 后台还没解析完
+          auto& box = *m_latex[command.resource];
+          painter.fillRect(Rect(rect.pos, Size(box.width(), box.height())), LatexBox::placeholderColor);
+          break;
+        }
+        // LaTeX引擎会改painter状态，单独save/restore
+        painter.save();
+        painter.drawLatex(rect, *render);
+        painter.restore();
+        break;
+      }
+    }
+  }
+  painter.restore();
+}
+}  // namespace md::render
@@ -0,0 +1,86 @@
+#ifndef QTMARKDOWN_DISPLAYLIST_H
+#define QTMARKDOWN_DISPLAYLIST_H
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "QtMarkdown_global.h"
+#include "mddef.h"
+#include "parser/IBufferProvider.h"
+#include "Cell.h"
+#include "StyleTable.h"
+#include "core/AbstractPainter.h"
+namespace md::render {
+class IconAtlas;
+class LatexBox;
+// 绘图指令类型
+enum class DisplayCommandType : uint8_t { text, staticText, fillRect, ellipse, image, icon, latex };
+// 一条绘图指令，POD，连续存放在DisplayList里
+// 字符串和图片放在DisplayList的资源表里，这里只记下标
+struct DisplayCommand {
+  DisplayCommandType type;
+  // text/staticText
+  StyleId style = StyleTable::defaultStyle;
+  Rect rect{};
+  // fillRect/ellipse，image: 还没有图片时的占位色
+  Color color{};
+  // text/latex 对应的cell
+  const Cell* cell = nullptr;
+  // staticText: 字符串下标，image: 图片下标，icon: IconAtlas槽位，latex: 公式下标
+  uint32_t resource = 0;
+};
+static_assert(std::is_trivially_copyable_v<DisplayCommand>);
+
+// 一个块的显示列表，绘制时线性扫描一遍
+class QTMARKDOWNRENDER_EXPORT DisplayList {
+ public:
+  DisplayList() = default;
+  explicit DisplayList(const StyleTable* styles, const IconAtlas* icons = nullptr)
+      : m_styles(styles), m_icons(icons) {}
+  DisplayList(const DisplayList&) = delete;
+  DisplayList& operator=(const DisplayList&) = delete;
+  DisplayList(DisplayList&&) noexcept = default;
+  DisplayList& operator=(DisplayList&&) noexcept = default;
+
+  void addText(const TextCell* cell);
+  void addStaticText(String text, Rect rect, StyleId style);
+  void addFillRect(Rect rect, Color color);
+  void addEllipse(Rect rect, Color color);
+  // 像素来自ImageCache，多条指令共享一份，为空时不画
+  void addImage(Rect rect, sptr<const editor::core::ImageData> image);
+  // 图片还在后台解码，先画占位色块，解码好后用setImage填上。返回图片下标
+  uint32_t addImagePlaceholder(Rect rect, Color color);
+  void setImage(uint32_t index, sptr<const editor::core::ImageData> image);
+  // 图标按IconAtlas的槽位引用，绘制时再取像素
+  void addIcon(Rect rect, uint32_t slot);
+  // box来自LatexCache，绘制时直接使用，不再解析公式
+  void addLatex(const InlineLatexCell* cell, sptr<LatexBox> box);
+  void clear();
+  // 把[from, size())的指令挪到[first, last)处，替换掉原来的指令。资源表不动，下标照旧有效
+  void splice(SizeType first, SizeType last, SizeType from);
+  // [first, last)里不引用cell的指令下移dy，引用cell的跟着cell的位置走
+  void translate(SizeType first, SizeType last, int dy);
+
+  // 执行所有指令，相邻指令相同的字体/画笔不重复设置
+  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const;
+
+  // 所有指令画到的范围，可能超出块的大小
+  [[nodiscard]] Rect bounds() const;
+  [[nodiscard]] bool empty() const { return m_commands.empty(); }
+  [[nodiscard]] SizeType size() const { return m_commands.size(); }
+  [[nodiscard]] const DisplayCommand& commandAt(SizeType index) const { return m_commands[index]; }
+  [[nodiscard]] auto begin() const { return m_commands.begin(); }
+  [[nodiscard]] auto end() const { return m_commands.end(); }
+  [[nodiscard]] const String& stringAt(uint32_t index) const { return m_strings[index]; }
+  [[nodiscard]] const sptr<const editor::core::ImageData>& imageAt(uint32_t index) const { return m_images[index]; }
+  [[nodiscard]] const sptr<LatexBox>& latexAt(uint32_t index) const { return m_latex[index]; }
+
+ private:
+  std::vector<DisplayCommand> m_commands;
+  std::vector<String> m_strings;
+  std::vector<sptr<const editor::core::ImageData>> m_images;
+  std::vector<sptr<LatexBox>> m_latex;
+  const StyleTable* m_styles = nullptr;
+  const IconAtlas* m_icons = nullptr;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_DISPLAYLIST_H
@@ -12,6 +12,8 @@ public:
     virtual ~IFontMetricsProvider() = default;
     virtual Size size(const Font& font, const String& text) const = 0;
     virtual int horizontalAdvance(const Font& font, const String& text) const = 0;
+    // 不取整的宽度，逐字累加时用，避免舍入误差越积越多
+    virtual double horizontalAdvanceF(const Font& font, const String& text) const { return horizontalAdvance(font, text); }
     virtual int height(const Font& font) const = 0;
     virtual int ascent(const Font& font) const = 0;
     virtual int lineSpacing(const Font& font) const { return height(font); }
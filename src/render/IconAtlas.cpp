@@ -0,0 +1,50 @@
+#include "IconAtlas.h"
+
+#include "ImageCache.h"
+#include "debug.h"
+namespace md::render {
+IconAtlas::IconAtlas(editor::core::IImageProvider* provider) : m_provider(provider) {}
+const editor::core::ImageData& IconAtlas::source(IconId id) const {
+  auto i = index(id);
+  if (!m_loaded[i]) {
+    m_loaded[i] = true;
+    if (m_provider) m_sources[i] = m_provider->load(pathOf(id));
+  }
+  return m_sources[i];
+}
+const char* IconAtlas::pathOf(IconId id) {
+  switch (id) {
+    case IconId::checkboxSelected:
+      return ":icon/checkbox-selected_64x64.png";
+    case IconId::checkboxUnselected:
+      return ":icon/checkbox-unselected_64x64.png";
+    case IconId::copy:
+      return ":icon/copy_32x32.png";
+    case IconId::play:
+      return ":/icon/play_64x64.png";
+    case IconId::count:
+      break;
+  }
+  ASSERT(false && "invalid icon id");
+  return "";
+}
+Size IconAtlas::nativeSize(IconId id) const {
+  const auto& image = source(id);
+  return {image.width, image.height};
+}
+uint32_t IconAtlas::slot(IconId id, Size size) {
+  if (!has(id)) return noIcon;
+  for (uint32_t i = 0; i < m_slots.size(); ++i) {
+    if (m_slots[i].id == id && m_slots[i].size == size) return i;
+  }
+  auto image = size == nativeSize(id) ? source(id) : ImageCache::scaled(source(id), size);
+  // 像素不会再变，绘制端可以缓存转换好的平台图片
+  image.cacheKey = ImageCache::newCacheKey();
+  m_slots.push_back({id, size, std::move(image)});
+  return m_slots.size() - 1;
+}
+const editor::core::ImageData* IconAtlas::imageAt(uint32_t slot) const {
+  if (slot >= m_slots.size()) return nullptr;
+  return &m_slots[slot].image;
+}
+}  // namespace md::render
@@ -0,0 +1,47 @@
+#ifndef QTMARKDOWN_ICONATLAS_H
+#define QTMARKDOWN_ICONATLAS_H
+#include "QtMarkdown_global.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "mddef.h"
+#include "core/IImageProvider.h"
+namespace md::render {
+enum class IconId : uint8_t { checkboxSelected, checkboxUnselected, copy, play, count };
+// 界面图标(复选框、复制按钮、gif播放)，每个图标第一次用到时解码一次，
+// 再按实际绘制大小各缩放一次，DisplayList里按槽位号引用，之后排版和绘制都不再碰文件。
+// 只在GUI线程使用。
+class QTMARKDOWNRENDER_EXPORT IconAtlas {
+ public:
+  static constexpr uint32_t noIcon = UINT32_MAX;
+  explicit IconAtlas(editor::core::IImageProvider* provider);
+  IconAtlas(const IconAtlas&) = delete;
+  IconAtlas& operator=(const IconAtlas&) = delete;
+  static const char* pathOf(IconId id);
+  [[nodiscard]] bool has(IconId id) const { return !source(id).isNull(); }
+  [[nodiscard]] Size nativeSize(IconId id) const;
+  // 按绘制大小取槽位，某个大小第一次用到时缩放。图标不存在时返回noIcon
+  uint32_t slot(IconId id, Size size);
+  uint32_t slot(IconId id) { return slot(id, nativeSize(id)); }
+  // 槽位不存在时返回nullptr
+  [[nodiscard]] const editor::core::ImageData* imageAt(uint32_t slot) const;
+  [[nodiscard]] SizeType countOfSlot() const { return m_slots.size(); }
+
+ private:
+  static constexpr std::size_t index(IconId id) { return static_cast<std::size_t>(id); }
+  const editor::core::ImageData& source(IconId id) const;
+  struct Slot {
+    IconId id;
+    Size size;
+    editor::core::ImageData image;
+  };
+  editor::core::IImageProvider* m_provider;
+  // 按需加载，加载失败也记下来不再重试
+  mutable std::array<editor::core::ImageData, static_cast<std::size_t>(IconId::count)> m_sources;
+  mutable std::array<bool, static_cast<std::size_t>(IconId::count)> m_loaded{};
+  // 槽位只增不删，下标一直有效。图标种类和大小都很少，线性查找就够了
+  std::vector<Slot> m_slots;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_ICONATLAS_H
@@ -0,0 +1,307 @@
+#include "ImageCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <utility>
+
+#include "debug.h"
+namespace md::render {
+using editor::core::ImageData;
+std::size_t ImageKeyHash::operator()(const ImageKey& key) const {
+  std::size_t h = std::hash<std::string_view>()(std::string_view(key.path.data(), key.path.size()));
+  auto mix = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+  mix(std::hash<int64_t>()(key.mtime));
+  mix(key.width);
+  mix(key.height);
+  return h;
+}
+// 不放大
+static Size clampSize(Size size, Size source) {
+  return {std::clamp(size.width, 1, source.width), std::clamp(size.height, 1, source.height)};
+}
+ImageCache::ImageCache(std::size_t maxBytes, int threads, DecodeCallback decodeCallback)
+    : m_maxBytes(maxBytes), m_decodeCallback(std::move(decodeCallback)) {
+  for (int i = 0; i < threads; ++i) {
+    m_workers.emplace_back([this]() { work(); });
+  }
+}
+ImageCache::~ImageCache() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_queueChanged.notify_all();
+  for (auto& worker : m_workers) {
+    worker.join();
+  }
+}
+ImageCache::Image ImageCache::get(editor::core::IImageProvider* provider, const String& path) {
+  return get(provider, path, [](Size size) { return size; });
+}
+ImageCache::Image ImageCache::get(editor::core::IImageProvider* provider, const String& path,
+                                  const SizeFunc& displaySize) {
+  if (!provider) return nullptr;
+  auto mtime = provider->lastModified(path);
+  {
+    std::lock_guard lock(m_mutex);
+    if (auto image = findLocked(path, mtime, displaySize)) return *image;
+  }
+  // 解码和缩放都可能很慢，不持锁
+  auto image = provider->load(path);
+  if (image.isNull()) return nullptr;
+  Size source(image.width, image.height);
+  auto size = clampSize(displaySize(source), source);
+  if (size != source) {
+    image = scaled(image, size);
+  }
+  std::lock_guard lock(m_mutex);
+  return insertLocked(path, mtime, source, std::move(image), false);
+}
+std::optional<ImageCache::Image> ImageCache::tryGet(editor::core::IImageProvider* provider, const String& path,
+                                                    const SizeFunc& displaySize, ImageKey* pending) {
+  if (!async()) return get(provider, path, displaySize);
+  if (!provider) return nullptr;
+  auto mtime = provider->lastModified(path);
+  Size source;
+  {
+    std::lock_guard lock(m_mutex);
+    if (auto image = findLocked(path, mtime, displaySize)) return image;
+    if (auto src = m_sources.find(path.toStdString()); src != m_sources.end()) source = src->second.size;
+  }
+  if (pending) {
+    *pending = {path, mtime, 0, 0};
+    if (source == Size()) {
+      source = provider->imageSize(path);
+      if (source.width > 0 && source.height > 0) {
+        std::lock_guard lock(m_mutex);
+        m_sources.try_emplace(path.toStdString(), Source{mtime, source, false});
+      }
+    }
+    if (source.width > 0 && source.height > 0) {
+      auto size = clampSize(displaySize(source), source);
+      pending->width = size.width;
+      pending->height = size.height;
+    }
+  }
+  enqueue({provider, path, mtime, displaySize});
+  return std::nullopt;
+}
+std::optional<ImageCache::Image> ImageCache::findLocked(const String& path, int64_t mtime,
+                                                        const SizeFunc& displaySize) {
+  auto src = m_sources.find(path.toStdString());
+  if (src != m_sources.end() && src->second.mtime != mtime) {
+    invalidate(path);
+    src = m_sources.end();
+  }
+  if (src == m_sources.end() || !src->second.decoded) {
+    m_misses++;
+    return std::nullopt;
+  }
+  if (src->second.failed) {
+    m_hits++;
+    return nullptr;
+  }
+  auto size = clampSize(displaySize(src->second.size), src->second.size);
+  auto it = m_index.find(ImageKey{path, mtime, size.width, size.height});
+  if (it == m_index.end()) {
+    m_misses++;
+    return std::nullopt;
+  }
+  m_hits++;
+  it->second->fresh = false;
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  return it->second->image;
+}
+ImageCache::Image ImageCache::insertLocked(const String& path, int64_t mtime, Size source,
+                                           editor::core::ImageData image, bool fresh) {
+  auto src = m_sources.find(path.toStdString());
+  if (src != m_sources.end() && src->second.mtime != mtime) invalidate(path);
+  m_sources[path.toStdString()] = {mtime, source, true};
+  ImageKey key{path, mtime, image.width, image.height};
+  // 别的线程可能已经解码过同样大小的
+  if (auto it = m_index.find(key); it != m_index.end()) {
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return it->second->image;
+  }
+  // 进了缓存像素就不会再变，绘制端可以按cacheKey缓存转换好的平台图片
+  image.cacheKey = newCacheKey();
+  auto ret = std::make_shared<const ImageData>(std::move(image));
+  m_totalBytes += ret->byteCount();
+  m_entries.push_front({key, ret, fresh});
+  m_index.emplace(std::move(key), m_entries.begin());
+  evict();
+  return ret;
+}
+std::optional<ImageCache::Image> ImageCache::find(const ImageKey& key) {
+  std::lock_guard lock(m_mutex);
+  auto src = m_sources.find(key.path.toStdString());
+  if (src == m_sources.end() || src->second.mtime != key.mtime || !src->second.decoded) return std::nullopt;
+  if (src->second.failed) return nullptr;
+  auto it = m_index.find(key);
+  // 解码完了却没有这个大小的结果(比如排版宽度变了)，当作失败，让调用方重新排版
+  if (it == m_index.end()) return nullptr;
+  it->second->fresh = false;
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  return it->second->image;
+}
+bool ImageCache::hasSourceSize(const String& path, int64_t mtime) const {
+  std::lock_guard lock(m_mutex);
+  auto src = m_sources.find(path.toStdString());
+  return src != m_sources.end() && src->second.mtime == mtime && src->second.decoded;
+}
+void ImageCache::enqueue(Job job) {
+  {
+    std::lock_guard lock(m_mutex);
+    if (!m_queued.insert(job.path.toStdString()).second) return;
+    m_queue.push_back(std::move(job));
+  }
+  m_queueChanged.notify_one();
+}
+void ImageCache::prioritize(const String& path) {
+  std::lock_guard lock(m_mutex);
+  auto it = std::find_if(m_queue.begin(), m_queue.end(), [&path](const Job& job) { return job.path == path; });
+  if (it == m_queue.end() || it == m_queue.begin()) return;
+  auto job = std::move(*it);
+  m_queue.erase(it);
+  m_queue.push_front(std::move(job));
+}
+bool ImageCache::takeDecodeResults() {
+  std::lock_guard lock(m_mutex);
+  return std::exchange(m_hasDecodeResults, false);
+}
+void ImageCache::work() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock lock(m_mutex);
+      m_queueChanged.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+      if (m_stop) return;
+      job = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    auto image = job.provider->load(job.path);
+    Size source(image.width, image.height);
+    if (!image.isNull()) {
+      auto size = clampSize(job.displaySize(source), source);
+      if (size != source) {
+        image = scaled(image, size);
+      }
+    }
+    bool notify = false;
+    {
+      std::lock_guard lock(m_mutex);
+      m_queued.erase(job.path.toStdString());
+      if (image.isNull()) {
+        // 失败也记下来，否则重新排版时又会排队，一直循环
+        invalidate(job.path);
+        m_sources[job.path.toStdString()] = {job.mtime, Size(), true, true};
+      } else {
+        insertLocked(job.path, job.mtime, source, std::move(image), true);
+      }
+      // 上一次通知还没被处理时不重复通知
+      notify = !std::exchange(m_hasDecodeResults, true);
+    }
+    if (notify && m_decodeCallback) m_decodeCallback();
+  }
+}
+uint64_t ImageCache::newCacheKey() {
+  static std::atomic<uint64_t> next{1};
+  return next++;
+}
+ImageData ImageCache::scaled(const ImageData& image, Size size) {
+  ASSERT(!image.isNull());
+  size = clampSize(size, Size(image.width, image.height));
+  int w = size.width;
+  int h = size.height;
+  if (w == image.width && h == image.height) return image;
+  ImageData ret;
+  ret.width = w;
+  ret.height = h;
+  ret.pixels.resize(static_cast<std::size_t>(w) * h * 4);
+  // 每个目标像素取原图对应矩形内所有像素的平均值
+  for (int y = 0; y < h; ++y) {
+    int y0 = int(int64_t(y) * image.height / h);
+    int y1 = std::max(y0 + 1, int(int64_t(y + 1) * image.height / h));
+    for (int x = 0; x < w; ++x) {
+      int x0 = int(int64_t(x) * image.width / w);
+      int x1 = std::max(x0 + 1, int(int64_t(x + 1) * image.width / w));
+      uint32_t sum[4] = {0, 0, 0, 0};
+      for (int sy = y0; sy < y1; ++sy) {
+        const unsigned char* p = image.bits() + (static_cast<std::size_t>(sy) * image.width + x0) * 4;
+        for (int sx = x0; sx < x1; ++sx, p += 4) {
+          sum[0] += p[0];
+          sum[1] += p[1];
+          sum[2] += p[2];
+          sum[3] += p[3];
+        }
+      }
+      uint32_t count = (y1 - y0) * (x1 - x0);
+      unsigned char* q = ret.pixels.data() + (static_cast<std::size_t>(y) * w + x) * 4;
+      for (int i = 0; i < 4; ++i) {
+        q[i] = static_cast<unsigned char>((sum[i] + count / 2) / count);
+      }
+    }
+  }
+  return ret;
+}
+void ImageCache::invalidate(const String& path) {
+  m_sources.erase(path.toStdString());
+  for (auto it = m_entries.begin(); it != m_entries.end();) {
+    if (it->key.path == path) {
+      m_totalBytes -= it->image->byteCount();
+      m_index.erase(it->key);
+      it = m_entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+void ImageCache::evict() {
+  // 从最久没用的开始，跳过还被块引用的和刚解码好的
+  auto it = m_entries.end();
+  while (m_totalBytes > m_maxBytes && it != m_entries.begin()) {
+    --it;
+    if (it->fresh || it->image.use_count() > 1) continue;
+    m_totalBytes -= it->image->byteCount();
+    m_index.erase(it->key);
+    it = m_entries.erase(it);
+  }
+}
+void ImageCache::setMaxBytes(std::size_t maxBytes) {
+  std::lock_guard lock(m_mutex);
+  m_maxBytes = maxBytes;
+  evict();
+}
+std::size_t ImageCache::maxBytes() const {
+  std::lock_guard lock(m_mutex);
+  return m_maxBytes;
+}
+std::size_t ImageCache::totalBytes() const {
+  std::lock_guard lock(m_mutex);
+  return m_totalBytes;
+}
+void ImageCache::clear() {
+  std::lock_guard lock(m_mutex);
+  m_index.clear();
+  m_entries.clear();
+  m_sources.clear();
+  m_totalBytes = 0;
+}
+SizeType ImageCache::size() const {
+  std::lock_guard lock(m_mutex);
+  return m_entries.size();
+}
+SizeType ImageCache::hits() const {
+  std::lock_guard lock(m_mutex);
+  return m_hits;
+}
+SizeType ImageCache::misses() const {
+  std::lock_guard lock(m_mutex);
+  return m_misses;
+}
+SizeType ImageCache::countOfQueued() const {
+  std::lock_guard lock(m_mutex);
+  return m_queued.size();
+}
+}  // namespace md::render
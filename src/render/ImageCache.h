@@ -0,0 +1,130 @@
+#ifndef QTMARKDOWN_IMAGECACHE_H
+#define QTMARKDOWN_IMAGECACHE_H
+#include "QtMarkdown_global.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "mddef.h"
+#include "core/IImageProvider.h"
+namespace md::render {
+struct ImageKey {
+  String path;
+  int64_t mtime;
+  // 缓存的是显示大小的图片
+  int width;
+  int height;
+  bool operator==(const ImageKey& other) const = default;
+};
+struct ImageKeyHash {
+  std::size_t operator()(const ImageKey& key) const;
+};
+// 文档级的解码图片缓存，按(路径, 修改时间, 显示大小)查找。
+// 解码后直接缩到显示大小再缓存，原图不保留；同一张图的所有绘图指令共享一份像素。
+// 按像素字节数做LRU淘汰，还被DisplayList引用的不淘汰(淘汰了也省不下内存)。
+// 文件修改时间变了，这个路径下的所有缓存都作废。
+// threads > 0 时未命中的图片交给后台线程解码，同一路径只排队一次，
+// 排版先用文件头里的大小(读不到就用默认大小)占位，有新结果时在工作线程调用decodeCallback。
+class QTMARKDOWNRENDER_EXPORT ImageCache {
+ public:
+  using Image = sptr<const editor::core::ImageData>;
+  // 根据原图大小算显示大小
+  using SizeFunc = std::function<Size(Size)>;
+  using DecodeCallback = std::function<void()>;
+  static constexpr Color placeholderColor{238, 238, 238};
+  // 文件头也读不出大小时的占位大小
+  static constexpr Size placeholderSize{320, 180};
+  explicit ImageCache(std::size_t maxBytes = 64 * 1024 * 1024, int threads = 0,
+                      DecodeCallback decodeCallback = nullptr);
+  ~ImageCache();
+  ImageCache(const ImageCache&) = delete;
+  ImageCache& operator=(const ImageCache&) = delete;
+  // 同步加载。加载失败返回nullptr，同步模式下失败不缓存，文件可能之后才出现
+  Image get(editor::core::IImageProvider* provider, const String& path, const SizeFunc& displaySize);
+  // 按原图大小
+  Image get(editor::core::IImageProvider* provider, const String& path);
+  // 异步模式下未命中时排队解码并返回std::nullopt，pending填上要等的key：
+  // 能从文件头读出原图大小时宽高是显示大小，否则是0。同步模式等同于get
+  std::optional<Image> tryGet(editor::core::IImageProvider* provider, const String& path,
+                              const SizeFunc& displaySize, ImageKey* pending = nullptr);
+  // 后台解码的结果。还没解码完返回std::nullopt，解码失败返回nullptr
+  std::optional<Image> find(const ImageKey& key);
+  // 原图大小已经知道了(解码完成或失败)，大小未知的占位可以重新排版了
+  [[nodiscard]] bool hasSourceSize(const String& path, int64_t mtime) const;
+  // 排队中的图片挪到队首，先解码视口附近的
+  void prioritize(const String& path);
+  [[nodiscard]] bool async() const { return !m_workers.empty(); }
+  // 自上次调用以来是否有新的解码结果
+  bool takeDecodeResults();
+  // 面积平均缩放，只缩小
+  static editor::core::ImageData scaled(const editor::core::ImageData& image, Size size);
+  // 给像素不会再变的图片分配ImageData::cacheKey
+  static uint64_t newCacheKey();
+  void setMaxBytes(std::size_t maxBytes);
+  [[nodiscard]] std::size_t maxBytes() const;
+  [[nodiscard]] std::size_t totalBytes() const;
+  void clear();
+  [[nodiscard]] SizeType size() const;
+  [[nodiscard]] SizeType hits() const;
+  [[nodiscard]] SizeType misses() const;
+  // 排队中和正在解码的图片数
+  [[nodiscard]] SizeType countOfQueued() const;
+
+ private:
+  struct Entry {
+    ImageKey key;
+    Image image;
+    // 后台解码好但还没人取走，不能淘汰
+    bool fresh = false;
+  };
+  // 原图信息，不解码就能算出显示大小。decoded为false时大小来自文件头
+  struct Source {
+    int64_t mtime;
+    Size size;
+    bool decoded;
+    // 解码失败
+    bool failed = false;
+  };
+  struct Job {
+    editor::core::IImageProvider* provider;
+    String path;
+    int64_t mtime;
+    SizeFunc displaySize;
+  };
+  void enqueue(Job job);
+  void work();
+  // 以下都要持锁调用
+  std::optional<Image> findLocked(const String& path, int64_t mtime, const SizeFunc& displaySize);
+  Image insertLocked(const String& path, int64_t mtime, Size source, editor::core::ImageData image, bool fresh);
+  void invalidate(const String& path);
+  void evict();
+
+  mutable std::mutex m_mutex;
+  // 最近用过的在前面
+  std::list<Entry> m_entries;
+  std::unordered_map<ImageKey, std::list<Entry>::iterator, ImageKeyHash> m_index;
+  std::unordered_map<std::string, Source> m_sources;
+  std::size_t m_maxBytes;
+  std::size_t m_totalBytes = 0;
+  SizeType m_hits = 0;
+  SizeType m_misses = 0;
+
+  std::deque<Job> m_queue;
+  std::unordered_set<std::string> m_queued;
+  std::condition_variable m_queueChanged;
+  std::vector<std::thread> m_workers;
+  DecodeCallback m_decodeCallback;
+  bool m_hasDecodeResults = false;
+  bool m_stop = false;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_IMAGECACHE_H
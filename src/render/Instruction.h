@@ -1,105 +0,0 @@
-//
-// Created by PikachuHy on 2021/11/5.
-//
-
-#ifndef QTMARKDOWN_INSTRUCTION_H
-#define QTMARKDOWN_INSTRUCTION_H
-#include <memory>
-#include <utility>
-#include <vector>
-#include "QtMarkdown_global.h"
-#include "mddef.h"
-#include "parser/IBufferProvider.h"
-#include "Cell.h"
-#include "core/AbstractPainter.h"
-namespace md::parser {
-class Text;
-}
-namespace md::render {
-class RenderPrivate;
-// 基本绘图指令
-class QTMARKDOWNRENDER_EXPORT Instruction {
- public:
-  virtual ~Instruction() = default;
-  virtual void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const = 0;
-};
-class QTMARKDOWNRENDER_EXPORT TextInstruction : public Instruction {
- public:
-  TextInstruction(const TextCell* cell) : m_cell(cell) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-  String textString(const parser::IBufferProvider& doc) const;
-
- private:
-  const TextCell* m_cell;
-};
-
-class QTMARKDOWNRENDER_EXPORT StaticTextInstruction : public Instruction {
- public:
-  StaticTextInstruction(String text, Point pos, Size size, Color color, Font font)
-      : m_text(std::move(text)), m_pos(pos), m_size(size), m_fg(color), m_font(std::move(font)) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  String m_text;
-  Point m_pos;
-  Size m_size;
-  Color m_fg;
-  Font m_font;
-};
-class QTMARKDOWNRENDER_EXPORT ImageInstruction : public Instruction {
- public:
-  ImageInstruction(String path, Point pos, Size size, editor::core::ImageData image)
-      : m_path(std::move(path)), m_pos(pos), m_size(size), m_image(std::move(image)) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  String m_path;
-  Point m_pos;
-  Size m_size;
-  editor::core::ImageData m_image;
-};
-class QTMARKDOWNRENDER_EXPORT StaticImageInstruction : public Instruction {
- public:
-  StaticImageInstruction(String path, Point pos, Size size, editor::core::ImageData image)
-      : m_path(std::move(path)), m_pos(pos), m_size(size), m_image(std::move(image)) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  String m_path;
-  Point m_pos;
-  Size m_size;
-  editor::core::ImageData m_image;
-};
-class QTMARKDOWNRENDER_EXPORT FillRectInstruction : public Instruction {
- public:
-  explicit FillRectInstruction(Point point, Size size, Color color) : m_point(point), m_size(size), m_color(color) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  Point m_point;
-  Size m_size;
-  Color m_color;
-};
-class QTMARKDOWNRENDER_EXPORT EllipseInstruction : public Instruction {
- public:
-  explicit EllipseInstruction(Point point, Size size, Color color) : m_point(point), m_size(size), m_color(color) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  Point m_point;
-  Size m_size;
-  Color m_color;
-};
-class QTMARKDOWNRENDER_EXPORT LatexInstruction : public Instruction {
- public:
-  LatexInstruction(const InlineLatexCell* cell, String latex, int fontSize)
-      : m_cell(cell), m_latex(std::move(latex)), m_fontSize(fontSize) {}
-  void run(Painter& painter, Point offset, const parser::IBufferProvider& doc) const override;
-
- private:
-  const InlineLatexCell* m_cell;
-  String m_latex;
-  int m_fontSize;
-};
-}  // namespace md::render
-#endif  // QTMARKDOWN_INSTRUCTION_H
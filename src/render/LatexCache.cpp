@@ -0,0 +1,199 @@
+#include "LatexCache.h"
+
+#include <string_view>
+#include <utility>
+
+#include "debug.h"
+#include "microtex.h"
+namespace md::render {
+std::size_t LatexKeyHash::operator()(const LatexKey& key) const {
+  std::size_t h = std::hash<std::string_view>()(std::string_view(key.latex.data(), key.latex.size()));
+  auto mix = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+  mix(std::hash<float>()(key.fontSize));
+  mix(key.maxWidth);
+  mix(key.color);
+  return h;
+}
+LatexBox::LatexBox(sptr<microtex::Render> render) : m_render(std::move(render)) {
+  ASSERT(m_render != nullptr);
+  m_metrics = {m_render->getWidth(), m_render->getHeight()};
+}
+LatexBox::LatexBox(LatexMetrics metrics, std::optional<LatexKey> lazyKey)
+    : m_metrics(metrics), m_lazyKey(std::move(lazyKey)) {}
+microtex::Render* LatexBox::render() const {
+  if (!m_render && m_lazyKey) {
+    m_render = LatexCache::parse(*m_lazyKey);
+    m_lazyKey.reset();
+  }
+  return m_render.get();
+}
+LatexCache::LatexCache(SizeType capacity, int threads, TypesetCallback typesetCallback,
+                       sptr<LatexDiskCache> diskCache)
+    : m_capacity(capacity), m_diskCache(std::move(diskCache)), m_typesetCallback(std::move(typesetCallback)) {
+  for (int i = 0; i < threads; ++i) {
+    m_workers.emplace_back([this]() { work(); });
+  }
+}
+LatexCache::~LatexCache() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_queueChanged.notify_all();
+  for (auto& worker : m_workers) {
+    worker.join();
+  }
+}
+sptr<microtex::Render> LatexCache::parse(const LatexKey& key) {
+  try {
+    return sptr<microtex::Render>(microtex::MicroTeX::parse(key.latex.toStdString(), key.maxWidth, key.fontSize,
+                                                            key.fontSize / 3.f, key.color));
+  } catch (const std::exception& ex) {
+    DEBUG << "ERROR" << ex.what();
+    DEBUG << "Render LaTeX fail:" << key.latex;
+  }
+  return nullptr;
+}
+std::optional<sptr<LatexBox>> LatexCache::find(const LatexKey& key) {
+  auto it = m_index.find(key);
+  if (it == m_index.end()) {
+    m_misses++;
+    return std::nullopt;
+  }
+  m_hits++;
+  it->second->fresh = false;
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  return it->second->box;
+}
+void LatexCache::insert(LatexKey key, sptr<LatexBox> box, bool fresh) {
+  auto it = m_index.find(key);
+  if (it != m_index.end()) {
+    auto& entry = *it->second;
+    // 只有大小的结果被后台解析的结果替换
+    if (entry.box && !entry.box->drawable()) {
+      entry.box = std::move(box);
+      entry.fresh = fresh;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return;
+  }
+  m_entries.push_front({key, std::move(box), fresh});
+  m_index.emplace(std::move(key), m_entries.begin());
+  evict();
+}
+void LatexCache::evict() {
+  // 从最久没用的开始，跳过还被块引用的和刚排好的
+  auto it = m_entries.end();
+  while (static_cast<SizeType>(m_entries.size()) > m_capacity && it != m_entries.begin()) {
+    --it;
+    if (it->fresh || it->box.use_count() > 1) continue;
+    m_index.erase(it->key);
+    it = m_entries.erase(it);
+  }
+}
+void LatexCache::enqueue(const LatexKey& key) {
+  {
+    std::lock_guard lock(m_mutex);
+    if (!m_queued.insert(key).second) return;
+    m_queue.push_back(key);
+  }
+  m_queueChanged.notify_one();
+}
+sptr<LatexBox> LatexCache::loadFromDisk(const LatexKey& key) {
+  if (!m_diskCache) return nullptr;
+  auto metrics = m_diskCache->load(key);
+  if (!metrics) return nullptr;
+  if (!async()) return std::make_shared<LatexBox>(*metrics, key);
+  enqueue(key);
+  return std::make_shared<LatexBox>(*metrics, std::nullopt);
+}
+sptr<LatexBox> LatexCache::get(const LatexKey& key) {
+  {
+    std::lock_guard lock(m_mutex);
+    if (auto box = find(key)) return *box;
+  }
+  // 读盘和解析都可能很慢，不持锁
+  auto box = loadFromDisk(key);
+  if (!box) {
+    if (auto render = parse(key)) {
+      box = std::make_shared<LatexBox>(std::move(render));
+      if (m_diskCache) m_diskCache->store(key, box->metrics());
+    }
+  }
+  std::lock_guard lock(m_mutex);
+  insert(key, box, false);
+  return box;
+}
+std::optional<sptr<LatexBox>> LatexCache::tryGet(const LatexKey& key) {
+  if (!async()) return get(key);
+  {
+    std::lock_guard lock(m_mutex);
+    if (auto box = find(key)) return box;
+  }
+  if (auto box = loadFromDisk(key)) {
+    std::lock_guard lock(m_mutex);
+    insert(key, box, false);
+    return box;
+  }
+  enqueue(key);
+  return std::nullopt;
+}
+bool LatexCache::ready(const LatexKey& key) const {
+  std::lock_guard lock(m_mutex);
+  auto it = m_index.find(key);
+  if (it == m_index.end()) return false;
+  const auto& box = it->second->box;
+  return !box || box->drawable();
+}
+bool LatexCache::takeTypesetResults() {
+  std::lock_guard lock(m_mutex);
+  return std::exchange(m_hasTypesetResults, false);
+}
+void LatexCache::work() {
+  while (true) {
+    LatexKey key;
+    {
+      std::unique_lock lock(m_mutex);
+      m_queueChanged.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+      if (m_stop) return;
+      key = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    sptr<LatexBox> box;
+    if (auto render = parse(key)) {
+      box = std::make_shared<LatexBox>(std::move(render));
+      if (m_diskCache) m_diskCache->store(key, box->metrics());
+    }
+    bool notify = false;
+    {
+      std::lock_guard lock(m_mutex);
+      m_queued.erase(key);
+      insert(std::move(key), std::move(box), true);
+      // 上一次通知还没被处理时不重复通知
+      notify = !std::exchange(m_hasTypesetResults, true);
+    }
+    if (notify && m_typesetCallback) m_typesetCallback();
+  }
+}
+void LatexCache::clear() {
+  std::lock_guard lock(m_mutex);
+  m_index.clear();
+  m_entries.clear();
+}
+SizeType LatexCache::size() const {
+  std::lock_guard lock(m_mutex);
+  return m_entries.size();
+}
+SizeType LatexCache::hits() const {
+  std::lock_guard lock(m_mutex);
+  return m_hits;
+}
+SizeType LatexCache::misses() const {
+  std::lock_guard lock(m_mutex);
+  return m_misses;
+}
+SizeType LatexCache::countOfQueued() const {
+  std::lock_guard lock(m_mutex);
+  return m_queued.size();
+}
+}  // namespace md::render
@@ -0,0 +1,122 @@
+#ifndef QTMARKDOWN_LATEXCACHE_H
+#define QTMARKDOWN_LATEXCACHE_H
+#include "QtMarkdown_global.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "LatexDiskCache.h"
+#include "mddef.h"
+namespace microtex {
+class Render;
+}
+namespace md::render {
+struct LatexKey {
+  String latex;
+  float fontSize;
+  int maxWidth;
+  uint32_t color;
+  bool operator==(const LatexKey& other) const = default;
+};
+struct LatexKeyHash {
+  std::size_t operator()(const LatexKey& key) const;
+};
+// 一个公式的排版结果。大小来自磁盘缓存时还没有microtex::Render：
+// 同步模式下第一次绘制时再解析(lazy)，异步模式下由后台线程补上，之前画占位
+class QTMARKDOWNRENDER_EXPORT LatexBox {
+ public:
+  static constexpr Color placeholderColor{238, 238, 238};
+  explicit LatexBox(sptr<microtex::Render> render);
+  LatexBox(LatexMetrics metrics, std::optional<LatexKey> lazyKey);
+  [[nodiscard]] int width() const { return m_metrics.width; }
+  [[nodiscard]] int height() const { return m_metrics.height; }
+  [[nodiscard]] const LatexMetrics& metrics() const { return m_metrics; }
+  // 可以直接画，不用等后台结果
+  [[nodiscard]] bool drawable() const { return m_render || m_lazyKey; }
+  // 没有结果时返回nullptr，lazy的在这里解析
+  microtex::Render* render() const;
+
+ private:
+  LatexMetrics m_metrics;
+  mutable sptr<microtex::Render> m_render;
+  mutable std::optional<LatexKey> m_lazyKey;
+};
+// 文档级的LaTeX排版结果缓存，按(公式, 字号, 最大宽度, 颜色)查找。
+// 排版时解析一次，DisplayList持有同一个LatexBox，绘制时不再解析。
+// 淘汰只丢掉缓存里的引用，还在用的块不受影响。
+// threads > 0 时未命中的公式交给后台线程解析，相同公式只排队一次；
+// 有新结果时在工作线程调用typesetCallback，调用方自己切回GUI线程重新排版。
+// 有磁盘缓存时，内存未命中先查磁盘，命中就只用大小排版，解析推迟。
+// 磁盘上只有大小，真正画出来的公式每次打开文档还是要解析一次。
+class QTMARKDOWNRENDER_EXPORT LatexCache {
+ public:
+  static constexpr uint32_t defaultColor = 0xff424242;
+  using TypesetCallback = std::function<void()>;
+  explicit LatexCache(SizeType capacity = 1024, int threads = 0, TypesetCallback typesetCallback = nullptr,
+                      sptr<LatexDiskCache> diskCache = nullptr);
+  ~LatexCache();
+  LatexCache(const LatexCache&) = delete;
+  LatexCache& operator=(const LatexCache&) = delete;
+  static sptr<microtex::Render> parse(const LatexKey& key);
+  // 同步查找，未命中时当场解析。解析失败返回nullptr，失败的结果同样缓存，不会反复解析
+  sptr<LatexBox> get(const LatexKey& key);
+  sptr<LatexBox> get(const String& latex, float fontSize, int maxWidth, uint32_t color = defaultColor) {
+    return get(LatexKey{latex, fontSize, maxWidth, color});
+  }
+  // 异步模式下未命中时排队并返回std::nullopt，同步模式等同于get
+  std::optional<sptr<LatexBox>> tryGet(const LatexKey& key);
+  // 有结果且可以画了（包括解析失败）
+  [[nodiscard]] bool ready(const LatexKey& key) const;
+  [[nodiscard]] bool async() const { return !m_workers.empty(); }
+  // 自上次调用以来是否有新的排版结果
+  bool takeTypesetResults();
+  void clear();
+  [[nodiscard]] SizeType size() const;
+  [[nodiscard]] SizeType capacity() const { return m_capacity; }
+  [[nodiscard]] SizeType hits() const;
+  [[nodiscard]] SizeType misses() const;
+  // 排队中和正在解析的公式数
+  [[nodiscard]] SizeType countOfQueued() const;
+
+ private:
+  struct Entry {
+    LatexKey key;
+    sptr<LatexBox> box;
+    // 后台排好但还没人取走，不能淘汰，否则等着它的块会一直拿不到
+    bool fresh = false;
+  };
+  std::optional<sptr<LatexBox>> find(const LatexKey& key);
+  // 磁盘命中时返回只有大小的box，异步模式下顺便排队解析
+  sptr<LatexBox> loadFromDisk(const LatexKey& key);
+  void insert(LatexKey key, sptr<LatexBox> box, bool fresh);
+  void enqueue(const LatexKey& key);
+  void evict();
+  void work();
+
+  mutable std::mutex m_mutex;
+  // 最近用过的在前面
+  std::list<Entry> m_entries;
+  std::unordered_map<LatexKey, std::list<Entry>::iterator, LatexKeyHash> m_index;
+  SizeType m_capacity;
+  SizeType m_hits = 0;
+  SizeType m_misses = 0;
+
+  std::deque<LatexKey> m_queue;
+  std::unordered_set<LatexKey, LatexKeyHash> m_queued;
+  std::condition_variable m_queueChanged;
+  std::vector<std::thread> m_workers;
+  sptr<LatexDiskCache> m_diskCache;
+  TypesetCallback m_typesetCallback;
+  bool m_hasTypesetResults = false;
+  bool m_stop = false;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_LATEXCACHE_H
@@ -0,0 +1,146 @@
+#include "LatexDiskCache.h"
+
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include "LatexCache.h"
+#include "debug.h"
+#include "microtex.h"
+namespace fs = std::filesystem;
+namespace md::render {
+static constexpr std::string_view kMagic = "QtMarkdownLatex 1";
+LatexDiskCache::LatexDiskCache(fs::path dir, std::uintmax_t maxBytes)
+    : m_dir(std::move(dir)), m_maxBytes(maxBytes), m_version(microtex::MicroTeX::version()) {
+  std::error_code ec;
+  fs::create_directories(m_dir, ec);
+  if (ec) {
+    DEBUG << "create latex cache dir fail:" << m_dir.string() << ec.message();
+    return;
+  }
+  for (const auto& entry : fs::directory_iterator(m_dir, ec)) {
+    if (entry.is_regular_file(ec)) m_totalBytes += entry.file_size(ec);
+  }
+  if (m_totalBytes > m_maxBytes) pruneLocked();
+}
+fs::path LatexDiskCache::pathOf(const LatexKey& key) const {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  auto feed = [&h](const void* data, std::size_t size) {
+    auto* p = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  };
+  feed(m_version.data(), m_version.size() + 1);
+  feed(key.latex.data(), key.latex.size());
+  feed(&key.fontSize, sizeof(key.fontSize));
+  feed(&key.maxWidth, sizeof(key.maxWidth));
+  feed(&key.color, sizeof(key.color));
+  return m_dir / std::format("{:016x}.box", h);
+}
+std::optional<LatexMetrics> LatexDiskCache::load(const LatexKey& key) {
+  auto path = pathOf(key);
+  std::lock_guard lock(m_mutex);
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    m_misses++;
+    return std::nullopt;
+  }
+  std::string magic;
+  std::string version;
+  std::getline(in, magic);
+  std::getline(in, version);
+  uint32_t fontSize = 0;
+  int maxWidth = 0;
+  uint32_t color = 0;
+  LatexMetrics metrics;
+  in >> fontSize >> maxWidth >> color >> metrics.width >> metrics.height;
+  in.get();
+  if (!in) {
+    m_misses++;
+    return std::nullopt;
+  }
+  std::string latex((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (magic != kMagic || version != m_version || fontSize != std::bit_cast<uint32_t>(key.fontSize) ||
+      maxWidth != key.maxWidth || color != key.color || latex != key.latex.toStdString()) {
+    m_misses++;
+    return std::nullopt;
+  }
+  m_hits++;
+  // 修改时间就是最近使用时间
+  std::error_code ec;
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+  return metrics;
+}
+void LatexDiskCache::store(const LatexKey& key, LatexMetrics metrics) {
+  auto path = pathOf(key);
+  std::lock_guard lock(m_mutex);
+  std::error_code ec;
+  auto oldSize = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+  // 先写临时文件再改名，别的进程不会读到写了一半的文件
+  auto tmpPath = path;
+  tmpPath += std::format(".{}.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      DEBUG << "write latex cache fail:" << tmpPath.string();
+      return;
+    }
+    out << kMagic << '\n' << m_version << '\n';
+    out << std::bit_cast<uint32_t>(key.fontSize) << ' ' << key.maxWidth << ' ' << key.color << ' ' << metrics.width
+        << ' ' << metrics.height << '\n';
+    out.write(key.latex.data(), key.latex.size());
+  }
+  fs::rename(tmpPath, path, ec);
+  if (ec) {
+    fs::remove(tmpPath, ec);
+    return;
+  }
+  m_totalBytes = m_totalBytes - std::min(m_totalBytes, oldSize) + fs::file_size(path, ec);
+  if (m_totalBytes > m_maxBytes) pruneLocked();
+}
+void LatexDiskCache::prune() {
+  std::lock_guard lock(m_mutex);
+  pruneLocked();
+}
+void LatexDiskCache::pruneLocked() {
+  struct File {
+    fs::file_time_type time;
+    std::uintmax_t size;
+    fs::path path;
+  };
+  std::vector<File> files;
+  std::error_code ec;
+  m_totalBytes = 0;
+  for (const auto& entry : fs::directory_iterator(m_dir, ec)) {
+    if (!entry.is_regular_file(ec)) continue;
+    File file{entry.last_write_time(ec), entry.file_size(ec), entry.path()};
+    m_totalBytes += file.size;
+    files.push_back(std::move(file));
+  }
+  std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.time < b.time; });
+  auto target = m_maxBytes / 10 * 9;
+  for (const auto& file : files) {
+    if (m_totalBytes <= target) break;
+    if (fs::remove(file.path, ec)) m_totalBytes -= file.size;
+  }
+}
+std::uintmax_t LatexDiskCache::totalBytes() const {
+  std::lock_guard lock(m_mutex);
+  return m_totalBytes;
+}
+SizeType LatexDiskCache::hits() const {
+  std::lock_guard lock(m_mutex);
+  return m_hits;
+}
+SizeType LatexDiskCache::misses() const {
+  std::lock_guard lock(m_mutex);
+  return m_misses;
+}
+}  // namespace md::render
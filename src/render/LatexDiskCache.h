@@ -0,0 +1,49 @@
+#ifndef QTMARKDOWN_LATEXDISKCACHE_H
+#define QTMARKDOWN_LATEXDISKCACHE_H
+#include "QtMarkdown_global.h"
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+
+#include "mddef.h"
+namespace md::render {
+struct LatexKey;
+struct LatexMetrics {
+  int width = 0;
+  int height = 0;
+};
+// 公式大小的磁盘缓存，重新打开文档时排版直接拿大小，不用等MicroTeX解析。
+// 不保存绘制结果，画公式时还是要解析。
+// 一个公式一个文件，文件名是(公式, 字号, 宽度, 颜色, MicroTeX版本)的哈希，
+// 文件里保存完整的key，读的时候校验，哈希冲突时当作未命中。
+// 文件修改时间当作最近使用时间，总大小超过上限时删掉最久没用的。
+class QTMARKDOWNRENDER_EXPORT LatexDiskCache {
+ public:
+  explicit LatexDiskCache(std::filesystem::path dir, std::uintmax_t maxBytes = 16 * 1024 * 1024);
+  LatexDiskCache(const LatexDiskCache&) = delete;
+  LatexDiskCache& operator=(const LatexDiskCache&) = delete;
+  std::optional<LatexMetrics> load(const LatexKey& key);
+  void store(const LatexKey& key, LatexMetrics metrics);
+  // 删到上限的90%以下
+  void prune();
+  [[nodiscard]] const std::filesystem::path& dir() const { return m_dir; }
+  [[nodiscard]] std::uintmax_t totalBytes() const;
+  [[nodiscard]] SizeType hits() const;
+  [[nodiscard]] SizeType misses() const;
+
+ private:
+  std::filesystem::path pathOf(const LatexKey& key) const;
+  void pruneLocked();
+
+  mutable std::mutex m_mutex;
+  std::filesystem::path m_dir;
+  std::uintmax_t m_maxBytes;
+  std::uintmax_t m_totalBytes = 0;
+  // 参与哈希，升级MicroTeX后旧结果自然失效
+  std::string m_version;
+  SizeType m_hits = 0;
+  SizeType m_misses = 0;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_LATEXDISKCACHE_H
@@ -4,11 +4,20 @@
 
 #include "Render.h"
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 
-#include "Instruction.h"
+#include "DisplayList.h"
+#include "IconAtlas.h"
+#include "ImageCache.h"
+#include "LatexCache.h"
+#include "ShapeCache.h"
 #include "StringUtil.h"
+#include "StyleTable.h"
 #include "FontMetricsProvider.h"
 #include "debug.h"
 #include "microtex.h"
@@ -18,24 +27,40 @@
 #include "DefaultFontMetrics.h"
 using namespace md::parser;
 namespace md::render {
-// Render内部配置
-struct LayoutConfig {
-  Font font;
-  Color pen;
-};
+static uint64_t nextBlockVersion() {
+  static std::atomic<uint64_t> next{1};
+  return next++;
+}
+static void mixHash(uint64_t &h, uint64_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); }
 class LayoutPass
     : public NodeVisitor {
  public:
   explicit LayoutPass(Node *node, sptr<RenderSetting> setting, const parser::IBufferProvider& doc,
                       IFontMetricsProvider* fontMetrics = nullptr,
-                      editor::core::IImageProvider* imageProvider = nullptr)
+                      editor::core::IImageProvider* imageProvider = nullptr,
+                      sptr<ShapeCache> shapeCache = nullptr,
+                      sptr<StyleTable> styles = nullptr,
+                      sptr<LatexCache> latexCache = nullptr,
+                      sptr<ImageCache> imageCache = nullptr,
+                      sptr<IconAtlas> icons = nullptr,
+                      const Preedit* preedit = nullptr)
       : m_block(), m_setting(setting), m_doc(doc),
         m_fontMetrics(fontMetrics ? fontMetrics : &g_defaultFontMetrics),
         m_hasGui(fontMetrics == nullptr),
-        m_imageProvider(imageProvider) {
+        m_imageProvider(imageProvider),
+        m_shapeCache(std::move(shapeCache)),
+        m_styles(styles ? std::move(styles) : std::make_shared<StyleTable>()),
+        m_latexCache(latexCache ? std::move(latexCache) : std::make_shared<LatexCache>()),
+        m_imageCache(imageCache ? std::move(imageCache) : std::make_shared<ImageCache>()),
+        m_icons(icons ? std::move(icons) : std::make_shared<IconAtlas>(imageProvider)),
+        m_preedit(preedit) {
     ASSERT(m_fontMetrics != nullptr);
-    m_config.font.pixelSize = 18;
-    m_config.pen = Color::black();
+    if (!m_shapeCache || m_shapeCache->fontMetrics() != m_fontMetrics) {
+      m_shapeCache = std::make_shared<ShapeCache>(m_fontMetrics);
+    }
+    m_shapeCache->beginPass();
+    m_displayList = DisplayList(m_styles.get(), m_icons.get());
+    m_config = StyleTable::defaultStyle;
     m_configs.push_back(m_config);
   }
   void visit(Header *node) override {
@@ -66,80 +91,94 @@ class LayoutPass
     endBlock();
     restore();
   }
-  void drawEnglishString(Text *node, const String &str, RenderString s, SizeType &startIndex, SizeType &drawCount) {
-    String enStr = str.mid(startIndex, s.length - drawCount);
-    auto enStrList = enStr.split(' ');
-    for (int i = 0; i < enStrList.size(); ++i) {
-      auto enSubStr = enStrList[i];
-      if (currentLineCanDrawText(enSubStr)) {
-        auto count = enSubStr.size();
-        if (i < enStrList.size() - 1) {
+  // 宽度都按整个run算好的累计宽度取，断在哪里都和绘制时的宽度一致
+  void drawEnglishString(Text *node, const String &str, const RenderString &s, const RunAdvances &adv,
+                         SizeType &startIndex) {
+    const auto end = s.offset + s.length;
+    while (startIndex < end) {
+      auto wordEnd = startIndex;
+      while (wordEnd < end && str[wordEnd] != ' ') {
+        wordEnd++;
+      }
+      auto wordWidth = adv.width(startIndex, wordEnd);
+      if (currentLineCanDrawWidth(wordWidth)) {
+        auto count = wordEnd - startIndex;
+        if (wordEnd < end) {
           // 加一个空格
           count++;
         }
-        drawText(node, str, s, startIndex, count);
+        drawText(node, s, adv, startIndex, count);
         startIndex += count;
         continue;
       }
 
-      if (textSize(enSubStr).width + m_setting->docMargin.left < m_setting->contentMaxWidth()) {
+      if (wordWidth + m_setting->docMargin.left < m_setting->contentMaxWidth()) {
         moveToNewLine();
-        // 抵消后面都i++
-        i--;
         continue;
       }
-      auto count = countOfThisLineCanDraw(str.mid(startIndex, s.length - drawCount));
+      auto count = countOfThisLineCanDraw(str, adv, startIndex, wordEnd);
       DEBUG << count;
       if (count == 0) {
         moveToNewLine();
         continue;
       }
-      drawText(node, str, s, startIndex, count);
+      drawText(node, s, adv, startIndex, count);
       startIndex += count;
       // 画不下，就强制加一个连字符
       auto hyphenPos = Point(m_curX, m_curY);
       auto hyphenSize = textSize("-");
-      m_instructions.push_back(std::make_unique<StaticTextInstruction>(String("-"), hyphenPos, hyphenSize, Color::black(), curFont()));
+      m_displayList.addStaticText(String("-"), Rect(hyphenPos, hyphenSize), m_styles->intern(curFont(), Color::black()));
       moveToNewLine();
     }
   }
   void drawRenderString(Text *node, const String &str, RenderString s) {
+    const auto &adv = m_shapeCache->runAdvances(node, runFont(s), s.offset);
     SizeType startIndex = s.offset;
-    SizeType drawCount = 0;
-    while (!currentLineCanDrawText(str.mid(startIndex, s.length - drawCount))) {
+    const auto end = s.offset + s.length;
+    while (startIndex < end && !currentLineCanDrawWidth(adv.width(startIndex, end))) {
       // 如果是英文的话，先按空格分割，然后如果还画不下，去下一行
       // 如果一行都画不下，就暴力分割
       if (s.type == RenderString::English) {
-        drawEnglishString(node, str, s, startIndex, drawCount);
+        drawEnglishString(node, str, s, adv, startIndex);
       } else {
-        auto count = countOfThisLineCanDraw(str.mid(startIndex, s.length - drawCount));
+        auto count = countOfThisLineCanDraw(str, adv, startIndex, end);
         if (count == 0) {
           moveToNewLine();
           continue;
         }
         // 如果是中文的逗号或者句号结尾，就少画一个中文字，把符号画到下一行。
-        if (startIndex + count < str.size()) {
+        if (startIndex + count < end) {
           auto cp = md::codePointAt(str.toStdString(), startIndex + count);
           if (cp == 0xFF0C /* ， */ || cp == 0x3002 /* 。 */ || cp == 0x3001 /* 、 */) {
-            count--;
+            auto back = count;
+            do {
+              back--;
+            } while (back > 0 && (static_cast<unsigned char>(str[startIndex + back]) & 0xC0) == 0x80);
+            if (back > 0) count = back;
           }
         }
-        drawText(node, str, s, startIndex, count);
+        drawText(node, s, adv, startIndex, count);
         startIndex += count;
-        drawCount += count;
         moveToNewLine();
       }
     }
-    auto lastLength = s.length + s.offset - startIndex;
-    if (lastLength > 0) {
-      drawText(node, str, s, startIndex, lastLength);
+    if (startIndex < end) {
+      drawText(node, s, adv, startIndex, end - startIndex);
     }
   }
   void visit(Text *node) override {
     ASSERT(node != nullptr);
     auto str = node->toString(m_doc);
-    auto stringList = StringUtil::split(str);
+    const auto& stringList = m_shapeCache->runs(node, str);
+    auto split = preeditSplit(str.size());
     for (auto s : stringList) {
+      // 组字文本插在这一段中间时，先画前半段
+      if (split >= s.offset && split < s.offset + s.length) {
+        if (split > s.offset) drawRenderString(node, str, RenderString(s.type, s.offset, split - s.offset));
+        drawPreedit();
+        s.length -= split - s.offset;
+        s.offset = split;
+      }
       drawRenderString(node, str, s);
     }
   }
@@ -167,8 +206,7 @@ class LayoutPass
     int y = m_curY;
     if (currentLineCanDrawText(codeStr)) {
       auto size = textSize(codeStr);
-      m_instructions.push_back(std::make_unique<FillRectInstruction>(
-          Point(x - 2, y - 2), Size(size.width + 4, size.height + 4), Color(249, 249, 249)));
+      m_displayList.addFillRect(Rect(Point(x - 2, y - 2), Size(size.width + 4, size.height + 4)), Color(249, 249, 249));
       node->code()->accept(this);
     }
     restore();
@@ -178,15 +216,15 @@ class LayoutPass
     save();
     setFont(codeFont());
     m_rewriteFont = false;
-    beginBlock();
-    auto x = m_curX;
+    // 背景在第一行之前画，不算进任何一行的指令范围
+    auto x = m_setting->docMargin.left;
     auto y = m_curY;
     auto w = m_setting->contentMaxWidth();
 
     int lineH = textHeight();
     int estimatedH = node->size() * lineH + (node->size() - 1) * m_setting->lineSpacing;
-    m_instructions.push_back(std::make_unique<FillRectInstruction>(
-        Point(x - 3, y - 3), Size(w + 6, estimatedH + 6), Color(249, 249, 249)));
+    m_displayList.addFillRect(Rect(Point(x - 3, y - 3), Size(w + 6, estimatedH + 6)), Color(249, 249, 249));
+    beginBlock();
 
     for (int i = 0; i < node->size(); ++i) {
       if (i > 0) beginLogicalLine();
@@ -195,14 +233,11 @@ class LayoutPass
     }
     endBlock();
 
-    if (m_hasGui && m_imageProvider) {
-      String copyBtnFilePath = ":icon/copy_32x32.png";
-      auto image = m_imageProvider->load(copyBtnFilePath);
-      if (!image.isNull()) {
-        Point pos(x + w - image.width, y);
-        m_instructions.push_back(std::make_unique<StaticImageInstruction>(copyBtnFilePath, pos, Size(image.width, image.height), std::move(image)));
-        m_block.appendElement({node, pos, Size(image.width, image.height)});
-      }
+    if (m_hasGui && m_icons->has(IconId::copy)) {
+      Size size = m_icons->nativeSize(IconId::copy);
+      Point pos(x + w - size.width, y);
+      m_displayList.addIcon(Rect(pos, size), m_icons->slot(IconId::copy));
+      m_block.appendElement({node, pos, size});
     }
     restore();
   }
@@ -210,21 +245,26 @@ class LayoutPass
     ASSERT(node != nullptr);
     save();
     auto latex = node->code()->toString(m_doc);
-    try {
-      float textSize = m_setting->latexFontSize;
-      auto render = std::unique_ptr<microtex::Render>(
-          microtex::MicroTeX::parse(latex.toStdString(), m_setting->contentMaxWidth(), textSize,
-                                    textSize / 3.f, 0xff424242));
+    LatexKey key{latex, float(m_setting->latexFontSize), m_setting->contentMaxWidth(), LatexCache::defaultColor};
+    auto box = m_latexCache->tryGet(key);
+    if (!box) {
+      // 还在后台排版，先按估计的大小占位
+      auto size = estimateLatexSize(latex);
+      auto cell = std::make_unique<InlineLatexCell>(Point(m_curX, m_curY), size);
+      m_displayList.addFillRect(Rect(cell->m_pos, size), LatexBox::placeholderColor);
+      appendVisualCell(std::move(cell));
+      m_curX += size.width;
+      m_block.m_pendingLatex.push_back(std::move(key));
+    } else if (*box) {
       const Point &point = Point(m_curX, m_curY);
-      const Size &size = Size(render->getWidth() + 2, render->getHeight());
+      const Size &size = Size((*box)->width() + 2, (*box)->height());
       auto cell = std::make_unique<InlineLatexCell>(point, size);
       auto* rawCell = cell.get();
       appendVisualCell(std::move(cell));
-      m_instructions.push_back(std::make_unique<LatexInstruction>(rawCell, latex, textSize));
-      m_curX += render->getWidth();
-    } catch (const std::exception &ex) {
-      DEBUG << "ERROR" << ex.what();
-      DEBUG << "Render LaTeX fail:" << latex;
+      m_curX += (*box)->width();
+      // 大小已经准确，等后台的结果只是为了能画出来
+      if (!(*box)->drawable()) m_block.m_pendingLatex.push_back(std::move(key));
+      m_displayList.addLatex(rawCell, std::move(*box));
     }
     restore();
   }
@@ -233,21 +273,25 @@ class LayoutPass
     save();
     beginBlock();
     auto latex = node->toString(m_doc);
-    try {
-      float textSize = m_setting->latexFontSize;
-      auto render = std::unique_ptr<microtex::Render>(
-          microtex::MicroTeX::parse(latex.toStdString(), m_setting->contentMaxWidth(), textSize,
-                                    textSize / 3.f, 0xff424242));
-      const Point &point = Point((m_setting->contentMaxWidth() - render->getWidth()) / 2, m_curY);
-      const Size &size = Size(m_setting->contentMaxWidth(), render->getHeight());
+    LatexKey key{latex, float(m_setting->latexFontSize), m_setting->contentMaxWidth(), LatexCache::defaultColor};
+    auto box = m_latexCache->tryGet(key);
+    if (!box) {
+      auto estimated = estimateLatexSize(latex);
+      const Point &point = Point((m_setting->contentMaxWidth() - estimated.width) / 2, m_curY);
+      auto cell = std::make_unique<InlineLatexCell>(point, Size(m_setting->contentMaxWidth(), estimated.height));
+      m_displayList.addFillRect(Rect(point, estimated), LatexBox::placeholderColor);
+      appendVisualCell(std::move(cell));
+      m_curX += estimated.width;
+      m_block.m_pendingLatex.push_back(std::move(key));
+    } else if (*box) {
+      const Point &point = Point((m_setting->contentMaxWidth() - (*box)->width()) / 2, m_curY);
+      const Size &size = Size(m_setting->contentMaxWidth(), (*box)->height());
       auto cell = std::make_unique<InlineLatexCell>(point, size);
       auto* rawCell = cell.get();
       appendVisualCell(std::move(cell));
-      m_instructions.push_back(std::make_unique<LatexInstruction>(rawCell, latex, textSize));
-      m_curX += render->getWidth();
-    } catch (const std::exception &ex) {
-      DEBUG << "ERROR" << ex.what();
-      DEBUG << "Render LaTeX fail:" << latex;
+      m_curX += (*box)->width();
+      if (!(*box)->drawable()) m_block.m_pendingLatex.push_back(std::move(key));
+      m_displayList.addLatex(rawCell, std::move(*box));
     }
     endBlock();
     restore();
@@ -308,17 +352,35 @@ class LayoutPass
       std::cerr << "image not exist: " << imgPath << std::endl;
       return;
     }
-    auto image = m_imageProvider->load(imgPath);
     int imageMaxWidth = std::min(1080, m_setting->contentMaxWidth());
-    int imgWidth = image.width;
-    while (imgWidth > imageMaxWidth) {
-      imgWidth /= 2;
+    // 缓存里存的就是显示大小的图，不用每次排版都解码原图
+    ImageKey pending{};
+    auto image = m_imageCache->tryGet(
+        m_imageProvider, imgPath,
+        [imageMaxWidth](Size size) {
+          int imgWidth = size.width;
+          while (imgWidth > imageMaxWidth) {
+            imgWidth /= 2;
+          }
+          return Size(imgWidth, (imgWidth * size.height) / std::max(size.width, 1));
+        },
+        &pending);
+    if (image && !*image) {
+      std::cerr << "image load fail: " << imgPath << std::endl;
+      return;
     }
-    int displayWidth = imgWidth;
-    int displayHeight = (displayWidth * image.height) / image.width;
+    // 还在后台解码，先用文件头里的大小占位，读不到就用默认大小
+    Size imgSize = image ? Size((*image)->width, (*image)->height)
+                         : (pending.width > 0 ? Size(pending.width, pending.height) : ImageCache::placeholderSize);
+    int displayWidth = imgSize.width;
+    int displayHeight = imgSize.height;
     const Point &pos = Point(m_curX, m_curY);
-    Size imgSize(displayWidth, displayHeight);
-    m_instructions.push_back(std::make_unique<ImageInstruction>(imgPath, pos, imgSize, std::move(image)));
+    if (image) {
+      m_displayList.addImage(Rect(pos, imgSize), std::move(*image));
+    } else {
+      auto resource = m_displayList.addImagePlaceholder(Rect(pos, imgSize), ImageCache::placeholderColor);
+      m_block.m_pendingImages.push_back({std::move(pending), resource});
+    }
     m_curY += displayHeight;
     m_block.appendElement({node, pos, imgSize});
     // TODO: 需要重新考虑图片
@@ -328,14 +390,13 @@ class LayoutPass
       return;
     }
     // gif加一个播放的图标
-    String playIconPath = ":/icon/play_64x64.png";
-    auto playIcon = m_imageProvider->load(playIconPath);
-    if (playIcon.isNull()) return;
+    if (!m_icons->has(IconId::play)) return;
     // 计算播放图标所在位置
     // 播放图标放在中心位置
-    int x = (displayWidth - playIcon.width) / 2 + pos.x;
-    int y = (displayHeight - playIcon.height) / 2 + pos.y;
-    m_instructions.push_back(std::make_unique<StaticImageInstruction>(playIconPath, Point(x, y), Size(playIcon.width, playIcon.height), std::move(playIcon)));
+    Size iconSize = m_icons->nativeSize(IconId::play);
+    int x = (displayWidth - iconSize.width) / 2 + pos.x;
+    int y = (displayHeight - iconSize.height) / 2 + pos.y;
+    m_displayList.addIcon(Rect(Point(x, y), iconSize), m_icons->slot(IconId::play));
   }
   void visit(CheckboxList *node) override {
     ASSERT(node != nullptr);
@@ -359,14 +420,9 @@ class LayoutPass
     save();
     const Point &pos = Point(m_curX, m_curY);
     const Size &size = Size(h1, h1);
-    if (node->isChecked()) {
-      String imagePath = ":icon/checkbox-selected_64x64.png";
-      auto image = m_imageProvider ? m_imageProvider->load(imagePath) : editor::core::ImageData();
-      m_instructions.push_back(std::make_unique<StaticImageInstruction>(imagePath, pos, size, std::move(image)));
-    } else {
-      String imagePath = ":icon/checkbox-unselected_64x64.png";
-      auto image = m_imageProvider ? m_imageProvider->load(imagePath) : editor::core::ImageData();
-      m_instructions.push_back(std::make_unique<StaticImageInstruction>(imagePath, pos, size, std::move(image)));
+    auto icon = m_icons->slot(node->isChecked() ? IconId::checkboxSelected : IconId::checkboxUnselected, size);
+    if (icon != IconAtlas::noIcon) {
+      m_displayList.addIcon(Rect(pos, size), icon);
     }
     m_block.appendElement({node, pos, size});
     m_curX += h1 + 10;
@@ -385,21 +441,24 @@ class LayoutPass
     ASSERT(node != nullptr);
     beginBlock(false);
     for (const auto &item : node->children()) {
-      beginLogicalLine(false);
-      auto oldX = m_curX;
-      m_curX += m_setting->listMargin.left;
-      auto h = textHeight();
-      auto size = 5;
-      auto y = m_curY + (h - size) / 2 + 2;
-      m_instructions.push_back(std::make_unique<EllipseInstruction>(Point(m_curX, y), Size(size, size), Color::black()));
-      m_curX += 15;
-      m_block.m_logicalLines.back().m_padding = m_curX - oldX;
-      beginVisualLine();
-      item->accept(this);
-      endLogicalLine();
+      layoutUnorderedItem(item.get());
     }
     endBlock();
   }
+  void layoutUnorderedItem(Node *item) {
+    beginLogicalLine(false);
+    auto oldX = m_curX;
+    m_curX += m_setting->listMargin.left;
+    auto h = textHeight();
+    auto size = 5;
+    auto y = m_curY + (h - size) / 2 + 2;
+    m_displayList.addEllipse(Rect(Point(m_curX, y), Size(size, size)), Color::black());
+    m_curX += 15;
+    m_block.m_logicalLines.back().m_padding = m_curX - oldX;
+    beginVisualLine();
+    item->accept(this);
+    endLogicalLine();
+  }
   void visit(UnorderedListItem *node) override {
     ASSERT(node != nullptr);
     for (const auto &item : node->children()) {
@@ -412,21 +471,24 @@ class LayoutPass
     int i = 0;
     for (const auto &item : node->children()) {
       i++;
-      beginLogicalLine(false);
-      auto oldX = m_curX;
-      m_curX += m_setting->listMargin.left;
-      String numStr = std::to_string(i) + ".  ";
-      const Size &size = textSize(numStr);
-      const Point &pos = Point(m_curX, m_curY);
-      m_instructions.push_back(std::make_unique<StaticTextInstruction>(numStr, pos, size, Color::black(), curFont()));
-      m_curX += size.width;
-      m_block.m_logicalLines.back().m_padding = m_curX - oldX;
-      beginVisualLine();
-      item->accept(this);
-      endLogicalLine();
+      layoutOrderedItem(item.get(), i);
     }
     endBlock();
   }
+  void layoutOrderedItem(Node *item, int number) {
+    beginLogicalLine(false);
+    auto oldX = m_curX;
+    m_curX += m_setting->listMargin.left;
+    String numStr = std::to_string(number) + ".  ";
+    const Size &size = textSize(numStr);
+    const Point &pos = Point(m_curX, m_curY);
+    m_displayList.addStaticText(numStr, Rect(pos, size), m_styles->intern(curFont(), Color::black()));
+    m_curX += size.width;
+    m_block.m_logicalLines.back().m_padding = m_curX - oldX;
+    beginVisualLine();
+    item->accept(this);
+    endLogicalLine();
+  }
   void visit(OrderedListItem *node) override {
     ASSERT(node != nullptr);
     for (const auto &item : node->children()) {
@@ -438,10 +500,9 @@ class LayoutPass
     save();
     beginBlock();
     int lineY = m_curY + m_setting->lineSpacing;
-    m_instructions.push_back(std::make_unique<FillRectInstruction>(
-        Point(m_setting->docMargin.left, lineY),
-        Size(m_setting->contentMaxWidth() - m_setting->docMargin.left, 1),
-        Color(200, 200, 200)));
+    m_displayList.addFillRect(Rect(Point(m_setting->docMargin.left, lineY),
+                                   Size(m_setting->contentMaxWidth() - m_setting->docMargin.left, 1)),
+                              Color(200, 200, 200));
     m_curY = lineY + m_setting->lineSpacing;
     endBlock();
     restore();
@@ -461,7 +522,7 @@ class LayoutPass
     }
     Color bgColor(238, 238, 238);
     Point pos(m_setting->docMargin.left - m_setting->quoteMargin.left, startY);
-    m_instructions.push_back(std::make_unique<FillRectInstruction>(pos, Size(5, endY - startY), bgColor));
+    m_displayList.addFillRect(Rect(pos, Size(5, endY - startY)), bgColor);
     endBlock();
   }
   void visit(Table *node) override {
@@ -477,8 +538,7 @@ class LayoutPass
         headerLine += cell + " | ";
       }
       auto size = textSize(headerLine);
-      m_instructions.push_back(std::make_unique<StaticTextInstruction>(
-          headerLine, Point(m_curX, m_curY), size, curPen(), curFont()));
+      m_displayList.addStaticText(headerLine, Rect(Point(m_curX, m_curY), size), m_config);
       m_curY += size.height + m_setting->lineSpacing;
     }
     // Render content rows
@@ -488,8 +548,7 @@ class LayoutPass
         rowLine += cell + " | ";
       }
       auto size = textSize(rowLine);
-      m_instructions.push_back(std::make_unique<StaticTextInstruction>(
-          rowLine, Point(m_curX, m_curY), size, curPen(), curFont()));
+      m_displayList.addStaticText(rowLine, Rect(Point(m_curX, m_curY), size), m_config);
       m_curY += size.height + m_setting->lineSpacing;
     }
     endBlock();
@@ -504,18 +563,209 @@ class LayoutPass
     auto font = curFont();
     font.pixelSize = 12;
     auto size = textSize(enterStr);
-    m_instructions.push_back(std::make_unique<StaticTextInstruction>(enterStr, Point(m_curX, m_curY), size, Color::blue(), font));
+    m_displayList.addStaticText(enterStr, Rect(Point(m_curX, m_curY), size), m_styles->intern(font, Color::blue()));
 #endif
     endLogicalLine();
     beginLogicalLine();
     restore();
   }
   [[nodiscard]] Block execute() {
-    m_block.setInstructions(std::move(m_instructions));
+    for (auto &logicalLine : m_block.m_logicalLines) {
+      if (!logicalLine.hasIndex()) logicalLine.buildIndex();
+    }
+    m_block.m_displayList = std::move(m_displayList);
+    m_shapeCache->endPass();
+    m_block.m_shapeCache = std::move(m_shapeCache);
+    m_block.m_styles = std::move(m_styles);
+    m_block.m_icons = std::move(m_icons);
+    m_block.m_version = nextBlockVersion();
+    signLines();
+    return std::move(m_block);
+  }
+  // 只重排block的第lineNo个逻辑行：新行先排在最后，再换到原来的位置上，后面的行平移高度差
+  [[nodiscard]] Block relayout(Node *node, Block block, SizeType lineNo) {
+    m_block = std::move(block);
+    m_displayList = std::move(m_block.m_displayList);
+    auto &lines = m_block.m_logicalLines;
+    const int top = lines[lineNo].m_pos.y;
+    const int oldH = lines[lineNo].m_h;
+    std::vector<int> oldTops;
+    for (const auto &line : lines[lineNo].m_lines) oldTops.push_back(line.m_pos.y);
+    const auto from = m_displayList.size();
+    const auto elementFrom = static_cast<SizeType>(m_block.m_elements.size());
+    auto *child = node->type() == NodeType::paragraph ? nullptr : node->asContainer()->childAt(lineNo);
+    m_curY = top;
+    switch (node->type()) {
+      case NodeType::code_block:
+        save();
+        setFont(codeFont());
+        beginLogicalLine();
+        child->accept(this);
+        endLogicalLine();
+        restore();
+        break;
+      case NodeType::ul:
+        layoutUnorderedItem(child);
+        break;
+      case NodeType::ol:
+        layoutOrderedItem(child, static_cast<int>(lineNo) + 1);
+        break;
+      case NodeType::checkbox:
+        beginLogicalLine(false);
+        child->accept(this);
+        endLogicalLine();
+        break;
+      case NodeType::paragraph: {
+        // 段落按换行分成逻辑行，这一行是第lineNo个换行之后的那些孩子
+        auto *container = node->asContainer();
+        const auto size = static_cast<SizeType>(container->size());
+        SizeType first = 0;
+        for (SizeType lf = 0; lf < lineNo; ++first) {
+          if (container->childAt(first)->type() == NodeType::lf) ++lf;
+        }
+        auto last = first;
+        while (last < size && container->childAt(last)->type() != NodeType::lf) ++last;
+        beginLogicalLine();
+        if (lineNo == 0) m_curX += curFont().pixelSize * m_setting->paragraphIntent;
+        for (auto i = first; i < last; ++i) container->childAt(i)->accept(this);
+        if (last < size) {
+          // 换行结束这一行，顺带开的下一行不要
+          container->childAt(last)->accept(this);
+          lines.pop_back();
+        } else {
+          endLogicalLine();
+        }
+        break;
+      }
+      default:
+        ASSERT(false && "relayout: unsupported block");
+    }
+    auto line = std::move(lines.back());
+    lines.pop_back();
+    auto &target = lines[lineNo];
+    const auto commandCount = m_displayList.size() - from;
+    const auto commandDelta = commandCount - (target.m_lastCommand - target.m_firstCommand);
+    const auto elementCount = static_cast<SizeType>(m_block.m_elements.size()) - elementFrom;
+    const auto elementDelta = elementCount - (target.m_lastElement - target.m_firstElement);
+    m_displayList.splice(target.m_firstCommand, target.m_lastCommand, from);
+    auto &elements = m_block.m_elements;
+    std::rotate(elements.begin() + target.m_lastElement, elements.begin() + elementFrom, elements.end());
+    elements.erase(elements.begin() + target.m_firstElement, elements.begin() + target.m_lastElement);
+    line.m_firstCommand = target.m_firstCommand;
+    line.m_lastCommand = target.m_firstCommand + commandCount;
+    line.m_firstElement = target.m_firstElement;
+    line.m_lastElement = target.m_firstElement + elementCount;
+    const int dy = line.m_h - oldH;
+    target = std::move(line);
+    for (auto i = lineNo + 1; i < static_cast<SizeType>(lines.size()); ++i) {
+      auto &later = lines[i];
+      later.m_firstCommand += commandDelta;
+      later.m_lastCommand += commandDelta;
+      later.m_firstElement += elementDelta;
+      later.m_lastElement += elementDelta;
+      if (dy == 0) continue;
+      later.m_pos.y += dy;
+      for (auto &visualLine : later.m_lines) {
+        visualLine.m_pos.y += dy;
+        for (auto &cell : visualLine.m_cells) cell->m_pos.y += dy;
+      }
+      m_displayList.translate(later.m_firstCommand, later.m_lastCommand, dy);
+      for (auto e = later.m_firstElement; e < later.m_lastElement; ++e) elements[e].pos.y += dy;
+    }
+    m_block.m_displayList = std::move(m_displayList);
+    m_block.m_version = nextBlockVersion();
+    bool sameRows = dy == 0 && oldTops.size() == target.m_lines.size();
+    for (SizeType i = 0; sameRows && i < static_cast<SizeType>(oldTops.size()); ++i) {
+      sameRows = oldTops[i] == target.m_lines[i].m_pos.y;
+    }
+    if (sameRows) {
+      // 行的划分没变，只重算这一行占的那几个可见行的摘要
+      for (auto &signature : m_block.m_lineSignatures) {
+        if (signature.top >= top && signature.top < top + oldH) signature.hash = 0;
+      }
+      signCommands(top, top + oldH);
+    } else {
+      signLines();
+    }
     return std::move(m_block);
   }
 
  private:
+  // 按可见行把块分段，每段的绘图指令算一个摘要，用来比较前后两次排版哪些行变了
+  void signLines() {
+    std::vector<int> tops;
+    for (const auto &logicalLine : m_block.m_logicalLines) {
+      for (const auto &line : logicalLine.m_lines) {
+        tops.push_back(line.m_pos.y);
+      }
+    }
+    std::sort(tops.begin(), tops.end());
+    tops.erase(std::unique(tops.begin(), tops.end()), tops.end());
+    int height = m_block.height();
+    auto &signatures = m_block.m_lineSignatures;
+    const auto count = static_cast<SizeType>(tops.size());
+    signatures.clear();
+    m_block.m_chromeHash = 0;
+    for (SizeType i = 0; i < count; ++i) {
+      int bottom = i + 1 < count ? tops[i + 1] : std::max(height, tops[i] + 1);
+      signatures.push_back({tops[i], bottom - tops[i], 0});
+    }
+    signCommands(std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+  }
+  // 把整个落在[top, bottom)里的绘图指令的摘要并进所在的行
+  void signCommands(int top, int bottom) {
+    // 同一个Text结点的cell通常挨在一起
+    const Text *lastText = nullptr;
+    String lastString;
+    const auto &displayList = m_block.m_displayList;
+    for (const auto &command : displayList) {
+      Rect rect = command.cell ? Rect(command.cell->m_pos, command.cell->m_size) : command.rect;
+      if (rect.y() < top || rect.y() + rect.height() > bottom) continue;
+      uint64_t value = static_cast<uint64_t>(command.type);
+      mixHash(value, command.style);
+      switch (command.type) {
+        case DisplayCommandType::text: {
+          auto *cell = static_cast<const TextCell *>(command.cell);
+          if (cell->text() != lastText) {
+            lastText = cell->text();
+            lastString = lastText->toString(m_doc);
+          }
+          auto sv = std::string_view(lastString.data(), lastString.size()).substr(cell->textOffset(), cell->textLength());
+          mixHash(value, std::hash<std::string_view>()(sv));
+          break;
+        }
+        case DisplayCommandType::latex:
+          mixHash(value, reinterpret_cast<uintptr_t>(displayList.latexAt(command.resource).get()));
+          break;
+        case DisplayCommandType::staticText: {
+          const auto &str = displayList.stringAt(command.resource);
+          mixHash(value, std::hash<std::string_view>()(std::string_view(str.data(), str.size())));
+          break;
+        }
+        case DisplayCommandType::image: {
+          const auto &image = displayList.imageAt(command.resource);
+          mixHash(value, image ? image->cacheKey : 0);
+          break;
+        }
+        case DisplayCommandType::icon:
+          mixHash(value, command.resource);
+          break;
+        case DisplayCommandType::fillRect:
+        case DisplayCommandType::ellipse:
+          break;
+      }
+      mixHash(value, (uint64_t(command.color.r) << 24) | (command.color.g << 16) | (command.color.b << 8) | command.color.a);
+      mixHash(value, (uint64_t(uint32_t(rect.x())) << 32) | uint32_t(rect.y()));
+      mixHash(value, (uint64_t(uint32_t(rect.width())) << 32) | uint32_t(rect.height()));
+      m_block.sign(rect, value);
+    }
+  }
+  // 公式还没排好时的占位大小，只求大致不差，结果回来后整块重排
+  Size estimateLatexSize(const String &latex) const {
+    int fontSize = m_setting->latexFontSize;
+    int w = std::min<SizeType>(latex.size() * fontSize / 2, m_setting->contentMaxWidth());
+    return {w, fontSize * 3 / 2};
+  }
   void drawHeaderPrefix(int level) {
     save();
     String prefix = std::format("H{}", level);
@@ -524,25 +774,58 @@ class LayoutPass
     setFont(font);
     auto size = textSize(prefix);
     auto x = m_curX - size.width - 1;
-    m_instructions.push_back(std::make_unique<StaticTextInstruction>(prefix, Point(x, m_curY), size, Color::black(), font));
+    m_displayList.addStaticText(prefix, Rect(Point(x, m_curY), size), m_styles->intern(font, Color::black()));
     restore();
   }
 
-  void drawText(Text *node, const String &str, RenderString &s, SizeType offset, SizeType length) {
+  void drawText(Text *node, const RenderString &s, const RunAdvances &adv, SizeType offset, SizeType length) {
     save();
-    if (s.type == RenderString::Chinese) {
-      auto font = curFont();
-      font.family = m_setting->zhTextFont.c_str();
-      setFont(font);
-    }
-    const String &text = str.mid(offset, length);
-    const Size &size = textSize(text);
-    auto cell = std::make_unique<TextCell>(node, offset, length, Point(m_curX, m_curY), size, curPen(), curFont(), m_fontMetrics);
+    setFont(runFont(s));
+    const auto &font = curFont();
+    auto width = adv.width(offset, offset + length);
+    auto cell = std::make_unique<TextCell>(node, offset, length, Point(m_curX, m_curY), m_config, m_styles.get(), adv,
+                                           textHeight(), m_shapeCache->ascent(font));
     auto* rawCell = cell.get();
     appendVisualCell(std::move(cell));
-    m_instructions.push_back(std::make_unique<TextInstruction>(rawCell));
+    m_displayList.addText(rawCell);
     restore();
-    m_curX += size.width;
+    m_curX += width;
+  }
+  [[nodiscard]] bool pendingPreedit() const {
+    return m_preedit && !m_preeditDrawn && !m_block.m_logicalLines.empty() &&
+           m_preedit->lineNo + 1 == static_cast<SizeType>(m_block.m_logicalLines.size());
+  }
+  // 当前逻辑行已经排了多长
+  SizeType currentLineOffset() const {
+    SizeType offset = 0;
+    for (auto *cell : m_block.m_logicalLines.back().m_cells) {
+      offset += cell->length();
+    }
+    return offset;
+  }
+  // 组字文本落在长为length的文本节点里时，返回在节点里的位置，否则返回-1
+  SizeType preeditSplit(SizeType length) const {
+    if (!pendingPreedit()) return -1;
+    auto start = currentLineOffset();
+    if (m_preedit->offset < start || m_preedit->offset >= start + length) return -1;
+    return m_preedit->offset - start;
+  }
+  void drawPreedit() {
+    m_preeditDrawn = true;
+    save();
+    auto font = curFont();
+    font.underline = true;
+    const auto &text = m_preedit->text;
+    if (std::any_of(text.begin(), text.end(), [](char ch) { return static_cast<unsigned char>(ch) >= 0x80; })) {
+      font.family = m_setting->zhTextFont.c_str();
+    }
+    setFont(font);
+    if (!currentLineCanDrawText(text) && m_curX > m_setting->docMargin.left) moveToNewLine();
+    Rect rect(Point(m_curX, m_curY), textSize(text));
+    m_displayList.addStaticText(text, rect, m_config);
+    m_block.m_preeditRect = rect;
+    restore();
+    m_curX += rect.width();
   }
   void appendVisualCell(std::unique_ptr<Cell> cell) {
     ASSERT(!m_block.m_logicalLines.empty());
@@ -563,8 +846,9 @@ class LayoutPass
     LogicalLine logicalLine;
     m_curX = m_setting->docMargin.left;
     logicalLine.m_pos = Point(m_curX, m_curY);
-    auto size = m_fontMetrics->size(curFont(), "龙");
-    logicalLine.m_h = size.height;
+    logicalLine.m_h = textHeight();
+    logicalLine.m_firstCommand = m_displayList.size();
+    logicalLine.m_firstElement = static_cast<SizeType>(m_block.m_elements.size());
     m_block.m_logicalLines.push_back(std::move(logicalLine));
     if (initNewVisualLine) {
       beginVisualLine();
@@ -576,6 +860,8 @@ class LayoutPass
       return;
     }
     ASSERT(!m_block.m_logicalLines.empty());
+    // 光标在行尾或者空行
+    if (pendingPreedit() && currentLineOffset() <= m_preedit->offset) drawPreedit();
     auto &logicalLine = m_block.m_logicalLines.back();
     ASSERT(!logicalLine.m_lines.empty());
     if (endLastVisualLine) {
@@ -587,12 +873,14 @@ class LayoutPass
       h += m_setting->lineSpacing;
     }
     logicalLine.m_h = h;
+    logicalLine.m_lastCommand = m_displayList.size();
+    logicalLine.m_lastElement = static_cast<SizeType>(m_block.m_elements.size());
+    logicalLine.buildIndex();
   }
   void beginVisualLine() {
     ASSERT(!m_block.m_logicalLines.empty());
     auto &line = m_block.m_logicalLines.back();
-    auto size = m_fontMetrics->size(curFont(), "龙");
-    line.m_lines.push_back(VisualLine(Point(m_curX, m_curY), size.height));
+    line.m_lines.push_back(VisualLine(Point(m_curX, m_curY), textHeight()));
   }
   void endVisualLine() {
     ASSERT(!m_block.m_logicalLines.empty());
@@ -638,69 +926,67 @@ class LayoutPass
     font.pixelSize = 20;
     return font;
   }
-  [[nodiscard]] Font curFont() const { return m_config.font; }
-  [[nodiscard]] Color curPen() const { return m_config.pen; }
-  void setFont(const Font &font) { m_config.font = font; }
-  void setPen(const Color &color) { m_config.pen = color; }
+  // m_config只是样式表里的id，save/restore不再拷贝字体
+  [[nodiscard]] const Font &curFont() const { return m_styles->font(m_config); }
+  [[nodiscard]] const Color &curPen() const { return m_styles->pen(m_config); }
+  void setFont(const Font &font) { m_config = m_styles->intern(font, curPen()); }
+  void setPen(const Color &color) { m_config = m_styles->intern(curFont(), color); }
   // 辅助到绘制方法
-  Size textSize(const String &text) { return m_fontMetrics->size(curFont(), text); }
+  // 宽度都来自ShapeCache，改变宽度重新排版时不再测量文字
+  Size textSize(const String &text) {
+    return {m_shapeCache->advance(curFont(), text), m_shapeCache->height(curFont())};
+  }
 
   int textWidth(const String &text) {
-    return m_fontMetrics->horizontalAdvance(curFont(), text);
+    return m_shapeCache->advance(curFont(), text);
   }
 
-  int charWidth(const String &text) {
-    return m_fontMetrics->horizontalAdvance(curFont(), text);
+  int textHeight() {
+    return m_shapeCache->height(curFont());
   }
 
-  int textHeight() {
-    return m_fontMetrics->height(curFont());
+  // run实际用的字体，中文换成中文字体
+  [[nodiscard]] Font runFont(const RenderString &s) const {
+    auto font = curFont();
+    if (s.type == RenderString::Chinese) {
+      font.family = m_setting->zhTextFont.c_str();
+    }
+    return font;
+  }
+
+  bool currentLineCanDrawWidth(int needWidth) const {
+    return m_curX + needWidth < m_setting->contentMaxWidth();
   }
 
   bool currentLineCanDrawText(const String &text) {
-    auto needWidth = textWidth(text);
-    if (m_curX + needWidth < m_setting->contentMaxWidth()) {
-      return true;
-    } else {
-      return false;
-    }
+    return currentLineCanDrawWidth(textWidth(text));
   }
 
-  int countOfThisLineCanDraw(const String &text) {
-    // 计算这一行可以画多少个字符
-    // Measure the width of the first complete code point, not a single byte
-    int cpLen = md::utf8SequenceLength(text[0]);
-    auto ch_w = charWidth(text.left(cpLen));
+  // [begin, end)在一个run里，计算这一行可以画多少个字节，停在码点边界上
+  int countOfThisLineCanDraw(const String &str, const RunAdvances &adv, SizeType begin, SizeType end) {
+    int cpLen = md::utf8SequenceLength(str[begin]);
+    auto ch_w = adv.width(begin, std::min(begin + cpLen, end));
     int left_w = m_setting->contentMaxWidth() - m_curX;
-    int may_ch_count = left_w / ch_w - 1;
     // 可能根本画不了
-    if (may_ch_count <= 0) return 0;
-    // Ensure we don't split multi-byte UTF-8 characters
-    auto alignedLeft = [&text](int n) {
-      while (n > 0 && (static_cast<unsigned char>(text[n]) & 0xC0) == 0x80) {
-        n--;
-      }
-      return text.left(n);
-    };
-    if (currentLineCanDrawText(alignedLeft(may_ch_count + 1))) {
-      while (currentLineCanDrawText(alignedLeft(may_ch_count + 1))) {
-        may_ch_count++;
-      }
-    } else {
-      while (!currentLineCanDrawText(alignedLeft(may_ch_count))) {
-        may_ch_count--;
-      }
+    if (ch_w <= 0 || left_w / ch_w - 1 <= 0) return 0;
+    // 累计宽度单调不减，二分找第一个放不下的位置
+    const auto &prefix = *adv.prefix;
+    auto first = prefix.begin() + (begin - adv.offset);
+    auto last = prefix.begin() + (end - adv.offset) + 1;
+    auto limit = left_w + *first;
+    auto it = std::lower_bound(first, last, limit);
+    SizeType count = (it - first) - 1;
+    if (it == last) count = end - begin;
+    // 多字节字符的后续字节和首字节宽度相同，退回到字符起点
+    while (count > 0 && count < end - begin && (static_cast<unsigned char>(str[begin + count]) & 0xC0) == 0x80) {
+      count--;
     }
-    // Final alignment to code point boundary
-    while (may_ch_count > 0 && (static_cast<unsigned char>(text[may_ch_count]) & 0xC0) == 0x80) {
-      may_ch_count--;
-    }
-    return may_ch_count;
+    return count;
   }
 
  private:
-  std::vector<LayoutConfig> m_configs;
-  LayoutConfig m_config;
+  std::vector<StyleId> m_configs;
+  StyleId m_config;
   const parser::IBufferProvider& m_doc;
   Block m_block;
 
@@ -709,19 +995,20 @@ class LayoutPass
   sptr<RenderSetting> m_setting;
 
   bool m_rewriteFont = true;
-  InstructionPtrList m_instructions;
+  DisplayList m_displayList;
   IFontMetricsProvider* m_fontMetrics;
   bool m_hasGui;
   editor::core::IImageProvider* m_imageProvider = nullptr;
+  sptr<ShapeCache> m_shapeCache;
+  sptr<StyleTable> m_styles;
+  sptr<LatexCache> m_latexCache;
+  sptr<ImageCache> m_imageCache;
+  sptr<IconAtlas> m_icons;
+  const Preedit* m_preedit = nullptr;
+  bool m_preeditDrawn = false;
 };
 int VisualLine::height() const { return m_h; }
-SizeType VisualLine::length() const {
-  auto l = 0;
-  for (const auto& cell : m_cells) {
-    l += cell->length();
-  }
-  return l;
-}
+SizeType VisualLine::length() const { return m_length; }
 std::pair<Cell *, int> VisualLine::cellAtX(int x, const parser::IBufferProvider& doc) const {
   if (m_cells.empty()) {
     return {nullptr, 0};
@@ -733,19 +1020,7 @@ std::pair<Cell *, int> VisualLine::cellAtX(int x, const parser::IBufferProvider&
   for (const auto& cell : m_cells) {
     if (totalX <= x && x <= totalX + cell->width()) {
       // 再确定offset
-      for (int j = 0; j < cell->length(); ++j) {
-        auto w = cell->width(j + 1, doc);
-        if (totalX <= x && x <= totalX + w) {
-          auto delta = j;
-          // 按中间划分
-          if (totalX <= x && x <= totalX + w / 2) {
-            delta = j;
-          } else {
-            delta = j + 1;
-          }
-          return {cell.get(), delta};
-        }
-      }
+      return {cell.get(), cell->offsetAtX(x - totalX, doc)};
     }
     totalX += cell->width();
   }
@@ -758,61 +1033,79 @@ int VisualLine::width() const {
   auto w = cell->m_pos.x + cell->m_size.width - m_pos.x;
   return w;
 }
+void LogicalLine::buildIndex() {
+  m_cellOffsets.clear();
+  m_cellOffsets.reserve(m_cells.size() + 1);
+  SizeType totalOffset = 0;
+  for (auto cell : m_cells) {
+    m_cellOffsets.push_back(totalOffset);
+    totalOffset += cell->length();
+  }
+  m_cellOffsets.push_back(totalOffset);
+  m_lineOffsets.clear();
+  m_lineOffsets.reserve(m_lines.size() + 1);
+  totalOffset = 0;
+  for (auto &line : m_lines) {
+    line.m_length = 0;
+    for (const auto &cell : line.m_cells) {
+      line.m_length += cell->length();
+    }
+    m_lineOffsets.push_back(totalOffset);
+    totalOffset += line.m_length;
+  }
+  m_lineOffsets.push_back(totalOffset);
+}
+SizeType LogicalLine::cellIndexAt(SizeType offset) const {
+  auto it = std::upper_bound(m_cellOffsets.begin(), m_cellOffsets.end(), offset);
+  return std::distance(m_cellOffsets.begin(), it) - 1;
+}
+SizeType LogicalLine::visualLineIndexAt(SizeType offset) const {
+  auto it = std::upper_bound(m_lineOffsets.begin(), m_lineOffsets.end(), offset);
+  return std::distance(m_lineOffsets.begin(), it) - 1;
+}
 int LogicalLine::height() const { return m_h; }
 std::tuple<Point, int, int> LogicalLine::cursorAt(SizeType offset, const parser::IBufferProvider& doc) const {
   if (m_cells.empty()) {
     return {Point(m_pos.x + m_padding, m_pos.y), m_h, 0};
   }
-  auto totalOffset = 0;
-  for (auto cell : m_cells) {
-    if (totalOffset <= offset && offset < totalOffset + cell->length()) {
-      auto w = cell->width(offset - totalOffset, doc);
-      auto pos = Point(cell->m_pos.x + w, cell->m_pos.y + cell->ascent());
-      return {pos, cell->m_size.height, cell->ascent()};
-    }
-    totalOffset += cell->length();
+  ASSERT(hasIndex());
+  auto i = cellIndexAt(offset);
+  if (i >= 0 && i < static_cast<SizeType>(m_cells.size())) {
+    auto cell = m_cells[i];
+    auto w = cell->width(offset - m_cellOffsets[i], doc);
+    auto pos = Point(cell->m_pos.x + w, cell->m_pos.y + cell->ascent());
+    return {pos, cell->m_size.height, cell->ascent()};
   }
-  if (offset >= totalOffset) {
+  if (offset >= length()) {
     auto cell = m_cells.back();
     auto pos = Point(cell->m_pos.x + cell->width(), cell->m_pos.y + cell->ascent());
     return {pos, cell->m_size.height, cell->ascent()};
   }
-  DEBUG << m_cells.size() << offset << totalOffset;
+  DEBUG << m_cells.size() << offset << length();
   ASSERT(false && "cursor not in cell");
   auto cell = m_cells.back();
   return {Point(cell->m_pos.x, cell->m_pos.y + cell->ascent()), cell->m_size.height, cell->ascent()};
 }
-SizeType LogicalLine::length() const {
-  SizeType length = 0;
-  for (auto cell : m_cells) {
-    length += cell->length();
-  }
-  return length;
-}
+SizeType LogicalLine::length() const { return m_cellOffsets.back(); }
 
 bool LogicalLine::hasTextAt(SizeType offset) const {
-  auto totalOffset = 0;
-  for (auto cell : m_cells) {
-    if (totalOffset <= offset && offset <= totalOffset + cell->length()) {
-      auto leftOffset = offset - totalOffset;
-      return cell->textNode() != nullptr;
-    }
-    totalOffset += cell->length();
-  }
-  return false;
+  // 第一个满足 start <= offset <= end 的cell，即第一个end >= offset的cell
+  auto it = std::lower_bound(m_cellOffsets.begin() + 1, m_cellOffsets.end(), offset);
+  if (it == m_cellOffsets.end()) return false;
+  auto i = std::distance(m_cellOffsets.begin() + 1, it);
+  return m_cells[i]->textNode() != nullptr;
 }
 std::pair<parser::Text *, int> LogicalLine::textAt(SizeType offset) const {
-  auto totalOffset = 0;
-  for (auto cell : m_cells) {
-    if (totalOffset <= offset && offset <= totalOffset + cell->length()) {
-      auto leftOffset = offset - totalOffset;
-      auto* textNode = cell->textNode();
-      if (!textNode) continue;
-      return {textNode, leftOffset + cell->textOffset()};
-    }
-    totalOffset += cell->length();
+  auto it = std::lower_bound(m_cellOffsets.begin() + 1, m_cellOffsets.end(), offset);
+  auto i = std::distance(m_cellOffsets.begin() + 1, it);
+  // 落在cell边界上时，前一个cell不是Text就看后一个
+  for (; i < static_cast<SizeType>(m_cells.size()) && m_cellOffsets[i] <= offset; ++i) {
+    auto* cell = m_cells[i];
+    auto* textNode = cell->textNode();
+    if (!textNode) continue;
+    return {textNode, offset - m_cellOffsets[i] + cell->textOffset()};
   }
-  DEBUG << m_cells.size() << offset << totalOffset;
+  DEBUG << m_cells.size() << offset << length();
   ASSERT(false && "text not in cell");
   return {nullptr, 0};
 }
@@ -832,80 +1125,49 @@ String LogicalLine::left(SizeType length, const parser::IBufferProvider& doc) co
 }
 bool LogicalLine::canMoveDown(SizeType offset, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
-  auto totalOffset = 0;
-  for (int i = 0; i < m_lines.size(); ++i) {
-    auto &line = m_lines[i];
-    if (totalOffset <= offset && offset < totalOffset + line.length()) {
-      return i + 1 < m_lines.size();
-    }
-    totalOffset += line.length();
-  }
-  if (totalOffset == offset) {
-    return false;
-  }
-  DEBUG << this->length() << offset;
-  ASSERT(false && "no cell in line");
-  return false;
+  auto i = visualLineIndexAt(offset);
+  return i + 1 < static_cast<SizeType>(m_lines.size());
 }
 bool LogicalLine::canMoveUp(SizeType offset, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
   if (m_cells.empty()) return false;
-  auto totalOffset = 0;
-  for (int i = 0; i < m_lines.size(); ++i) {
-    auto &line = m_lines[i];
-    if (totalOffset <= offset && offset < totalOffset + line.length()) {
-      return i > 0;
-    }
-    totalOffset += line.length();
+  auto i = visualLineIndexAt(offset);
+  if (i < static_cast<SizeType>(m_lines.size())) {
+    return i > 0;
   }
-  if (totalOffset == offset) {
-    return m_lines.size() > 1;
-  }
-  DEBUG << this->length() << offset;
-  ASSERT(false && "no cell in line");
   return m_lines.size() > 1;
 }
 SizeType LogicalLine::moveDown(SizeType offset, int x, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
-  auto totalOffset = 0;
-  for (int visualLineNo = 0; visualLineNo < m_lines.size(); ++visualLineNo) {
-    if (totalOffset <= offset && offset < totalOffset + m_lines[visualLineNo].length()) {
-      ASSERT(visualLineNo + 1 < m_lines.size());
-      auto &line = m_lines[visualLineNo + 1];
-      auto [cell, delta] = line.cellAtX(x, doc);
-      return this->totalOffset(cell, delta);
-    }
-    totalOffset += m_lines[visualLineNo].length();
+  auto visualLineNo = visualLineIndexAt(offset);
+  if (visualLineNo >= static_cast<SizeType>(m_lines.size())) {
+    return this->length();
   }
-  return this->length();
+  ASSERT(visualLineNo + 1 < static_cast<SizeType>(m_lines.size()));
+  auto &line = m_lines[visualLineNo + 1];
+  auto [cell, delta] = line.cellAtX(x, doc);
+  return this->totalOffset(visualLineNo + 1, cell, delta);
 }
 SizeType LogicalLine::moveUp(SizeType offset, int x, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
-  auto totalOffset = 0;
-  for (int i = 0; i < m_lines.size(); ++i) {
-    if (totalOffset <= offset && offset < totalOffset + m_lines[i].length()) {
-      ASSERT(i - 1 >= 0);
-      auto &line = m_lines[i - 1];
-      auto [cell, delta] = line.cellAtX(x, doc);
-      return this->totalOffset(cell, delta);
-    }
-    totalOffset += m_lines[i].length();
-  }
-  if (totalOffset == offset) {
+  auto i = visualLineIndexAt(offset);
+  if (i >= static_cast<SizeType>(m_lines.size())) {
     ASSERT(!m_cells.empty());
     ASSERT(m_lines.size() > 1);
-    auto [cell, delta] = m_lines[m_lines.size() - 2].cellAtX(x, doc);
-    return this->totalOffset(cell, delta);
+    i = m_lines.size() - 1;
   }
-  ASSERT(false && "no offset in line");
+  ASSERT(i - 1 >= 0);
+  auto [cell, delta] = m_lines[i - 1].cellAtX(x, doc);
+  return this->totalOffset(i - 1, cell, delta);
 }
-SizeType LogicalLine::totalOffset(Cell *cell, SizeType delta) const {
+SizeType LogicalLine::totalOffset(SizeType lineNo, Cell *cell, SizeType delta) const {
   if (cell == nullptr) {
     return 0;
   }
-  SizeType offset = 0;
-  for (auto it : m_cells) {
-    if (it == cell) {
+  // cell只可能在这一行里，不用扫整个逻辑行
+  SizeType offset = m_lineOffsets[lineNo];
+  for (const auto &it : m_lines[lineNo].m_cells) {
+    if (it.get() == cell) {
       return offset + delta;
     }
     offset += it->length();
@@ -913,9 +1175,9 @@ SizeType LogicalLine::totalOffset(Cell *cell, SizeType delta) const {
   ASSERT(false && "no cell in line");
 }
 SizeType LogicalLine::moveToX(int x, const parser::IBufferProvider& doc, bool lastLine) const {
-  auto &line = lastLine ? m_lines.back() : m_lines.front();
-  auto [cell, delta] = line.cellAtX(x, doc);
-  return totalOffset(cell, delta);
+  SizeType lineNo = lastLine ? m_lines.size() - 1 : 0;
+  auto [cell, delta] = m_lines[lineNo].cellAtX(x, doc);
+  return totalOffset(lineNo, cell, delta);
 }
 int LogicalLine::width() const {
   int w = 0;
@@ -927,45 +1189,35 @@ int LogicalLine::width() const {
 SizeType LogicalLine::moveToBol(SizeType offset, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
   if (m_cells.empty()) return 0;
-  SizeType totalOffset = 0;
-  for (const auto &line : m_lines) {
-    if (totalOffset <= offset && offset < totalOffset + line.length()) {
-      return totalOffset;
-    }
-    totalOffset += line.length();
-  }
-  if (totalOffset == offset) {
-    ASSERT(!m_lines.empty());
-    return totalOffset - m_lines.back().length();
+  ASSERT(!m_lines.empty());
+  auto i = visualLineIndexAt(offset);
+  if (i >= static_cast<SizeType>(m_lines.size())) {
+    return m_lineOffsets[m_lines.size() - 1];
   }
-  ASSERT(false && "no offset in line");
+  return m_lineOffsets[i];
 }
 std::pair<SizeType, int> LogicalLine::moveToEol(SizeType offset, const parser::IBufferProvider& /*doc*/) const {
   ASSERT(offset >= 0 && offset <= this->length());
   if (m_cells.empty()) return {0, m_pos.x};
-  SizeType totalOffset = 0;
-  for (const auto &line : m_lines) {
-    if (totalOffset <= offset && offset < totalOffset + line.length()) {
-      return {totalOffset + line.length(), line.m_pos.x + line.width()};
-    }
-    totalOffset += line.length();
-  }
-  if (totalOffset == offset) {
-    ASSERT(!m_lines.empty());
+  ASSERT(!m_lines.empty());
+  auto i = visualLineIndexAt(offset);
+  if (i >= static_cast<SizeType>(m_lines.size())) {
     const auto &line = m_lines.back();
-    return {totalOffset, line.m_pos.x + line.width()};
+    return {length(), line.m_pos.x + line.width()};
   }
-  ASSERT(false && "no offset in line");
+  const auto &line = m_lines[i];
+  return {m_lineOffsets[i + 1], line.m_pos.x + line.width()};
 }
 SizeType LogicalLine::offsetAt(Point pos, const parser::IBufferProvider& doc, int lineSpacing) const {
   int y = m_pos.y;
   // -1表示没有算出offset
   SizeType offset = -1;
-  for (const auto &line : m_lines) {
+  for (SizeType lineNo = 0; lineNo < static_cast<SizeType>(m_lines.size()); ++lineNo) {
+    const auto &line = m_lines[lineNo];
     // 这里要考虑lineSpacing
     if (y - lineSpacing / 2 <= pos.y && pos.y <= y + line.height() + lineSpacing / 2) {
       auto [cell, delta] = line.cellAtX(pos.x, doc);
-      offset = this->totalOffset(cell, delta);
+      offset = this->totalOffset(lineNo, cell, delta);
       break;
     }
     y += line.height();
@@ -974,7 +1226,7 @@ SizeType LogicalLine::offsetAt(Point pos, const parser::IBufferProvider& doc, in
     ASSERT(!m_lines.empty());
     const auto &line = m_lines.back();
     auto [cell, delta] = line.cellAtX(pos.x, doc);
-    offset = this->totalOffset(cell, delta);
+    offset = this->totalOffset(m_lines.size() - 1, cell, delta);
   }
   if (offset != -1) {
     // 修正emoji offset — ensure cursor is at a valid code-point boundary
@@ -1001,14 +1253,12 @@ SizeType LogicalLine::offsetAt(Point pos, const parser::IBufferProvider& doc, in
 }
 int LogicalLine::visualLineAt(SizeType offset, const parser::IBufferProvider& doc) const {
   ASSERT(offset >= 0 && offset <= this->length());
-  SizeType totalOffset = 0;
-  for (int i = 0; i < m_lines.size(); ++i) {
-    if (totalOffset <= offset && offset <= totalOffset + m_lines[i].length()) {
-      return i;
-    }
-    totalOffset += m_lines[i].length();
+  // 第一个满足 start <= offset <= end 的行
+  auto it = std::lower_bound(m_lineOffsets.begin() + 1, m_lineOffsets.end(), offset);
+  if (it == m_lineOffsets.end()) {
+    return m_lines.size() - 1;
   }
-  return m_lines.size() - 1;
+  return std::distance(m_lineOffsets.begin() + 1, it);
 }
 VisualLine &LogicalLine::visualLineAt(int index) {
   ASSERT(index >= 0 && index < m_lines.size());
@@ -1020,12 +1270,9 @@ const VisualLine &LogicalLine::visualLineAt(int index) const {
 }
 bool LogicalLine::isBol(SizeType offset, const parser::IBufferProvider& doc) const {
   if (offset == 0) return true;
-  SizeType totalOffset = 0;
-  for (const auto &line : m_lines) {
-    if (totalOffset == offset) return true;
-    totalOffset += line.length();
-  }
-  return false;
+  if (m_lines.empty()) return false;
+  // 只看每一行的起点，不含最后的总长度
+  return std::binary_search(m_lineOffsets.begin(), m_lineOffsets.end() - 1, offset);
 }
 int Block::height() const {
   int h = 0;
@@ -1034,6 +1281,45 @@ int Block::height() const {
   }
   return h;
 }
+Block::ImageUpdate Block::updateDecodedImages(ImageCache &cache) {
+  ImageUpdate update = ImageUpdate::none;
+  std::erase_if(m_pendingImages, [&](const PendingImage &pending) {
+    if (pending.key.width == 0) {
+      if (cache.hasSourceSize(pending.key.path, pending.key.mtime)) update = ImageUpdate::relayout;
+      return false;
+    }
+    auto image = cache.find(pending.key);
+    if (!image) return false;
+    if (!*image) {
+      update = ImageUpdate::relayout;
+      return false;
+    }
+    // 占位色块换成了图片，所在的行要重画
+    for (const auto &command : m_displayList) {
+      if (command.type == DisplayCommandType::image && command.resource == pending.resource) {
+        sign(command.rect, (*image)->cacheKey);
+        break;
+      }
+    }
+    m_displayList.setImage(pending.resource, std::move(*image));
+    if (update == ImageUpdate::none) update = ImageUpdate::repaint;
+    return true;
+  });
+  if (update == ImageUpdate::repaint) m_version = nextBlockVersion();
+  return update;
+}
+void Block::sign(const Rect &rect, uint64_t value) {
+  auto it = std::upper_bound(m_lineSignatures.begin(), m_lineSignatures.end(), rect.y(),
+                             [](int y, const LineSignature &line) { return y < line.top; });
+  if (it != m_lineSignatures.begin()) {
+    --it;
+    if (rect.y() + rect.height() <= it->top + it->height) {
+      mixHash(it->hash, value);
+      return;
+    }
+  }
+  mixHash(m_chromeHash, value);
+}
 const LogicalLine &Block::logicalLineAt(SizeType index) const {
   ASSERT(index >= 0 && index < m_logicalLines.size());
   return m_logicalLines[index];
@@ -1047,11 +1333,52 @@ int Block::width() const {
 }
 Block Render::render(Node *node, sptr<RenderSetting> setting, const parser::IBufferProvider& doc,
                      IFontMetricsProvider* fontMetrics,
-                     editor::core::IImageProvider* imageProvider) {
+                     editor::core::IImageProvider* imageProvider,
+                     sptr<ShapeCache> shapeCache, sptr<StyleTable> styles, sptr<LatexCache> latexCache,
+                     sptr<ImageCache> imageCache, sptr<IconAtlas> icons, const Preedit* preedit) {
   ASSERT(node != nullptr);
-  LayoutPass render(node, setting, doc, fontMetrics, imageProvider);
+  LayoutPass render(node, setting, doc, fontMetrics, imageProvider, std::move(shapeCache), std::move(styles),
+                    std::move(latexCache), std::move(imageCache), std::move(icons), preedit);
   node->accept(&render);
   Block block = render.execute();
   return block;
 }
+bool Render::relayoutLine(Block &block, SizeType lineNo, Node *node, sptr<RenderSetting> setting,
+                          const parser::IBufferProvider &doc, IFontMetricsProvider *fontMetrics,
+                          editor::core::IImageProvider *imageProvider, sptr<LatexCache> latexCache,
+                          sptr<ImageCache> imageCache) {
+  ASSERT(node != nullptr);
+  // 代码块、列表的一行对应块结点的一个孩子，段落的行由换行隔开。
+  // 行数对不上(比如列表项里有换行、换行在粗体里)就只能整块重排
+  SizeType expected = 0;
+  switch (node->type()) {
+    case NodeType::code_block:
+    case NodeType::ul:
+    case NodeType::ol:
+    case NodeType::checkbox:
+      expected = static_cast<SizeType>(node->asContainer()->size());
+      break;
+    case NodeType::paragraph: {
+      const auto &children = node->asContainer()->children();
+      expected = 1 + std::count_if(children.begin(), children.end(),
+                                   [](const auto &child) { return child->type() == NodeType::lf; });
+      break;
+    }
+    default:
+      return false;
+  }
+  const auto count = static_cast<SizeType>(block.countOfLogicalLine());
+  if (lineNo < 0 || lineNo >= count || expected != count) return false;
+  auto *metrics = fontMetrics ? fontMetrics : &g_defaultFontMetrics;
+  if (!block.m_shapeCache || block.m_shapeCache->fontMetrics() != metrics || !block.m_styles) return false;
+  // 行里有公式、图片时，它们的异步结果按整块记录，不拆开替换
+  const auto &cells = block.logicalLineAt(lineNo).cells();
+  if (!std::all_of(cells.begin(), cells.end(), [](const Cell *cell) { return cell->textNode() != nullptr; })) {
+    return false;
+  }
+  LayoutPass render(node, std::move(setting), doc, fontMetrics, imageProvider, block.m_shapeCache, block.m_styles,
+                    std::move(latexCache), std::move(imageCache), block.m_icons);
+  block = render.relayout(node, std::move(block), lineNo);
+  return true;
+}
 }  // namespace md::render
@@ -5,20 +5,31 @@
 #ifndef QTMARKDOWN_RENDER_H
 #define QTMARKDOWN_RENDER_H
 #include "QtMarkdown_global.h"
-#include "Instruction.h"
+#include "DisplayList.h"
 #include "mddef.h"
 #include "parser/Document.h"
 #include "parser/IBufferProvider.h"
 #include "Element.h"
+#include "ImageCache.h"
+#include "LatexCache.h"
 #include "core/IImageProvider.h"
 namespace md::render {
 class IFontMetricsProvider;
+class IconAtlas;
+class ShapeCache;
+class StyleTable;
 struct RenderSetting {
   bool highlightCurrentLine = false;
   int blockSpacing = 10;
   int lineSpacing = 10;
   int maxWidth = 800;
   int latexFontSize = 20;
+  // 公式排版结果的磁盘缓存目录，为空时不用磁盘缓存
+  String latexCacheDir;
+  // 解码后图片占用的内存上限
+  std::size_t imageCacheMaxBytes = 64 * 1024 * 1024;
+  // 保留模式下块光栅化成图块缓存起来，这是图块占用的内存上限。为0时不缓存，每帧直接执行显示列表
+  std::size_t tileCacheMaxBytes = 0;
   int paragraphIntent = 2;
 #ifdef __ANDROID__
   String zhTextFont = "Noto Sans CJK SC";
@@ -34,6 +45,12 @@ struct RenderSetting {
   editor::core::Margins quoteMargin{10, 20, 20, 10};
   [[nodiscard]] int contentMaxWidth() const { return maxWidth - docMargin.left - docMargin.right; }
 };
+// 输入法正在组字的文本。排版时画在第lineNo个逻辑行的offset处，不生成Cell，不占逻辑行的长度
+struct Preedit {
+  SizeType lineNo;
+  SizeType offset;
+  String text;
+};
 class LogicalLine;
 class QTMARKDOWNRENDER_EXPORT VisualLine {
  public:
@@ -52,6 +69,8 @@ class QTMARKDOWNRENDER_EXPORT VisualLine {
   std::vector<std::unique_ptr<Cell>> m_cells;
   Point m_pos;
   int m_h;
+  // 由LogicalLine::buildIndex填充
+  SizeType m_length = 0;
   friend class LayoutPass;
   friend class LogicalLine;
 };
@@ -91,40 +110,84 @@ class QTMARKDOWNRENDER_EXPORT LogicalLine {
   const std::vector<Cell*>& cells() const { return m_cells; }
 
  private:
-  SizeType totalOffset(Cell* cell, SizeType delta) const;
+  SizeType totalOffset(SizeType lineNo, Cell* cell, SizeType delta) const;
+  // 排版结束后建立offset索引，之后的查询都是二分
+  void buildIndex();
+  bool hasIndex() const { return m_cellOffsets.size() == m_cells.size() + 1; }
+  // 满足cellOffset[i] <= offset的最大i，offset超出总长时返回m_cells.size()
+  SizeType cellIndexAt(SizeType offset) const;
+  // 满足lineOffset[i] <= offset的最大i，offset超出总长时返回m_lines.size()
+  SizeType visualLineIndexAt(SizeType offset) const;
 
  private:
   VisualLineList m_lines;
   std::vector<Cell*> m_cells;
+  // 前缀和：m_cellOffsets[i]是第i个cell的起始offset，最后一项是总长度
+  std::vector<SizeType> m_cellOffsets{0};
+  // 同上，按VisualLine
+  std::vector<SizeType> m_lineOffsets{0};
   Point m_pos;
   int m_h;
   int m_padding = 0;
+  // 排这一行时生成的绘图指令、元素在块里的下标范围[first, last)，只重排这一行时按它替换
+  SizeType m_firstCommand = 0;
+  SizeType m_lastCommand = 0;
+  SizeType m_firstElement = 0;
+  SizeType m_lastElement = 0;
   friend class LayoutPass;
 };
+// 一个可见行在块内占的纵向范围(到下一行开头)和行内绘图指令的摘要，
+// 前后两次排版摘要相同的行不用重画
+struct LineSignature {
+  int top;
+  int height;
+  uint64_t hash;
+  bool operator==(const LineSignature& other) const = default;
+};
 class QTMARKDOWNRENDER_EXPORT Block {
  public:
   using LogicalLineList = std::vector<LogicalLine>;
+  // 排版时还在后台解码的图片，resource是DisplayList里的图片下标
+  struct PendingImage {
+    ImageKey key;
+    uint32_t resource;
+  };
+  enum class ImageUpdate { none, repaint, relayout };
   Block() = default;
   Block(const Block&) = delete;
   Block& operator=(const Block&) = delete;
   Block(Block&&) noexcept = default;
   Block& operator=(Block&&) noexcept = default;
-  void setInstructions(InstructionPtrList instructions) { m_instructions = std::move(instructions); }
   void appendElement(Element element) { m_elements.push_back(element); }
   int width() const;
   [[nodiscard]] int height() const;
   [[nodiscard]] const LogicalLineList& lines() const { return m_logicalLines; }
-  [[nodiscard]] auto begin() const { return m_instructions.begin(); }
-  [[nodiscard]] auto end() const { return m_instructions.end(); }
+  [[nodiscard]] const DisplayList& displayList() const { return m_displayList; }
   auto countOfLogicalLine() const { return m_logicalLines.size(); }
   const LogicalLine& logicalLineAt(SizeType index) const;
   const ElementList& elementList() const { return m_elements; }
+  // 与宽度无关的排版缓存，传回Render::render即可只重新断行
+  [[nodiscard]] const sptr<ShapeCache>& shapeCache() const { return m_shapeCache; }
+  // 排版时还没排好的公式，用的是占位大小
+  [[nodiscard]] const std::vector<LatexKey>& pendingLatex() const { return m_pendingLatex; }
+  [[nodiscard]] const std::vector<PendingImage>& pendingImages() const { return m_pendingImages; }
+  // 把解码好的图片填进显示列表，大小已知的只需要重画；
+  // 大小未知的(用的默认占位大小)或解码失败的返回relayout，需要重新排版
+  ImageUpdate updateDecodedImages(ImageCache& cache);
+  // 每次排版或填进图片都换一个新的版本号，版本号相同的块画出来一定一样
+  [[nodiscard]] uint64_t version() const { return m_version; }
+  // 按top排好序
+  [[nodiscard]] const std::vector<LineSignature>& lineSignatures() const { return m_lineSignatures; }
+  // 不落在任何一行里的绘图指令(代码块背景、引用竖线等)的摘要
+  [[nodiscard]] uint64_t chromeHash() const { return m_chromeHash; }
+  // 组字文本画在哪(块内坐标)，没有时为空
+  [[nodiscard]] const Rect& preeditRect() const { return m_preeditRect; }
 
  private:
-  // Destruction order: m_instructions (non-owning raw Cell*) destroyed BEFORE m_logicalLines.
+  // Destruction order: m_displayList (non-owning raw Cell*) destroyed BEFORE m_logicalLines.
   // m_logicalLines owns cells via VisualLine::vector<unique_ptr<Cell>>.
-  // C++ destroys members in reverse declaration order, so m_instructions is destroyed first.
-  // The raw Cell* pointers in Instructions dangle only after the Instructions themselves are gone.
+  // C++ destroys members in reverse declaration order, so m_displayList is destroyed first.
+  // The raw Cell* pointers in DisplayCommands dangle only after the DisplayList itself is gone.
   //
   // NOTE: No static_assert with offsetof here — Block is not a standard-layout type
   // (has std::vector members, members under different access specifiers).
@@ -132,20 +195,45 @@ class QTMARKDOWNRENDER_EXPORT Block {
   // 逻辑行
   LogicalLineList m_logicalLines;
   // 绘图指令
-  InstructionPtrList m_instructions;
+  DisplayList m_displayList;
   ElementList m_elements;
+  sptr<ShapeCache> m_shapeCache;
+  // Cell和DisplayList里的StyleId指向这里
+  sptr<StyleTable> m_styles;
+  // DisplayList里的图标槽位指向这里
+  sptr<IconAtlas> m_icons;
+  std::vector<LatexKey> m_pendingLatex;
+  std::vector<PendingImage> m_pendingImages;
+  uint64_t m_version = 0;
+  std::vector<LineSignature> m_lineSignatures;
+  uint64_t m_chromeHash = 0;
+  Rect m_preeditRect;
 
   // Non-owning pointer to the AST node this Block was rendered from.
   // The AST (parser::Document) must outlive this Block.
-  // For debugging only — prefer Element/Instruction data in production paths.
+  // For debugging only — prefer Element/DisplayList data in production paths.
   friend class LayoutPass;
+  friend class Render;
+
+ private:
+  // 把一条绘图指令的摘要并进它所在的行，跨行的并进chromeHash
+  void sign(const Rect& rect, uint64_t value);
 };
 
 class QTMARKDOWNRENDER_EXPORT Render {
  public:
   static Block render(parser::Node* node, sptr<RenderSetting> setting, const parser::IBufferProvider& doc,
                       IFontMetricsProvider* fontMetrics = nullptr,
-                      editor::core::IImageProvider* imageProvider = nullptr);
+                      editor::core::IImageProvider* imageProvider = nullptr,
+                      sptr<ShapeCache> shapeCache = nullptr, sptr<StyleTable> styles = nullptr,
+                      sptr<LatexCache> latexCache = nullptr, sptr<ImageCache> imageCache = nullptr,
+                      sptr<IconAtlas> icons = nullptr, const Preedit* preedit = nullptr);
+  // 结构没变时只重排block的第lineNo个逻辑行(node是排出block的那个块结点)，
+  // 其它行原样保留，后面的行按高度差平移。块的类型不支持时返回false，block不变
+  static bool relayoutLine(Block& block, SizeType lineNo, parser::Node* node, sptr<RenderSetting> setting,
+                           const parser::IBufferProvider& doc, IFontMetricsProvider* fontMetrics = nullptr,
+                           editor::core::IImageProvider* imageProvider = nullptr,
+                           sptr<LatexCache> latexCache = nullptr, sptr<ImageCache> imageCache = nullptr);
 
  private:
 };
@@ -0,0 +1,121 @@
+#include "ShapeCache.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "FontMetricsProvider.h"
+#include "core/Utf8Util.h"
+#include "debug.h"
+namespace md::render {
+const std::vector<RenderString>& ShapeCache::runs(parser::Text* node, const String& str) {
+  ASSERT(node != nullptr);
+  auto& shaped = m_runs[node];
+  auto cached = shaped.generation != 0;
+  shaped.generation = m_generation;
+  if (cached && shaped.str == str) {
+    m_hits++;
+    return shaped.runs;
+  }
+  m_misses++;
+  shaped.str = str;
+  shaped.runs = StringUtil::split(str);
+  shaped.shaped.clear();
+  return shaped.runs;
+}
+int ShapeCache::advance(const Font& font, const String& text) {
+  if (text.isEmpty()) return 0;
+  // 单个字符查表，否则整串交给字体测量，和绘制时的结果一致
+  if (md::utf8SequenceLength(text[0]) >= static_cast<int>(text.size())) {
+    return static_cast<int>(std::lround(clusterAdvance(fontEntry(font), text, 0, text.size())));
+  }
+  return m_fm->horizontalAdvance(font, text);
+}
+const RunAdvances& ShapeCache::runAdvances(parser::Text* node, const Font& font, SizeType pos) {
+  auto it = m_runs.find(node);
+  ASSERT(it != m_runs.end());
+  auto& shaped = it->second;
+  const auto& runs = shaped.runs;
+  auto run = std::upper_bound(runs.begin(), runs.end(), pos,
+                              [](SizeType offset, const RenderString& s) { return offset < s.offset; });
+  ASSERT(run != runs.begin());
+  --run;
+  ASSERT(pos <= run->offset + run->length);
+  for (const auto& cached : shaped.shaped) {
+    if (cached.advances.offset == run->offset && cached.font == font) return cached.advances;
+  }
+  auto& entry = fontEntry(font);
+  const auto& str = shaped.str;
+  const SizeType length = run->length;
+  std::vector<double> sums(length + 1, 0);
+  SizeType i = 0;
+  double w = 0;
+  while (i < length) {
+    int len = md::utf8SequenceLength(str[run->offset + i]);
+    if (i + len > length) len = length - i;
+    for (int j = 1; j < len; ++j) {
+      sums[i + j] = w;
+    }
+    w += clusterAdvance(entry, str, run->offset + i, len);
+    i += len;
+    sums[i] = w;
+  }
+  // 整段测一次，把字距调整和连字摊到各个码点上
+  double total = m_fm->horizontalAdvance(font, str.mid(run->offset, length));
+  double scale = w > 0 ? total / w : 1;
+  auto prefix = std::make_shared<std::vector<int>>(length + 1);
+  for (i = 0; i <= length; ++i) {
+    (*prefix)[i] = static_cast<int>(std::lround(sums[i] * scale));
+  }
+  auto& result = shaped.shaped.emplace_back();
+  result.font = font;
+  result.advances.offset = run->offset;
+  result.advances.prefix = std::move(prefix);
+  return result.advances;
+}
+int ShapeCache::ascent(const Font& font) {
+  auto& entry = fontEntry(font);
+  if (entry.ascent < 0) {
+    entry.ascent = m_fm->ascent(font);
+  }
+  return entry.ascent;
+}
+int ShapeCache::height(const Font& font) {
+  auto& entry = fontEntry(font);
+  if (entry.height < 0) {
+    entry.height = m_fm->height(font);
+  }
+  return entry.height;
+}
+void ShapeCache::endPass() {
+  std::erase_if(m_runs, [this](const auto& it) { return it.second.generation != m_generation; });
+}
+ShapeCache::FontEntry& ShapeCache::fontEntry(const Font& font) {
+  // 一个块里通常只有几种字体，线性查找即可
+  for (auto& entry : m_fonts) {
+    if (entry.font == font) return entry;
+  }
+  auto& entry = m_fonts.emplace_back();
+  entry.font = font;
+  entry.ascii.fill(-1);
+  return entry;
+}
+double ShapeCache::clusterAdvance(FontEntry& entry, const String& text, SizeType pos, int len) {
+  auto ch = static_cast<unsigned char>(text[pos]);
+  if (len == 1 && ch < 128) {
+    auto& w = entry.ascii[ch];
+    if (w < 0) {
+      w = m_fm->horizontalAdvanceF(entry.font, String(static_cast<char>(ch)));
+    }
+    return w;
+  }
+  uint32_t key = 0;
+  for (int i = 0; i < len; ++i) {
+    key = (key << 8) | static_cast<unsigned char>(text[pos + i]);
+  }
+  auto it = entry.others.find(key);
+  if (it != entry.others.end()) return it->second;
+  auto w = m_fm->horizontalAdvanceF(entry.font, text.mid(pos, len));
+  entry.others.emplace(key, w);
+  return w;
+}
+}  // namespace md::render
@@ -0,0 +1,78 @@
+#ifndef QTMARKDOWN_SHAPECACHE_H
+#define QTMARKDOWN_SHAPECACHE_H
+#include "QtMarkdown_global.h"
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "StringUtil.h"
+#include "mddef.h"
+namespace md::parser {
+class Text;
+}
+namespace md::render {
+class IFontMetricsProvider;
+// 一个run按字节的累计宽度，prefix[i]是run前i个字节的宽度，多字节字符的后续字节取字符起点的宽度。
+// 按码点累加小数宽度，再缩放到整段测出的宽度(含字距调整和连字)，每段只取整一次
+struct RunAdvances {
+  // run在Text结点字符串里的起点
+  SizeType offset = 0;
+  sptr<const std::vector<int>> prefix;
+  [[nodiscard]] int at(SizeType pos) const { return (*prefix)[pos - offset]; }
+  [[nodiscard]] int width(SizeType begin, SizeType end) const { return at(end) - at(begin); }
+};
+// 与宽度无关的排版结果（分段、字形宽度），按块缓存。
+// 宽度变化时LayoutPass复用这里的结果，只重新断行和定位。
+class QTMARKDOWNRENDER_EXPORT ShapeCache {
+ public:
+  explicit ShapeCache(IFontMetricsProvider* fm) : m_fm(fm) {}
+  ShapeCache(const ShapeCache&) = delete;
+  ShapeCache& operator=(const ShapeCache&) = delete;
+  IFontMetricsProvider* fontMetrics() const { return m_fm; }
+  // Text结点按脚本切分的结果，内容变化时自动失效
+  const std::vector<RenderString>& runs(parser::Text* node, const String& str);
+  // 整串测量的宽度
+  int advance(const Font& font, const String& text);
+  // Text结点里包含pos的那个run的累计宽度，要先调用过runs
+  const RunAdvances& runAdvances(parser::Text* node, const Font& font, SizeType pos);
+  int height(const Font& font);
+  int ascent(const Font& font);
+  // 一次排版前后调用，清理不再出现的Text结点
+  void beginPass() { m_generation++; }
+  void endPass();
+  SizeType countOfShapedText() const { return m_runs.size(); }
+  SizeType hits() const { return m_hits; }
+  SizeType misses() const { return m_misses; }
+
+ private:
+  struct FontEntry {
+    Font font;
+    int height = -1;
+    int ascent = -1;
+    // 单个码点的小数宽度
+    std::array<double, 128> ascii;
+    std::unordered_map<uint32_t, double> others;
+  };
+  struct ShapedRun {
+    Font font;
+    RunAdvances advances;
+  };
+  struct ShapedText {
+    String str;
+    std::vector<RenderString> runs;
+    std::vector<ShapedRun> shaped;
+    uint64_t generation = 0;
+  };
+  FontEntry& fontEntry(const Font& font);
+  double clusterAdvance(FontEntry& entry, const String& text, SizeType pos, int len);
+
+  IFontMetricsProvider* m_fm;
+  std::vector<FontEntry> m_fonts;
+  std::unordered_map<parser::Text*, ShapedText> m_runs;
+  uint64_t m_generation = 0;
+  SizeType m_hits = 0;
+  SizeType m_misses = 0;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_SHAPECACHE_H
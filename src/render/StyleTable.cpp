@@ -0,0 +1,36 @@
+#include "StyleTable.h"
+
+#include <functional>
+
+#include "debug.h"
+namespace md::render {
+StyleTable::StyleTable() {
+  Font font;
+  font.pixelSize = 18;
+  intern(font, Color::black());
+}
+StyleId StyleTable::intern(const Font& font, const Color& pen) {
+  auto h = hash(font, pen);
+  auto [first, last] = m_ids.equal_range(h);
+  for (auto it = first; it != last; ++it) {
+    const auto& style = m_styles[it->second];
+    if (style.font == font && style.pen == pen) return it->second;
+  }
+  auto id = static_cast<StyleId>(m_styles.size());
+  m_styles.push_back({font, pen});
+  m_ids.emplace(h, id);
+  return id;
+}
+const Style& StyleTable::style(StyleId id) const {
+  ASSERT(id < m_styles.size());
+  return m_styles[id];
+}
+std::size_t StyleTable::hash(const Font& font, const Color& pen) {
+  std::size_t h = std::hash<std::string>()(font.family);
+  auto mix = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+  mix(font.pixelSize);
+  mix(font.bold | font.italic << 1 | font.underline << 2 | font.strikeOut << 3);
+  mix(static_cast<std::size_t>(pen.r) << 24 | pen.g << 16 | pen.b << 8 | pen.a);
+  return h;
+}
+}  // namespace md::render
@@ -0,0 +1,38 @@
+#ifndef QTMARKDOWN_STYLETABLE_H
+#define QTMARKDOWN_STYLETABLE_H
+#include "QtMarkdown_global.h"
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+
+#include "mddef.h"
+namespace md::render {
+using StyleId = uint32_t;
+struct Style {
+  Font font;
+  Color pen;
+  bool operator==(const Style& other) const = default;
+};
+// 文档级的样式表，把字体+颜色组合映射成小整数。
+// Cell和Instruction只保存StyleId，绘制时再查表。
+class QTMARKDOWNRENDER_EXPORT StyleTable {
+ public:
+  StyleTable();
+  StyleTable(const StyleTable&) = delete;
+  StyleTable& operator=(const StyleTable&) = delete;
+  StyleId intern(const Font& font, const Color& pen);
+  // 返回的引用在样式表生命周期内一直有效
+  [[nodiscard]] const Style& style(StyleId id) const;
+  [[nodiscard]] const Font& font(StyleId id) const { return style(id).font; }
+  [[nodiscard]] const Color& pen(StyleId id) const { return style(id).pen; }
+  [[nodiscard]] SizeType size() const { return m_styles.size(); }
+  static constexpr StyleId defaultStyle = 0;
+
+ private:
+  static std::size_t hash(const Font& font, const Color& pen);
+  std::deque<Style> m_styles;
+  // 按哈希值找id，样式本身只在m_styles里存一份，查找时也不构造Style
+  std::unordered_multimap<std::size_t, StyleId> m_ids;
+};
+}  // namespace md::render
+#endif  // QTMARKDOWN_STYLETABLE_H
@@ -10,11 +10,6 @@ namespace md::editor::core {
 class AbstractPainter;
 }
 namespace md {
-namespace render {
-class Instruction;
-}
-using InstructionPtr = std::unique_ptr<render::Instruction>;
-using InstructionPtrList = std::vector<InstructionPtr>;
 using Color = editor::core::Color;
 using Painter = editor::core::AbstractPainter;
 using Point = editor::core::Point;
@@ -0,0 +1,81 @@
+// 光标导航基准：在很长的折行段落和代码块上逐offset查询光标位置，再上下移动
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "SimpleFontMetricsProvider.h"
+#include "parser/Document.h"
+#include "render/Render.h"
+using namespace md;
+using namespace md::parser;
+using namespace md::render;
+
+static String makeMarkdown(int repeat) {
+  String md;
+  for (int i = 0; i < repeat; ++i) {
+    md += "Plain text with **bold words**, *italic words* and `inline code` mixed in. ";
+  }
+  md += "\n\n";
+  for (int i = 0; i < repeat; ++i) {
+    md += "敏捷的棕色狐狸跳过了懒狗。";
+  }
+  md += "\n\n```cpp\n";
+  for (int i = 0; i < repeat; ++i) {
+    md += "int value = compute(first, second) + another_long_identifier_name * 42;\n";
+  }
+  md += "```\n";
+  return md;
+}
+
+int main(int argc, char** argv) {
+  int repeat = argc > 1 ? std::atoi(argv[1]) : 200;
+  int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+  Document doc(makeMarkdown(repeat));
+  auto setting = std::make_shared<RenderSetting>();
+  SimpleFontMetricsProvider fm;
+  BlockList blocks;
+  for (auto& node : doc.root()->children()) {
+    blocks.push_back(Render::render(node.get(), setting, doc, &fm));
+  }
+
+  std::size_t queries = 0;
+  std::size_t visualLines = 0;
+  // 防止查询结果被优化掉
+  SizeType sink = 0;
+  double totalMs = 0;
+  for (int round = 0; round < rounds; ++round) {
+    queries = 0;
+    visualLines = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& block : blocks) {
+      for (const auto& line : block.lines()) {
+        visualLines += line.countOfVisualLine();
+        auto length = line.length();
+        for (SizeType offset = 0; offset <= length; ++offset) {
+          auto [pos, h, ascent] = line.cursorAt(offset, doc);
+          sink += pos.x + line.visualLineAt(offset, doc) + line.isBol(offset, doc) + line.hasTextAt(offset);
+          queries += 4;
+        }
+        // 从头一直按下键到尾，再按上键回来
+        SizeType offset = 0;
+        while (line.canMoveDown(offset, doc)) {
+          offset = line.moveDown(offset, 200, doc);
+          sink += line.moveToBol(offset, doc) + line.moveToEol(offset, doc).first;
+          queries += 4;
+        }
+        while (line.canMoveUp(offset, doc)) {
+          offset = line.moveUp(offset, 200, doc);
+          queries += 2;
+        }
+        sink += offset;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    totalMs += std::chrono::duration<double, std::milli>(end - start).count();
+  }
+  std::cout << "visual lines: " << visualLines << "\n";
+  std::cout << "queries: " << queries << " per round\n";
+  std::cout << "navigation: " << totalMs / rounds << " ms/round\n";
+  std::cout << "sink: " << sink << "\n";
+  return 0;
+}
@@ -0,0 +1,57 @@
+// 公式磁盘缓存基准：冷启动排版一篇公式很多的文档，再用同一个缓存目录重新打开。
+// 只统计排版，不绘制，所以不包括画公式时的解析
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+
+#include "SimpleFontMetricsProvider.h"
+#include "parser/Document.h"
+#include "render/LatexCache.h"
+#include "render/LatexDiskCache.h"
+#include "render/Render.h"
+using namespace md;
+using namespace md::parser;
+using namespace md::render;
+
+static String makeMarkdown(int formulas) {
+  String md;
+  for (int i = 0; i < formulas; ++i) {
+    md += std::format("Formula {}: $\\sum_{{k=0}}^{{{}}} \\frac{{x^k}}{{k!}}$ and more text.\n\n", i, i);
+    if (i % 10 == 0) {
+      md += std::format("$$\n\\begin{{pmatrix}} a_{{{}}} & b \\\\ c & d \\end{{pmatrix}}\n$$\n\n", i);
+    }
+  }
+  return md;
+}
+
+// 模拟打开文档：新建缓存，排版所有块，第一次绘制前所有公式都要能拿到大小
+static double open(const Document& doc, const std::filesystem::path& dir, SizeType& diskHits) {
+  auto setting = std::make_shared<RenderSetting>();
+  SimpleFontMetricsProvider fm;
+  auto start = std::chrono::steady_clock::now();
+  auto disk = std::make_shared<LatexDiskCache>(dir);
+  auto latexCache = std::make_shared<LatexCache>(1024, 0, nullptr, disk);
+  BlockList blocks;
+  for (auto& node : doc.root()->children()) {
+    blocks.push_back(Render::render(node.get(), setting, doc, &fm, nullptr, nullptr, nullptr, latexCache));
+  }
+  auto end = std::chrono::steady_clock::now();
+  diskHits = disk->hits();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+  int formulas = argc > 1 ? std::atoi(argv[1]) : 500;
+  auto dir = std::filesystem::temp_directory_path() / "qtmarkdown_bench_latex";
+  std::filesystem::remove_all(dir);
+  Document doc(makeMarkdown(formulas));
+  SizeType diskHits = 0;
+  auto cold = open(doc, dir, diskHits);
+  std::cout << "cold open (layout only): " << cold << " ms, disk hits: " << diskHits << "\n";
+  auto warm = open(doc, dir, diskHits);
+  std::cout << "warm open (layout only): " << warm << " ms, disk hits: " << diskHits << "\n";
+  std::filesystem::remove_all(dir);
+  return 0;
+}
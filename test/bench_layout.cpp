@@ -0,0 +1,76 @@
+// 排版基准：对一篇较大的文档逐块做LayoutPass，统计耗时、堆分配次数和单元格大小
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "SimpleFontMetricsProvider.h"
+#include "parser/Document.h"
+#include "render/Cell.h"
+#include "render/Render.h"
+#include "render/StyleTable.h"
+using namespace md;
+using namespace md::parser;
+using namespace md::render;
+
+static std::size_t g_allocations = 0;
+void* operator new(std::size_t size) {
+  g_allocations++;
+  if (void* p = std::malloc(size)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static String makeMarkdown(int sections) {
+  String md;
+  for (int i = 0; i < sections; ++i) {
+    md += "# Section title\n\n";
+    md += "Plain text with **bold words**, *italic words*, ~~strike~~ and `inline code` mixed in. "
+          "敏捷的棕色狐狸跳过了懒狗，然后继续向前跑。 The quick brown fox jumps over the lazy dog.\n\n";
+    md += "- first item with [a link](https://example.com)\n- second item\n\n";
+    md += "1. ordered one\n2. ordered two\n\n";
+    md += "> quoted text that is long enough to wrap around the editor width at least once or twice\n\n";
+  }
+  return md;
+}
+
+int main(int argc, char** argv) {
+  int sections = argc > 1 ? std::atoi(argv[1]) : 200;
+  int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+  Document doc(makeMarkdown(sections));
+  auto setting = std::make_shared<RenderSetting>();
+  if (argc > 3) setting->zhTextFont = argv[3];
+  SimpleFontMetricsProvider fm;
+  // 和editor::Document一样，所有块共享一张样式表
+  auto styles = std::make_shared<StyleTable>();
+
+  std::size_t cells = 0;
+  std::size_t allocations = 0;
+  double totalMs = 0;
+  for (int round = 0; round < rounds; ++round) {
+    BlockList blocks;
+    blocks.reserve(doc.root()->size());
+    cells = 0;
+    auto allocBefore = g_allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& node : doc.root()->children()) {
+      blocks.push_back(Render::render(node.get(), setting, doc, &fm, nullptr, nullptr, styles));
+    }
+    auto end = std::chrono::steady_clock::now();
+    allocations = g_allocations - allocBefore;
+    totalMs += std::chrono::duration<double, std::milli>(end - start).count();
+    for (const auto& block : blocks) {
+      for (const auto& line : block.lines()) {
+        cells += line.cells().size();
+      }
+    }
+  }
+  std::cout << "blocks: " << doc.root()->size() << "\n";
+  std::cout << "cells: " << cells << "\n";
+  std::cout << "sizeof(TextCell): " << sizeof(TextCell) << "\n";
+  std::cout << "layout: " << totalMs / rounds << " ms/round\n";
+  std::cout << "allocations: " << allocations << " per round\n";
+  std::cout << "styles: " << styles->size() << "\n";
+  return 0;
+}
@@ -0,0 +1,125 @@
+// 按键延迟基准：在一个很多行的段落里轮流往各行打字，统计每次按键(插入+重新排版)的耗时分布。
+// 行中间敲字母走快速路径，行首敲字母只能序列化整块再重新解析，两者对比。
+// 另外模拟快速打字时一帧里到了好几个按键，比较逐个处理和合成一次插入的按键到画出来的延迟
+#include <QGuiApplication>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "editor/Cursor.h"
+#include "editor/Document.h"
+#include "editor/Editor.h"
+#include "core/Event.h"
+#include "NullImageProvider.h"
+using namespace md;
+using namespace md::editor;
+
+static String makeMarkdown(int lines) {
+  String md = "# Typing\n\n";
+  for (int i = 0; i < lines; ++i) {
+    md += "Plain text with **bold words**, *italic* and `code`.\n";
+  }
+  md += "\n";
+  return md;
+}
+
+struct Latency {
+  double p50;
+  double p99;
+  double max;
+};
+
+static Latency measure(std::vector<double>& samples) {
+  std::sort(samples.begin(), samples.end());
+  auto at = [&samples](double q) { return samples[std::size_t(q * (samples.size() - 1))]; };
+  return {at(0.5), at(0.99), samples.back()};
+}
+
+static Latency type(int lines, int keys, bool atLineStart) {
+  static core::NullImageProvider nullProvider;
+  Editor editor(&nullProvider);
+  editor.loadText(makeMarkdown(lines));
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  std::vector<double> samples;
+  samples.reserve(keys);
+  const String letters = "abcdefghijklmnopqrstuvwxyz";
+  for (int i = 0; i < keys; ++i) {
+    // 每行都打在第一个单词后面，一行只多几个字符，不会折行
+    doc->updateCursor(cursor, CursorCoord{1, i % lines, atLineStart ? 0 : 5});
+    auto start = std::chrono::steady_clock::now();
+    editor.insertText(letters.mid(i % letters.size(), 1));
+    auto end = std::chrono::steady_clock::now();
+    samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  return measure(samples);
+}
+
+class LetterKeyEvent : public core::KeyEvent {
+ public:
+  explicit LetterKeyEvent(char ch) : m_ch(ch) {}
+  core::Key key() const override { return static_cast<core::Key>(m_ch - 'a' + 'A'); }
+  core::Modifier modifiers() const override { return core::Modifier::None; }
+  std::string text() const override { return std::string(1, m_ch); }
+  bool isAutoRepeat() const override { return true; }
+
+ private:
+  char m_ch;
+};
+
+// 每帧到keysPerFrame个按键，都算在帧开始时到达。一个按键的延迟是从帧开始到它所在的那次更新
+// (takeDamage和文档高度，界面每次重画前要做的)完成
+static Latency burst(int lines, int frames, int keysPerFrame, bool coalescing) {
+  static core::NullImageProvider nullProvider;
+  Editor editor(&nullProvider);
+  editor.setInputCoalescing(coalescing);
+  editor.loadText(makeMarkdown(lines));
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  std::vector<double> samples;
+  samples.reserve(frames * keysPerFrame);
+  auto paint = [&editor]() {
+    editor.takeDamage();
+    return editor.height();
+  };
+  for (int i = 0; i < frames; ++i) {
+    doc->updateCursor(cursor, CursorCoord{1, i % lines, 5});
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [start]() {
+      return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    };
+    for (int k = 0; k < keysPerFrame; ++k) {
+      editor.keyPressEvent(LetterKeyEvent(char('a' + k % 26)));
+      if (!coalescing) {
+        paint();
+        samples.push_back(elapsed());
+      }
+    }
+    if (coalescing) {
+      editor.flushInput();
+      paint();
+      samples.insert(samples.end(), keysPerFrame, elapsed());
+    }
+  }
+  return measure(samples);
+}
+
+static void print(const char* name, const Latency& latency) {
+  std::cout << name << ": p50 " << latency.p50 << " us, p99 " << latency.p99 << " us, max " << latency.max
+            << " us\n";
+}
+
+int main(int argc, char** argv) {
+  QGuiApplication app(argc, argv);
+  int lines = argc > 1 ? std::atoi(argv[1]) : 200;
+  int keys = argc > 2 ? std::atoi(argv[2]) : 1000;
+  std::cout << "paragraph bytes: " << makeMarkdown(lines).size() << ", keystrokes: " << keys << "\n";
+  print("plain typing (in place)", type(lines, keys, false));
+  print("typing at line start (reparse)", type(lines, keys, true));
+  int frames = std::max(1, keys / 4);
+  print("4 keys per frame, one by one", burst(lines, frames, 4, false));
+  print("4 keys per frame, coalesced", burst(lines, frames, 4, true));
+  return 0;
+}
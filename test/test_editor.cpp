@@ -4,11 +4,24 @@
 #include "editor/Cursor.h"
 #include "editor/Document.h"
 #include "editor/Editor.h"
+#include "editor/AsyncSaver.h"
+#include "editor/EditJournal.h"
+#include "editor/MarkdownSerializer.h"
+#include "editor/SearchEngine.h"
+#include "render/ImageCache.h"
+#include "render/LatexCache.h"
 #include "parser/Document.h"
 #include "parser/Text.h"
 #include "parser/nodes/UnorderedList.h"
 #include "parser/nodes/CheckboxList.h"
 #include <QGuiApplication>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
 #include "NullImageProvider.h"
 #include "debug.h"
 using namespace md::editor;
@@ -866,28 +879,39 @@ a😊b
 TEST_CASE("PreeditTest,  ShowPreedit") {
   static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
   editor.loadText(R"()");
-  editor.setPreedit("a");
   auto doc = editor.document();
   auto& blocks = doc->blocks();
   auto& cursor = editor.cursor();
+  auto revision = doc->revision();
+  // 组字文本只画出来，不进文档
+  editor.setPreedit("a");
   CHECK(blocks.size() == 1);
   CHECK(doc->root()->size() == 1);
-  CHECK(cursor.coord().offset == 1);
-  CHECK(blocks[0].logicalLineAt(0).length() == 1);
+  CHECK(cursor.coord().offset == 0);
+  CHECK(blocks[0].logicalLineAt(0).length() == 0);
   CHECK(doc->root()->childAt(0)->type() == NodeType::paragraph);
-  CHECK(static_cast<md::parser::Paragraph*>(doc->root()->childAt(0))->size() == 1);
+  CHECK(static_cast<md::parser::Paragraph*>(doc->root()->childAt(0))->size() == 0);
+  auto rect = blocks[0].preeditRect();
+  CHECK(!rect.isEmpty());
+  CHECK(cursor.pos().x == rect.x() + rect.width());
   editor.setPreedit("ab");
-  CHECK(blocks.size() == 1);
-  CHECK(doc->root()->size() == 1);
-  CHECK(cursor.coord().offset == 2);
-  CHECK(static_cast<md::parser::Paragraph*>(doc->root()->childAt(0))->size() == 1);
-  CHECK(blocks[0].logicalLineAt(0).length() == 2);
+  CHECK(cursor.coord().offset == 0);
+  CHECK(blocks[0].logicalLineAt(0).length() == 0);
+  CHECK(blocks[0].preeditRect().width() > rect.width());
   editor.setPreedit("abc");
+  CHECK(cursor.coord().offset == 0);
+  CHECK(blocks[0].logicalLineAt(0).length() == 0);
+  CHECK(doc->revision() == revision);
+  // 提交时才插入一次
+  editor.commitString("abc");
   CHECK(blocks.size() == 1);
-  CHECK(doc->root()->size() == 1);
+  CHECK(blocks[0].preeditRect().isEmpty());
   CHECK(cursor.coord().offset == 3);
-  CHECK(static_cast<md::parser::Paragraph*>(doc->root()->childAt(0))->size() == 1);
   CHECK(blocks[0].logicalLineAt(0).length() == 3);
+  CHECK(static_cast<md::parser::Paragraph*>(doc->root()->childAt(0))->size() == 1);
+  CHECK(doc->revision() == revision + 1);
+  doc->undo(cursor);
+  CHECK(blocks[0].logicalLineAt(0).length() == 0);
 }
 
 TEST_CASE("PreeditTest,  ShowPreedit2") {
@@ -914,6 +938,14 @@ TEST_CASE("PreeditTest,  ShowPreedit2") {
     CHECK(header->size() == 0);
   }
   editor.setPreedit("a");
+  {
+    auto node = doc->root()->childAt(0);
+    CHECK(node->type() == NodeType::header);
+    auto header = (md::parser::Header*)node;
+    CHECK(header->size() == 0);
+    CHECK(!blocks[0].preeditRect().isEmpty());
+  }
+  editor.commitString("a");
   {
     auto node = doc->root()->childAt(0);
     CHECK(node->type() == NodeType::header);
@@ -926,6 +958,27 @@ TEST_CASE("PreeditTest,  ShowPreedit2") {
   }
 }
 
+TEST_CASE("PreeditTest,  OverlayInsideLine") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("hello\n");
+  auto doc = editor.document();
+  auto& blocks = doc->blocks();
+  auto& cursor = editor.cursor();
+  auto [tailPos, h, ascent] = doc->mapToScreen({0, 0, 4});
+  doc->updateCursor(cursor, {0, 0, 2});
+  editor.setPreedit("xy");
+  CHECK(blocks[0].logicalLineAt(0).length() == 5);
+  CHECK(cursor.coord().offset == 2);
+  // 组字文本后面的字往后挪
+  auto rect = blocks[0].preeditRect();
+  CHECK(!rect.isEmpty());
+  CHECK(std::get<0>(doc->mapToScreen({0, 0, 4})).x == tailPos.x + rect.width());
+  CHECK(cursor.pos().x == rect.x() + rect.width());
+  editor.commitString("xy");
+  CHECK(doc->serializeBlock(0) == "hexyllo\n\n");
+  CHECK(cursor.coord().offset == 4);
+}
+
 TEST_CASE("MultiBlockEditTest,  RemoveEmptyParagraph") {
   static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
   editor.loadText(R"(
@@ -1242,6 +1295,1088 @@ TEST_CASE("RemoveTextTest, BackspaceAtStartOfWrappedLine") {
   CHECK(doc->root()->size() > 0);
 }
 
+TEST_CASE("LatexTest, AsyncTypesetRelayoutsPendingBlocks") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool typeset = false;
+  editor.setLatexTypesetCallback([&]() {
+    std::lock_guard lock(mutex);
+    typeset = true;
+    cv.notify_one();
+  });
+  editor.loadText("plain\n\nmath $x^2$ and $x^2$\n\n$$\ny = 1\n$$\n\n");
+  auto doc = editor.document();
+  auto countPending = [doc]() {
+    std::size_t n = 0;
+    for (const auto& block : doc->blocks()) n += block.pendingLatex().size();
+    return n;
+  };
+  CHECK(doc->blocks()[0].pendingLatex().empty());
+  // 结果已经到了的话就直接是真实大小，没到就是占位
+  while (countPending() > 0) {
+    std::unique_lock lock(mutex);
+    REQUIRE(cv.wait_for(lock, std::chrono::seconds(10), [&]() { return typeset; }));
+    typeset = false;
+    lock.unlock();
+    editor.updateTypesetLatex();
+  }
+  CHECK(doc->latexCache().size() == 2);
+  CHECK_FALSE(editor.updateTypesetLatex());
+}
+
+TEST_CASE("ImageTest, AsyncDecodePrioritizesViewport") {
+  // 放行前load一直阻塞；记录解码顺序
+  struct GatedImageProvider : md::editor::core::IImageProvider {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool released = false;
+    std::vector<std::string> order;
+    md::editor::core::ImageData load(const md::String& path) override {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [this]() { return released; });
+      order.push_back(path.toStdString());
+      md::editor::core::ImageData image;
+      image.width = 40;
+      image.height = 30;
+      image.pixels.assign(40 * 30 * 4, 100);
+      return image;
+    }
+    bool exists(const md::String& path) override { return path.startsWith("/img/"); }
+  };
+  GatedImageProvider provider;
+  Editor editor(&provider);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool decoded = false;
+  editor.setImageDecodeCallback([&]() {
+    std::lock_guard lock(mutex);
+    decoded = true;
+    cv.notify_one();
+  });
+  md::String text;
+  for (int i = 0; i < 10; ++i) {
+    text += "![i](/img/" + md::String(std::to_string(i)) + ".png)\n\n";
+  }
+  editor.loadText(text);
+  auto doc = editor.document();
+  REQUIRE(doc->countOfBlock() == 10);
+  int oldHeight = editor.height();
+  // 视口在最后一张图
+  int top = 0;
+  for (int i = 0; i < 9; ++i) top += doc->blocks()[i].height() + doc->setting().blockSpacing;
+  editor.updateViewport(top, 100);
+  {
+    std::lock_guard lock(provider.mutex);
+    provider.released = true;
+  }
+  provider.cv.notify_all();
+  auto countPending = [doc]() {
+    std::size_t n = 0;
+    for (const auto& block : doc->blocks()) n += block.pendingImages().size();
+    return n;
+  };
+  while (countPending() > 0) {
+    std::unique_lock lock(mutex);
+    REQUIRE(cv.wait_for(lock, std::chrono::seconds(10), [&]() { return decoded; }));
+    decoded = false;
+    lock.unlock();
+    editor.updateDecodedImages();
+  }
+  // 没有文件头大小，占位用的默认大小，解码后重新排版
+  CHECK(editor.height() < oldHeight);
+  REQUIRE(provider.order.size() == 10);
+  auto indexOf = [&](const std::string& path) {
+    return std::find(provider.order.begin(), provider.order.end(), path) - provider.order.begin();
+  };
+  CHECK(indexOf("/img/9.png") < indexOf("/img/5.png"));
+}
+
+TEST_CASE("DamageTest, RepaintOnlyChangedLinesAndCursor") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("aaa\nbbb\nccc\n\npara2\n\npara3\n\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  REQUIRE(doc->countOfBlock() >= 3);
+  REQUIRE(doc->blocks()[0].lineSignatures().size() == 3);
+  // 第一次是整个文档
+  auto damage = editor.takeDamage();
+  REQUIRE(!damage.empty());
+  CHECK(damage[0].y() <= doc->blockRect(0).y());
+  CHECK(damage[0].y() + damage[0].height() >= doc->blockRect(2).y() + doc->blockRect(2).height());
+  CHECK(editor.takeDamage().empty());
+  // 重新排版但内容没变，不用重画
+  doc->renderBlock(1);
+  CHECK(editor.takeDamage().empty());
+  // 同一个块里移动光标，只重画光标的新旧位置
+  CursorCoord coord;
+  coord.blockNo = 0;
+  coord.lineNo = 1;
+  coord.offset = 0;
+  doc->updateCursor(cursor, coord);
+  damage = editor.takeDamage();
+  CHECK(damage.size() == 2);
+  for (const auto& rect : damage) {
+    CHECK(rect.height() < doc->blocks()[0].height() / 2);
+  }
+  // 打字只重画这一行，其他块不动
+  editor.insertText("X");
+  damage = editor.takeDamage();
+  REQUIRE(!damage.empty());
+  auto block0 = doc->blockRect(0);
+  const auto& line = doc->blocks()[0].lineSignatures()[1];
+  CHECK(damage[0].y() == block0.y() + line.top);
+  CHECK(damage[0].height() == line.height);
+  for (const auto& rect : damage) {
+    CHECK_FALSE(rect.intersects(doc->blockRect(1)));
+  }
+  // 换到别的块，两个块的高亮框都要重画
+  coord.blockNo = 2;
+  coord.lineNo = 0;
+  doc->updateCursor(cursor, coord);
+  damage = editor.takeDamage();
+  auto covers = [&damage](const md::editor::core::Rect& block) {
+    return std::any_of(damage.begin(), damage.end(), [&block](const auto& rect) {
+      return rect.y() <= block.y() && rect.y() + rect.height() >= block.y() + block.height();
+    });
+  };
+  CHECK(covers(block0));
+  CHECK(covers(doc->blockRect(2)));
+}
+
+TEST_CASE("TileCacheTest, RasterizeBlocksOnceUntilChanged") {
+  using namespace md::editor::core;
+  struct CountingPainter : AbstractPainter {
+    void save() override {}
+    void restore() override {}
+    void setPen(const Color&) override {}
+    void drawRect(const Rect&) override {}
+    void drawText(const Point&, const md::String&) override { texts++; }
+    void drawLine(const Point&, const Point&) override {}
+    void setFont(const FontDescription&) override {}
+    void fillRect(const Rect&, const Color&) override {}
+    void drawEllipse(const Rect&, const Color&) override {}
+    void drawImage(const Rect&, const ImageData&) override {}
+    void drawText(const Rect&, int, const md::String&) override { texts++; }
+    void drawLatex(const Rect&, microtex::Render&) override {}
+    int texts = 0;
+  };
+  struct CountingLayer : AbstractLayer {
+    CountingPainter layerPainter;
+    std::size_t bytes = 0;
+    AbstractPainter& painter() override { return layerPainter; }
+    void finish() override {}
+    std::size_t byteCount() const override { return bytes; }
+  };
+  struct LayerPainter : CountingPainter {
+    std::unique_ptr<AbstractLayer> createLayer(const Size& size) override {
+      layers++;
+      auto layer = std::make_unique<CountingLayer>();
+      layer->bytes = std::size_t(size.width) * size.height * 4;
+      return layer;
+    }
+    void drawLayer(const Point&, const AbstractLayer& layer) override {
+      blits++;
+      layerTexts += static_cast<const CountingLayer&>(layer).layerPainter.texts;
+    }
+    int layers = 0;
+    int blits = 0;
+    int layerTexts = 0;
+  };
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.setTileCacheMaxBytes(64 * 1024 * 1024);
+  editor.loadText("one\n\ntwo\n\nthree\n\n");
+  auto doc = editor.document();
+  int blocks = 0;
+  for (const auto& block : doc->blocks()) {
+    if (block.height() > 0) blocks++;
+  }
+  REQUIRE(blocks >= 3);
+  LayerPainter painter;
+  editor.drawDoc(painter, Point(0, 0));
+  CHECK(painter.layers == blocks);
+  CHECK(painter.blits == blocks);
+  CHECK(painter.layerTexts > 0);
+  // 没变的块直接贴图
+  int texts = painter.texts;
+  editor.drawDoc(painter, Point(0, 0));
+  CHECK(painter.layers == blocks);
+  CHECK(painter.blits == blocks * 2);
+  CHECK(painter.texts == texts * 2);
+  // 改了的块重新光栅化
+  editor.insertText("X");
+  editor.drawDoc(painter, Point(0, 0));
+  CHECK(painter.layers == blocks + 1);
+  // 超出内存上限时淘汰这一帧没画到的图块
+  editor.setTileCacheMaxBytes(1);
+  auto third = doc->blockRect(2);
+  editor.drawDoc(painter, Point(0, 0), third);
+  CHECK(painter.layers == blocks + 1);
+  editor.drawDoc(painter, Point(0, 0));
+  CHECK(painter.layers == blocks * 2);
+}
+
+TEST_CASE("TileCacheTest, TilesKeepDecorationsOutsideBlock") {
+  using namespace md::editor::core;
+  struct RectPainter : AbstractPainter {
+    void save() override {}
+    void restore() override {}
+    void setPen(const Color&) override {}
+    void drawRect(const Rect&) override {}
+    void drawText(const Point&, const md::String&) override {}
+    void drawLine(const Point&, const Point&) override {}
+    void setFont(const FontDescription&) override {}
+    void fillRect(const Rect& rect, const Color&) override { fills.push_back(rect); }
+    void drawEllipse(const Rect&, const Color&) override {}
+    void drawImage(const Rect&, const ImageData&) override {}
+    void drawText(const Rect&, int, const md::String&) override {}
+    void drawLatex(const Rect&, microtex::Render&) override {}
+    std::vector<Rect> fills;
+  };
+  struct RectLayer : AbstractLayer {
+    RectPainter layerPainter;
+    Size size;
+    AbstractPainter& painter() override { return layerPainter; }
+    void finish() override {}
+    std::size_t byteCount() const override { return std::size_t(size.width) * size.height * 4; }
+  };
+  struct LayerPainter : RectPainter {
+    std::unique_ptr<AbstractLayer> createLayer(const Size& size) override {
+      auto layer = std::make_unique<RectLayer>();
+      layer->size = size;
+      return layer;
+    }
+    // 图层里的填充换回文档坐标，超出图层的部分裁掉
+    void drawLayer(const Point& pos, const AbstractLayer& layer) override {
+      const auto& rectLayer = static_cast<const RectLayer&>(layer);
+      for (const auto& rect : rectLayer.layerPainter.fills) {
+        int left = std::max(rect.x(), 0);
+        int top = std::max(rect.y(), 0);
+        int right = std::min(rect.x() + rect.width(), rectLayer.size.width);
+        int bottom = std::min(rect.y() + rect.height(), rectLayer.size.height);
+        tiled.emplace_back(pos.x + left, pos.y + top, right - left, bottom - top);
+      }
+    }
+    std::vector<Rect> tiled;
+  };
+  static md::editor::core::NullImageProvider nullProvider;
+  Editor editor(&nullProvider);
+  editor.loadText("```\ncode\n```\n\n");
+  // 直接画
+  editor.setTileCacheMaxBytes(0);
+  LayerPainter immediate;
+  editor.drawDoc(immediate, Point(0, 0));
+  REQUIRE(!immediate.fills.empty());
+  // 代码块的背景四周比块大3像素，贴图后要和直接画的一样
+  editor.setTileCacheMaxBytes(64 * 1024 * 1024);
+  LayerPainter retained;
+  editor.drawDoc(retained, Point(0, 0));
+  CHECK(retained.fills.empty());
+  REQUIRE(retained.tiled.size() == immediate.fills.size());
+  for (std::size_t i = 0; i < immediate.fills.size(); ++i) {
+    CHECK(retained.tiled[i] == immediate.fills[i]);
+  }
+}
+
+TEST_CASE("TypingTest, PlainTextEditsTextInPlace") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("hello\n\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  doc->updateCursor(cursor, CursorCoord{0, 0, 5});
+  auto* text = static_cast<Text*>(static_cast<Paragraph*>(doc->root()->childAt(0))->childAt(0));
+  auto addSize = doc->addBuffer().size();
+  editor.insertText("a");
+  editor.insertText("b");
+  editor.insertText(" ");
+  editor.insertText("c");
+  // 结点没有重新解析，add buffer里只有敲的字节
+  CHECK(static_cast<Paragraph*>(doc->root()->childAt(0))->childAt(0) == text);
+  CHECK(text->toString(doc->bufferProvider()) == "helloab c");
+  CHECK(doc->addBuffer().size() == addSize + 4);
+  CHECK(cursor.coord().offset == 9);
+  doc->undo(cursor);
+  CHECK(text->toString(doc->bufferProvider()) == "hello");
+  CHECK(cursor.coord().offset == 5);
+  doc->redo(cursor);
+  CHECK(text->toString(doc->bufferProvider()) == "helloab c");
+  CHECK(cursor.coord().offset == 9);
+}
+
+TEST_CASE("TypingTest, RelayoutOnlyTheEditedLine") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("```\nabc\ndef\nghi\n```\n\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  REQUIRE(doc->root()->childAt(0)->type() == NodeType::code_block);
+  const auto& block = doc->blocks()[0];
+  REQUIRE(block.countOfLogicalLine() == 3);
+  auto* firstCell = block.logicalLineAt(0).cells()[0];
+  auto* lastCell = block.logicalLineAt(2).cells()[0];
+  auto lastY = block.logicalLineAt(2).visualLineAt(0).pos().y;
+  auto height = block.height();
+  // 改第二行，一次折成几行
+  doc->updateCursor(cursor, CursorCoord{0, 1, 3});
+  editor.insertText(md::String(std::string(200, 'x')));
+  CHECK(block.logicalLineAt(1).countOfVisualLine() > 1);
+  auto dy = block.height() - height;
+  CHECK(dy > 0);
+  // 其它行没有重新排，只是平移
+  CHECK(block.logicalLineAt(0).cells()[0] == firstCell);
+  CHECK(block.logicalLineAt(2).cells()[0] == lastCell);
+  CHECK(block.logicalLineAt(2).visualLineAt(0).pos().y == lastY + dy);
+  CHECK(cursor.coord() == CursorCoord(0, 1, 203));
+  // 和整块重排的结果一样
+  // 绘图指令的位置由行的摘要比较，这里比较行的位置和指令的种类
+  auto snapshot = [](const md::render::Block& b) {
+    std::vector<int> values;
+    for (const auto& line : b.lines()) {
+      for (int i = 0; i < static_cast<int>(line.countOfVisualLine()); ++i) values.push_back(line.visualLineAt(i).pos().y);
+    }
+    for (const auto& command : b.displayList()) values.push_back(static_cast<int>(command.type));
+    return values;
+  };
+  auto rects = snapshot(block);
+  auto signatures = block.lineSignatures();
+  auto chrome = block.chromeHash();
+  doc->renderBlock(0);
+  CHECK(snapshot(doc->blocks()[0]) == rects);
+  CHECK(doc->blocks()[0].lineSignatures() == signatures);
+  CHECK(doc->blocks()[0].chromeHash() == chrome);
+  // 高度不变时只重算这一行的摘要
+  doc->updateCursor(cursor, CursorCoord{0, 0, 3});
+  editor.insertText("y");
+  rects = snapshot(doc->blocks()[0]);
+  signatures = doc->blocks()[0].lineSignatures();
+  chrome = doc->blocks()[0].chromeHash();
+  doc->renderBlock(0);
+  CHECK(snapshot(doc->blocks()[0]) == rects);
+  CHECK(doc->blocks()[0].lineSignatures() == signatures);
+  CHECK(doc->blocks()[0].chromeHash() == chrome);
+  doc->undo(cursor);
+  doc->undo(cursor);
+  CHECK(doc->blocks()[0].height() == height);
+
+  // 段落按换行分行
+  editor.loadText("abc **def**\nghi\njkl\n\n");
+  doc = editor.document();
+  const auto& paragraph = doc->blocks()[0];
+  REQUIRE(paragraph.countOfLogicalLine() == 3);
+  firstCell = paragraph.logicalLineAt(0).cells()[0];
+  doc->updateCursor(editor.cursor(), CursorCoord{0, 1, 2});
+  editor.insertText(md::String(std::string(200, 'x')));
+  CHECK(paragraph.logicalLineAt(0).cells()[0] == firstCell);
+  CHECK(doc->root()->childAt(0)->type() == NodeType::paragraph);
+  rects = snapshot(paragraph);
+  signatures = paragraph.lineSignatures();
+  doc->renderBlock(0);
+  CHECK(snapshot(doc->blocks()[0]) == rects);
+  CHECK(doc->blocks()[0].lineSignatures() == signatures);
+}
+
+TEST_CASE("TypingTest, FallBackWhenSyntaxCanForm") {
+  static md::editor::core::NullImageProvider nullProvider;
+  {
+    // 行首凑出了块前缀
+    Editor editor(&nullProvider);
+    editor.loadText("#abc\n\n");
+    auto doc = editor.document();
+    doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 1});
+    editor.insertText(" ");
+    CHECK(doc->root()->childAt(0)->type() == NodeType::header);
+  }
+  {
+    // 两个语法字符中间插进文本
+    Editor editor(&nullProvider);
+    editor.loadText("a**b\n\n");
+    auto doc = editor.document();
+    doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 2});
+    editor.insertText("x");
+    auto* p = static_cast<Paragraph*>(doc->root()->childAt(0));
+    REQUIRE(p->size() == 3);
+    CHECK(p->childAt(1)->type() == NodeType::italic);
+  }
+  {
+    // 数字后面插'.'可能凑出有序列表
+    Editor editor(&nullProvider);
+    editor.loadText("1 abc\n\n");
+    auto doc = editor.document();
+    doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 1});
+    editor.insertText(".");
+    CHECK(doc->root()->childAt(0)->type() == NodeType::ol);
+  }
+}
+
+TEST_CASE("UndoHistoryTest, ByteBudgetEvictsOldest") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("one\n\ntwo\n\nthree\n\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  CHECK(doc->undoHistoryBytes() == 0);
+  std::size_t bytes = 0;
+  // 每次在不同的块行首打字，记录不会合并
+  for (md::SizeType blockNo = 0; blockNo < 3; ++blockNo) {
+    doc->updateCursor(cursor, CursorCoord{blockNo, 0, 0});
+    editor.insertText("x");
+    CHECK(doc->undoHistoryBytes() > bytes);
+    bytes = doc->undoHistoryBytes();
+  }
+  // 预算放不下时只留最近一条
+  doc->setUndoHistoryMaxBytes(1);
+  CHECK(doc->undoHistoryBytes() < bytes);
+  CHECK(doc->undoHistoryBytes() > 0);
+  doc->undo(cursor);
+  doc->undo(cursor);
+  CHECK(doc->serializeBlock(0).startsWith("xone"));
+  CHECK(doc->serializeBlock(1).startsWith("xtwo"));
+  CHECK(doc->serializeBlock(2).startsWith("three"));
+}
+
+TEST_CASE("UndoHistoryTest, UndoRestoresSplitBlocks") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("xy\n\nend\n\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  auto count = doc->countOfBlock();
+  doc->updateCursor(cursor, CursorCoord{0, 0, 1});
+  // 一条命令插入多块(比如粘贴)，撤销时要把多出来的块一起去掉
+  doc->insertText(cursor, "1\n\n- 2");
+  CHECK(doc->countOfBlock() == count + 1);
+  CHECK(doc->root()->childAt(1)->type() == NodeType::ul);
+  doc->undo(cursor);
+  CHECK(doc->countOfBlock() == count);
+  CHECK(doc->serializeBlock(0).startsWith("xy"));
+  CHECK(doc->serializeBlock(1).startsWith("end"));
+  doc->redo(cursor);
+  CHECK(doc->countOfBlock() == count + 1);
+}
+
+TEST_CASE("UndoHistoryTest, RecordOnlyChangedBytes") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  md::String md;
+  for (int i = 0; i < 100; ++i) md += "some words in a long paragraph\n";
+  editor.loadText(md + "\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  auto before = doc->serializeBlock(0);
+  // 行首打字要重新解析整块，撤销记录里只有换掉的那几个字节
+  doc->updateCursor(cursor, CursorCoord{0, 50, 0});
+  editor.insertText("*");
+  editor.insertText("x");
+  CHECK(doc->undoHistoryBytes() < before.size() / 4);
+  doc->updateCursor(cursor, CursorCoord{0, 20, 0});
+  editor.insertText("`");
+  CHECK(doc->undoHistoryBytes() < before.size() / 4);
+  doc->undo(cursor);
+  doc->undo(cursor);
+  CHECK(doc->serializeBlock(0) == before);
+  doc->redo(cursor);
+  CHECK(doc->serializeBlock(0).toStdString().find("\n*xsome") != std::string::npos);
+}
+
+static md::String documentMarkdown(Document* doc) {
+  md::String md;
+  for (md::SizeType i = 0; i < doc->countOfBlock(); ++i) {
+    md += doc->serializeBlock(i);
+  }
+  return md;
+}
+
+TEST_CASE("JournalTest, ReplayRestoresEdits") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_replay.journal";
+  std::filesystem::remove(path);
+  const md::String base = "title\n\n- [ ] todo\n\nbody\n\n";
+  md::String edited;
+  md::String beforeLastEdit;
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    // 没有日志时新建，没什么可恢复的
+    CHECK_FALSE(editor.openJournal(md::String(path.string())));
+    auto doc = editor.document();
+    auto& cursor = editor.cursor();
+    doc->updateCursor(cursor, CursorCoord{0, 0, 5});
+    editor.insertText("s");
+    doc->insertReturn(cursor);
+    editor.insertText("new");
+    doc->removeText(cursor);
+    doc->updateCursor(cursor, CursorCoord{0, 0, 0});
+    doc->upgradeToHeader(cursor, 2);
+    doc->toggleCheckbox(2, md::SizeType(0));
+    doc->updateCursor(cursor, CursorCoord{3, 0, 4});
+    editor.insertText("!");
+    doc->undo(cursor);
+    editor.syncJournal();
+    beforeLastEdit = documentMarkdown(doc);
+    editor.insertText("?");
+    editor.syncJournal();
+    edited = documentMarkdown(doc);
+    // 不保存，当作崩溃
+  }
+  CHECK(edited != base);
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    CHECK(editor.openJournal(md::String(path.string())));
+    CHECK(documentMarkdown(editor.document()) == edited);
+  }
+  // 最后一条记录只写了一半，丢掉它
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 2);
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    CHECK(editor.openJournal(md::String(path.string())));
+    CHECK(documentMarkdown(editor.document()) == beforeLastEdit);
+  }
+  // 原文件变了，日志作废
+  {
+    Editor editor(&nullProvider);
+    editor.loadText("other\n\n");
+    CHECK_FALSE(editor.openJournal(md::String(path.string())));
+    CHECK(documentMarkdown(editor.document()).startsWith("other"));
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("JournalTest, CompactIntoSnapshot") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_compact.journal";
+  const md::String base = "abc\n\n";
+  std::size_t compactedBytes = 0;
+  {
+    EditJournal journal(md::String(path.string()));
+    REQUIRE(journal.create(base));
+    for (int i = 0; i < 100; ++i) {
+      journal.append({EditOp::insertText, {0, 0, 3 + i}, {}, 0, "d"});
+    }
+    CHECK_FALSE(journal.needsCompaction());
+    auto bytes = journal.byteCount();
+    CHECK(journal.compact("snapshot\n\n"));
+    compactedBytes = journal.byteCount();
+    CHECK(compactedBytes < bytes);
+    journal.append({EditOp::insertText, {0, 0, 8}, {}, 0, "!"});
+    CHECK(journal.sync());
+  }
+  CHECK(std::filesystem::file_size(path) > compactedBytes);
+  Editor editor(&nullProvider);
+  editor.loadText(base);
+  CHECK(editor.openJournal(md::String(path.string())));
+  CHECK(editor.document()->serializeBlock(0).startsWith("snapshot!"));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("JournalTest, UndoPastSnapshot") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_undo_snapshot.journal";
+  std::filesystem::remove(path);
+  const md::String base = "hello\n\n";
+  md::String edited;
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    CHECK_FALSE(editor.openJournal(md::String(path.string())));
+    auto doc = editor.document();
+    auto& cursor = editor.cursor();
+    doc->updateCursor(cursor, CursorCoord{0, 0, 5});
+    editor.insertText("abc");
+    // 记录超过压缩阈值，压成快照，前面的编辑日志里没有了。一个段落里的很多行，排版快
+    std::string big;
+    while (big.size() < EditJournal::kCompactBytes) big += "\nxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx";
+    doc->insertText(cursor, md::String(big));
+    editor.syncJournal();
+    {
+      std::ifstream file(path, std::ios::binary);
+      // 文件头后面是长度，再后面是第一条记录的类型
+      file.seekg(4 + 4 + 8 + 8 + 4);
+      CHECK(file.get() == EditOp::snapshot);
+    }
+    // 撤销到快照之前
+    doc->undo(cursor);
+    doc->undo(cursor);
+    doc->redo(cursor);
+    CHECK(documentMarkdown(doc).startsWith("helloabc"));
+    doc->undo(cursor);
+    editor.syncJournal();
+    edited = documentMarkdown(doc);
+  }
+  CHECK(edited == base);
+  Editor editor(&nullProvider);
+  editor.loadText(base);
+  CHECK(editor.openJournal(md::String(path.string())));
+  CHECK(documentMarkdown(editor.document()) == edited);
+  // 恢复出来的撤销、重做也是普通的编辑，还能撤销
+  editor.document()->undo(editor.cursor());
+  CHECK(documentMarkdown(editor.document()).startsWith("helloabc"));
+  editor.closeJournal(true);
+}
+
+static md::String readFile(const std::filesystem::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  return md::String(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+}
+
+TEST_CASE("SaveTest, AsyncSaveReusesUnchangedBlocks") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_async_save.md";
+  Editor editor(&nullProvider);
+  editor.loadText("# one\n\ntwo\n\n- three\n\n");
+  auto doc = editor.document();
+  std::mutex mutex;
+  std::condition_variable cv;
+  int finished = 0;
+  AsyncSaver saver([&]() {
+    std::lock_guard lock(mutex);
+    finished++;
+    cv.notify_all();
+  });
+  saver.save(*doc, md::String(path.string()));
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&finished]() { return finished == 1; });
+  }
+  auto result = saver.takeResult();
+  REQUIRE(result.has_value());
+  CHECK(result->ok);
+  CHECK_FALSE(saver.takeResult().has_value());
+  CHECK(saver.countOfSerializedBlocks() == doc->countOfBlock());
+  auto content = readFile(path);
+  CHECK(content == documentMarkdown(doc));
+  CHECK(result->bytes == content.size());
+  CHECK(result->hash == EditJournal::hash(content.data(), content.size()));
+  // 只改了一块，只有它重新序列化
+  doc->updateCursor(editor.cursor(), CursorCoord{1, 0, 3});
+  editor.insertText("!");
+  saver.save(*doc, md::String(path.string()));
+  saver.wait();
+  CHECK(saver.countOfSerializedBlocks() == 1);
+  CHECK(saver.takeResult()->ok);
+  CHECK(readFile(path) == documentMarkdown(doc));
+  CHECK(readFile(path).startsWith("# one\n\ntwo!"));
+  // 拍完快照再改不影响正在写的内容
+  saver.save(*doc, md::String(path.string()));
+  editor.insertText("?");
+  saver.wait();
+  CHECK(saver.countOfSerializedBlocks() == 0);
+  CHECK(readFile(path).startsWith("# one\n\ntwo!\n"));
+  // 快照共享add缓冲区，写的时候追加到要扩容也不影响它
+  auto expected = documentMarkdown(doc);
+  saver.save(*doc, md::String(path.string()));
+  editor.insertText(md::String(std::string(4096, 'x')));
+  saver.wait();
+  CHECK(saver.countOfSerializedBlocks() == 1);
+  CHECK(readFile(path) == expected);
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("SaveTest, JournalFollowsAsyncSave") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto dir = std::filesystem::temp_directory_path();
+  auto path = dir / "qtmarkdown_test_save_journal.md";
+  auto journalPath = md::String((dir / "qtmarkdown_test_save_journal.journal").string());
+  std::filesystem::remove(journalPath.toStdString());
+  {
+    std::ofstream file(path, std::ios::binary);
+    file << "first\n\nsecond\n\n";
+  }
+  md::String expected;
+  {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    Editor editor(&nullProvider);
+    editor.setSaveFinishedCallback([&]() {
+      std::lock_guard lock(mutex);
+      finished = true;
+      cv.notify_all();
+    });
+    REQUIRE(editor.loadFile(md::String(path.string())).first);
+    CHECK_FALSE(editor.openJournal(journalPath));
+    auto doc = editor.document();
+    doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 5});
+    editor.insertText(" saved");
+    CHECK(editor.saveToFileAsync(md::String(path.string())));
+    // 保存开始之后的编辑要接到新文件上
+    doc->updateCursor(editor.cursor(), CursorCoord{1, 0, 6});
+    editor.insertText(" unsaved");
+    {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [&finished]() { return finished; });
+    }
+    CHECK(editor.finishSave() == std::optional<bool>(true));
+    editor.syncJournal();
+    expected = documentMarkdown(doc);
+  }
+  CHECK(readFile(path).startsWith("first saved\n\nsecond\n"));
+  {
+    Editor editor(&nullProvider);
+    REQUIRE(editor.loadFile(md::String(path.string())).first);
+    CHECK(editor.openJournal(journalPath));
+    CHECK(documentMarkdown(editor.document()) == expected);
+  }
+  // 保存之后撤销保存之前的编辑，日志截掉了那次编辑，撤销也要恢复出来
+  {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << "hello";
+  }
+  std::filesystem::remove(journalPath.toStdString());
+  {
+    Editor editor(&nullProvider);
+    REQUIRE(editor.loadFile(md::String(path.string())).first);
+    CHECK_FALSE(editor.openJournal(journalPath));
+    auto doc = editor.document();
+    doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 5});
+    editor.insertText("abc");
+    CHECK(editor.saveToFile(md::String(path.string())));
+    doc->undo(editor.cursor());
+    editor.syncJournal();
+    expected = documentMarkdown(doc);
+  }
+  CHECK(expected == "hello\n\n");
+  CHECK(readFile(path).startsWith("helloabc"));
+  Editor editor(&nullProvider);
+  REQUIRE(editor.loadFile(md::String(path.string())).first);
+  CHECK(editor.openJournal(journalPath));
+  CHECK(documentMarkdown(editor.document()) == expected);
+  std::filesystem::remove(path);
+  std::filesystem::remove(journalPath.toStdString());
+}
+
+TEST_CASE("MarkdownSerializerTest, RunLengthPositionMap") {
+  md::parser::Document doc("ab **cd** [ef](url) gh\n\n");
+  MarkdownSerializer serializer(doc);
+  doc.root()->childAt(0)->accept(&serializer);
+  auto md = serializer.markdown();
+  CHECK(md == "ab **cd** [ef](url) gh\n\n");
+  // 内容是"ab cd ef gh"，被标记符号分成"ab ", "cd", " ", "ef", " gh"
+  CHECK(serializer.contentLength() == 11);
+  CHECK(serializer.countOfSegments() == 5);
+  const md::String content = "ab cd ef gh";
+  for (md::SizeType i = 0; i < serializer.contentLength(); ++i) {
+    auto pos = serializer.contentToMarkdown(i);
+    REQUIRE(pos.has_value());
+    CHECK(md[*pos] == content[i]);
+  }
+  CHECK(*serializer.contentToMarkdown(3) == 5);
+  CHECK_FALSE(serializer.contentToMarkdown(11).has_value());
+  // 很长的代码块一行只占一段
+  md::String code = "```\n";
+  for (int i = 0; i < 1000; ++i) {
+    code += "int x = 0;\n";
+  }
+  code += "```\n\n";
+  md::parser::Document codeDoc(code);
+  MarkdownSerializer codeSerializer(codeDoc);
+  codeDoc.root()->childAt(0)->accept(&codeSerializer);
+  CHECK(codeSerializer.countOfSegments() <= 1000);
+  CHECK(*codeSerializer.contentToMarkdown(0) == 4);
+}
+
+TEST_CASE("SerializeCacheTest, ReuseUntilBlockChanges") {
+  static md::editor::core::NullImageProvider nullProvider;
+  Editor editor(&nullProvider);
+  editor.loadText("first **bold**\n\nsecond\n\n");
+  auto doc = editor.document();
+  auto misses = doc->serializeCacheMisses();
+  auto [md, pos] = doc->cursorToMarkdownPosition(CursorCoord{0, 0, 6});
+  CHECK(md == "first **bold**\n\n");
+  CHECK(pos == 8);
+  CHECK(doc->serializeCacheMisses() == misses + 1);
+  // 块没变，光标映射和序列化都用缓存
+  CHECK(doc->cursorToMarkdownPosition(CursorCoord{0, 0, 2}).pos == 2);
+  CHECK(doc->serializeBlock(0) == md);
+  CHECK(doc->serializeCacheMisses() == misses + 1);
+  // 改了第0块，只有它重新序列化
+  doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 0});
+  doc->insertText(editor.cursor(), "#");
+  CHECK(doc->serializeBlock(0) == "#first **bold**\n\n");
+  auto afterEdit = doc->serializeCacheMisses();
+  CHECK(doc->serializeBlock(0) == "#first **bold**\n\n");
+  CHECK(doc->serializeCacheMisses() == afterEdit);
+  doc->serializeBlock(1);
+  doc->serializeBlock(1);
+  CHECK(doc->serializeCacheMisses() <= afterEdit + 1);
+}
+
+namespace {
+class TestKeyEvent : public md::editor::core::KeyEvent {
+ public:
+  TestKeyEvent(md::editor::core::Key key, std::string text) : m_key(key), m_text(std::move(text)) {}
+  md::editor::core::Key key() const override { return m_key; }
+  md::editor::core::Modifier modifiers() const override { return md::editor::core::Modifier::None; }
+  std::string text() const override { return m_text; }
+  bool isAutoRepeat() const override { return false; }
+
+ private:
+  md::editor::core::Key m_key;
+  std::string m_text;
+};
+}  // namespace
+TEST_CASE("InputCoalescingTest, OneInsertPerFrame") {
+  using md::editor::core::Key;
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("hello\n");
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  doc->updateCursor(cursor, {0, 0, 5});
+  auto revision = doc->revision();
+  editor.keyPressEvent(TestKeyEvent(Key::A, "a"));
+  editor.keyPressEvent(TestKeyEvent(Key::B, "b"));
+  editor.keyPressEvent(TestKeyEvent(Key::C, "c"));
+  // 这一帧还没结束，文档没动
+  CHECK(editor.hasPendingInput());
+  CHECK(doc->revision() == revision);
+  CHECK(editor.flushInput());
+  CHECK_FALSE(editor.flushInput());
+  CHECK(doc->serializeBlock(0) == "helloabc\n\n");
+  CHECK(doc->revision() == revision + 1);
+  CHECK(cursor.coord().offset == 8);
+  // 退格先插入攒着的字符
+  editor.keyPressEvent(TestKeyEvent(Key::D, "d"));
+  editor.keyPressEvent(TestKeyEvent(Key::Backspace, "\b"));
+  CHECK_FALSE(editor.hasPendingInput());
+  CHECK(doc->serializeBlock(0) == "helloabc\n\n");
+  doc->undo(cursor);
+  doc->undo(cursor);
+  doc->undo(cursor);
+  CHECK(doc->serializeBlock(0) == "hello\n\n");
+  editor.setInputCoalescing(false);
+  editor.keyPressEvent(TestKeyEvent(Key::E, "e"));
+  CHECK_FALSE(editor.hasPendingInput());
+  CHECK(doc->serializeBlock(0) == "helloe\n\n");
+}
+
+TEST_CASE("InputCoalescingTest, SameResultAsTypingKeyByKey") {
+  using md::editor::core::Key;
+  static md::editor::core::NullImageProvider nullProvider;
+  // 在"hello"开头一帧里打完seq，返回文档和光标
+  auto type = [](const std::string& seq, bool coalescing) {
+    Editor editor(&nullProvider);
+    editor.loadText("hello\n");
+    editor.setInputCoalescing(coalescing);
+    editor.document()->updateCursor(editor.cursor(), CursorCoord{0, 0, 0});
+    for (char ch : seq) {
+      auto uc = static_cast<unsigned char>(ch);
+      auto key = std::isalnum(uc) ? Key(std::toupper(uc)) : Key::Unknown;
+      editor.keyPressEvent(TestKeyEvent(key, std::string(1, ch)));
+    }
+    editor.flushInput();
+    return std::make_pair(documentMarkdown(editor.document()), editor.cursor().coord());
+  };
+  for (const std::string seq : {"(x", "# T", "- [ ] a", "1. ab", "ab [cd] e", "x)y"}) {
+    auto keyByKey = type(seq, false);
+    auto coalesced = type(seq, true);
+    CHECK(coalesced.first == keyByKey.first);
+    CHECK(coalesced.second == keyByKey.second);
+  }
+  CHECK(type("(x", true).first.startsWith("(x)hello"));
+  CHECK(type("(x", true).second == CursorCoord({0, 0, 2}));
+  CHECK(type("# T", true).second == CursorCoord({0, 0, 1}));
+}
+
+TEST_CASE("InputCoalescingTest, FlushBeforeSwitchingDocuments") {
+  using md::editor::core::Key;
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_flush_input.journal";
+  std::filesystem::remove(path);
+  const md::String base = "hello\n\n";
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    CHECK_FALSE(editor.openJournal(md::String(path.string())));
+    editor.document()->updateCursor(editor.cursor(), CursorCoord{0, 0, 5});
+    editor.keyPressEvent(TestKeyEvent(Key::A, "a"));
+    editor.keyPressEvent(TestKeyEvent(Key::B, "b"));
+    CHECK(editor.hasPendingInput());
+    // 攒着的字符插进旧文档，记进它的日志，不会丢
+    editor.loadText("other\n\n");
+    CHECK_FALSE(editor.hasPendingInput());
+    CHECK(documentMarkdown(editor.document()).startsWith("other"));
+    editor.keyPressEvent(TestKeyEvent(Key::C, "c"));
+    editor.reset();
+    CHECK_FALSE(editor.hasPendingInput());
+  }
+  Editor editor(&nullProvider);
+  editor.loadText(base);
+  CHECK(editor.openJournal(md::String(path.string())));
+  CHECK(documentMarkdown(editor.document()).startsWith("helloab\n"));
+  editor.closeJournal(true);
+}
+
+TEST_CASE("TransactionTest, SingleReparseAndUndoStep") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  const md::String base = "# title\n\naaa foo bbb\n\nccc\n\nfoo ddd\n\n";
+  editor.loadText(base);
+  auto doc = editor.document();
+  auto& cursor = editor.cursor();
+  auto blockCount = doc->countOfBlock();
+  auto titleVersion = doc->blocks()[0].version();
+  auto cccVersion = doc->blocks()[2].version();
+  doc->beginTransaction();
+  doc->replaceText(cursor, {1, 0, 4}, {1, 0, 7}, "bar");
+  doc->replaceText(cursor, {3, 0, 0}, {3, 0, 3}, "**baz**");
+  // 提交之前文档不动
+  CHECK(doc->inTransaction());
+  CHECK(documentMarkdown(doc) == base);
+  doc->commit(cursor);
+  CHECK_FALSE(doc->inTransaction());
+  CHECK(documentMarkdown(doc) == "# title\n\naaa bar bbb\n\nccc\n\n**baz** ddd\n\n");
+  CHECK(doc->countOfBlock() == blockCount);
+  // 没编辑的块不重新排版
+  CHECK(doc->blocks()[0].version() == titleVersion);
+  CHECK(doc->blocks()[2].version() == cccVersion);
+  // 光标在最后一处编辑之后
+  CHECK(cursor.coord() == CursorCoord({3, 0, 3}));
+  // 一步撤销
+  doc->undo(cursor);
+  CHECK(documentMarkdown(doc) == base);
+  doc->redo(cursor);
+  CHECK(documentMarkdown(doc) == "# title\n\naaa bar bbb\n\nccc\n\n**baz** ddd\n\n");
+  // 跨块的编辑把两块合成一块
+  doc->replaceText(cursor, {1, 0, 4}, {2, 0, 1}, "");
+  CHECK(documentMarkdown(doc) == "# title\n\naaa cc\n\n**baz** ddd\n\n");
+  // 不在事务里也把光标放到编辑之后
+  CHECK(cursor.coord() == CursorCoord({1, 0, 4}));
+  doc->undo(cursor);
+  CHECK(documentMarkdown(doc) == "# title\n\naaa bar bbb\n\nccc\n\n**baz** ddd\n\n");
+}
+TEST_CASE("TransactionTest, JournalReplaysTransaction") {
+  static md::editor::core::NullImageProvider nullProvider;
+  auto path = std::filesystem::temp_directory_path() / "qtmarkdown_test_transaction.journal";
+  std::filesystem::remove(path);
+  const md::String base = "one two\n\nthree two\n\n";
+  md::String edited;
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    editor.openJournal(md::String(path.string()));
+    auto doc = editor.document();
+    doc->beginTransaction();
+    doc->replaceText(editor.cursor(), {0, 0, 4}, {0, 0, 7}, "2");
+    doc->replaceText(editor.cursor(), {1, 0, 6}, {1, 0, 9}, "2");
+    doc->commit(editor.cursor());
+    editor.syncJournal();
+    edited = documentMarkdown(doc);
+  }
+  CHECK(edited == "one 2\n\nthree 2\n\n");
+  {
+    Editor editor(&nullProvider);
+    editor.loadText(base);
+    CHECK(editor.openJournal(md::String(path.string())));
+    CHECK(documentMarkdown(editor.document()) == edited);
+    editor.closeJournal(true);
+  }
+}
+
+TEST_CASE("SearchTest, FindIncrementallyAndReplaceAll") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  const md::String base = "foo **foo**bar\n\naaaa xfoo\n\n";
+  editor.loadText(base);
+  auto doc = editor.document();
+  SearchEngine search(*doc);
+  auto matches = search.search("foo");
+  REQUIRE(matches.size() == 3);
+  CHECK(matches[0].begin == CursorCoord({0, 0, 0}));
+  CHECK(matches[1].begin == CursorCoord({0, 0, 4}));
+  CHECK(matches[1].end == CursorCoord({0, 0, 7}));
+  CHECK(matches[2].begin == CursorCoord({1, 0, 6}));
+  // 跨过粗体的边界
+  CHECK(search.search("foobar").size() == 1);
+  // 不重叠
+  CHECK(search.search("aa").size() == 2);
+  // 边打边搜
+  CHECK(search.search("f").size() == 3);
+  CHECK_FALSE(search.lastSearchWasIncremental());
+  CHECK(search.search("fo").size() == 3);
+  CHECK(search.lastSearchWasIncremental());
+  CHECK(search.search("foob").size() == 1);
+  CHECK(search.lastSearchWasIncremental());
+  CHECK(search.search("fo+b", true).size() == 1);
+  CHECK(search.search("(", true).empty());
+  // 只有视口里的匹配有高亮框
+  search.search("foo");
+  CHECK(search.highlightRects(0, editor.height()).size() == 3);
+  auto firstBlock = doc->blockRect(0);
+  CHECK(search.highlightRects(firstBlock.y(), firstBlock.y() + firstBlock.height()).size() == 2);
+  CHECK(search.highlightRects(editor.height() + 100, editor.height() + 200).empty());
+  // 一次替换，一步撤销
+  CHECK(search.replaceAll(editor.cursor(), "qux") == 3);
+  CHECK(documentMarkdown(doc) == "qux **qux**bar\n\naaaa xqux\n\n");
+  doc->undo(editor.cursor());
+  CHECK(documentMarkdown(doc) == base);
+  // 插入的字符在add缓冲区里，匹配跨两个缓冲区
+  doc->updateCursor(editor.cursor(), CursorCoord{1, 0, 1});
+  doc->insertText(editor.cursor(), "zz");
+  CHECK(editor.find("azza") == 1);
+  CHECK_FALSE(search.search("azza").empty());
+  CHECK(editor.replaceAll("b") == 1);
+  CHECK(documentMarkdown(doc) == "foo **foo**bar\n\nbaa xfoo\n\n");
+}
+
+TEST_CASE("SearchTest, ReplaceAllSkipsMatchesAcrossStyles") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  editor.loadText("foobar **foo**bar\n\nab *cd* ef\n\n");
+  auto doc = editor.document();
+  // 能找到，但换掉会把**切开，只换没跨样式的那处
+  CHECK(editor.find("foobar") == 2);
+  CHECK(editor.replaceAll("X") == 1);
+  CHECK(documentMarkdown(doc) == "X **foo**bar\n\nab *cd* ef\n\n");
+  CHECK(editor.find("b cd") == 1);
+  CHECK(editor.replaceAll("Y") == 0);
+  CHECK(documentMarkdown(doc) == "X **foo**bar\n\nab *cd* ef\n\n");
+  // 样式里面的照样换
+  CHECK(editor.find("cd") == 1);
+  CHECK(editor.replaceAll("Z") == 1);
+  CHECK(documentMarkdown(doc) == "X **foo**bar\n\nab *Z* ef\n\n");
+}
+
+TEST_CASE("SelectionTest, LazyRectsAndEdgeDamage") {
+  static md::editor::core::NullImageProvider nullProvider; Editor editor(&nullProvider);
+  using md::editor::core::Key;
+  editor.loadText("abc def\n\nghi\n\njkl\n\n");
+  auto doc = editor.document();
+  auto manualTop = [doc](md::SizeType blockNo) {
+    int y = doc->setting().docMargin.top;
+    for (md::SizeType i = 0; i < blockNo; ++i) y += doc->blocks()[i].height() + doc->setting().blockSpacing;
+    return y;
+  };
+  for (md::SizeType i = 0; i < doc->countOfBlock(); ++i) {
+    CHECK(doc->blockTop(i) == manualTop(i));
+  }
+  CHECK(doc->blockAt(manualTop(1) + 1) == 1);
+  doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 1});
+  editor.takeDamage();
+  editor.setHoldShift(true);
+  editor.keyPressEvent(TestKeyEvent(Key::Right, ""));
+  REQUIRE(editor.hasSelection());
+  auto rects = editor.selectionRects();
+  REQUIRE(rects.size() == 1);
+  CHECK(rects[0].y() < manualTop(1));
+  CHECK(rects[0].width() > 0);
+  editor.keyPressEvent(TestKeyEvent(Key::Down, ""));
+  CHECK(editor.selectionRects().size() == 2);
+  editor.takeDamage();
+  // 只动了后一头，前一块不重画
+  editor.keyPressEvent(TestKeyEvent(Key::Right, ""));
+  auto damage = editor.takeDamage();
+  REQUIRE(!damage.empty());
+  for (const auto& rect : damage) {
+    CHECK(rect.y() >= manualTop(1));
+  }
+  CHECK(editor.takeDamage().empty());
+  // 视口外的视觉行不算
+  editor.updateViewport(manualTop(1), doc->blocks()[1].height());
+  rects = editor.selectionRects();
+  REQUIRE(rects.size() == 1);
+  CHECK(rects[0].y() >= manualTop(1));
+  // 块变了之后位置索引接着对
+  doc->updateCursor(editor.cursor(), CursorCoord{0, 0, 3});
+  doc->insertReturn(editor.cursor());
+  for (md::SizeType i = 0; i < doc->countOfBlock(); ++i) {
+    CHECK(doc->blockTop(i) == manualTop(i));
+  }
+}
+
 int main(int argc, char** argv) {
   // 必须加这一句
   // 不然调用字体(QFontMetric)时会崩溃
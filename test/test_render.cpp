@@ -6,11 +6,29 @@
 #include "parser/Text.h"
 #include "render/Render.h"
 #include "render/Cell.h"
+#include "render/ShapeCache.h"
+#include "render/StyleTable.h"
+#include "render/DisplayList.h"
+#include "render/IconAtlas.h"
+#include "render/ImageCache.h"
+#include "render/LatexCache.h"
+#include "render/LatexDiskCache.h"
+#include "core/AbstractPainter.h"
+#include "core/IImageProvider.h"
 #include "SimpleFontMetricsProvider.h"
 
 #include "debug.h"
 #define DOCTEST_CONFIG_IMPLEMENT
 #include <doctest/doctest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 using namespace md;
 using namespace md::parser;
 using namespace md::render;
@@ -295,6 +313,539 @@ TEST_CASE("render chinese text") {
   CHECK(block.logicalLineAt(0).length() > 0);
 }
 
+TEST_CASE("rewrap with shape cache matches fresh layout") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  auto doc = parseDoc("The quick brown fox jumps over the lazy dog, 敏捷的棕色狐狸跳过了懒狗。 **bold words** and more text here\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto* node = doc->root()->childAt(0);
+  auto block = renderNode(node, setting, *doc, &fm);
+  REQUIRE(block.shapeCache() != nullptr);
+  auto cache = block.shapeCache();
+  CHECK(cache->countOfShapedText() > 0);
+  auto misses = cache->misses();
+  for (int width : {600, 400, 300, 800}) {
+    setting->maxWidth = width;
+    auto rewrapped = Render::render(node, setting, *doc, &fm, nullptr, cache);
+    auto fresh = renderNode(node, setting, *doc, &fm);
+    CHECK(rewrapped.shapeCache() == cache);
+    REQUIRE(rewrapped.countOfLogicalLine() == fresh.countOfLogicalLine());
+    for (SizeType i = 0; i < fresh.countOfLogicalLine(); ++i) {
+      const auto& a = rewrapped.logicalLineAt(i);
+      const auto& b = fresh.logicalLineAt(i);
+      CHECK(a.countOfVisualLine() == b.countOfVisualLine());
+      REQUIRE(a.cells().size() == b.cells().size());
+      for (SizeType j = 0; j < a.cells().size(); ++j) {
+        CHECK(a.cells()[j]->length() == b.cells()[j]->length());
+        CHECK(a.cells()[j]->width() == b.cells()[j]->width());
+      }
+    }
+  }
+  // 宽度变化不需要重新切分文字
+  CHECK(cache->misses() == misses);
+}
+
+TEST_CASE("style table interns font and color") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  auto styles = std::make_shared<StyleTable>();
+  Font font;
+  font.pixelSize = 20;
+  auto id = styles->intern(font, Color::black());
+  CHECK(styles->intern(font, Color::black()) == id);
+  CHECK(styles->intern(font, Color::blue()) != id);
+  font.bold = true;
+  CHECK(styles->intern(font, Color::black()) != id);
+  CHECK(styles->font(id).pixelSize == 20);
+  CHECK_FALSE(styles->font(id).bold);
+
+  auto doc = parseDoc("plain **bold** plain **bold**\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto block = Render::render(doc->root()->childAt(0), setting, *doc, &fm, nullptr, nullptr, styles);
+  std::vector<TextCell*> cells;
+  for (auto* cell : block.logicalLineAt(0).cells()) {
+    if (auto* textCell = dynamic_cast<TextCell*>(cell)) cells.push_back(textCell);
+  }
+  REQUIRE(cells.size() == 4);
+  CHECK(cells[0]->style() == cells[2]->style());
+  CHECK(cells[1]->style() == cells[3]->style());
+  CHECK(cells[0]->style() != cells[1]->style());
+  CHECK(cells[1]->font().bold);
+  // 再排一次不会产生新的样式
+  auto count = styles->size();
+  auto again = Render::render(doc->root()->childAt(0), setting, *doc, &fm, nullptr, nullptr, styles);
+  CHECK(styles->size() == count);
+}
+
+// 记录painter调用次数
+class CountingPainter : public md::editor::core::AbstractPainter {
+ public:
+  void save() override { saves++; }
+  void restore() override { restores++; }
+  void setPen(const Color&) override { pens++; }
+  void drawRect(const Rect&) override {}
+  void drawText(const Point&, const String&) override { texts++; }
+  void drawLine(const Point&, const Point&) override {}
+  void setFont(const Font&) override { fonts++; }
+  void fillRect(const Rect&, const Color&) override { fills++; }
+  void drawEllipse(const Rect&, const Color&) override {}
+  void drawImage(const Rect&, const md::editor::core::ImageData&) override {}
+  void drawText(const Rect&, int, const String&) override { texts++; }
+  void drawLatex(const Rect&, microtex::Render&) override {}
+  int saves = 0, restores = 0, pens = 0, fonts = 0, texts = 0, fills = 0;
+};
+
+TEST_CASE("display list elides redundant state changes") {
+  auto setting = makeSetting();
+  setting->maxWidth = 300;
+  SimpleFontMetricsProvider fm;
+  auto doc = parseDoc("one two three four five six seven eight nine ten eleven twelve thirteen\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto block = renderNode(doc->root()->childAt(0), setting, *doc, &fm);
+  const auto& list = block.displayList();
+  REQUIRE(list.size() > 2);
+  for (const auto& command : list) {
+    CHECK(command.type == DisplayCommandType::text);
+  }
+  CountingPainter painter;
+  list.run(painter, Point(0, 0), *doc);
+  CHECK(painter.texts == list.size());
+  CHECK(painter.fonts == 1);
+  CHECK(painter.pens == 1);
+  CHECK(painter.saves == painter.restores);
+  CHECK(painter.saves == 1);
+}
+
+TEST_CASE("text cell hit test uses cumulative advances") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  // 中文18px，英文9px
+  auto doc = parseDoc("ab你好\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto block = renderNode(doc->root()->childAt(0), setting, *doc, &fm);
+  const auto& line = block.logicalLineAt(0);
+  REQUIRE(line.cells().size() == 2);
+  auto* en = line.cells()[0];
+  auto* zh = line.cells()[1];
+  CHECK(en->width(0, *doc) == 0);
+  CHECK(en->width(1, *doc) == 9);
+  CHECK(en->width(2, *doc) == 18);
+  CHECK(zh->width(3, *doc) == 18);
+  CHECK(zh->width(6, *doc) == 36);
+  CHECK(en->offsetAtX(4, *doc) == 0);
+  CHECK(en->offsetAtX(5, *doc) == 1);
+  CHECK(en->offsetAtX(18, *doc) == 2);
+  // 落在多字节字符内部时只会返回字符边界
+  CHECK(zh->offsetAtX(8, *doc) == 0);
+  CHECK(zh->offsetAtX(10, *doc) == 3);
+  CHECK(zh->offsetAtX(30, *doc) == 6);
+  CHECK(zh->offsetAtX(100, *doc) == 6);
+  const auto& visualLine = line.visualLineAt(0);
+  auto x0 = visualLine.pos().x + setting->paragraphIntent * 18;
+  auto [cell, delta] = visualLine.cellAtX(x0 + 18 + 20, *doc);
+  CHECK(cell == zh);
+  CHECK(delta == 3);
+}
+
+// 小数宽度，整串测量时"AV"之间有字距调整
+class KerningFontMetricsProvider : public SimpleFontMetricsProvider {
+ public:
+  double horizontalAdvanceF(const Font& font, const String& text) const override {
+    double w = text.size() * font.pixelSize * 0.42;
+    for (size_t i = 0; i + 1 < text.size(); ++i) {
+      if (text[i] == 'A' && text[i + 1] == 'V') w -= 2;
+    }
+    return w;
+  }
+  int horizontalAdvance(const Font& font, const String& text) const override {
+    return static_cast<int>(std::lround(horizontalAdvanceF(font, text)));
+  }
+};
+
+TEST_CASE("text cell width matches whole run measurement") {
+  auto setting = makeSetting();
+  KerningFontMetricsProvider fm;
+  auto doc = parseDoc("AVAVAVAVAV\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto block = renderNode(doc->root()->childAt(0), setting, *doc, &fm);
+  const auto& line = block.logicalLineAt(0);
+  REQUIRE(line.cells().size() == 1);
+  auto* cell = dynamic_cast<TextCell*>(line.cells()[0]);
+  REQUIRE(cell != nullptr);
+  // 逐字取整是10 * 8 = 80，整串测量是75.6 - 10 = 65.6
+  CHECK(line.cells()[0]->width() == fm.horizontalAdvance(cell->font(), "AVAVAVAVAV"));
+  CHECK(line.cells()[0]->width() == 66);
+  for (SizeType i = 0; i < 10; ++i) {
+    CHECK(cell->width(i, *doc) <= cell->width(i + 1, *doc));
+  }
+  CHECK(cell->width(5, *doc) == 33);
+}
+
+TEST_CASE("latex cache is shared across relayout") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  auto doc = parseDoc("Math: $x^2$ and $y^2$ and $x^2$\n\n");
+  REQUIRE(doc->root()->size() == 1);
+  auto* node = doc->root()->childAt(0);
+  auto latexCache = std::make_shared<LatexCache>();
+  auto block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+  // 同一公式只解析一次，解析失败也一样
+  CHECK(latexCache->misses() == 2);
+  CHECK(latexCache->hits() == 1);
+  CHECK(latexCache->size() == 2);
+  auto latexCount = countCells<InlineLatexCell>(block);
+  block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+  CHECK(latexCache->misses() == 2);
+  CHECK(latexCache->hits() == 4);
+  CHECK(countCells<InlineLatexCell>(block) == latexCount);
+  int latexCommands = 0;
+  for (const auto& command : block.displayList()) {
+    if (command.type != DisplayCommandType::latex) continue;
+    CHECK(block.displayList().latexAt(command.resource) != nullptr);
+    latexCommands++;
+  }
+  CHECK(latexCommands == latexCount);
+}
+
+TEST_CASE("latex cache evicts least recently used") {
+  LatexCache cache(2);
+  cache.get("a", 20, 600);
+  cache.get("b", 20, 600);
+  cache.get("a", 20, 600);
+  cache.get("c", 20, 600);
+  CHECK(cache.size() == 2);
+  CHECK(cache.misses() == 3);
+  CHECK(cache.hits() == 1);
+  // b最久没用，被淘汰
+  cache.get("a", 20, 600);
+  CHECK(cache.hits() == 2);
+  cache.get("b", 20, 600);
+  CHECK(cache.misses() == 4);
+  // 字号、宽度、颜色不同都是不同的条目
+  cache.get("b", 24, 600);
+  cache.get("b", 24, 500);
+  cache.get("b", 24, 500, 0xff000000);
+  CHECK(cache.misses() == 7);
+}
+
+TEST_CASE("async latex emits placeholders until typeset") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  auto doc = parseDoc("Math: $x^2$ and $x^2$\n\n");
+  auto* node = doc->root()->childAt(0);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool typeset = false;
+  auto latexCache = std::make_shared<LatexCache>(16, 1, [&]() {
+    std::lock_guard lock(mutex);
+    typeset = true;
+    cv.notify_one();
+  });
+  REQUIRE(latexCache->async());
+  auto block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+  if (!block.pendingLatex().empty()) {
+    // 占位cell也占宽度，光标可以照常移动
+    CHECK(countCells<InlineLatexCell>(block) >= block.pendingLatex().size());
+    std::unique_lock lock(mutex);
+    REQUIRE(cv.wait_for(lock, std::chrono::seconds(10), [&]() { return typeset; }));
+  }
+  // 相同的公式只排一次
+  CHECK(latexCache->size() == 1);
+  CHECK(latexCache->countOfQueued() == 0);
+  CHECK(latexCache->takeTypesetResults());
+  CHECK_FALSE(latexCache->takeTypesetResults());
+  block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+  CHECK(block.pendingLatex().empty());
+}
+
+TEST_CASE("latex disk cache gives sizes on reopen") {
+  auto dir = std::filesystem::temp_directory_path() / "qtmarkdown_test_latex_cache";
+  std::filesystem::remove_all(dir);
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  auto doc = parseDoc("Math: $x^2$ and $y^2$\n\n");
+  auto* node = doc->root()->childAt(0);
+  int latexCount = 0;
+  {
+    auto disk = std::make_shared<LatexDiskCache>(dir);
+    auto latexCache = std::make_shared<LatexCache>(1024, 0, nullptr, disk);
+    auto block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+    latexCount = countCells<InlineLatexCell>(block);
+    CHECK(disk->hits() == 0);
+  }
+  // 重新打开：大小从磁盘来，第一次画之前不解析
+  auto disk = std::make_shared<LatexDiskCache>(dir);
+  auto latexCache = std::make_shared<LatexCache>(1024, 0, nullptr, disk);
+  auto block = Render::render(node, setting, *doc, &fm, nullptr, nullptr, nullptr, latexCache);
+  CHECK(disk->hits() == latexCount);
+  CHECK(countCells<InlineLatexCell>(block) == latexCount);
+  CHECK(block.pendingLatex().empty());
+  for (const auto& command : block.displayList()) {
+    if (command.type != DisplayCommandType::latex) continue;
+    const auto& box = block.displayList().latexAt(command.resource);
+    CHECK(box->drawable());
+    CHECK(box->render() != nullptr);
+  }
+  // 参数不同就是不同的条目
+  CHECK_FALSE(disk->load(LatexKey{"x^2", 24, setting->contentMaxWidth(), LatexCache::defaultColor}));
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("latex disk cache prunes least recently used") {
+  auto dir = std::filesystem::temp_directory_path() / "qtmarkdown_test_latex_prune";
+  std::filesystem::remove_all(dir);
+  LatexDiskCache disk(dir, 1024 * 1024);
+  LatexKey a{"a", 20, 600, LatexCache::defaultColor};
+  LatexKey b{"b", 20, 600, LatexCache::defaultColor};
+  LatexKey c{"c", 20, 600, LatexCache::defaultColor};
+  disk.store(a, {10, 20});
+  disk.store(b, {11, 21});
+  disk.store(c, {12, 22});
+  auto fileSize = disk.totalBytes() / 3;
+  auto loaded = disk.load(b);
+  REQUIRE(loaded);
+  CHECK(loaded->width == 11);
+  CHECK(loaded->height == 21);
+  // 修改时间就是使用时间，先都改成一小时前，再用一次a和c，b就是最久没用的
+  auto hourAgo = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+    std::filesystem::last_write_time(entry.path(), hourAgo);
+  }
+  REQUIRE(disk.load(a));
+  REQUIRE(disk.load(c));
+  LatexDiskCache small(dir, fileSize * 2 + fileSize / 2);
+  CHECK(small.totalBytes() <= fileSize * 2);
+  CHECK(small.load(a));
+  CHECK(small.load(c));
+  CHECK_FALSE(small.load(b));
+  std::filesystem::remove_all(dir);
+}
+
+// 按路径返回给定大小的纯色图，记录解码次数
+class CountingImageProvider : public md::editor::core::IImageProvider {
+ public:
+  std::map<std::string, Size> sizes;
+  std::map<std::string, int64_t> mtimes;
+  std::atomic<int> loads = 0;
+  md::editor::core::ImageData load(const String& path) override {
+    auto it = sizes.find(path.toStdString());
+    if (it == sizes.end()) return {};
+    loads++;
+    md::editor::core::ImageData image;
+    image.width = it->second.width;
+    image.height = it->second.height;
+    image.pixels.assign(std::size_t(image.width) * image.height * 4, 200);
+    return image;
+  }
+  bool exists(const String& path) override { return sizes.contains(path.toStdString()); }
+  int64_t lastModified(const String& path) override { return mtimes[path.toStdString()]; }
+};
+
+static std::vector<sptr<const md::editor::core::ImageData>> imagesOf(const Block& block) {
+  std::vector<sptr<const md::editor::core::ImageData>> images;
+  for (const auto& command : block.displayList()) {
+    if (command.type == DisplayCommandType::image) images.push_back(block.displayList().imageAt(command.resource));
+  }
+  return images;
+}
+
+TEST_CASE("image cache decodes once and shares display-size pixels") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  CountingImageProvider provider;
+  provider.sizes["/img/big.png"] = Size(2000, 1000);
+  auto doc = parseDoc("![a](/img/big.png)\n\n");
+  auto* node = doc->root()->childAt(0);
+  auto imageCache = std::make_shared<ImageCache>();
+  auto block1 = Render::render(node, setting, *doc, &fm, &provider, nullptr, nullptr, nullptr, imageCache);
+  auto block2 = Render::render(node, setting, *doc, &fm, &provider, nullptr, nullptr, nullptr, imageCache);
+  CHECK(provider.loads == 1);
+  CHECK(imageCache->misses() == 1);
+  CHECK(imageCache->hits() == 1);
+  auto images1 = imagesOf(block1);
+  auto images2 = imagesOf(block2);
+  REQUIRE(images1.size() == 1);
+  REQUIRE(images2.size() == 1);
+  // 680宽的内容区，2000一直减半到500
+  CHECK(images1[0]->width == 500);
+  CHECK(images1[0]->height == 250);
+  CHECK(images1[0].get() == images2[0].get());
+  CHECK(imageCache->totalBytes() == 500 * 250 * 4);
+  // 文件改了就重新解码
+  provider.mtimes["/img/big.png"] = 1;
+  auto block3 = Render::render(node, setting, *doc, &fm, &provider, nullptr, nullptr, nullptr, imageCache);
+  CHECK(provider.loads == 2);
+  CHECK(imagesOf(block3)[0].get() != images1[0].get());
+  // 绘制端按cacheKey缓存转换好的图片，不同的像素key不同
+  CHECK(images1[0]->cacheKey != 0);
+  CHECK(imagesOf(block3)[0]->cacheKey != images1[0]->cacheKey);
+  CHECK(imageCache->size() == 1);
+}
+
+TEST_CASE("image cache evicts least recently used under memory budget") {
+  CountingImageProvider provider;
+  provider.sizes["a"] = Size(10, 10);
+  provider.sizes["b"] = Size(10, 10);
+  provider.sizes["c"] = Size(10, 10);
+  ImageCache cache(2 * 10 * 10 * 4);
+  cache.get(&provider, "a");
+  cache.get(&provider, "b");
+  cache.get(&provider, "a");
+  // 还在用的不淘汰
+  auto c = cache.get(&provider, "c");
+  CHECK(cache.size() == 2);
+  CHECK(cache.totalBytes() <= cache.maxBytes());
+  CHECK(provider.loads == 3);
+  cache.get(&provider, "a");
+  CHECK(provider.loads == 3);
+  cache.get(&provider, "b");
+  CHECK(provider.loads == 4);
+  cache.setMaxBytes(10 * 10 * 4);
+  CHECK(cache.size() == 1);
+  CHECK(cache.get(&provider, "missing") == nullptr);
+
+  // 缩放取面积平均
+  md::editor::core::ImageData image;
+  image.width = 2;
+  image.height = 1;
+  image.pixels = {0, 0, 0, 255, 100, 200, 50, 255};
+  auto small = ImageCache::scaled(image, Size(1, 1));
+  CHECK(small.width == 1);
+  CHECK((small.pixels == std::vector<unsigned char>{50, 100, 25, 255}));
+  // 像素放在外部存储里(平台的图片对象)时不拷贝，读写都走bits()
+  auto storage = std::make_shared<const std::vector<unsigned char>>(image.pixels);
+  md::editor::core::ImageData shared;
+  shared.width = 2;
+  shared.height = 1;
+  shared.storageBits = storage->data();
+  shared.storage = storage;
+  CHECK_FALSE(shared.isNull());
+  CHECK(shared.byteCount() == 8);
+  CHECK(shared.pixels.empty());
+  CHECK((ImageCache::scaled(shared, Size(1, 1)).pixels == small.pixels));
+}
+
+TEST_CASE("async image decode paints placeholders until pixels arrive") {
+  // 放行前load一直阻塞，保证排版时拿不到结果
+  struct GatedImageProvider : CountingImageProvider {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool released = false;
+    std::set<std::string> probed;
+    md::editor::core::ImageData load(const String& path) override {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [this]() { return released; });
+      return CountingImageProvider::load(path);
+    }
+    Size imageSize(const String& path) override {
+      if (!probed.contains(path.toStdString())) return {};
+      return sizes[path.toStdString()];
+    }
+  };
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  GatedImageProvider provider;
+  provider.sizes["/img/a.png"] = Size(2000, 1000);
+  provider.sizes["/img/b.png"] = Size(400, 300);
+  provider.probed.insert("/img/a.png");
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool decoded = false;
+  auto imageCache = std::make_shared<ImageCache>(64 * 1024 * 1024, 1, [&]() {
+    std::lock_guard lock(mutex);
+    decoded = true;
+    cv.notify_one();
+  });
+  REQUIRE(imageCache->async());
+  auto doc = parseDoc("![a](/img/a.png)\n\n![b](/img/b.png)\n\n");
+  REQUIRE(doc->root()->size() == 2);
+  auto render = [&](int i) {
+    return Render::render(doc->root()->childAt(i), setting, *doc, &fm, &provider, nullptr, nullptr, nullptr,
+                          imageCache);
+  };
+  auto blockA = render(0);
+  auto blockB = render(1);
+  REQUIRE(blockA.pendingImages().size() == 1);
+  REQUIRE(blockB.pendingImages().size() == 1);
+  CHECK(imagesOf(blockA)[0] == nullptr);
+  // a的大小从文件头来，b只能用默认大小
+  CHECK(blockA.elementList()[0].size == Size(500, 250));
+  CHECK(blockB.elementList()[0].size == ImageCache::placeholderSize);
+  CHECK(imageCache->countOfQueued() == 2);
+  {
+    std::lock_guard lock(provider.mutex);
+    provider.released = true;
+  }
+  provider.cv.notify_all();
+  {
+    std::unique_lock lock(mutex);
+    REQUIRE(cv.wait_for(lock, std::chrono::seconds(10), [&]() { return decoded; }));
+  }
+  // 结果没被取走前不会再通知，剩下的轮询到队列清空
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (imageCache->countOfQueued() > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(imageCache->countOfQueued() == 0);
+  CHECK(imageCache->takeDecodeResults());
+  // 大小没变，填上像素重画就行
+  CHECK(blockA.updateDecodedImages(*imageCache) == Block::ImageUpdate::repaint);
+  CHECK(blockA.pendingImages().empty());
+  REQUIRE(imagesOf(blockA)[0] != nullptr);
+  CHECK(imagesOf(blockA)[0]->width == 500);
+  // 大小变了，要重新排版
+  CHECK(blockB.updateDecodedImages(*imageCache) == Block::ImageUpdate::relayout);
+  blockB = render(1);
+  CHECK(blockB.pendingImages().empty());
+  CHECK(blockB.elementList()[0].size == Size(400, 300));
+  CHECK(provider.loads == 2);
+}
+
+TEST_CASE("icon atlas decodes each icon once and shares slots") {
+  auto setting = makeSetting();
+  SimpleFontMetricsProvider fm;
+  CountingImageProvider provider;
+  provider.sizes[IconAtlas::pathOf(IconId::checkboxSelected)] = Size(64, 64);
+  provider.sizes[IconAtlas::pathOf(IconId::checkboxUnselected)] = Size(64, 64);
+  provider.sizes[IconAtlas::pathOf(IconId::copy)] = Size(32, 32);
+  provider.sizes[IconAtlas::pathOf(IconId::play)] = Size(64, 64);
+  auto icons = std::make_shared<IconAtlas>(&provider);
+  // 用到才加载
+  CHECK(provider.loads == 0);
+  String text;
+  for (int i = 0; i < 50; ++i) {
+    text += i % 2 ? "- [x] done\n" : "- [ ] todo\n";
+  }
+  text += "\n";
+  auto doc = parseDoc(text);
+  auto* node = doc->root()->childAt(0);
+  int iconCount = 0;
+  for (int i = 0; i < 3; ++i) {
+    auto block = Render::render(node, setting, *doc, &fm, &provider, nullptr, nullptr, nullptr, nullptr, icons);
+    for (const auto& command : block.displayList()) {
+      if (command.type == DisplayCommandType::icon) {
+        iconCount++;
+        const auto* image = icons->imageAt(command.resource);
+        REQUIRE(image != nullptr);
+        CHECK(image->width == command.rect.width());
+        CHECK(image->cacheKey != 0);
+      }
+      // 图标不再走解码图片的路径
+      CHECK(command.type != DisplayCommandType::image);
+    }
+  }
+  CHECK(iconCount == 150);
+  // 只加载了两个复选框图标，之后排版和绘制都不再读文件
+  CHECK(provider.loads == 2);
+  // 选中和未选中各一个显示大小
+  CHECK(icons->countOfSlot() == 2);
+  // 没有这个图标时不画
+  IconAtlas empty(nullptr);
+  CHECK_FALSE(empty.has(IconId::copy));
+  CHECK(empty.slot(IconId::copy) == IconAtlas::noIcon);
+  CHECK(empty.imageAt(0) == nullptr);
+}
+
 int main(int argc, char** argv) {
   doctest::Context context;
   int res = context.run();